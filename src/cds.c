@@ -440,7 +440,9 @@ cds_search_match (dlna_t *dlna, vfs_item_t *item, char *search_criteria)
     dlna_write_protocol_info (dlna, DLNA_PROTOCOL_INFO_TYPE_HTTP,
                               DLNA_ORG_PLAY_SPEED_NORMAL,
                               item->u.resource.cnv,
-                              DLNA_ORG_OPERATION_RANGE,
+                              DLNA_ORG_OPERATION_RANGE
+                              | (dlna_item->seek_index ?
+                                 DLNA_ORG_OPERATION_TIMESEEK : 0),
                               dlna->flags, dlna_item->profile);
 
   object_type = dlna_profile_upnp_object_item (dlna_item->profile);
@@ -65,10 +65,22 @@
   "INSERT INTO "PROPERTIES_TABLE" (UID,"DLNA_DB_PROP_DURATION","DLNA_DB_PROP_BITRATE","DLNA_DB_PROP_SAMPLE_FREQUENCY ","DLNA_DB_PROP_BPS ","DLNA_DB_PROP_CHANNELS","DLNA_DB_PROP_RESOLUTION ")" \
   "VALUES (%u,'%" xstr(DLNA_PROPERTIES_DURATION_MAX_SIZE) "q',%d,%d,%d,%d,'%" xstr(DLNA_PROPERTIES_RESOLUTION_MAX_SIZE) "q');"
 
+#define SEEK_INDEX_TABLE "seek_index_table"
+#define DLNA_DB_SEEK_INDEX_POINTS "points"
+#define DLNA_DB_SEEK_INDEX_CREATE_TABLE \
+  "CREATE TABLE IF NOT EXISTS "SEEK_INDEX_TABLE"(" \
+                      "UID INT PRIMARY KEY NOT NULL," \
+                      DLNA_DB_SEEK_INDEX_POINTS" TEXT" \
+                      ");"
+#define DLNA_DB_SEEK_INDEX_INSERT \
+  "INSERT OR REPLACE INTO "SEEK_INDEX_TABLE" (UID,"DLNA_DB_SEEK_INDEX_POINTS")" \
+  "VALUES (%u,'%q');"
+
 int dms_db_open (dlna_t *dlna, char *dbname)
 {
   int res;
   sqlite3 *db = NULL;
+  char *errMsg;
   
   if (!dlna)
     return -1;
@@ -97,6 +109,14 @@ int dms_db_open (dlna_t *dlna, char *dbname)
             "Use SQL database for VFS metadata storage.\n");
   dlna->db = (void*)db;
 
+  /* databases created before time seek indexes have no such table */
+  res = sqlite3_exec(db, DLNA_DB_SEEK_INDEX_CREATE_TABLE, NULL, NULL, &errMsg);
+  if ( res != SQLITE_OK )
+  {
+    dlna_log (dlna, DLNA_MSG_WARNING, "SQL error: %s\n", errMsg);
+    sqlite3_free(errMsg);
+  }
+
   res = dms_db_check(dlna);
   return 0;
 }
@@ -191,6 +211,48 @@ static int dms_db_properties_callback(void *data, int argc, char **argv, char **
   return 0;
 }
 
+static int dms_db_seek_index_callback(void *data, int argc, char **argv, char **colname)
+{
+  int i;
+  dlna_item_t *item = (dlna_item_t *)data;
+
+  for (i = 0; i < argc; i++)
+  {
+    if (!strcmp(colname[i], DLNA_DB_SEEK_INDEX_POINTS) && !item->seek_index)
+      item->seek_index = dlna_seek_index_from_string(argv[i]);
+  }
+  return 1; /* row found, the index is known */
+}
+
+static int
+dms_db_seek_index_store (dlna_t *dlna, uint32_t id, dlna_item_t *item)
+{
+  sqlite3 *db = (sqlite3 *)dlna->db;
+  char *points = NULL;
+  char* sql = NULL;
+  char *errMsg;
+  int rc;
+
+  /* an empty row records a file without index, not to scan it again */
+  if (item->seek_index)
+  {
+    points = dlna_seek_index_to_string (item->seek_index);
+    if (!points)
+      return -1;
+  }
+  sql = sqlite3_mprintf(DLNA_DB_SEEK_INDEX_INSERT,id, points ? points : "");
+  free (points);
+  rc = sqlite3_exec(db, sql, NULL, NULL, &errMsg);
+  sqlite3_free(sql);
+  if ( rc != SQLITE_OK )
+  {
+    dlna_log (dlna, DLNA_MSG_CRITICAL, "SQL error: %s\n", errMsg);
+    sqlite3_free(errMsg);
+    return -1;
+  }
+  return 0;
+}
+
 dlna_item_t *
 dms_db_get (dlna_t *dlna, uint32_t id)
 {
@@ -231,6 +293,18 @@ dms_db_get (dlna_t *dlna, uint32_t id)
     item->properties = NULL;
   }
   item->profile = dlna_get_media_profile(dlna, item->profileid);
+  /* the callback aborts the query on the first row */
+  sql = sqlite3_mprintf("SELECT * FROM "SEEK_INDEX_TABLE" WHERE uid=%d ;",id);
+  rc = sqlite3_exec(db, sql, dms_db_seek_index_callback, (void*)item, NULL);
+  sqlite3_free(sql);
+  if ( rc == SQLITE_OK && item->profile
+       && (item->profile->media_class == DLNA_CLASS_AV
+           || item->profile->media_class == DLNA_CLASS_AUDIO) )
+  {
+    /* items added before time seek indexes: build it once now */
+    item->seek_index = dlna_seek_index_new (dlna, item->filename);
+    dms_db_seek_index_store (dlna, id, item);
+  }
     
   return item;
 }
@@ -242,6 +316,7 @@ dms_db_create (dlna_t *dlna)
   char* sql_items = DLNA_DB_ITEMS_CREATE_TABLE;
   char* sql_media = DLNA_DB_METADATA_CREATE_TABLE;
   char* sql_properties = DLNA_DB_PROPERTIES_CREATE_TABLE;
+  char* sql_seek_index = DLNA_DB_SEEK_INDEX_CREATE_TABLE;
   char *errMsg;
   int rc;
 
@@ -269,6 +344,13 @@ dms_db_create (dlna_t *dlna)
     sqlite3_free(errMsg);
     return -1;
   }
+  rc = sqlite3_exec(db, sql_seek_index, NULL, NULL, &errMsg);
+  if ( rc != SQLITE_OK )
+  {
+    dlna_log (dlna, DLNA_MSG_CRITICAL, "SQL error: %s\n", errMsg);
+    sqlite3_free(errMsg);
+    return -1;
+  }
   return 0;
 }
 
@@ -330,5 +412,9 @@ dms_db_add (dlna_t *dlna, uint32_t id, dlna_item_t *item)
       return -1;
     }
   }
+  if ((item->profile->media_class == DLNA_CLASS_AV
+       || item->profile->media_class == DLNA_CLASS_AUDIO)
+      && dms_db_seek_index_store (dlna, id, item) < 0)
+    return -1;
   return 0;
 }
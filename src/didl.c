@@ -219,7 +219,9 @@ didl_add_item (dlna_t *dlna, buffer_t *out, vfs_item_t *item,
         dlna_write_protocol_info (dlna, DLNA_PROTOCOL_INFO_TYPE_HTTP,
                                 DLNA_ORG_PLAY_SPEED_NORMAL,
                                 item->u.resource.cnv,
-                                DLNA_ORG_OPERATION_RANGE,
+                                DLNA_ORG_OPERATION_RANGE
+                                | (dlna_item->seek_index ?
+                                   DLNA_ORG_OPERATION_TIMESEEK : 0),
                                 dlna->flags, dlna_item->profile);
     
       buffer_appendf (out, "<%s", DIDL_RES);
@@ -49,6 +49,9 @@
 
 #include "dlna_internals.h"
 #include "upnp_internals.h"
+#ifndef HAVE_EXTERNAL_LIBUPNP
+#include "threadutil/ThreadPool.h"
+#endif
 #include "ffmpeg_profiler/ffmpeg_profiler.h"
 
 void dlna_profiler_init (dlna_t *dlna)
@@ -74,6 +77,13 @@ dlna_init (void)
 
   /* Internal HTTP Server */
   dlna->http_callback = NULL;
+  dlna->http_files = NULL;
+  ithread_mutex_init (&dlna->http_files_mutex, NULL);
+  dlna->http_chunks = NULL;
+  dlna->http_chunks_size = 0;
+  dlna->http_chunks_max = DLNA_HTTP_CACHE_SIZE;
+  ithread_mutex_init (&dlna->http_chunks_mutex, NULL);
+  ithread_cond_init (&dlna->http_chunks_loaded, NULL);
 
   dlna->services = NULL;
 
@@ -120,6 +130,10 @@ dlna_uninit (dlna_t *dlna)
   /* Internal HTTP Server */
   if (dlna->http_callback)
     free (dlna->http_callback);
+  dlna_http_file_cache_flush (dlna);
+  ithread_mutex_destroy (&dlna->http_files_mutex);
+  ithread_mutex_destroy (&dlna->http_chunks_mutex);
+  ithread_cond_destroy (&dlna->http_chunks_loaded);
 
   dlna_service_unregister_all (dlna);
   
@@ -316,6 +330,120 @@ dlna_set_port (dlna_t *dlna, int port)
   dlna->port = port;
 }
 
+void
+dlna_set_http_cache_size (dlna_t *dlna, size_t size)
+{
+  if (!dlna)
+    return;
+
+  /* a smaller cap is applied as the next chunks get cached */
+  ithread_mutex_lock (&dlna->http_chunks_mutex);
+  dlna->http_chunks_max = size;
+  ithread_mutex_unlock (&dlna->http_chunks_mutex);
+}
+
+#ifndef HAVE_EXTERNAL_LIBUPNP
+static int
+threadpool_type (dlna_threadpool_t pool, dlna_ThreadPoolType *type)
+{
+  switch (pool)
+  {
+  case DLNA_THREADPOOL_CONTROL:
+    *type = DLNA_TP_MINISERVER;
+    break;
+  case DLNA_THREADPOOL_STREAM:
+    *type = DLNA_TP_STREAM;
+    break;
+  case DLNA_THREADPOOL_EVENT:
+    *type = DLNA_TP_RECV;
+    break;
+  case DLNA_THREADPOOL_SEND:
+    *type = DLNA_TP_SEND;
+    break;
+  default:
+    return 0;
+  }
+
+  return 1;
+}
+#endif
+
+int
+dlna_set_threadpool_policy (dlna_t *dlna, dlna_threadpool_t pool,
+                            dlna_threadpool_policy_t *policy)
+{
+#ifndef HAVE_EXTERNAL_LIBUPNP
+  dlna_ThreadPoolType type;
+
+  if (!dlna || !policy)
+    return DLNA_ST_ERROR;
+
+  if (!threadpool_type (pool, &type))
+    return DLNA_ST_ERROR;
+
+  if (dlnaSetThreadPoolPolicy (type, policy->min_threads,
+                               policy->max_threads, policy->target_wait,
+                               policy->idle_time) != DLNA_E_SUCCESS)
+    return DLNA_ST_ERROR;
+
+  return DLNA_ST_OK;
+#else
+  /* the external UPnP stack does not expose its thread pools */
+  return DLNA_ST_ERROR;
+#endif
+}
+
+int
+dlna_get_threadpool_stats (dlna_t *dlna, dlna_threadpool_t pool,
+                           dlna_threadpool_stats_t *stats)
+{
+#ifndef HAVE_EXTERNAL_LIBUPNP
+  dlna_ThreadPoolType type;
+  ThreadPoolStats tps;
+  int p, b;
+
+  if (!dlna || !stats)
+    return DLNA_ST_ERROR;
+
+  if (!threadpool_type (pool, &type))
+    return DLNA_ST_ERROR;
+
+  if (dlnaGetThreadPoolStats (type, &tps) != DLNA_E_SUCCESS)
+    return DLNA_ST_ERROR;
+
+  memset (stats, 0, sizeof (dlna_threadpool_stats_t));
+  stats->threads = tps.totalThreads;
+  stats->idle_threads = tps.idleThreads;
+  stats->persistent_threads = tps.persistentThreads;
+  stats->max_threads = tps.maxThreads;
+  stats->queued[LOW_PRIORITY] = tps.currentJobsLQ;
+  stats->queued[MED_PRIORITY] = tps.currentJobsMQ;
+  stats->queued[HIGH_PRIORITY] = tps.currentJobsHQ;
+  stats->jobs[LOW_PRIORITY] = tps.totalJobsLQ;
+  stats->jobs[MED_PRIORITY] = tps.totalJobsMQ;
+  stats->jobs[HIGH_PRIORITY] = tps.totalJobsHQ;
+  stats->avg_wait[LOW_PRIORITY] = tps.avgWaitLQ;
+  stats->avg_wait[MED_PRIORITY] = tps.avgWaitMQ;
+  stats->avg_wait[HIGH_PRIORITY] = tps.avgWaitHQ;
+  for (p = LOW_PRIORITY; p <= HIGH_PRIORITY; p++)
+  {
+    stats->avg_run[p] = tps.avgRunTime[p];
+    for (b = 0; b < DLNA_THREADPOOL_HISTOGRAM_SIZE && b < TP_HISTOGRAM_SIZE; b++)
+    {
+      stats->wait_histogram[p][b] = tps.waitHistogram[p][b];
+      stats->run_histogram[p][b] = tps.runHistogram[p][b];
+    }
+  }
+  stats->steals = tps.totalSteals;
+  stats->idle_waits = tps.totalIdleWaits;
+
+  return DLNA_ST_OK;
+#else
+  /* the external UPnP stack does not expose its thread pools */
+  return DLNA_ST_ERROR;
+#endif
+}
+
 void
 dlna_device_set_friendly_name (dlna_t *dlna, char *str)
 {
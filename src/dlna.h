@@ -220,6 +220,100 @@ void dlna_set_interface (dlna_t *dlna, char *itf);
  */
 void dlna_set_port (dlna_t *dlna, int port);
 
+/**
+ * Set the memory cap of library's HTTP chunk cache.
+ *  The streams of a same file share the chunks read from the disk
+ *  and the small files are kept in memory, until the cap is reached
+ *  and the least recently used chunks are dropped.
+ *
+ * @param[in] dlna  The DLNA library's controller.
+ * @param[in] size  The cap in bytes, 0 to disable the cache.
+ */
+void dlna_set_http_cache_size (dlna_t *dlna, size_t size);
+
+/**
+ * Thread pools of the internal UPnP stack.
+ */
+typedef enum {
+  DLNA_THREADPOOL_CONTROL,    /* SOAP actions and description fetches */
+  DLNA_THREADPOOL_STREAM,     /* media transfers */
+  DLNA_THREADPOOL_EVENT,      /* SSDP and GENA messages received */
+  DLNA_THREADPOOL_SEND        /* SSDP and GENA messages sent, timers */
+} dlna_threadpool_t;
+
+/**
+ * Sizing policy of a thread pool.
+ * A negative value keeps the current setting.
+ */
+typedef struct dlna_threadpool_policy_s {
+  /* minimum number of threads */
+  int min_threads;
+  /* maximum number of threads */
+  int max_threads;
+  /* queueing delay to keep the jobs under, in ms (0 to disable) */
+  int target_wait;
+  /* time an idle thread is kept, in ms */
+  int idle_time;
+} dlna_threadpool_policy_t;
+
+/**
+ * Set the sizing policy of one of library's thread pools.
+ *  Between its bounds, a pool grows when its jobs are expected to wait
+ *  longer than target_wait and shrinks when its threads are idle, so
+ *  that the same settings suit small and large hosts.
+ *  The maximum number of threads can only be raised before dlna_start().
+ *
+ * @param[in] dlna   The DLNA library's controller.
+ * @param[in] pool   The thread pool.
+ * @param[in] policy The sizing policy.
+ * @return   DLNA_ST_OK in case of success, DLNA_ST_ERROR otherwise.
+ */
+int dlna_set_threadpool_policy (dlna_t *dlna, dlna_threadpool_t pool,
+                                dlna_threadpool_policy_t *policy);
+
+#define DLNA_THREADPOOL_HISTOGRAM_SIZE 16
+
+/**
+ * Statistics of a thread pool.
+ * Arrays by priority are indexed low, medium, high.
+ * Histogram bucket 0 counts the jobs under 1 ms, bucket i the jobs
+ * between 2^(i-1) and 2^i ms and the last bucket the longer ones.
+ */
+typedef struct dlna_threadpool_stats_s {
+  /* threads running, idle, and running persistent jobs */
+  int threads;
+  int idle_threads;
+  int persistent_threads;
+  /* highest number of threads reached */
+  int max_threads;
+  /* jobs waiting for a thread */
+  int queued[3];
+  /* jobs run */
+  unsigned long jobs[3];
+  /* average time jobs waited for and ran, in ms */
+  double avg_wait[3];
+  double avg_run[3];
+  unsigned long wait_histogram[3][DLNA_THREADPOOL_HISTOGRAM_SIZE];
+  unsigned long run_histogram[3][DLNA_THREADPOOL_HISTOGRAM_SIZE];
+  /* jobs a thread took from another one */
+  unsigned long steals;
+  /* times a thread waited for a job */
+  unsigned long idle_waits;
+} dlna_threadpool_stats_t;
+
+/**
+ * Get the statistics of one of library's thread pools.
+ *  They are read without locking the pool, so that they can be
+ *  polled to detect a saturated pool.
+ *
+ * @param[in]  dlna   The DLNA library's controller.
+ * @param[in]  pool   The thread pool.
+ * @param[out] stats  The statistics.
+ * @return   DLNA_ST_OK in case of success, DLNA_ST_ERROR otherwise.
+ */
+int dlna_get_threadpool_stats (dlna_t *dlna, dlna_threadpool_t pool,
+                               dlna_threadpool_stats_t *stats);
+
 /***************************************************************************/
 /*                                                                         */
 /* DLNA Item Profile Handling                                              */
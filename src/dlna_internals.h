@@ -145,6 +145,9 @@ struct upnp_service_statevar_s {
   char * (*get) (dlna_t *);
 };
 
+/* default memory cap of the HTTP chunk cache */
+#define DLNA_HTTP_CACHE_SIZE (32 * 1024 * 1024)
+
 /**
  * DLNA Library's controller.
  * This controls the whole library.
@@ -163,6 +166,13 @@ struct dlna_s {
 
   /* Internal HTTP Server */
   dlna_http_callback_t *http_callback;
+  struct http_file_s *http_files; /* open media files, LRU first */
+  ithread_mutex_t http_files_mutex;
+  struct http_chunk_s *http_chunks; /* cached file chunks, LRU first */
+  size_t http_chunks_size;        /* memory held by the cached chunks */
+  size_t http_chunks_max;         /* memory cap, 0 to disable the cache */
+  ithread_mutex_t http_chunks_mutex;
+  ithread_cond_t http_chunks_loaded;
 
   /* UPnP Services */
   struct dlna_service_list_s *services;
@@ -228,6 +238,20 @@ typedef struct dlna_properties_s {
   char     resolution[DLNA_PROPERTIES_RESOLUTION_MAX_SIZE];        /* res@resolution */
 } dlna_properties_t;
 
+/**
+ * DLNA Media Object item time seek index
+ */
+typedef struct dlna_seek_point_s {
+  uint32_t time;                  /* play time, in ms */
+  int64_t  offset;                /* byte offset of the play time */
+} dlna_seek_point_t;
+
+typedef struct dlna_seek_index_s {
+  uint32_t duration;              /* play time of the whole file, in ms */
+  uint32_t count;
+  dlna_seek_point_t *points;      /* sorted by time and offset */
+} dlna_seek_index_t;
+
 /**
  * DLNA Media Object item
  */
@@ -239,6 +263,7 @@ struct dlna_item_s {
   dlna_metadata_t *metadata;
   dlna_profile_t *profile;
   void *profile_cookie;
+  dlna_seek_index_t *seek_index;
 };
 
 /**
@@ -267,6 +292,148 @@ void dlna_item_free (dlna_item_t *item);
 dlna_item_t *
 dlna_item_get(dlna_t *dlna, vfs_item_t *item);
 
+/**
+ * Build the time seek index of a media file.
+ *  MPEG-2 TS, MPEG-1/2 PS and MP4 files can be indexed.
+ *
+ * @param[in] dlna     The DLNA library's controller.
+ * @param[in] filename The media file.
+ * @return The time seek index, NULL if the file can't be indexed.
+ */
+dlna_seek_index_t *dlna_seek_index_new (dlna_t *dlna, const char *filename);
+
+/**
+ * Free a time seek index.
+ *
+ * @param[in] index    The time seek index to be freed.
+ */
+void dlna_seek_index_free (dlna_seek_index_t *index);
+
+/**
+ * Map a play time range to the byte range of a media file.
+ *  The times are moved to the indexed points the bytes start and end
+ *  at, a negative end time stands for the end of the file.
+ *
+ * @param[in]     index    The time seek index of the file.
+ * @param[in]     filesize The size of the file.
+ * @param[in,out] start    The first play time, in ms.
+ * @param[in,out] end      The last play time, in ms.
+ * @param[out]    first    The first byte of the range.
+ * @param[out]    last     The last byte of the range.
+ * @return 0 in case of success, a negative value if the file isn't
+ *         indexed, a positive value if the time range is out of the file.
+ */
+int dlna_seek_index_lookup (dlna_seek_index_t *index, int64_t filesize,
+                            int64_t *start, int64_t *end,
+                            int64_t *first, int64_t *last);
+
+/**
+ * Serialize a time seek index, to store it with its item.
+ *
+ * @param[in] index    The time seek index.
+ * @return A newly allocated string, NULL in case of error.
+ */
+char *dlna_seek_index_to_string (dlna_seek_index_t *index);
+
+/**
+ * Restore a time seek index serialized by dlna_seek_index_to_string().
+ *
+ * @param[in] str      The serialized time seek index.
+ * @return The time seek index, NULL in case of error.
+ */
+dlna_seek_index_t *dlna_seek_index_from_string (const char *str);
+
+/**
+ * UPnP description document, rendered once and shared read-only by
+ *  the HTTP requests serving it.
+ */
+#define DLNA_DESCRIPTION_ETAG_SIZE 32
+
+typedef struct dlna_description_s {
+  char *content;
+  size_t length;
+  char etag[DLNA_DESCRIPTION_ETAG_SIZE]; /* hash of the content */
+  int refcount;
+} dlna_description_t;
+
+/**
+ * Wrap a rendered description document.
+ *
+ * @param[in] content  The document, owned by the description from now on.
+ * @return The description with a reference, NULL in case of error.
+ */
+dlna_description_t *dlna_description_new (char *content);
+
+/**
+ * Take a reference on a description.
+ *
+ * @param[in] desc     The description.
+ * @return The description.
+ */
+dlna_description_t *dlna_description_ref (dlna_description_t *desc);
+
+/**
+ * Release a reference on a description, freed with the last one.
+ *
+ * @param[in] desc     The description.
+ */
+void dlna_description_unref (dlna_description_t *desc);
+
+/**
+ * Registered service: the library's copy of the service, along with its
+ *  description rendered once by dlna_service_register().
+ */
+typedef struct dlna_service_entry_s {
+  dlna_service_t service;          /* first: the services list points here */
+  dlna_description_t *description; /* NULL if the service has none */
+} dlna_service_entry_t;
+
+/**
+ * Get the description rendered for a registered service.
+ *
+ * @param[in] service  A service returned by dlna_service_find_url().
+ * @return The description, NULL if there is none.
+ */
+dlna_description_t *dlna_service_description (const dlna_service_t *service);
+
+#ifdef HAVE_IO_URING
+/**
+ * Asynchronous reader of a media file, keeping the next blocks of the
+ *  stream queued to the kernel with io_uring.
+ */
+typedef struct dlna_uring_reader_s dlna_uring_reader_t;
+
+/**
+ * Create an asynchronous reader on an open file.
+ *
+ * @param[in] fd       The file descriptor, left open by the reader.
+ * @return The reader, NULL if io_uring isn't available: the file
+ *         is then to be read with pread().
+ */
+dlna_uring_reader_t *dlna_uring_reader_new (int fd);
+
+/**
+ * Read from the file, as pread() does. Reading at another offset
+ *  than the end of the previous read drops the queued blocks.
+ *
+ * @param[in]  reader  The reader.
+ * @param[out] buf     The buffer to fill.
+ * @param[in]  len     The number of bytes to read.
+ * @param[in]  offset  The file offset to read from.
+ * @return The number of bytes read, 0 at the end of the file,
+ *         -1 in case of error.
+ */
+ssize_t dlna_uring_reader_read (dlna_uring_reader_t *reader,
+                                char *buf, size_t len, off_t offset);
+
+/**
+ * Wait for the queued reads and free the reader.
+ *
+ * @param[in] reader   The reader to be freed.
+ */
+void dlna_uring_reader_free (dlna_uring_reader_t *reader);
+#endif /* HAVE_IO_URING */
+
 void dlna_log (dlna_t *dlna,
                dlna_verbosity_level_t level,
                const char *format, ...);
@@ -28,11 +28,29 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "upnp_internals.h"
 #include "services.h"
 
 #define PROTOCOL_TYPE_PRE_SZ  11   /* for the str length of "http-get:*:" */
+#define HTTP_ETAG_SIZE        64
+#define HTTP_FILE_CACHE_SIZE  32   /* media files kept open */
+#define HTTP_FILE_CACHE_TTL   2    /* seconds a cached stat is trusted */
+
+/* streaming: read ahead windows, scaled to the rate of the stream */
+#define HTTP_READAHEAD_TIME   4    /* seconds of stream read ahead */
+#define HTTP_READAHEAD_MIN    (256 * 1024)
+#define HTTP_READAHEAD_MAX    (16 * 1024 * 1024)
+/* pages of the files this large are dropped from the cache once read */
+#define HTTP_DROP_BEHIND_SIZE ((off_t) 512 * 1024 * 1024)
+#define HTTP_DROP_BEHIND_STEP (8 * 1024 * 1024)
+/* files this large are read asynchronously, when io_uring is available */
+#define HTTP_URING_MIN_SIZE   (1024 * 1024)
+/* chunk cache: unit of the reads shared by the streams of a file */
+#define HTTP_CHUNK_SIZE       (256 * 1024)
+/* files up to this part of the cache cap are always read through it */
+#define HTTP_CHUNK_SMALL_FILE 16
 #define PROTOCOL_TYPE_SUFF_SZ 2    /* for the str length of ":*" */
 
 typedef enum {
@@ -40,6 +58,37 @@ typedef enum {
   HTTP_OK    =  0,
 } http_error_code_t;
 
+/* media file, opened once and shared by the requests reading it */
+typedef struct http_file_s {
+  uint32_t id;          /* VFS item ID */
+  char *fullpath;
+  int fd;               /* -1 if the file can't be read */
+  struct stat st;
+  uint64_t serial;      /* unique to this open file, keys its chunks */
+  time_t checked;       /* time of the last stat */
+  int refcount;         /* the cache and the open handles */
+  int readers;          /* open handles reading the file */
+  UT_hash_handle hh;
+} http_file_t;
+
+/* part of a media file, read once and shared by the requests of the file */
+typedef struct http_chunk_key_s {
+  uint64_t file;        /* serial of the open file */
+  int64_t offset;       /* multiple of HTTP_CHUNK_SIZE */
+} http_chunk_key_t;
+
+typedef struct http_chunk_s {
+  http_chunk_key_t key;
+  char *data;
+  ssize_t len;          /* bytes read, -1 in case of error */
+  int loading;          /* the read is on, waited for by the others */
+  int cached;           /* still in the cache, and counted in its size */
+  int refcount;         /* the cache and the readers */
+  UT_hash_handle hh;
+} http_chunk_t;
+
+static uint64_t http_file_serial = 0;
+
 typedef struct http_file_handler_s {
   char *fullpath;
   off_t pos;
@@ -49,15 +98,458 @@ typedef struct http_file_handler_s {
   } type;
   union {
     struct {
-      int fd;
+      http_file_t *file;
+      off_t next;             /* end of the last read, -1 before */
+      off_t advised;          /* end of the window read ahead */
+      off_t dropped;          /* pages before are dropped from the cache */
+      off_t run;              /* bytes read sequentially */
+      struct timespec start;  /* start of the sequential reads */
+#ifdef HAVE_IO_URING
+      dlna_uring_reader_t *uring; /* NULL to read with pread() */
+#endif /* HAVE_IO_URING */
     } local;
     struct {
-      char *content;
+      const char *content;
       off_t len;
+      dlna_description_t *description; /* reference held on content */
     } memory;
   } detail;
 } http_file_handler_t;
 
+/* called with dlna->http_files_mutex held */
+static void
+http_file_release (http_file_t *file)
+{
+  if (--file->refcount > 0)
+    return;
+
+  if (file->fd >= 0)
+    close (file->fd);
+  free (file->fullpath);
+  free (file);
+}
+
+static void
+http_file_unref (dlna_t *dlna, http_file_t *file)
+{
+  ithread_mutex_lock (&dlna->http_files_mutex);
+  http_file_release (file);
+  ithread_mutex_unlock (&dlna->http_files_mutex);
+}
+
+static inline int
+http_file_changed (const struct stat *a, const struct stat *b)
+{
+  return a->st_dev != b->st_dev || a->st_ino != b->st_ino
+    || a->st_size != b->st_size || a->st_mtime != b->st_mtime;
+}
+
+/* called with dlna->http_files_mutex held */
+static http_file_t *
+http_file_use (dlna_t *dlna, http_file_t *file)
+{
+  /* the most recently used files go last, the eviction takes the first */
+  HASH_DEL (dlna->http_files, file);
+  HASH_ADD_INT (dlna->http_files, id, file);
+  file->refcount++;
+
+  return file;
+}
+
+/*
+ * Get a media file from the cache, with a reference to be released by
+ *  http_file_unref(). Its stat is trusted for HTTP_FILE_CACHE_TTL, then
+ *  checked again: an unchanged file keeps its descriptor, a changed one
+ *  is opened again. The system calls are made out of the lock.
+ */
+static http_file_t *
+http_file_get (dlna_t *dlna, uint32_t id, const char *fullpath)
+{
+  http_file_t *file, *old;
+  struct stat st;
+  time_t now;
+  int err, fd;
+
+  now = time (NULL);
+
+  ithread_mutex_lock (&dlna->http_files_mutex);
+  HASH_FIND_INT (dlna->http_files, &id, file);
+  if (file && !strcmp (file->fullpath, fullpath)
+      && now >= file->checked && now - file->checked < HTTP_FILE_CACHE_TTL)
+  {
+    file = http_file_use (dlna, file);
+    ithread_mutex_unlock (&dlna->http_files_mutex);
+    return file;
+  }
+  ithread_mutex_unlock (&dlna->http_files_mutex);
+
+  err = stat (fullpath, &st);
+
+  ithread_mutex_lock (&dlna->http_files_mutex);
+  HASH_FIND_INT (dlna->http_files, &id, file);
+  if (file && !err && !strcmp (file->fullpath, fullpath)
+      && !http_file_changed (&file->st, &st))
+  {
+    file->checked = now;
+    file = http_file_use (dlna, file);
+    ithread_mutex_unlock (&dlna->http_files_mutex);
+    return file;
+  }
+  if (file)
+  {
+    /* changed or gone: the handles still reading it keep it alive */
+    HASH_DEL (dlna->http_files, file);
+    http_file_release (file);
+  }
+  ithread_mutex_unlock (&dlna->http_files_mutex);
+
+  if (err < 0)
+    return NULL;
+
+  fd = open (fullpath, O_RDONLY);
+  if (fd < 0 && errno != EACCES)
+    return NULL;
+  if (fd >= 0 && fstat (fd, &st) < 0)
+  {
+    close (fd);
+    return NULL;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  /* media are streamed: larger kernel read ahead */
+  if (fd >= 0)
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  file = calloc (1, sizeof (http_file_t));
+  if (!file)
+  {
+    if (fd >= 0)
+      close (fd);
+    return NULL;
+  }
+  file->id = id;
+  file->fullpath = strdup (fullpath);
+  file->fd = fd;
+  file->st = st;
+  file->serial = __atomic_add_fetch (&http_file_serial, 1, __ATOMIC_RELAXED);
+  file->checked = now;
+  file->refcount = 2; /* the cache and the caller */
+
+  ithread_mutex_lock (&dlna->http_files_mutex);
+  HASH_FIND_INT (dlna->http_files, &id, old);
+  if (old && !strcmp (old->fullpath, fullpath)
+      && !http_file_changed (&old->st, &file->st))
+  {
+    /* opened by another request meanwhile: share its chunks */
+    old = http_file_use (dlna, old);
+    ithread_mutex_unlock (&dlna->http_files_mutex);
+    file->refcount = 1;
+    http_file_unref (dlna, file);
+    return old;
+  }
+  if (old)
+  {
+    HASH_DEL (dlna->http_files, old);
+    http_file_release (old);
+  }
+  HASH_ADD_INT (dlna->http_files, id, file);
+  if (dlna->http_files->hh.tbl->num_items > HTTP_FILE_CACHE_SIZE)
+  {
+    /* evict the least recently used file no handle reads, so that the
+       requests of a file always share it */
+    for (old = dlna->http_files; old; old = old->hh.next)
+      if (!old->readers)
+        break;
+    if (old)
+    {
+      HASH_DEL (dlna->http_files, old);
+      http_file_release (old);
+    }
+  }
+  ithread_mutex_unlock (&dlna->http_files_mutex);
+
+  return file;
+}
+
+/* other handles read the file: its pages and chunks serve them too */
+static int
+http_file_shared (dlna_t *dlna, http_file_t *file)
+{
+  int shared;
+
+  ithread_mutex_lock (&dlna->http_files_mutex);
+  shared = file->readers > 1;
+  ithread_mutex_unlock (&dlna->http_files_mutex);
+
+  return shared;
+}
+
+/* called with dlna->http_chunks_mutex held */
+static void
+http_chunk_release (http_chunk_t *chunk)
+{
+  if (--chunk->refcount > 0)
+    return;
+
+  free (chunk->data);
+  free (chunk);
+}
+
+/* called with dlna->http_chunks_mutex held */
+static void
+http_chunk_remove (dlna_t *dlna, http_chunk_t *chunk)
+{
+  HASH_DEL (dlna->http_chunks, chunk);
+  dlna->http_chunks_size -= chunk->loading ? HTTP_CHUNK_SIZE : chunk->len;
+  chunk->cached = 0;
+  http_chunk_release (chunk);
+}
+
+static void
+http_chunk_unref (dlna_t *dlna, http_chunk_t *chunk)
+{
+  ithread_mutex_lock (&dlna->http_chunks_mutex);
+  http_chunk_release (chunk);
+  ithread_mutex_unlock (&dlna->http_chunks_mutex);
+}
+
+/*
+ * Get the chunk of a file at an offset, with a reference to be released
+ *  by http_chunk_unref(). A chunk missing from the cache is read by the
+ *  first request asking for it, out of the lock, while the others wait
+ *  for it. The least recently used chunks are dropped to keep the cache
+ *  under its cap; those of the files changed since are never asked for
+ *  again and go the same way.
+ */
+static http_chunk_t *
+http_chunk_get (dlna_t *dlna, http_file_t *file, off_t offset)
+{
+  http_chunk_key_t key;
+  http_chunk_t *chunk, *next;
+  char *data;
+  ssize_t len;
+
+  memset (&key, 0, sizeof (key));
+  key.file = file->serial;
+  key.offset = offset;
+
+  ithread_mutex_lock (&dlna->http_chunks_mutex);
+  HASH_FIND (hh, dlna->http_chunks, &key, sizeof (key), chunk);
+  if (chunk)
+  {
+    /* the most recently used chunks go last, the eviction takes the first */
+    HASH_DEL (dlna->http_chunks, chunk);
+    HASH_ADD (hh, dlna->http_chunks, key, sizeof (key), chunk);
+    chunk->refcount++;
+    while (chunk->loading)
+      ithread_cond_wait (&dlna->http_chunks_loaded, &dlna->http_chunks_mutex);
+    if (chunk->len < 0)
+    {
+      http_chunk_release (chunk);
+      chunk = NULL;
+    }
+    ithread_mutex_unlock (&dlna->http_chunks_mutex);
+    return chunk;
+  }
+
+  chunk = calloc (1, sizeof (http_chunk_t));
+  data = malloc (HTTP_CHUNK_SIZE);
+  if (!chunk || !data)
+  {
+    ithread_mutex_unlock (&dlna->http_chunks_mutex);
+    free (chunk);
+    free (data);
+    return NULL;
+  }
+  chunk->key = key;
+  chunk->data = data;
+  chunk->loading = 1;
+  chunk->cached = 1;
+  chunk->refcount = 2; /* the cache and the caller */
+  HASH_ADD (hh, dlna->http_chunks, key, sizeof (key), chunk);
+  dlna->http_chunks_size += HTTP_CHUNK_SIZE;
+
+  for (next = dlna->http_chunks;
+       next && dlna->http_chunks_size > dlna->http_chunks_max; )
+  {
+    http_chunk_t *old = next;
+
+    next = old->hh.next;
+    if (!old->loading)
+      http_chunk_remove (dlna, old);
+  }
+  ithread_mutex_unlock (&dlna->http_chunks_mutex);
+
+  len = pread (file->fd, data, HTTP_CHUNK_SIZE, offset);
+  if (len >= 0 && len < HTTP_CHUNK_SIZE)
+  {
+    /* end of the file: no need to hold a full chunk */
+    data = realloc (chunk->data, len ? len : 1);
+    if (data)
+      chunk->data = data;
+  }
+
+  ithread_mutex_lock (&dlna->http_chunks_mutex);
+  chunk->loading = 0;
+  chunk->len = len;
+  if (chunk->cached)
+  {
+    dlna->http_chunks_size -= HTTP_CHUNK_SIZE;
+    if (len < 0)
+    {
+      /* let the next request try again */
+      HASH_DEL (dlna->http_chunks, chunk);
+      chunk->cached = 0;
+      http_chunk_release (chunk);
+    }
+    else
+      dlna->http_chunks_size += len;
+  }
+  ithread_cond_broadcast (&dlna->http_chunks_loaded);
+  if (len < 0)
+  {
+    http_chunk_release (chunk);
+    chunk = NULL;
+  }
+  ithread_mutex_unlock (&dlna->http_chunks_mutex);
+
+  return chunk;
+}
+
+/*
+ * Read a local file through the chunk cache: for the small files, and
+ *  for the files streamed by several requests at once.
+ */
+static int
+http_chunk_usable (dlna_t *dlna, http_file_handler_t *hdl)
+{
+  http_file_t *file = hdl->detail.local.file;
+  size_t max;
+
+  ithread_mutex_lock (&dlna->http_chunks_mutex);
+  max = dlna->http_chunks_max;
+  ithread_mutex_unlock (&dlna->http_chunks_mutex);
+
+  if (!max)
+    return 0;
+  if ((size_t) file->st.st_size <= max / HTTP_CHUNK_SMALL_FILE)
+    return 1;
+
+  return http_file_shared (dlna, file);
+}
+
+static ssize_t
+http_chunk_read (dlna_t *dlna, http_file_handler_t *hdl,
+                 char *buf, size_t len)
+{
+  http_file_t *file = hdl->detail.local.file;
+  size_t copied = 0;
+
+  while (copied < len && hdl->pos + (off_t) copied < file->st.st_size)
+  {
+    off_t pos = hdl->pos + copied;
+    off_t skip = pos % HTTP_CHUNK_SIZE;
+    http_chunk_t *chunk;
+    size_t n;
+
+    chunk = http_chunk_get (dlna, file, pos - skip);
+    if (!chunk)
+      return copied ? (ssize_t) copied : -1;
+
+    n = chunk->len > skip ? MIN ((size_t) (chunk->len - skip), len - copied) : 0;
+    memcpy (buf + copied, chunk->data + skip, n);
+    http_chunk_unref (dlna, chunk);
+    if (!n)
+      break; /* the file is shorter than its stat */
+    copied += n;
+  }
+
+  return copied;
+}
+
+void
+dlna_http_file_cache_flush (dlna_t *dlna)
+{
+  http_file_t *file;
+
+  if (!dlna)
+    return;
+
+  ithread_mutex_lock (&dlna->http_chunks_mutex);
+  while (dlna->http_chunks)
+    http_chunk_remove (dlna, dlna->http_chunks);
+  ithread_mutex_unlock (&dlna->http_chunks_mutex);
+
+  ithread_mutex_lock (&dlna->http_files_mutex);
+  while (dlna->http_files)
+  {
+    file = dlna->http_files;
+    HASH_DEL (dlna->http_files, file);
+    http_file_release (file);
+  }
+  ithread_mutex_unlock (&dlna->http_files_mutex);
+}
+
+/*
+ * Page cache hints of a local file read, before it is made. Sequential
+ *  reads get a window read ahead, of HTTP_READAHEAD_TIME seconds at the
+ *  rate the stream is consumed; a seek starts the measure again. The
+ *  pages read from large files are dropped, unless other requests read
+ *  the same file.
+ */
+static void
+http_file_advise (dlna_t *dlna, http_file_handler_t *hdl, size_t len)
+{
+#ifdef POSIX_FADV_WILLNEED
+  struct timespec now;
+  int64_t elapsed;
+  off_t window, end;
+  int fd;
+
+  fd = hdl->detail.local.file->fd;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  if (hdl->pos != hdl->detail.local.next)
+  {
+    /* first read or seek */
+    hdl->detail.local.run = 0;
+    hdl->detail.local.start = now;
+    hdl->detail.local.advised = hdl->pos;
+    hdl->detail.local.dropped = hdl->pos;
+    return;
+  }
+
+  /* stream rate, in bytes per second */
+  elapsed = (int64_t) (now.tv_sec - hdl->detail.local.start.tv_sec) * 1000
+    + (now.tv_nsec - hdl->detail.local.start.tv_nsec) / 1000000;
+  if (elapsed > 0)
+    window = hdl->detail.local.run * 1000 / elapsed * HTTP_READAHEAD_TIME;
+  else
+    window = HTTP_READAHEAD_MIN;
+  window = MAX (window, MAX (HTTP_READAHEAD_MIN, 2 * (off_t) len));
+  window = MIN (window, HTTP_READAHEAD_MAX);
+
+  /* ask for the next window when half of the last one is read */
+  end = hdl->pos + len + window;
+  if (hdl->detail.local.advised < hdl->pos + len + window / 2)
+  {
+    off_t start = MAX (hdl->detail.local.advised, hdl->pos);
+    posix_fadvise (fd, start, end - start, POSIX_FADV_WILLNEED);
+    hdl->detail.local.advised = end;
+  }
+
+  if (hdl->detail.local.file->st.st_size >= HTTP_DROP_BEHIND_SIZE
+      && hdl->pos - hdl->detail.local.dropped >= HTTP_DROP_BEHIND_STEP)
+  {
+    if (!http_file_shared (dlna, hdl->detail.local.file))
+      posix_fadvise (fd, hdl->detail.local.dropped,
+                     hdl->pos - hdl->detail.local.dropped,
+                     POSIX_FADV_DONTNEED);
+    hdl->detail.local.dropped = hdl->pos;
+  }
+#endif /* POSIX_FADV_WILLNEED */
+}
+
 static inline void
 set_service_http_info (struct File_Info *info,
                        const size_t length,
@@ -79,8 +571,12 @@ dlna_http_get_info (void *cookie,
   uint32_t id;
   vfs_item_t *item;
   dlna_item_t *dlna_item;
-  struct stat st;
+  http_file_t *file;
   dlna_service_t *service;
+  dlna_description_t *description;
+#ifndef HAVE_EXTERNAL_LIBUPNP
+  char etag[HTTP_ETAG_SIZE];
+#endif
   
   if (!cookie || !filename || !info)
     return HTTP_ERROR;
@@ -111,12 +607,14 @@ dlna_http_get_info (void *cookie,
     service = dlna_service_find_url (dlna, (char *)filename + SERVICES_VIRTUAL_DIR_LEN + 1);
 
     /* return the service description if available */
-    if (service)
+    description = dlna_service_description (service);
+    if (description)
     {
-      char *description = service->get_description (dlna);
-
-      set_service_http_info (info, strlen(description), SERVICE_CONTENT_TYPE);
-      free (description);
+      set_service_http_info (info, description->length,
+                             SERVICE_CONTENT_TYPE);
+#ifndef HAVE_EXTERNAL_LIBUPNP
+      info->etag = ixmlCloneDOMString (description->etag);
+#endif
       return HTTP_OK;
     }
   }
@@ -137,21 +635,24 @@ dlna_http_get_info (void *cookie,
   if (!dlna_item->filename)
     return HTTP_ERROR;
 
-  if (stat (dlna_item->filename, &st) < 0)
+  /* cached stat, the file is opened along for the next request */
+  file = http_file_get (dlna, id, dlna_item->filename);
+  if (!file)
     return HTTP_ERROR;
 
-  info->is_readable = 1;
-  if (access (dlna_item->filename, R_OK) < 0)
-  {
-    if (errno != EACCES)
-      return HTTP_ERROR;
-    info->is_readable = 0;
-  }
-
   /* file exist and can be read */
-  info->file_length = st.st_size;
-  info->last_modified = st.st_mtime;
-  info->is_directory = S_ISDIR (st.st_mode);
+  info->is_readable = (file->fd >= 0);
+  info->file_length = file->st.st_size;
+  info->last_modified = file->st.st_mtime;
+  info->is_directory = S_ISDIR (file->st.st_mode);
+#ifndef HAVE_EXTERNAL_LIBUPNP
+  /* strong entity tag: object ID, size and modification time */
+  snprintf (etag, sizeof (etag), "%x-%llx-%lx", id,
+            (unsigned long long) file->st.st_size,
+            (unsigned long) file->st.st_mtime);
+  info->etag = ixmlCloneDOMString (etag);
+#endif
+  http_file_unref (dlna, file);
 
   if (dlna_item->profile->mime)
   {
@@ -165,21 +666,22 @@ dlna_http_get_info (void *cookie,
 
 static dlnaWebFileHandle
 http_get_file_from_memory (const char *fullpath,
-                           const char *description,
-                           const size_t length)
+                           dlna_description_t *description)
 {
   dlna_http_file_handler_t *dhdl;
   http_file_handler_t *hdl;
 
-  if (!fullpath || !description || length == 0)
+  if (!fullpath || !description || description->length == 0)
     return NULL;
   
+  /* the description is shared, not copied */
   hdl                        = malloc (sizeof (http_file_handler_t));
   hdl->fullpath              = strdup (fullpath);
   hdl->pos                   = 0;
   hdl->type                  = HTTP_FILE_MEMORY;
-  hdl->detail.memory.content = strdup (description);
-  hdl->detail.memory.len     = length;
+  hdl->detail.memory.description = dlna_description_ref (description);
+  hdl->detail.memory.content = description->content;
+  hdl->detail.memory.len     = description->length;
 
   dhdl                       = malloc (sizeof (dlna_http_file_handler_t));
   dhdl->external             = 0;
@@ -189,11 +691,11 @@ http_get_file_from_memory (const char *fullpath,
 }
 
 static dlnaWebFileHandle
-http_get_file_local (dlna_item_t *dlna_item)
+http_get_file_local (dlna_t *dlna, uint32_t id, dlna_item_t *dlna_item)
 {
   dlna_http_file_handler_t *dhdl;
   http_file_handler_t *hdl;
-  int fd;
+  http_file_t *file;
   
   if (!dlna_item)
     return NULL;
@@ -201,16 +703,31 @@ http_get_file_local (dlna_item_t *dlna_item)
   if (!dlna_item->filename)
     return NULL;
   
-  fd = open (dlna_item->filename,
-             O_RDONLY | O_NONBLOCK | O_SYNC | O_NDELAY);
-  if (fd < 0)
+  /* the descriptor is shared with the other requests of the file */
+  file = http_file_get (dlna, id, dlna_item->filename);
+  if (!file)
+    return NULL;
+  if (file->fd < 0)
+  {
+    http_file_unref (dlna, file);
     return NULL;
+  }
+
+  ithread_mutex_lock (&dlna->http_files_mutex);
+  file->readers++;
+  ithread_mutex_unlock (&dlna->http_files_mutex);
   
   hdl                        = malloc (sizeof (http_file_handler_t));
   hdl->fullpath              = strdup (dlna_item->filename);
   hdl->pos                   = 0;
   hdl->type                  = HTTP_FILE_LOCAL;
-  hdl->detail.local.fd       = fd;
+  hdl->detail.local.file     = file;
+  hdl->detail.local.next     = -1;
+#ifdef HAVE_IO_URING
+  hdl->detail.local.uring    = NULL;
+  if (file->st.st_size >= HTTP_URING_MIN_SIZE)
+    hdl->detail.local.uring  = dlna_uring_reader_new (file->fd);
+#endif /* HAVE_IO_URING */
 
   dhdl                       = malloc (sizeof (dlna_http_file_handler_t));
   dhdl->external             = 0;
@@ -229,6 +746,7 @@ dlna_http_open (void *cookie,
   vfs_item_t *item;
   dlna_item_t *dlna_item;
   dlna_service_t *service;
+  dlna_description_t *description;
   
   if (!cookie || !filename)
     return NULL;
@@ -257,15 +775,9 @@ dlna_http_open (void *cookie,
     service = dlna_service_find_url (dlna, (char *)filename + SERVICES_VIRTUAL_DIR_LEN + 1);
 
     /* return the service description if available */
-    if (service)
-    {
-      dlnaWebFileHandle ret;
-      char *description = service->get_description (dlna);
-
-      ret = http_get_file_from_memory (filename, description, strlen(description));
-      free (description);
-      return ret;
-    }
+    description = dlna_service_description (service);
+    if (description)
+      return http_get_file_from_memory (filename, description);
   }
   
   /* ask for anything else ... */
@@ -277,7 +789,7 @@ dlna_http_open (void *cookie,
   dlna_item = dlna_item_get(dlna, item);
   if (!dlna_item)
     return NULL;
-  return http_get_file_local (dlna_item);
+  return http_get_file_local (dlna, id, dlna_item);
 }
 
 static int
@@ -314,7 +826,22 @@ dlna_http_read (void *cookie,
   {
   case HTTP_FILE_LOCAL:
     dlna_log (dlna, DLNA_MSG_INFO, "Read local file.\n");
-    len = read (hdl->detail.local.fd, buf, buflen);
+    http_file_advise (dlna, hdl, buflen);
+    if (http_chunk_usable (dlna, hdl))
+      len = http_chunk_read (dlna, hdl, buf, buflen);
+    else
+#ifdef HAVE_IO_URING
+    if (hdl->detail.local.uring)
+      len = dlna_uring_reader_read (hdl->detail.local.uring,
+                                    buf, buflen, hdl->pos);
+    else
+#endif /* HAVE_IO_URING */
+    len = pread (hdl->detail.local.file->fd, buf, buflen, hdl->pos);
+    if (len > 0)
+    {
+      hdl->detail.local.next = hdl->pos + len;
+      hdl->detail.local.run += len;
+    }
     break;
   case HTTP_FILE_MEMORY:
     dlna_log (dlna, DLNA_MSG_INFO, "Read file from memory.\n");
@@ -408,16 +935,7 @@ dlna_http_seek (void *cookie,
               offset, hdl->pos, hdl->fullpath);
 
     if (hdl->type == HTTP_FILE_LOCAL)
-    {
-      struct stat sb;
-      if (stat (hdl->fullpath, &sb) < 0)
-      {
-        dlna_log (dlna, DLNA_MSG_ERROR,
-                  "%s: cannot stat: %s\n", hdl->fullpath, strerror (errno));
-        return HTTP_ERROR;
-      }
-      newpos = sb.st_size + offset;
-    }
+      newpos = hdl->detail.local.file->st.st_size + offset;
     else if (hdl->type == HTTP_FILE_MEMORY)
       newpos = hdl->detail.memory.len + offset;
     break;
@@ -434,14 +952,7 @@ dlna_http_seek (void *cookie,
       return HTTP_ERROR;
     }
 
-    /* Don't seek with origin as specified above, as file may have
-       changed in size since our last stat. */
-    if (lseek (hdl->detail.local.fd, newpos, SEEK_SET) == -1)
-    {
-      dlna_log (dlna, DLNA_MSG_ERROR,
-                "%s: cannot seek: %s\n", hdl->fullpath, strerror (errno));
-      return HTTP_ERROR;
-    }
+    /* the descriptor is shared: reads are made at hdl->pos */
     break;
   case HTTP_FILE_MEMORY:
     if (newpos < 0 || newpos > hdl->detail.memory.len)
@@ -491,12 +1002,18 @@ dlna_http_close (void *cookie,
   switch (hdl->type)
   {
   case HTTP_FILE_LOCAL:
-    close (hdl->detail.local.fd);
+#ifdef HAVE_IO_URING
+    /* the queued reads are done before the descriptor may be closed */
+    dlna_uring_reader_free (hdl->detail.local.uring);
+#endif /* HAVE_IO_URING */
+    ithread_mutex_lock (&dlna->http_files_mutex);
+    hdl->detail.local.file->readers--;
+    http_file_release (hdl->detail.local.file);
+    ithread_mutex_unlock (&dlna->http_files_mutex);
     break;
   case HTTP_FILE_MEMORY:
-    /* no close operation is needed, just free file content */
-    if (hdl->detail.memory.content)
-      free (hdl->detail.memory.content);
+    /* no close operation is needed, just release file content */
+    dlna_description_unref (hdl->detail.memory.description);
     break;
   default:
     dlna_log (dlna, DLNA_MSG_ERROR, "Unknown HTTP file type.\n");
@@ -511,6 +1028,56 @@ dlna_http_close (void *cookie,
   return HTTP_OK;
 }
 
+static int
+dlna_http_time_seek (void *cookie,
+                     const char *filename,
+                     int64_t *start,
+                     int64_t *end,
+                     int64_t *duration,
+                     off_t *first,
+                     off_t *last)
+{
+  dlna_t *dlna;
+  uint32_t id;
+  vfs_item_t *item;
+  dlna_item_t *dlna_item;
+  int64_t first_byte, last_byte;
+  int res;
+
+  if (!cookie || !filename)
+    return HTTP_ERROR;
+
+  dlna = (dlna_t *) cookie;
+
+  dlna_log (dlna, DLNA_MSG_INFO,
+            "%s, filename : %s\n", __FUNCTION__, filename);
+
+  id = strtoul (strrchr (filename, '/') + 1, NULL, 10);
+  item = vfs_get_item_by_id (dlna, id);
+  if (!item || item->type != DLNA_RESOURCE)
+    return HTTP_ERROR;
+
+  dlna_item = dlna_item_get (dlna, item);
+  if (!dlna_item || !dlna_item->seek_index)
+    return HTTP_ERROR;
+
+  res = dlna_seek_index_lookup (dlna_item->seek_index, dlna_item->filesize,
+                                start, end, &first_byte, &last_byte);
+  if (res)
+    return res;
+
+  *duration = dlna_item->seek_index->duration;
+  *first = (off_t) first_byte;
+  *last = (off_t) last_byte;
+
+  dlna_log (dlna, DLNA_MSG_INFO,
+            "Time seek to %"PRId64"-%"PRId64" ms, "
+            "bytes %"PRId64"-%"PRId64" of %s\n",
+            *start, *end, first_byte, last_byte, dlna_item->filename);
+
+  return HTTP_OK;
+}
+
 #ifndef HAVE_EXTERNAL_LIBUPNP
 struct dlnaVirtualDirCallbacks virtual_dir_callbacks = {
   .cookie = NULL,
@@ -519,7 +1086,8 @@ struct dlnaVirtualDirCallbacks virtual_dir_callbacks = {
   .read = dlna_http_read,
   .write = dlna_http_write,
   .seek = dlna_http_seek,
-  .close = dlna_http_close
+  .close = dlna_http_close,
+  .time_seek = dlna_http_time_seek
 };
 #else
 static void *http_cookie;
@@ -288,6 +288,9 @@ dlna_item_new (dlna_t *dlna, const char *filename)
     item->properties = item->profile->get_properties (item);
   if (item->profile->get_metadata)
     item->metadata   = item->profile->get_metadata (item);
+  if (item->profile->media_class == DLNA_CLASS_AV
+      || item->profile->media_class == DLNA_CLASS_AUDIO)
+    item->seek_index = dlna_seek_index_new (dlna, item->filename);
   return item;
 }
 
@@ -301,6 +304,8 @@ dlna_item_free (dlna_item_t *item)
     free (item->filename);
   if (item->properties)
     free (item->properties);
+  if (item->seek_index)
+    dlna_seek_index_free (item->seek_index);
   item->profile->free (item);
   item->profile = NULL;
   free (item);
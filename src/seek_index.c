@@ -0,0 +1,881 @@
+/*
+ * libdlna: reference DLNA standards implementation.
+ * Copyright (C) 2007-2008 Benjamin Zores <ben@geexbox.org>
+ *
+ * This file is part of libdlna.
+ *
+ * libdlna is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libdlna is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libdlna; if not, write to the Free Software
+ * Foundation, Inc, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Time seek index: maps play times of a media file to byte offsets,
+ * so that TimeSeekRange.dlna.org requests can be served without
+ * decoding the file.
+ *
+ *  - MPEG-2 TS files are probed at regular byte offsets for the
+ *    PCR of their first program.
+ *  - MPEG-1/2 PS files are probed the same way for the SCR of their
+ *    pack headers.
+ *  - MP4 files are indexed on the sync samples of their first video
+ *    track (or first audio track), from the stss, stts, stsc, stsz and
+ *    stco/co64 tables.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dlna_internals.h"
+#include "minmax.h"
+
+/* maximum number of points of an index */
+#define SEEK_INDEX_MAX_POINTS     4096
+/* minimum time between two points, in ms */
+#define SEEK_INDEX_MIN_INTERVAL   500
+
+#define TS_PACKET_SIZE            188
+#define TS_SYNC_BYTE              0x47
+/* number of packets read at once while probing */
+#define TS_PROBE_PACKETS          64
+/* maximum number of bytes read to find a PCR/SCR from a probe offset */
+#define MPEG_PROBE_MAX            (512 * 1024)
+/* 33 bits clock of 90 kHz */
+#define MPEG_CLOCK_WRAP           (INT64_C(1) << 33)
+#define MPEG_CLOCK_MS(t)          ((t) / 90)
+/* clock step between two probes beyond the expected one taken as a splice */
+#define MPEG_CLOCK_JUMP           (INT64_C(60) * 90000)
+
+/* largest moov box loaded for indexing */
+#define MP4_MOOV_MAX              (32 * 1024 * 1024)
+
+typedef enum {
+  SEEK_CONTAINER_UNKNOWN,
+  SEEK_CONTAINER_MPEG_TS,
+  SEEK_CONTAINER_MPEG_PS,
+  SEEK_CONTAINER_MP4,
+} seek_container_t;
+
+static int
+seek_index_add (dlna_seek_index_t *index, int64_t time, int64_t offset)
+{
+  dlna_seek_point_t *last = NULL;
+
+  if (time < 0 || time > UINT32_MAX || offset < 0)
+    return -1;
+
+  if (index->count)
+  {
+    last = &index->points[index->count - 1];
+    if (time < (int64_t) last->time + SEEK_INDEX_MIN_INTERVAL
+        || offset <= last->offset)
+      return 0;
+  }
+
+  if (index->count == SEEK_INDEX_MAX_POINTS)
+    return -1;
+
+  if (!index->points)
+  {
+    index->points = malloc (SEEK_INDEX_MAX_POINTS * sizeof (dlna_seek_point_t));
+    if (!index->points)
+      return -1;
+  }
+
+  index->points[index->count].time = (uint32_t) time;
+  index->points[index->count].offset = offset;
+  index->count++;
+
+  return 0;
+}
+
+static ssize_t
+seek_read (int fd, void *buf, size_t len, int64_t offset)
+{
+  ssize_t n, done = 0;
+
+  while ((size_t) done < len)
+  {
+    n = pread (fd, (char *) buf + done, len - done, (off_t) offset + done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+
+  return done;
+}
+
+/***************************************************************************/
+/*                                                                         */
+/* MPEG-2 Transport Stream and MPEG-1/2 Program Stream                     */
+/*                                                                         */
+/***************************************************************************/
+
+typedef struct mpeg_probe_s {
+  seek_container_t container;
+  /* TS: size of packets and offset of the sync byte in a packet */
+  int packet_size;
+  int sync_offset;
+  /* TS: PID carrying the PCR, -1 until the first PCR is found */
+  int pcr_pid;
+  /*
+   * Play clock: the stream clock plus a base, moved on wraps and
+   * splices so that the play clock always goes forward. first and last
+   * are the play clock of the first and last timestamps found, at the
+   * file offsets first_pos and last_pos.
+   */
+  int64_t base;
+  int64_t first;
+  int64_t last;
+  int64_t first_pos;
+  int64_t last_pos;
+  int discontinuities;
+} mpeg_probe_t;
+
+static int64_t
+ts_packet_pcr (mpeg_probe_t *probe, const uint8_t *p)
+{
+  int pid;
+
+  if (p[0] != TS_SYNC_BYTE)
+    return -1;
+
+  /* adaptation field with a PCR */
+  if (!(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+    return -1;
+
+  pid = ((p[1] & 0x1f) << 8) | p[2];
+  if (probe->pcr_pid >= 0 && pid != probe->pcr_pid)
+    return -1;
+  probe->pcr_pid = pid;
+
+  return ((int64_t) p[6] << 25) | (p[7] << 17) | (p[8] << 9)
+    | (p[9] << 1) | (p[10] >> 7);
+}
+
+static int64_t
+ps_pack_scr (const uint8_t *p)
+{
+  /* MPEG-2 pack header */
+  if ((p[4] & 0xc0) == 0x40)
+    return ((int64_t) ((p[4] >> 3) & 0x07) << 30) | ((p[4] & 0x03) << 28)
+      | (p[5] << 20) | ((p[6] >> 3) << 15) | ((p[6] & 0x03) << 13)
+      | (p[7] << 5) | (p[8] >> 3);
+
+  /* MPEG-1 pack header */
+  if ((p[4] & 0xf0) == 0x20)
+    return ((int64_t) ((p[4] >> 1) & 0x07) << 30) | (p[5] << 22)
+      | ((p[6] >> 1) << 15) | (p[7] << 7) | (p[8] >> 1);
+
+  return -1;
+}
+
+/*
+ * Find the first timestamp after offset, or the last one of the
+ * probed area if last is set. Returns the offset of the packet or pack
+ * carrying it, or -1 if none was found.
+ */
+static int64_t
+mpeg_probe_clock (mpeg_probe_t *probe, int fd, int64_t offset,
+                  int last, int64_t *clock)
+{
+  uint8_t *buf;
+  size_t len;
+  int64_t start, found = -1;
+  ssize_t n;
+  int i;
+
+  if (probe->container == SEEK_CONTAINER_MPEG_TS)
+  {
+    len = probe->packet_size * TS_PROBE_PACKETS;
+    offset -= offset % probe->packet_size;
+  }
+  else
+    len = 64 * 1024;
+
+  buf = malloc (len);
+  if (!buf)
+    return -1;
+
+  for (start = offset; start < offset + MPEG_PROBE_MAX; )
+  {
+    n = seek_read (fd, buf, len, start);
+    if (n <= 0)
+      break;
+
+    if (probe->container == SEEK_CONTAINER_MPEG_TS)
+    {
+      for (i = 0; i + probe->packet_size <= n; i += probe->packet_size)
+      {
+        int64_t pcr;
+
+        pcr = ts_packet_pcr (probe, buf + i + probe->sync_offset);
+        if (pcr < 0)
+          continue;
+        *clock = pcr;
+        found = start + i;
+        if (!last)
+          break;
+      }
+      start += n - n % probe->packet_size;
+    }
+    else
+    {
+      for (i = 0; i + 14 <= n; i++)
+      {
+        int64_t scr;
+
+        if (buf[i] || buf[i + 1] || buf[i + 2] != 0x01 || buf[i + 3] != 0xba)
+          continue;
+        scr = ps_pack_scr (buf + i);
+        if (scr < 0)
+          continue;
+        *clock = scr;
+        found = start + i;
+        if (!last)
+          break;
+      }
+      /* a pack header may straddle two reads */
+      start += (n > 14) ? n - 13 : n;
+    }
+
+    if ((found >= 0 && !last) || (size_t) n < len)
+      break;
+  }
+
+  free (buf);
+  return found;
+}
+
+/*
+ * Turn a 33 bits clock found at offset pos into the play clock. Wraps
+ * are followed, and on a splice (clock going backward, or jumping
+ * forward far more than the bytes in between can hold) the play clock
+ * goes on at the byte rate of the stream met so far.
+ */
+static int64_t
+mpeg_unwrap_clock (mpeg_probe_t *probe, int64_t clock, int64_t pos)
+{
+  int64_t t, delta, expected = 0;
+
+  t = clock + probe->base;
+  if (probe->first < 0)
+  {
+    probe->first = probe->last = t;
+    probe->first_pos = probe->last_pos = pos;
+    return t;
+  }
+
+  delta = t - probe->last;
+  while (delta < -MPEG_CLOCK_WRAP / 2)
+  {
+    probe->base += MPEG_CLOCK_WRAP;
+    delta += MPEG_CLOCK_WRAP;
+  }
+  while (delta > MPEG_CLOCK_WRAP / 2)
+  {
+    probe->base -= MPEG_CLOCK_WRAP;
+    delta -= MPEG_CLOCK_WRAP;
+  }
+
+  if (probe->last_pos > probe->first_pos && pos > probe->last_pos)
+    expected = (int64_t) ((double) (probe->last - probe->first)
+                          * (pos - probe->last_pos)
+                          / (probe->last_pos - probe->first_pos));
+
+  if (delta < 0 || delta > 2 * expected + MPEG_CLOCK_JUMP)
+  {
+    probe->base += expected - delta;
+    delta = expected;
+    probe->discontinuities++;
+  }
+
+  probe->last += delta;
+  probe->last_pos = pos;
+  return probe->last;
+}
+
+static dlna_seek_index_t *
+mpeg_seek_index_build (dlna_t *dlna, int fd, int64_t size,
+                       mpeg_probe_t *probe)
+{
+  dlna_seek_index_t *index;
+  int64_t step, offset, pos, clock, t;
+
+  index = calloc (1, sizeof (dlna_seek_index_t));
+  if (!index)
+    return NULL;
+
+  step = MAX (size / SEEK_INDEX_MAX_POINTS, MPEG_PROBE_MAX / 8);
+  probe->pcr_pid = -1;
+  probe->base = 0;
+  probe->first = -1;
+  probe->discontinuities = 0;
+
+  for (offset = 0; offset < size; offset += step)
+  {
+    pos = mpeg_probe_clock (probe, fd, offset, 0, &clock);
+    if (pos < 0)
+      continue;
+
+    t = mpeg_unwrap_clock (probe, clock, pos);
+    if (seek_index_add (index, MPEG_CLOCK_MS (t - probe->first), pos) < 0)
+      break;
+  }
+
+  /* the duration is given by the last timestamp of the file */
+  pos = mpeg_probe_clock (probe, fd, MAX (size - MPEG_PROBE_MAX, 0), 1, &clock);
+  if (pos >= 0 && probe->first >= 0)
+  {
+    t = mpeg_unwrap_clock (probe, clock, pos);
+    index->duration = (uint32_t) MPEG_CLOCK_MS (t - probe->first);
+  }
+  else if (index->count)
+    index->duration = index->points[index->count - 1].time;
+
+  if (probe->discontinuities)
+    dlna_log (dlna, DLNA_MSG_WARNING,
+              "Time index: %d timestamp discontinuities rebased\n",
+              probe->discontinuities);
+
+  return index;
+}
+
+/***************************************************************************/
+/*                                                                         */
+/* MP4                                                                     */
+/*                                                                         */
+/***************************************************************************/
+
+typedef struct mp4_box_s {
+  const uint8_t *data;
+  uint64_t size;
+} mp4_box_t;
+
+static uint32_t
+mp4_rb32 (const uint8_t *p)
+{
+  return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t
+mp4_rb64 (const uint8_t *p)
+{
+  return ((uint64_t) mp4_rb32 (p) << 32) | mp4_rb32 (p + 4);
+}
+
+/*
+ * Find the nth child box of a given type in a parent box payload.
+ * The found box payload excludes its header.
+ */
+static int
+mp4_box_find (const mp4_box_t *parent, const char *type, int nth,
+              mp4_box_t *box)
+{
+  const uint8_t *p = parent->data;
+  uint64_t left = parent->size;
+
+  while (left >= 8)
+  {
+    uint64_t size = mp4_rb32 (p);
+    int header = 8;
+
+    if (size == 1)
+    {
+      if (left < 16)
+        return -1;
+      size = mp4_rb64 (p + 8);
+      header = 16;
+    }
+    else if (size == 0)
+      size = left;
+
+    if (size < (uint64_t) header || size > left)
+      return -1;
+
+    if (!memcmp (p + 4, type, 4) && nth-- == 0)
+    {
+      box->data = p + header;
+      box->size = size - header;
+      return 0;
+    }
+
+    p += size;
+    left -= size;
+  }
+
+  return -1;
+}
+
+static int
+mp4_box_path (const mp4_box_t *parent, const char *path, mp4_box_t *box)
+{
+  mp4_box_t cur = *parent;
+
+  for (; *path; path += 4)
+  {
+    if (*path == '/')
+      path++;
+    if (mp4_box_find (&cur, path, 0, &cur) < 0)
+      return -1;
+  }
+
+  *box = cur;
+  return 0;
+}
+
+/* Full box with a table of entries, returns the number of entries. */
+static int64_t
+mp4_table (const mp4_box_t *box, uint64_t header, uint64_t entry_size)
+{
+  uint64_t count;
+
+  if (box->size < header)
+    return -1;
+
+  count = mp4_rb32 (box->data + header - 4);
+  if (count > (box->size - header) / entry_size)
+    return -1;
+
+  return count;
+}
+
+static int
+mp4_track_handler (const mp4_box_t *trak, const char *handler)
+{
+  mp4_box_t hdlr;
+
+  if (mp4_box_path (trak, "mdia/hdlr", &hdlr) < 0 || hdlr.size < 12)
+    return 0;
+
+  return !memcmp (hdlr.data + 8, handler, 4);
+}
+
+static dlna_seek_index_t *
+mp4_track_seek_index (const mp4_box_t *trak)
+{
+  mp4_box_t mdhd, stbl, stts, stss, stsc, stsz, stco;
+  dlna_seek_index_t *index;
+  uint32_t timescale, sample_size;
+  uint64_t duration;
+  int64_t nstts, nstss, nstsc, nstsz, nstco;
+  int64_t chunk, sample, stts_i, stts_left, stss_i, stsc_i, time;
+  int co64 = 0;
+
+  if (mp4_box_path (trak, "mdia/mdhd", &mdhd) < 0 || mdhd.size < 4)
+    return NULL;
+  if (mdhd.data[0] == 1)
+  {
+    if (mdhd.size < 32)
+      return NULL;
+    timescale = mp4_rb32 (mdhd.data + 20);
+    duration = mp4_rb64 (mdhd.data + 24);
+  }
+  else
+  {
+    if (mdhd.size < 20)
+      return NULL;
+    timescale = mp4_rb32 (mdhd.data + 12);
+    duration = mp4_rb32 (mdhd.data + 16);
+  }
+  if (!timescale)
+    return NULL;
+
+  if (mp4_box_path (trak, "mdia/minf/stbl", &stbl) < 0
+      || mp4_box_find (&stbl, "stts", 0, &stts) < 0
+      || mp4_box_find (&stbl, "stsc", 0, &stsc) < 0
+      || mp4_box_find (&stbl, "stsz", 0, &stsz) < 0)
+    return NULL;
+  if (mp4_box_find (&stbl, "stco", 0, &stco) < 0)
+  {
+    if (mp4_box_find (&stbl, "co64", 0, &stco) < 0)
+      return NULL;
+    co64 = 1;
+  }
+
+  /* no stss: every sample is a sync sample */
+  if (mp4_box_find (&stbl, "stss", 0, &stss) < 0)
+    nstss = -1;
+  else if ((nstss = mp4_table (&stss, 8, 4)) < 0)
+    return NULL;
+
+  nstts = mp4_table (&stts, 8, 8);
+  nstsc = mp4_table (&stsc, 8, 12);
+  nstco = mp4_table (&stco, 8, co64 ? 8 : 4);
+  if (nstts < 0 || nstsc < 1 || nstco < 0 || stsz.size < 12)
+    return NULL;
+  sample_size = mp4_rb32 (stsz.data + 4);
+  nstsz = mp4_rb32 (stsz.data + 8);
+  if (!sample_size && (uint64_t) nstsz > (stsz.size - 12) / 4)
+    return NULL;
+
+  index = calloc (1, sizeof (dlna_seek_index_t));
+  if (!index)
+    return NULL;
+  index->duration = (uint32_t) MIN (duration * 1000 / timescale, UINT32_MAX);
+
+  sample = 0;
+  time = 0;
+  stts_i = stss_i = stsc_i = 0;
+  stts_left = nstts ? mp4_rb32 (stts.data + 8) : 0;
+
+  for (chunk = 0; chunk < nstco && sample < nstsz; chunk++)
+  {
+    int64_t offset, n;
+    const uint8_t *e;
+
+    offset = co64 ? (int64_t) mp4_rb64 (stco.data + 8 + chunk * 8)
+      : mp4_rb32 (stco.data + 8 + chunk * 4);
+
+    /* stsc chunks are 1-based */
+    while (stsc_i + 1 < nstsc
+           && mp4_rb32 (stsc.data + 8 + (stsc_i + 1) * 12) <= chunk + 1)
+      stsc_i++;
+    e = stsc.data + 8 + stsc_i * 12;
+    n = mp4_rb32 (e + 4);
+
+    for (; n > 0 && sample < nstsz; n--, sample++)
+    {
+      int sync;
+
+      /* stss samples are 1-based */
+      if (nstss < 0)
+        sync = 1;
+      else
+      {
+        while (stss_i < nstss
+               && mp4_rb32 (stss.data + 8 + stss_i * 4) < sample + 1)
+          stss_i++;
+        sync = (stss_i < nstss
+                && mp4_rb32 (stss.data + 8 + stss_i * 4) == sample + 1);
+      }
+
+      if (sync && seek_index_add (index, time * 1000 / timescale, offset) < 0)
+        goto out;
+
+      offset += sample_size ? sample_size
+        : mp4_rb32 (stsz.data + 12 + sample * 4);
+
+      while (stts_left == 0 && ++stts_i < nstts)
+        stts_left = mp4_rb32 (stts.data + 8 + stts_i * 8);
+      if (stts_i >= nstts)
+        goto out;
+      time += mp4_rb32 (stts.data + 8 + stts_i * 8 + 4);
+      stts_left--;
+    }
+  }
+
+ out:
+  return index;
+}
+
+static dlna_seek_index_t *
+mp4_seek_index_build (dlna_t *dlna, int fd, int64_t size)
+{
+  dlna_seek_index_t *index = NULL;
+  mp4_box_t moov, trak;
+  uint8_t header[16], *buf = NULL;
+  int64_t offset = 0;
+  uint64_t box_size = 0;
+  int i;
+
+  /* look for the moov box, which may follow the media data */
+  while (offset + 8 <= size)
+  {
+    int header_size = 8;
+
+    if (seek_read (fd, header, sizeof (header), offset) < 8)
+      return NULL;
+    box_size = mp4_rb32 (header);
+    if (box_size == 1)
+    {
+      box_size = mp4_rb64 (header + 8);
+      header_size = 16;
+    }
+    else if (box_size == 0)
+      box_size = size - offset;
+    if (box_size < (uint64_t) header_size)
+      return NULL;
+
+    if (!memcmp (header + 4, "moov", 4))
+    {
+      offset += header_size;
+      box_size -= header_size;
+      break;
+    }
+    offset += box_size;
+    box_size = 0;
+  }
+
+  if (!box_size || box_size > MP4_MOOV_MAX)
+  {
+    if (box_size)
+      dlna_log (dlna, DLNA_MSG_WARNING,
+                "Time index: moov box too large (%"PRIu64" bytes)\n", box_size);
+    return NULL;
+  }
+
+  buf = malloc (box_size);
+  if (!buf)
+    return NULL;
+  if (seek_read (fd, buf, box_size, offset) != (ssize_t) box_size)
+    goto out;
+  moov.data = buf;
+  moov.size = box_size;
+
+  /* prefer the first video track, then the first audio track */
+  for (i = 0; !index && mp4_box_find (&moov, "trak", i, &trak) == 0; i++)
+    if (mp4_track_handler (&trak, "vide"))
+      index = mp4_track_seek_index (&trak);
+  for (i = 0; !index && mp4_box_find (&moov, "trak", i, &trak) == 0; i++)
+    if (mp4_track_handler (&trak, "soun"))
+      index = mp4_track_seek_index (&trak);
+
+ out:
+  free (buf);
+  return index;
+}
+
+/***************************************************************************/
+/*                                                                         */
+/* Time Seek Index                                                         */
+/*                                                                         */
+/***************************************************************************/
+
+static seek_container_t
+seek_index_probe (int fd, mpeg_probe_t *probe)
+{
+  uint8_t buf[3 * 192];
+  ssize_t n;
+
+  n = seek_read (fd, buf, sizeof (buf), 0);
+  if (n < 12)
+    return SEEK_CONTAINER_UNKNOWN;
+
+  if (!memcmp (buf + 4, "ftyp", 4) || !memcmp (buf + 4, "moov", 4))
+    return SEEK_CONTAINER_MP4;
+
+  if (!buf[0] && !buf[1] && buf[2] == 0x01 && buf[3] == 0xba)
+    return SEEK_CONTAINER_MPEG_PS;
+
+  if (n < (ssize_t) sizeof (buf))
+    return SEEK_CONTAINER_UNKNOWN;
+
+  /* plain TS packets, or timestamped ones as in M2TS files */
+  probe->sync_offset = 0;
+  probe->packet_size = TS_PACKET_SIZE;
+  if (buf[0] == TS_SYNC_BYTE && buf[188] == TS_SYNC_BYTE
+      && buf[376] == TS_SYNC_BYTE)
+    return SEEK_CONTAINER_MPEG_TS;
+
+  probe->sync_offset = 4;
+  probe->packet_size = TS_PACKET_SIZE + 4;
+  if (buf[4] == TS_SYNC_BYTE && buf[196] == TS_SYNC_BYTE
+      && buf[388] == TS_SYNC_BYTE)
+    return SEEK_CONTAINER_MPEG_TS;
+
+  return SEEK_CONTAINER_UNKNOWN;
+}
+
+dlna_seek_index_t *
+dlna_seek_index_new (dlna_t *dlna, const char *filename)
+{
+  dlna_seek_index_t *index = NULL;
+  mpeg_probe_t probe;
+  struct stat st;
+  int fd;
+
+  if (!filename)
+    return NULL;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+  {
+    close (fd);
+    return NULL;
+  }
+
+  memset (&probe, 0, sizeof (probe));
+  probe.container = seek_index_probe (fd, &probe);
+  switch (probe.container)
+  {
+  case SEEK_CONTAINER_MPEG_TS:
+  case SEEK_CONTAINER_MPEG_PS:
+    index = mpeg_seek_index_build (dlna, fd, st.st_size, &probe);
+    break;
+  case SEEK_CONTAINER_MP4:
+    index = mp4_seek_index_build (dlna, fd, st.st_size);
+    break;
+  default:
+    break;
+  }
+  close (fd);
+
+  /* an index without points can't seek anything */
+  if (index && (!index->count || !index->duration))
+  {
+    dlna_seek_index_free (index);
+    index = NULL;
+  }
+
+  if (index)
+    dlna_log (dlna, DLNA_MSG_INFO,
+              "Time index of %s: %u points over %u ms\n",
+              filename, index->count, index->duration);
+
+  return index;
+}
+
+void
+dlna_seek_index_free (dlna_seek_index_t *index)
+{
+  if (!index)
+    return;
+
+  if (index->points)
+    free (index->points);
+  free (index);
+}
+
+int
+dlna_seek_index_lookup (dlna_seek_index_t *index, int64_t filesize,
+                        int64_t *start, int64_t *end,
+                        int64_t *first, int64_t *last)
+{
+  uint32_t lo, hi, mid;
+
+  if (!index || !index->count || filesize <= 0)
+    return -1;
+
+  if (*start >= index->duration || (*end >= 0 && *end < *start))
+    return 1;
+
+  /* last point at or before the start time */
+  lo = 0;
+  hi = index->count;
+  while (hi - lo > 1)
+  {
+    mid = (lo + hi) / 2;
+    if (index->points[mid].time <= *start)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if (index->points[lo].time > *start)
+  {
+    *first = 0;
+    *start = 0;
+  }
+  else
+  {
+    *first = index->points[lo].offset;
+    *start = index->points[lo].time;
+  }
+
+  /* first point at or after the end time */
+  *last = filesize - 1;
+  if (*end < 0 || *end >= index->duration)
+    *end = index->duration;
+  else
+  {
+    for (hi = lo; hi < index->count; hi++)
+      if (index->points[hi].time >= *end)
+        break;
+    if (hi < index->count && index->points[hi].offset > *first)
+    {
+      *last = index->points[hi].offset - 1;
+      *end = index->points[hi].time;
+    }
+    else
+      *end = index->duration;
+  }
+
+  if (*first >= filesize)
+    return 1;
+  if (*last >= filesize)
+    *last = filesize - 1;
+
+  return 0;
+}
+
+char *
+dlna_seek_index_to_string (dlna_seek_index_t *index)
+{
+  char *str, *p;
+  size_t len;
+  uint32_t i;
+
+  if (!index)
+    return NULL;
+
+  /* "duration;time:offset,..." */
+  len = 12 + (size_t) index->count * 33;
+  str = malloc (len);
+  if (!str)
+    return NULL;
+
+  p = str + sprintf (str, "%u;", index->duration);
+  for (i = 0; i < index->count; i++)
+    p += sprintf (p, "%s%u:%"PRId64, i ? "," : "",
+                  index->points[i].time, index->points[i].offset);
+
+  return str;
+}
+
+dlna_seek_index_t *
+dlna_seek_index_from_string (const char *str)
+{
+  dlna_seek_index_t *index;
+  char *p;
+
+  if (!str || !*str)
+    return NULL;
+
+  index = calloc (1, sizeof (dlna_seek_index_t));
+  if (!index)
+    return NULL;
+
+  index->duration = strtoul (str, &p, 10);
+  if (*p == ';')
+    p++;
+
+  while (*p)
+  {
+    int64_t time, offset;
+
+    time = strtoll (p, &p, 10);
+    if (*p++ != ':')
+      break;
+    offset = strtoll (p, &p, 10);
+    if (seek_index_add (index, time, offset) < 0)
+      break;
+    if (*p == ',')
+      p++;
+  }
+
+  if (!index->count || !index->duration)
+  {
+    dlna_seek_index_free (index);
+    return NULL;
+  }
+
+  return index;
+}
@@ -66,6 +66,9 @@
 "      <dataType>%s</dataType>" \
 "    </stateVariable>"
 
+extern uint32_t
+crc32(uint32_t crc, const void *buf, size_t size);
+
 char *SERVICE_STATE_EVENTING[] = {
   "no",
   "yes"
@@ -120,18 +123,73 @@ dlna_service_get_description (dlna_t *dlna, upnp_service_action_t *actions, upnp
   return desc;
 }
 
+dlna_description_t *
+dlna_description_new (char *content)
+{
+  dlna_description_t *desc;
+
+  if (!content)
+    return NULL;
+
+  desc = calloc (1, sizeof (dlna_description_t));
+  if (!desc)
+  {
+    free (content);
+    return NULL;
+  }
+
+  desc->content = content;
+  desc->length = strlen (content);
+  snprintf (desc->etag, sizeof (desc->etag), "%08x-%zx",
+            crc32 (0, content, desc->length), desc->length);
+  desc->refcount = 1;
+
+  return desc;
+}
+
+dlna_description_t *
+dlna_description_ref (dlna_description_t *desc)
+{
+  if (desc)
+    __atomic_add_fetch (&desc->refcount, 1, __ATOMIC_RELAXED);
+  return desc;
+}
+
+void
+dlna_description_unref (dlna_description_t *desc)
+{
+  if (!desc)
+    return;
+
+  if (__atomic_sub_fetch (&desc->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  free (desc->content);
+  free (desc);
+}
+
 void
 dlna_service_register (dlna_t *dlna, dlna_service_t *service)
 {
   dlna_service_list_t *item = NULL;
+  dlna_service_entry_t *entry;
+
   if (!dlna || !service)
     return;
 
   item = calloc (1, sizeof(dlna_service_list_t));
 
   item->id = service->typeid;
-  item->service = calloc (1, sizeof (dlna_service_t));
-  memcpy (item->service, service, sizeof (dlna_service_t));
+  entry = calloc (1, sizeof (dlna_service_entry_t));
+  memcpy (&entry->service, service, sizeof (dlna_service_t));
+
+  /* the SCPD doesn't change: render it once for all the requests */
+  entry->description = NULL;
+  if (service->get_description)
+    entry->description =
+      dlna_description_new (service->get_description (dlna));
+  item->service = &entry->service;
+
   HASH_ADD_INT (dlna->services, id, item);
 }
 
@@ -142,10 +200,21 @@ dlna_service_free (dlna_t *dlna, dlna_service_list_t *item)
     return;
 
   HASH_DEL (dlna->services, item);
+  dlna_description_unref (dlna_service_description (item->service));
   free (item->service);
   free (item);
 }
 
+dlna_description_t *
+dlna_service_description (const dlna_service_t *service)
+{
+  if (!service)
+    return NULL;
+
+  /* registered services are the first member of their entry */
+  return ((const dlna_service_entry_t *) service)->description;
+}
+
 const dlna_service_t *
 dlna_service_find (dlna_t *dlna, char *id)
 {
@@ -32,7 +32,9 @@
 #include "ThreadPool.h"
 #include "FreeList.h"
 #include <assert.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <stdio.h>
 
@@ -67,7 +69,85 @@ static unsigned long DiffMillis( struct timeval *time1, struct timeval *time2 )
 	return temp;
 }
 
-#ifdef STATS
+/* atomic accesses to the fields shared by the workers and the schedulers */
+#define TP_LOAD( p )		__atomic_load_n( ( p ), __ATOMIC_SEQ_CST )
+#define TP_STORE( p, v )	__atomic_store_n( ( p ), ( v ), __ATOMIC_SEQ_CST )
+#define TP_ADD( p, v )		__atomic_fetch_add( ( p ), ( v ), __ATOMIC_SEQ_CST )
+#define TP_CAS( p, e, v )	__atomic_compare_exchange_n( ( p ), ( e ), ( v ), \
+				0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST )
+
+/* statistics counters, only written by their worker and read by anyone */
+#define TP_PEEK( p )		__atomic_load_n( ( p ), __ATOMIC_RELAXED )
+#define TP_COUNT( p, v )	__atomic_store_n( ( p ), *( p ) + ( v ), __ATOMIC_RELAXED )
+
+/* high priority jobs a worker takes in a row before it serves a job
+   starving in a lower priority Q */
+#define TP_HIGH_RUN		8
+
+/* set in statsReaders by the shutdown: no more readers are let in */
+#define TP_STATS_CLOSED		( 1 << 30 )
+
+/* worker slot of the current thread, NULL if it is not a pool worker */
+static __thread ThreadPoolWorker *currentWorker = NULL;
+
+/****************************************************************************
+ * Function: TimeMillis
+ *
+ *  Description:
+ *      Returns a timeval structure in milliseconds.
+ *      Internal Only.
+ *****************************************************************************/
+static long long TimeMillis( struct timeval *time )
+{
+	return ( long long )time->tv_sec * 1000 + time->tv_usec / 1000;
+}
+
+/* the wait and run time averages are kept in 1/8 of millisecond */
+#define AVERAGE_SCALE 8
+#define AVERAGE_MAX ( 0x7fffffff / AVERAGE_SCALE / 2 )
+
+/****************************************************************************
+ * Function: UpdateAverage
+ *
+ *  Description:
+ *      Moves a moving average of times 1/8 of the way towards
+ *      a new sample. Updates from several workers may race, losing
+ *      a sample is harmless.
+ *      Internal Only.
+ *  Parameters:
+ *      int *average - in 1/8 of millisecond
+ *      unsigned long sample - in milliseconds
+ *****************************************************************************/
+static void UpdateAverage( int *average, unsigned long sample )
+{
+	int old = TP_LOAD( average );
+
+	if( sample > AVERAGE_MAX ) {
+		sample = AVERAGE_MAX;
+	}
+	TP_STORE( average, old + ( ( int )sample * AVERAGE_SCALE - old ) / 8 );
+}
+
+/****************************************************************************
+ * Function: ServiceTime
+ *
+ *  Description:
+ *      Returns the average run time of the jobs of a priority,
+ *      at least one millisecond, as long as no job ran.
+ *      Internal Only.
+ *  Parameters:
+ *      ThreadPool *tp
+ *      int priority
+ *  Returns:
+ *      the average run time, in 1/8 of millisecond
+ *****************************************************************************/
+static int ServiceTime( ThreadPool *tp, int priority )
+{
+	int average = TP_LOAD( &tp->serviceTime[priority] );
+
+	return average > AVERAGE_SCALE ? average : AVERAGE_SCALE;
+}
+
 /****************************************************************************
  * Function: StatsInit
  *
@@ -81,79 +161,73 @@ static void StatsInit( ThreadPoolStats *stats )
 {
 	assert( stats != NULL );
 
-	stats->totalIdleTime = 0;
-	stats->totalJobsHQ = 0;
-	stats->totalJobsLQ = 0;
-	stats->totalJobsMQ = 0;
-	stats->totalTimeHQ = 0;
-	stats->totalTimeMQ = 0;
-	stats->totalTimeLQ = 0;
-	stats->totalWorkTime = 0;
-	stats->totalIdleTime = 0;
-	stats->avgWaitHQ = 0;
-	stats->avgWaitMQ = 0;
-	stats->avgWaitLQ = 0;
-	stats->workerThreads = 0;
-	stats->idleThreads = 0;
-	stats->persistentThreads = 0;
-	stats->maxThreads = 0; stats->totalThreads = 0;
+	memset( stats, 0, sizeof( ThreadPoolStats ) );
 }
 
-static void StatsAccountLQ( ThreadPool *tp, unsigned long diffTime )
+/****************************************************************************
+ * Function: HistogramBucket
+ *
+ *  Description:
+ *      Returns the histogram bucket of a time: 0 under 1ms,
+ *      i between 2^(i-1) and 2^i ms, the last bucket above.
+ *      Internal Only.
+ *  Parameters:
+ *      unsigned long millis
+ *****************************************************************************/
+static int HistogramBucket( unsigned long millis )
 {
-	tp->stats.totalJobsLQ++;
-	tp->stats.totalTimeLQ += diffTime;
-}
+	int bucket = 0;
 
-static void StatsAccountMQ( ThreadPool *tp, unsigned long diffTime )
-{
-	tp->stats.totalJobsMQ++;
-	tp->stats.totalTimeMQ += diffTime;
-}
+	while( millis != 0 && bucket < TP_HISTOGRAM_SIZE - 1 ) {
+		millis >>= 1;
+		bucket++;
+	}
 
-static void StatsAccountHQ( ThreadPool *tp, unsigned long diffTime )
-{
-	tp->stats.totalJobsHQ++;
-	tp->stats.totalTimeHQ += diffTime;
+	return bucket;
 }
 
 /****************************************************************************
  * Function: CalcWaitTime
  *
  *  Description:
- *      Calculates the time the job has been waiting at the specified
- *      priority. Adds to the totalTime and totalJobs kept in the
- *      thread pool statistics structure.
+ *      Adds the time the job has been waiting at its
+ *      priority to the statistics of the worker taking the job.
  *      Internal Only.
  *
  *  Parameters:
- *      ThreadPool *tp
- *      ThreadPriority p
+ *      ThreadPoolWorker *worker
  *      ThreadPoolJob *job
+ *      unsigned long diff - milliseconds the job waited
  *****************************************************************************/
-static void CalcWaitTime( ThreadPool *tp, ThreadPriority p, ThreadPoolJob *job )
+static void CalcWaitTime( ThreadPoolWorker *worker, ThreadPoolJob *job,
+	unsigned long diff )
 {
-	struct timeval now;
-	unsigned long diff;
-
-	assert( tp != NULL );
+	assert( worker != NULL );
 	assert( job != NULL );
 
-	gettimeofday( &now, NULL );
-	diff = DiffMillis( &now, &job->requestTime );
-	switch ( p ) {
-	case LOW_PRIORITY:
-		StatsAccountLQ( tp, diff );
-		break;
-	case MED_PRIORITY:
-		StatsAccountMQ( tp, diff );
-		break;
-	case HIGH_PRIORITY:
-		StatsAccountHQ( tp, diff );
-		break;
-	default:
-		assert( 0 );
-	}
+	TP_COUNT( &worker->totalJobs[job->priority], 1 );
+	TP_COUNT( &worker->totalTime[job->priority], diff );
+	TP_COUNT( &worker->waitHistogram[job->priority][HistogramBucket( diff )], 1 );
+}
+
+/****************************************************************************
+ * Function: CalcRunTime
+ *
+ *  Description:
+ *      Adds the time the job ran to the statistics of
+ *      its worker.
+ *      Internal Only.
+ *
+ *  Parameters:
+ *      ThreadPoolWorker *worker
+ *      ThreadPoolJob *job
+ *      unsigned long diff - milliseconds the job ran
+ *****************************************************************************/
+static void CalcRunTime( ThreadPoolWorker *worker, ThreadPoolJob *job,
+	unsigned long diff )
+{
+	TP_COUNT( &worker->totalRunTime[job->priority], diff );
+	TP_COUNT( &worker->runHistogram[job->priority][HistogramBucket( diff )], 1 );
 }
 
 static time_t StatsTime( time_t *t )
@@ -167,33 +241,242 @@ static time_t StatsTime( time_t *t )
 
 	return tv.tv_sec;
 }
-#else /* STATS */
-static UPNP_INLINE void StatsInit( ThreadPoolStats *stats ) {}
-static UPNP_INLINE void StatsAccountLQ( ThreadPool *tp, unsigned long diffTime ) {}
-static UPNP_INLINE void StatsAccountMQ( ThreadPool *tp, unsigned long diffTime ) {}
-static UPNP_INLINE void StatsAccountHQ( ThreadPool *tp, unsigned long diffTime ) {}
-static UPNP_INLINE void CalcWaitTime( ThreadPool *tp, ThreadPriority p, ThreadPoolJob *job ) {}
-static UPNP_INLINE time_t StatsTime( time_t *t ) { return 0; }
-#endif /* STATS */
 
 /****************************************************************************
- * Function: CmpThreadPoolJob
+ * Function: LaneInit
  *
  *  Description:
- *      Compares thread pool jobs.
+ *      Allocates the cells of a job injection queue.
+ *      Internal Only.
  *  Parameters:
- *      void * - job A
- *      void * - job B
+ *      ThreadPoolLane *lane
+ *      int size - minimum number of jobs the queue holds
+ *  Returns:
+ *      0 on success, EOUTOFMEM on failure.
+ *****************************************************************************/
+static int LaneInit( ThreadPoolLane *lane, int size )
+{
+	long capacity = 16;
+	long i;
+
+	while( capacity < size ) {
+		capacity *= 2;
+	}
+	lane->cells = ( ThreadPoolCell *)calloc( capacity, sizeof( ThreadPoolCell ) );
+	if( lane->cells == NULL ) {
+		return EOUTOFMEM;
+	}
+	for( i = 0; i < capacity; i++ ) {
+		lane->cells[i].sequence = i;
+	}
+	lane->mask = capacity - 1;
+	lane->enqueuePos = 0;
+	lane->dequeuePos = 0;
+
+	return 0;
+}
+
+/****************************************************************************
+ * Function: LanePush
+ *
+ *  Description:
+ *      Adds a job at the tail of a job injection queue.
+ *      Safe to call from any thread, lock-free.
+ *      Internal Only.
+ *  Returns:
+ *      0 on success, EOUTOFMEM if the queue is full.
+ *****************************************************************************/
+static int LanePush( ThreadPoolLane *lane, ThreadPoolJob *job )
+{
+	ThreadPoolCell *cell;
+	long pos = TP_LOAD( &lane->enqueuePos );
+	long diff;
+
+	while( 1 ) {
+		cell = &lane->cells[pos & lane->mask];
+		diff = TP_LOAD( &cell->sequence ) - pos;
+		if( diff == 0 ) {
+			// the cell is free, claim it
+			if( TP_CAS( &lane->enqueuePos, &pos, pos + 1 ) ) {
+				break;
+			}
+		} else if( diff < 0 ) {
+			return EOUTOFMEM;
+		} else {
+			pos = TP_LOAD( &lane->enqueuePos );
+		}
+	}
+
+	cell->job = job;
+	TP_STORE( &cell->requestTime, TimeMillis( &job->requestTime ) );
+	// publish the job
+	TP_STORE( &cell->sequence, pos + 1 );
+
+	return 0;
+}
+
+/****************************************************************************
+ * Function: LanePop
+ *
+ *  Description:
+ *      Takes the job at the head of a job injection queue.
+ *      Safe to call from any thread, lock-free.
+ *      Internal Only.
+ *  Returns:
+ *      the job, NULL if the queue is empty.
+ *****************************************************************************/
+static ThreadPoolJob *LanePop( ThreadPoolLane *lane )
+{
+	ThreadPoolCell *cell;
+	ThreadPoolJob *job;
+	long pos = TP_LOAD( &lane->dequeuePos );
+	long diff;
+
+	while( 1 ) {
+		cell = &lane->cells[pos & lane->mask];
+		diff = TP_LOAD( &cell->sequence ) - ( pos + 1 );
+		if( diff == 0 ) {
+			// the cell holds a job, claim it
+			if( TP_CAS( &lane->dequeuePos, &pos, pos + 1 ) ) {
+				break;
+			}
+		} else if( diff < 0 ) {
+			return NULL;
+		} else {
+			pos = TP_LOAD( &lane->dequeuePos );
+		}
+	}
+
+	job = cell->job;
+	// free the cell for the next round
+	TP_STORE( &cell->sequence, pos + lane->mask + 1 );
+
+	return job;
+}
+
+/****************************************************************************
+ * Function: LaneWaitTime
+ *
+ *  Description:
+ *      Returns how long the job at the head of a job injection queue
+ *      has been waiting. The job may be taken meanwhile, the result is
+ *      only a hint.
+ *      Internal Only.
+ *  Returns:
+ *      the time in milliseconds, -1 if the queue is empty.
+ *****************************************************************************/
+static long long LaneWaitTime( ThreadPoolLane *lane, long long now )
+{
+	long pos = TP_LOAD( &lane->dequeuePos );
+	ThreadPoolCell *cell = &lane->cells[pos & lane->mask];
+
+	if( TP_LOAD( &cell->sequence ) != pos + 1 ) {
+		return -1;
+	}
+	return now - TP_LOAD( &cell->requestTime );
+}
+
+/****************************************************************************
+ * Function: LaneSize
+ *
+ *  Description:
+ *      Returns the number of jobs in a job injection queue.
+ *      Internal Only.
+ *****************************************************************************/
+static int LaneSize( ThreadPoolLane *lane )
+{
+	long size = TP_LOAD( &lane->enqueuePos ) - TP_LOAD( &lane->dequeuePos );
+
+	return size > 0 ? size : 0;
+}
+
+/****************************************************************************
+ * Function: DequePush
+ *
+ *  Description:
+ *      Adds a job at the bottom of the deque of a worker.
+ *      Only called by the worker owning the deque.
+ *      Internal Only.
+ *  Returns:
+ *      0 on success, EOUTOFMEM if the deque is full.
+ *****************************************************************************/
+static int DequePush( ThreadPoolWorker *worker, ThreadPoolJob *job )
+{
+	long bottom = TP_LOAD( &worker->bottom );
+	long top = TP_LOAD( &worker->top );
+
+	if( bottom - top >= WORKER_DEQUE_SIZE ) {
+		return EOUTOFMEM;
+	}
+	TP_STORE( &worker->deque[bottom & ( WORKER_DEQUE_SIZE - 1 )], job );
+	TP_STORE( &worker->bottom, bottom + 1 );
+
+	return 0;
+}
+
+/****************************************************************************
+ * Function: DequeTake
+ *
+ *  Description:
+ *      Takes the job at the bottom of the deque of a worker, the last
+ *      one it added. Only called by the worker owning the deque.
+ *      Internal Only.
+ *  Returns:
+ *      the job, NULL if the deque is empty.
  *****************************************************************************/
-static int CmpThreadPoolJob( void *jobA, void *jobB )
+static ThreadPoolJob *DequeTake( ThreadPoolWorker *worker )
 {
-	ThreadPoolJob *a = ( ThreadPoolJob *) jobA;
-	ThreadPoolJob *b = ( ThreadPoolJob *) jobB;
+	long bottom = TP_LOAD( &worker->bottom ) - 1;
+	long top;
+	ThreadPoolJob *job;
+
+	TP_STORE( &worker->bottom, bottom );
+	top = TP_LOAD( &worker->top );
+	if( top > bottom ) {
+		// empty
+		TP_STORE( &worker->bottom, bottom + 1 );
+		return NULL;
+	}
+
+	job = TP_LOAD( &worker->deque[bottom & ( WORKER_DEQUE_SIZE - 1 )] );
+	if( top == bottom ) {
+		// last job, race against the thieves
+		if( !TP_CAS( &worker->top, &top, top + 1 ) ) {
+			job = NULL;
+		}
+		TP_STORE( &worker->bottom, bottom + 1 );
+	}
 
-	assert( jobA != NULL );
-	assert( jobB != NULL );
+	return job;
+}
 
-	return ( a->jobId == b->jobId );
+/****************************************************************************
+ * Function: DequeSteal
+ *
+ *  Description:
+ *      Takes the job at the top of the deque of a worker, the first
+ *      one it added. Safe to call from any thread, lock-free.
+ *      Internal Only.
+ *  Returns:
+ *      the job, NULL if the deque is empty.
+ *****************************************************************************/
+static ThreadPoolJob *DequeSteal( ThreadPoolWorker *worker )
+{
+	long top = TP_LOAD( &worker->top );
+	long bottom;
+	ThreadPoolJob *job;
+
+	while( 1 ) {
+		bottom = TP_LOAD( &worker->bottom );
+		if( top >= bottom ) {
+			return NULL;
+		}
+		job = TP_LOAD( &worker->deque[top & ( WORKER_DEQUE_SIZE - 1 )] );
+		if( TP_CAS( &worker->top, &top, top + 1 ) ) {
+			return job;
+		}
+		// another thread took it, top is reloaded
+	}
 }
 
 /****************************************************************************
@@ -208,7 +491,7 @@ static void FreeThreadPoolJob( ThreadPool *tp, ThreadPoolJob *tpj )
 {
 	assert( tp != NULL );
 
-	FreeListFree( &tp->jobFreeList, tpj );
+	free( tpj );
 }
 
 /****************************************************************************
@@ -295,58 +578,6 @@ static int SetPriority( ThreadPriority priority )
 #endif
 }
 
-/****************************************************************************
- * Function: BumpPriority
- *
- *  Description:
- *      Determines whether any jobs
- *      need to be bumped to a higher priority Q and bumps them.
- *
- *      tp->mutex must be locked.
- *      Internal Only.
- *  Parameters:
- *      ThreadPool *tp
- *****************************************************************************/
-static void BumpPriority( ThreadPool *tp )
-{
-    int done = 0;
-    struct timeval now;
-    long diffTime = 0;
-    ThreadPoolJob *tempJob = NULL;
-
-    assert( tp != NULL );
-
-    gettimeofday(&now, NULL);	
-
-    while( !done ) {
-        if( tp->medJobQ.size ) {
-            tempJob = ( ThreadPoolJob *) tp->medJobQ.head.next->item;
-            diffTime = DiffMillis( &now, &tempJob->requestTime );
-            if( diffTime >= ( tp->attr.starvationTime ) ) {
-                // If job has waited longer than the starvation time
-                // bump priority (add to higher priority Q)
-                StatsAccountMQ( tp, diffTime );
-                ListDelNode( &tp->medJobQ, tp->medJobQ.head.next, 0 );
-                ListAddTail( &tp->highJobQ, tempJob );
-                continue;
-            }
-        }
-        if( tp->lowJobQ.size ) {
-            tempJob = ( ThreadPoolJob *) tp->lowJobQ.head.next->item;
-            diffTime = DiffMillis( &now, &tempJob->requestTime );
-            if( diffTime >= ( tp->attr.maxIdleTime ) ) {
-                // If job has waited longer than the starvation time
-                // bump priority (add to higher priority Q)
-                StatsAccountLQ( tp, diffTime );
-                ListDelNode( &tp->lowJobQ, tp->lowJobQ.head.next, 0 );
-                ListAddTail( &tp->medJobQ, tempJob );
-                continue;
-            }
-        }
-        done = 1;
-    }
-}
-
 /****************************************************************************
  * Function: SetRelTimeout
  *
@@ -403,14 +634,141 @@ static void SetSeed()
 #endif
 }
 
+/****************************************************************************
+ * Function: StatsAccountWorkers
+ *
+ *  Description:
+ *      Adds the statistics kept by the workers to a statistics
+ *      structure. Reads the counters of the running workers
+ *      without locking.
+ *      Internal Only.
+ *  Parameters:
+ *      ThreadPool *tp
+ *      ThreadPoolStats *stats
+ *****************************************************************************/
+static void StatsAccountWorkers( ThreadPool *tp, ThreadPoolStats *stats )
+{
+	ThreadPoolWorker *worker;
+	int i;
+	int p;
+	int b;
+
+	for( i = 0; i < tp->workerSlots; i++ ) {
+		worker = &tp->workers[i];
+		stats->totalJobsHQ += TP_PEEK( &worker->totalJobs[HIGH_PRIORITY] );
+		stats->totalTimeHQ += TP_PEEK( &worker->totalTime[HIGH_PRIORITY] );
+		stats->totalJobsMQ += TP_PEEK( &worker->totalJobs[MED_PRIORITY] );
+		stats->totalTimeMQ += TP_PEEK( &worker->totalTime[MED_PRIORITY] );
+		stats->totalJobsLQ += TP_PEEK( &worker->totalJobs[LOW_PRIORITY] );
+		stats->totalTimeLQ += TP_PEEK( &worker->totalTime[LOW_PRIORITY] );
+		stats->totalWorkTime += TP_PEEK( &worker->totalWorkTime );
+		stats->totalIdleTime += TP_PEEK( &worker->totalIdleTime );
+		stats->totalSteals += TP_PEEK( &worker->steals );
+		stats->totalIdleWaits += TP_PEEK( &worker->idleWaits );
+		for( p = LOW_PRIORITY; p <= HIGH_PRIORITY; p++ ) {
+			stats->totalRunTime[p] += TP_PEEK( &worker->totalRunTime[p] );
+			for( b = 0; b < TP_HISTOGRAM_SIZE; b++ ) {
+				stats->waitHistogram[p][b] +=
+					TP_PEEK( &worker->waitHistogram[p][b] );
+				stats->runHistogram[p][b] +=
+					TP_PEEK( &worker->runHistogram[p][b] );
+			}
+		}
+	}
+}
+
+/****************************************************************************
+ * Function: FindJob
+ *
+ *  Description:
+ *      Takes the next job a worker should run: a high priority job,
+ *      a job starving in a lower priority Q when there is no high
+ *      priority job or after TP_HIGH_RUN of them in a row, a job
+ *      the worker scheduled itself, then a med and a low priority job,
+ *      and finally a job stolen from another worker.
+ *      Internal Only.
+ *  Parameters:
+ *      ThreadPool *tp
+ *      ThreadPoolWorker *worker
+ *  Returns:
+ *      the job, NULL if there is none.
+ *****************************************************************************/
+static ThreadPoolJob *FindJob( ThreadPool *tp, ThreadPoolWorker *worker )
+{
+	ThreadPoolJob *job = NULL;
+	struct timeval now;
+	long long nowMillis;
+	unsigned long wait;
+	int i;
+
+	if( worker->highRun < TP_HIGH_RUN ) {
+		job = LanePop( &tp->lanes[HIGH_PRIORITY] );
+	}
+	if( job != NULL ) {
+		worker->highRun++;
+	} else {
+		worker->highRun = 0;
+
+		// bump priority of starved jobs
+		if( LaneSize( &tp->lanes[LOW_PRIORITY] ) ||
+		    LaneSize( &tp->lanes[MED_PRIORITY] ) ) {
+			gettimeofday( &now, NULL );
+			nowMillis = TimeMillis( &now );
+			if( LaneWaitTime( &tp->lanes[LOW_PRIORITY], nowMillis ) >=
+			    tp->attr.maxIdleTime ) {
+				job = LanePop( &tp->lanes[LOW_PRIORITY] );
+			}
+			if( job == NULL &&
+			    LaneWaitTime( &tp->lanes[MED_PRIORITY], nowMillis ) >=
+			    tp->attr.starvationTime ) {
+				job = LanePop( &tp->lanes[MED_PRIORITY] );
+			}
+		}
+	}
+
+	if( job == NULL ) {
+		job = LanePop( &tp->lanes[HIGH_PRIORITY] );
+	}
+	if( job == NULL ) {
+		job = DequeTake( worker );
+	}
+	if( job == NULL ) {
+		job = LanePop( &tp->lanes[MED_PRIORITY] );
+	}
+	if( job == NULL ) {
+		job = LanePop( &tp->lanes[LOW_PRIORITY] );
+	}
+	for( i = 0; job == NULL && i < tp->workerSlots; i++ ) {
+		worker->victim = ( worker->victim + 1 ) % tp->workerSlots;
+		if( &tp->workers[worker->victim] != worker ) {
+			job = DequeSteal( &tp->workers[worker->victim] );
+			if( job != NULL ) {
+				TP_COUNT( &worker->steals, 1 );
+			}
+		}
+	}
+
+	if( job != NULL ) {
+		TP_ADD( &tp->jobCount, -1 );
+		gettimeofday( &now, NULL );
+		wait = DiffMillis( &now, &job->requestTime );
+		UpdateAverage( &tp->waitTime[job->priority], wait );
+		CalcWaitTime( worker, job, wait );
+	}
+
+	return job;
+}
+
+static int CreateWorker( ThreadPool *tp );
+
 /****************************************************************************
  * Function: WorkerThread
  *
  *  Description:
  *      Implements a thread pool worker.
- *      Worker waits for a job to become available.
- *      Worker picks up persistent jobs first, high priority, med priority,
- *             then low priority.
+ *      Worker looks for a job without locking, see FindJob,
+ *      and waits for one when there is none.
+ *      Worker picks up persistent jobs first.
  *      If worker remains idle for more than specified max, the worker
  *      is released.
  *      Internal Only.
@@ -422,11 +780,15 @@ static void *WorkerThread( void *arg )
 	time_t start = 0;
 
 	ThreadPoolJob *job = NULL;
-	ListNode *head = NULL;
+	ThreadPoolWorker *worker = NULL;
 
 	struct timespec timeout;
+	struct timeval started;
+	struct timeval finished;
+	unsigned long ran;
 	int retCode = 0;
-	int persistent = -1;
+	int priority = DEFAULT_PRIORITY;
+	int i;
 	ThreadPool *tp = ( ThreadPool *) arg;
 	// allow static linking
 #ifdef WIN32
@@ -436,145 +798,147 @@ static void *WorkerThread( void *arg )
 #endif
 	assert( tp != NULL );
 
-	// Increment total thread count
+	// Take a worker slot and increment total thread count
 	ithread_mutex_lock( &tp->mutex );
-	tp->totalThreads++;
+	for( i = 0; i < tp->workerSlots; i++ ) {
+		if( !tp->workers[i].inUse ) {
+			worker = &tp->workers[i];
+			worker->inUse = 1;
+			break;
+		}
+	}
+	assert( worker != NULL );
+	TP_ADD( &tp->totalThreads, 1 );
 	ithread_cond_broadcast( &tp->start_and_shutdown );
 	ithread_mutex_unlock( &tp->mutex );
 
+	currentWorker = worker;
 	SetSeed();
 	StatsTime( &start );
 	while( 1 ) {
-		ithread_mutex_lock( &tp->mutex );
-		if( job ) {
-			FreeThreadPoolJob( tp, job );
-			job = NULL;
+		if( TP_LOAD( &tp->shutdown ) ) {
+			break;
 		}
-		retCode = 0;
-
-		tp->stats.idleThreads++;
-		tp->stats.totalWorkTime += ( StatsTime( NULL ) - start ); // work time
-		StatsTime( &start ); // idle time
 
-		if( persistent == 1 ) {
-			// Persistent thread
-			// becomes a regular thread
-			tp->persistentThreads--;
+		job = NULL;
+		if( TP_LOAD( &tp->persistentJob ) == NULL ) {
+			job = FindJob( tp, worker );
 		}
 
-		if( persistent == 0 ) {
-			tp->stats.workerThreads--;
+		// jobs wait too long while nobody is idle
+		if( job != NULL && tp->attr.targetWaitTime > 0 &&
+		    TP_LOAD( &tp->idleThreads ) == 0 &&
+		    TP_LOAD( &tp->waitTime[job->priority] ) >
+		    tp->attr.targetWaitTime * AVERAGE_SCALE ) {
+			ithread_mutex_lock( &tp->mutex );
+			if( !tp->shutdown ) {
+				CreateWorker( tp );
+			}
+			ithread_mutex_unlock( &tp->mutex );
 		}
 
-		// Check for a job or shutdown
-		while( tp->lowJobQ.size  == 0 &&
-		       tp->medJobQ.size  == 0 &&
-		       tp->highJobQ.size == 0 &&
-		       !tp->persistentJob     &&
-		       !tp->shutdown ) {
-			// If wait timed out
-			// and we currently have more than the
-			// min threads, or if we have more than the max threads
-			// (only possible if the attributes have been reset)
-			// let this thread die.
-			if( ( retCode == ETIMEDOUT &&
-			      tp->totalThreads > tp->attr.minThreads ) ||
-			    ( tp->attr.maxThreads != -1 &&
-			      tp->totalThreads > tp->attr.maxThreads ) ) {
-				tp->stats.idleThreads--;
-				tp->totalThreads--;
-				ithread_cond_broadcast( &tp->start_and_shutdown );
-				ithread_mutex_unlock( &tp->mutex );
+		if( job == NULL ) {
+			ithread_mutex_lock( &tp->mutex );
+			retCode = 0;
+
+			TP_ADD( &tp->idleThreads, 1 );
+			TP_COUNT( &worker->idleWaits, 1 );
+			TP_COUNT( &worker->totalWorkTime, StatsTime( NULL ) - start ); // work time
+			StatsTime( &start ); // idle time
+
+			// Check for a job or shutdown, schedulers signal
+			// the condition when they see idle threads
+			while( !tp->shutdown &&
+			       !tp->persistentJob &&
+			       ( job = FindJob( tp, worker ) ) == NULL ) {
+				// If wait timed out
+				// and we currently have more than the
+				// min threads, or if we have more than the max threads
+				// (only possible if the attributes have been reset)
+				// let this thread die.
+				if( ( retCode == ETIMEDOUT &&
+				      tp->totalThreads > tp->attr.minThreads ) ||
+				    ( tp->attr.maxThreads != -1 &&
+				      tp->totalThreads > tp->attr.maxThreads ) ) {
+					TP_ADD( &tp->idleThreads, -1 );
+					TP_ADD( &tp->totalThreads, -1 );
+					worker->inUse = 0;
+					ithread_cond_broadcast( &tp->start_and_shutdown );
+					ithread_mutex_unlock( &tp->mutex );
 #ifdef WIN32
 #ifdef PTW32_STATIC_LIB
-				// allow static linking
-				pthread_win32_thread_detach_np ();
+					// allow static linking
+					pthread_win32_thread_detach_np ();
 #endif
 #endif
-				return NULL;
-			}
-			SetRelTimeout( &timeout, tp->attr.maxIdleTime );
-
-			// wait for a job up to the specified max time
-			retCode = ithread_cond_timedwait(
-				&tp->condition, &tp->mutex, &timeout );
-		}
+					return NULL;
+				}
+				SetRelTimeout( &timeout, tp->attr.maxIdleTime );
 
-		tp->stats.idleThreads--;
-		tp->stats.totalIdleTime += ( StatsTime( NULL ) - start ); // idle time
-		StatsTime( &start ); // work time
+				// wait for a job up to the specified max time
+				retCode = ithread_cond_timedwait(
+					&tp->condition, &tp->mutex, &timeout );
+			}
 
-		// bump priority of starved jobs
-		BumpPriority( tp );
+			TP_ADD( &tp->idleThreads, -1 );
+			TP_COUNT( &worker->totalIdleTime, StatsTime( NULL ) - start ); // idle time
+			StatsTime( &start ); // work time
 
-		// if shutdown then stop
-		if( tp->shutdown ) {
-			tp->totalThreads--;
-			ithread_cond_broadcast( &tp->start_and_shutdown );
-			ithread_mutex_unlock( &tp->mutex );
-#ifdef WIN32
-#ifdef PTW32_STATIC_LIB
-			// allow static linking
-			pthread_win32_thread_detach_np ();
-#endif
-#endif
-			return NULL;
-		} else {
-			// Pick up persistent job if available
-			if( tp->persistentJob ) {
-				job = tp->persistentJob;
-				tp->persistentJob = NULL;
-				tp->persistentThreads++;
-				persistent = 1;
-				ithread_cond_broadcast( &tp->start_and_shutdown );
-			} else {
-				tp->stats.workerThreads++;
-				persistent = 0;
-				// Pick the highest priority job
-				if( tp->highJobQ.size > 0 ) {
-					head = ListHead( &tp->highJobQ );
-					job = ( ThreadPoolJob *) head->item;
-					CalcWaitTime( tp, HIGH_PRIORITY, job );
-					ListDelNode( &tp->highJobQ, head, 0 );
-				} else if( tp->medJobQ.size > 0 ) {
-					head = ListHead( &tp->medJobQ );
-					job = ( ThreadPoolJob *) head->item;
-					CalcWaitTime( tp, MED_PRIORITY, job );
-					ListDelNode( &tp->medJobQ, head, 0 );
-				} else if( tp->lowJobQ.size > 0 ) {
-					head = ListHead( &tp->lowJobQ );
-					job = ( ThreadPoolJob *) head->item;
-					CalcWaitTime( tp, LOW_PRIORITY, job );
-					ListDelNode( &tp->lowJobQ, head, 0 );
-				} else {
-					// Should never get here
-					assert( 0 );
-					tp->stats.workerThreads--;
-					tp->totalThreads--;
-					ithread_cond_broadcast( &tp->start_and_shutdown );
+			if( job == NULL ) {
+				// if shutdown then stop
+				if( tp->shutdown ) {
 					ithread_mutex_unlock( &tp->mutex );
-
-					return NULL;
+					break;
 				}
+				// Pick up persistent job
+				job = tp->persistentJob;
+				TP_STORE( &tp->persistentJob, NULL );
+				TP_ADD( &tp->persistentThreads, 1 );
+				worker->persistent = 1;
+				ithread_cond_broadcast( &tp->start_and_shutdown );
 			}
-		}
 
-		ithread_mutex_unlock( &tp->mutex );
+			ithread_mutex_unlock( &tp->mutex );
+		}
 
-		if( SetPriority( job->priority ) != 0 ) {
-			// In the future can log
-			// info
-		} else {
-			// In the future can log
-			// info
+		if( job->priority != priority ) {
+			if( SetPriority( job->priority ) != 0 ) {
+				// In the future can log
+				// info
+			}
+			priority = job->priority;
 		}
 
 		// run the job
+		gettimeofday( &started, NULL );
 		job->func( job->arg );
 
-		// return to Normal
-		SetPriority( DEFAULT_PRIORITY );
+		if( worker->persistent ) {
+			// Persistent thread
+			// becomes a regular thread
+			TP_ADD( &tp->persistentThreads, -1 );
+			worker->persistent = 0;
+		} else {
+			gettimeofday( &finished, NULL );
+			ran = DiffMillis( &finished, &started );
+			UpdateAverage( &tp->serviceTime[job->priority], ran );
+			CalcRunTime( worker, job, ran );
+		}
+		FreeThreadPoolJob( tp, job );
 	}
+
+	ithread_mutex_lock( &tp->mutex );
+	TP_ADD( &tp->totalThreads, -1 );
+	worker->inUse = 0;
+	ithread_cond_broadcast( &tp->start_and_shutdown );
+	ithread_mutex_unlock( &tp->mutex );
+#ifdef WIN32
+#ifdef PTW32_STATIC_LIB
+	// allow static linking
+	pthread_win32_thread_detach_np ();
+#endif
+#endif
+	return NULL;
 }
 
 /****************************************************************************
@@ -597,7 +961,7 @@ static ThreadPoolJob *CreateThreadPoolJob( ThreadPoolJob *job, int id, ThreadPoo
 	assert( job != NULL );
 	assert( tp != NULL );
 
-	newJob = (ThreadPoolJob *)FreeListAlloc( &tp->jobFreeList );
+	newJob = (ThreadPoolJob *)malloc( sizeof( ThreadPoolJob ) );
 	if( newJob ) {
 		*newJob = *job;
 		newJob->jobId = id;
@@ -613,6 +977,7 @@ static ThreadPoolJob *CreateThreadPoolJob( ThreadPoolJob *job, int id, ThreadPoo
  *  Description:
  *      Creates a worker thread, if the thread pool
  *      does not already have max threads.
+ *      tp->mutex must be locked.
  *      Internal to thread pool.
  *  Parameters:
  *      ThreadPool *tp
@@ -631,8 +996,9 @@ static int CreateWorker( ThreadPool *tp )
 
 	assert( tp != NULL );
 
-	if ( tp->attr.maxThreads != INFINITE_THREADS &&
-	     currentThreads > tp->attr.maxThreads ) {
+	if ( ( tp->attr.maxThreads != INFINITE_THREADS &&
+	       currentThreads > tp->attr.maxThreads ) ||
+	     currentThreads > tp->workerSlots ) {
 		return EMAXTHREADS;
 	}
 
@@ -651,13 +1017,58 @@ static int CreateWorker( ThreadPool *tp )
 	return rc;
 }
 
+/****************************************************************************
+ * Function: NeedWorker
+ *
+ *  Description:
+ *      Determines whether or not a thread should be added.
+ *      Without targetWaitTime, based on the jobsPerThread ratio.
+ *      With targetWaitTime, based on the time the jobs queued should
+ *      wait: the average run time of their priority, spread over the
+ *      threads.
+ *      Internal to Thread Pool.
+ *  Parameters:
+ *      ThreadPool* tp
+ *      int threads - number of non persistent threads
+ *  Returns:
+ *      1 if a thread should be added, 0 otherwise
+ *****************************************************************************/
+static int NeedWorker( ThreadPool *tp, int threads )
+{
+	int jobs = TP_LOAD( &tp->jobCount );
+	int queued = 0;
+	long long delay = 0;
+	int size;
+	int i;
+
+	if( threads <= 0 ) {
+		return 1;
+	}
+	if( tp->attr.targetWaitTime <= 0 ) {
+		return ( jobs / threads ) >= tp->attr.jobsPerThread;
+	}
+
+	for( i = LOW_PRIORITY; i <= HIGH_PRIORITY; i++ ) {
+		size = LaneSize( &tp->lanes[i] );
+		queued += size;
+		delay += ( long long )size * ServiceTime( tp, i );
+	}
+	// the jobs kept by the workers are med priority
+	if( jobs > queued ) {
+		delay += ( long long )( jobs - queued ) *
+			ServiceTime( tp, MED_PRIORITY );
+	}
+
+	return delay / threads >
+		( long long )tp->attr.targetWaitTime * AVERAGE_SCALE;
+}
+
 /****************************************************************************
  * Function: AddWorker
  *
  *  Description:
- *      Determines whether or not a thread should be added
- *      based on the jobsPerThread ratio.
- *      Adds a thread if appropriate.
+ *      Adds threads while NeedWorker asks for it.
+ *      tp->mutex must be locked.
  *      Internal to Thread Pool.
  *  Parameters:
  *      ThreadPool* tp
@@ -665,14 +1076,12 @@ static int CreateWorker( ThreadPool *tp )
  *****************************************************************************/
 static void AddWorker( ThreadPool *tp )
 {
-	int jobs = 0;
 	int threads = 0;
 
 	assert( tp != NULL );
 
-	jobs = tp->highJobQ.size + tp->lowJobQ.size + tp->medJobQ.size;
-	threads = tp->totalThreads - tp->persistentThreads;
-	while( threads == 0 || (jobs / threads) >= tp->attr.jobsPerThread ) {
+	threads = tp->totalThreads - TP_LOAD( &tp->persistentThreads );
+	while( NeedWorker( tp, threads ) ) {
 		if( CreateWorker( tp ) != 0 ) {
 			return;
 		}
@@ -680,6 +1089,44 @@ static void AddWorker( ThreadPool *tp )
 	}
 }
 
+/****************************************************************************
+ * Function: WakeWorker
+ *
+ *  Description:
+ *      Makes sure a job just queued gets a worker: signals an idle
+ *      worker if there is one, else adds a worker if NeedWorker
+ *      asks for it. Takes tp->mutex only in these cases.
+ *      Internal to Thread Pool.
+ *  Parameters:
+ *      ThreadPool* tp
+ *
+ *****************************************************************************/
+static void WakeWorker( ThreadPool *tp )
+{
+	int threads;
+
+	if( TP_LOAD( &tp->idleThreads ) > 0 ) {
+		ithread_mutex_lock( &tp->mutex );
+		ithread_cond_signal( &tp->condition );
+		ithread_mutex_unlock( &tp->mutex );
+		return;
+	}
+
+	threads = TP_LOAD( &tp->totalThreads ) - TP_LOAD( &tp->persistentThreads );
+	if( !NeedWorker( tp, threads ) ) {
+		return;
+	}
+	if( TP_LOAD( &tp->totalThreads ) >= tp->workerSlots ) {
+		return;
+	}
+
+	ithread_mutex_lock( &tp->mutex );
+	if( !tp->shutdown ) {
+		AddWorker( tp );
+	}
+	ithread_mutex_unlock( &tp->mutex );
+}
+
 /****************************************************************************
  * Function: ThreadPoolInit
  *
@@ -757,29 +1204,46 @@ int ThreadPoolInit( ThreadPool *tp, ThreadPoolAttr *attr )
 		return INVALID_POLICY;
 	}
 
-	retCode += FreeListInit(
-		&tp->jobFreeList, sizeof( ThreadPoolJob ), JOBFREELISTSIZE );
-	assert( retCode == 0 );
-
 	StatsInit( &tp->stats );
 
-	retCode += ListInit( &tp->highJobQ, CmpThreadPoolJob, NULL );
-	assert( retCode == 0 );
+	tp->workerSlots = tp->attr.maxThreads;
+	if( tp->workerSlots == INFINITE_THREADS ) {
+		tp->workerSlots = INFINITE_THREADS_SLOTS;
+	}
+	tp->workers = ( ThreadPoolWorker *)calloc( tp->workerSlots,
+	                                           sizeof( ThreadPoolWorker ) );
+	if( tp->workers == NULL ) {
+		retCode = EOUTOFMEM;
+	} else {
+		for( i = 0; i < tp->workerSlots; i++ ) {
+			tp->workers[i].tp = tp;
+			tp->workers[i].victim = i;
+		}
+	}
 
-	retCode += ListInit( &tp->medJobQ, CmpThreadPoolJob, NULL );
-	assert( retCode == 0 );
+	for( i = LOW_PRIORITY; i <= HIGH_PRIORITY; i++ ) {
+		tp->lanes[i].cells = NULL;
+	}
+	for( i = LOW_PRIORITY; retCode == 0 && i <= HIGH_PRIORITY; i++ ) {
+		retCode = LaneInit( &tp->lanes[i], tp->attr.maxJobsTotal );
+	}
 
-	retCode += ListInit( &tp->lowJobQ, CmpThreadPoolJob, NULL );
-	assert( retCode == 0 );
+	tp->persistentJob = NULL;
+	tp->lastJobId = 0;
+	tp->shutdown = 0;
+	tp->statsReaders = 0;
+	tp->totalThreads = 0;
+	tp->persistentThreads = 0;
+	tp->idleThreads = 0;
+	tp->jobCount = 0;
+	for( i = LOW_PRIORITY; i <= HIGH_PRIORITY; i++ ) {
+		tp->waitTime[i] = 0;
+		tp->serviceTime[i] = 0;
+	}
 
 	if( retCode != 0 ) {
 		retCode = EAGAIN;
 	} else {
-		tp->persistentJob = NULL;
-		tp->lastJobId = 0;
-		tp->shutdown = 0;
-		tp->totalThreads = 0;
-		tp->persistentThreads = 0;
 		for( i = 0; i < tp->attr.minThreads; ++i ) {
 			if( ( retCode = CreateWorker( tp ) ) != 0 ) {
 				break;
@@ -819,6 +1283,7 @@ int ThreadPoolInit( ThreadPool *tp, ThreadPoolAttr *attr )
 int ThreadPoolAddPersistent( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
 {
 	int tempId = -1;
+	int id;
 	ThreadPoolJob *temp = NULL;
 
 	assert( tp != NULL );
@@ -851,13 +1316,14 @@ int ThreadPoolAddPersistent( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
 		}
 	}
 
-	temp = CreateThreadPoolJob( job, tp->lastJobId, tp );
+	id = TP_ADD( &tp->lastJobId, 1 );
+	temp = CreateThreadPoolJob( job, id, tp );
 	if( temp == NULL ) {
 		ithread_mutex_unlock( &tp->mutex );
 		return EOUTOFMEM;
 	}
 
-	tp->persistentJob = temp;
+	TP_STORE( &tp->persistentJob, temp );
 
 	// Notify a waiting thread
 	ithread_cond_signal( &tp->condition );
@@ -867,7 +1333,7 @@ int ThreadPoolAddPersistent( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
 		ithread_cond_wait( &tp->start_and_shutdown, &tp->mutex );
 	}
 
-	*jobId = tp->lastJobId++;
+	*jobId = id;
 	ithread_mutex_unlock( &tp->mutex );
 
 	return 0;
@@ -879,6 +1345,9 @@ int ThreadPoolAddPersistent( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
  *  Description:
  *      Adds a job to the thread pool.
  *      Job will be run as soon as possible.
+ *      A med priority job added by a worker of the pool is kept by this
+ *      worker, other jobs are queued by priority. Does not lock unless
+ *      a worker has to be woken up or created.
  *  Parameters:
  *      tp - valid thread pool pointer
  *      func - ThreadFunction to run
@@ -897,8 +1366,10 @@ int ThreadPoolAdd( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
 
 	int tempId = -1;
 	int totalJobs;
+	int id;
 
 	ThreadPoolJob *temp = NULL;
+	ThreadPoolWorker *self = currentWorker;
 
 	assert( tp != NULL );
 	assert( job != NULL );
@@ -906,57 +1377,47 @@ int ThreadPoolAdd( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
 		return EINVAL;
 	}
 
-	ithread_mutex_lock( &tp->mutex );
-
 	assert( job->priority == LOW_PRIORITY ||
 	job->priority == MED_PRIORITY ||
 	job->priority == HIGH_PRIORITY );
 
-	totalJobs = tp->highJobQ.size + tp->lowJobQ.size + tp->medJobQ.size;
-	if (totalJobs >= tp->attr.maxJobsTotal) {
-		fprintf(stderr, "total jobs = %d, too many jobs", totalJobs);
-		ithread_mutex_unlock( &tp->mutex );
-		return rc;
-	}
-
 	if( jobId == NULL ) {
 		jobId = &tempId;
 	}
 	*jobId = INVALID_JOB_ID;
 
-	temp = CreateThreadPoolJob( job, tp->lastJobId, tp );
-	if( temp == NULL ) {
-		ithread_mutex_unlock( &tp->mutex );
+	totalJobs = TP_ADD( &tp->jobCount, 1 );
+	if (totalJobs >= tp->attr.maxJobsTotal) {
+		TP_ADD( &tp->jobCount, -1 );
+		fprintf(stderr, "total jobs = %d, too many jobs", totalJobs);
 		return rc;
 	}
 
-	if( job->priority == HIGH_PRIORITY ) {
-		if( ListAddTail( &tp->highJobQ, temp ) ) {
-			rc = 0;
-		}
-	} else if( job->priority == MED_PRIORITY ) {
-		if( ListAddTail( &tp->medJobQ, temp ) ) {
-			rc = 0;
-		}
-	} else {
-		if( ListAddTail( &tp->lowJobQ, temp ) ) {
-			rc = 0;
-		}
+	id = TP_ADD( &tp->lastJobId, 1 );
+	temp = CreateThreadPoolJob( job, id, tp );
+	if( temp == NULL ) {
+		TP_ADD( &tp->jobCount, -1 );
+		return rc;
 	}
 
-	// AddWorker if appropriate
-	AddWorker( tp );
+	if( self != NULL && self->tp == tp && !self->persistent &&
+	    job->priority == MED_PRIORITY &&
+	    DequePush( self, temp ) == 0 ) {
+		rc = 0;
+	} else if( LanePush( &tp->lanes[job->priority], temp ) == 0 ) {
+		rc = 0;
+	}
 
-	// Notify a waiting thread
-	if( rc == 0 ) {
-		ithread_cond_signal( &tp->condition );
-	} else {
+	if( rc != 0 ) {
+		TP_ADD( &tp->jobCount, -1 );
 		FreeThreadPoolJob( tp, temp );
+		return rc;
 	}
 
-	*jobId = tp->lastJobId++;
+	// Notify a waiting thread or AddWorker if appropriate
+	WakeWorker( tp );
 
-	ithread_mutex_unlock( &tp->mutex );
+	*jobId = id;
 
 	return rc;
 }
@@ -966,8 +1427,9 @@ int ThreadPoolAdd( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
  *
  *  Description:
  *      Removes a job from the thread pool.
- *      Can only remove jobs which are not
- *      currently running.
+ *      Can only remove a persistent job which
+ *      is not picked up yet, queued jobs can
+ *      not be removed.
  *  Parameters:
  *      tp - valid thread pool pointer
  *      jobId - id of job
@@ -979,9 +1441,7 @@ int ThreadPoolAdd( ThreadPool *tp, ThreadPoolJob *job, int *jobId )
  *****************************************************************************/
 int ThreadPoolRemove( ThreadPool *tp, int jobId, ThreadPoolJob *out )
 {
-	ThreadPoolJob *temp = NULL;
 	int ret = INVALID_JOB_ID;
-	ListNode *tempNode = NULL;
 	ThreadPoolJob dummy;
 
 	assert( tp != NULL );
@@ -993,50 +1453,13 @@ int ThreadPoolRemove( ThreadPool *tp, int jobId, ThreadPoolJob *out )
 		out = &dummy;
 	}
 
-	dummy.jobId = jobId;
-
 	ithread_mutex_lock( &tp->mutex );
 
-	tempNode = ListFind( &tp->highJobQ, NULL, &dummy );
-	if( tempNode ) {
-		temp = (ThreadPoolJob *)tempNode->item;
-		*out = *temp;
-		ListDelNode( &tp->highJobQ, tempNode, 0 );
-		FreeThreadPoolJob( tp, temp );
-		ithread_mutex_unlock( &tp->mutex );
-
-		return 0;
-	}
-
-	tempNode = ListFind( &tp->medJobQ, NULL, &dummy );
-	if( tempNode ) {
-		temp = (ThreadPoolJob *)tempNode->item;
-		*out = *temp;
-		ListDelNode( &tp->medJobQ, tempNode, 0 );
-		FreeThreadPoolJob( tp, temp );
-		ithread_mutex_unlock( &tp->mutex );
-
-		return 0;
-	}
-
-	tempNode = ListFind( &tp->lowJobQ, NULL, &dummy );
-	if( tempNode ) {
-		temp = (ThreadPoolJob *)tempNode->item;
-		*out = *temp;
-		ListDelNode( &tp->lowJobQ, tempNode, 0 );
-		FreeThreadPoolJob( tp, temp );
-		ithread_mutex_unlock( &tp->mutex );
-
-		return 0;
-	}
-
 	if( tp->persistentJob && tp->persistentJob->jobId == jobId ) {
 		*out = *tp->persistentJob;
 		FreeThreadPoolJob( tp, tp->persistentJob );
-		tp->persistentJob = NULL;
-		ithread_mutex_unlock( &tp->mutex );
-
-		return 0;
+		TP_STORE( &tp->persistentJob, NULL );
+		ret = 0;
 	}
 
 	ithread_mutex_unlock( &tp->mutex );
@@ -1084,17 +1507,25 @@ int ThreadPoolGetAttr( ThreadPool *tp, ThreadPoolAttr *out )
  *  Description:
  *      Sets the attributes for the thread pool.
  *      Only affects future calculations.
+ *      maxThreads can not be raised above the
+ *      maxThreads the pool was initialized with.
+ *      On failure, the pool keeps its previous attributes.
  *  Parameters:
  *      tp - valid thread pool pointer
  *      attr - pointer to attributes, null sets attributes to default.
  *  Returns:
  *      0 on success, nonzero on failure
  *      Returns INVALID_POLICY if policy can not be set.
+ *      Returns EMAXTHREADS if minThreads is greater than maxThreads, or
+ *      either is greater than the worker slots of the pool.
+ *      Returns EAGAIN if the minThreads threads can not be created.
  *****************************************************************************/
 int ThreadPoolSetAttr( ThreadPool *tp, ThreadPoolAttr *attr )
 {
 	int retCode = 0;
 	ThreadPoolAttr temp;
+	ThreadPoolAttr previous;
+	int maxThreads;
 	int i = 0;
 
 	assert( tp != NULL );
@@ -1115,6 +1546,18 @@ int ThreadPoolSetAttr( ThreadPool *tp, ThreadPoolAttr *attr )
 		return INVALID_POLICY;
 	}
 
+	// the worker slots are allocated once, when the pool starts
+	maxThreads = temp.maxThreads;
+	if( maxThreads == INFINITE_THREADS ) {
+		maxThreads = INFINITE_THREADS_SLOTS;
+	}
+	if( temp.minThreads > maxThreads || maxThreads > tp->workerSlots ) {
+		ithread_mutex_unlock( &tp->mutex );
+
+		return EMAXTHREADS;
+	}
+
+	previous = tp->attr;
 	tp->attr = ( temp );
 
 	// add threads
@@ -1127,15 +1570,15 @@ int ThreadPoolSetAttr( ThreadPool *tp, ThreadPoolAttr *attr )
 		}
 	}
 
+	if( retCode != 0 ) {
+		// the threads created meanwhile go as idle ones
+		tp->attr = previous;
+	}
+
 	// signal changes 
 	ithread_cond_signal( &tp->condition ); 
 	ithread_mutex_unlock( &tp->mutex );
 
-	if( retCode != 0 ) {
-		// clean up if the min threads could not be created
-		ThreadPoolShutdown( tp );
-	}
-
 	return retCode;
 }
 
@@ -1155,8 +1598,8 @@ int ThreadPoolSetAttr( ThreadPool *tp, ThreadPoolAttr *attr )
  *****************************************************************************/
 int ThreadPoolShutdown( ThreadPool *tp )
 {
-	ListNode *head = NULL;
 	ThreadPoolJob *temp = NULL;
+	int i;
 
 	assert( tp != NULL );
 	if( tp == NULL ) {
@@ -1165,42 +1608,6 @@ int ThreadPoolShutdown( ThreadPool *tp )
 
 	ithread_mutex_lock( &tp->mutex );
 
-	// clean up high priority jobs
-	while( tp->highJobQ.size ) {
-		head = ListHead( &tp->highJobQ );
-		temp = ( ThreadPoolJob *) head->item;
-		if( temp->free_func ) {
-			temp->free_func( temp->arg );
-		}
-		FreeThreadPoolJob( tp, temp );
-		ListDelNode( &tp->highJobQ, head, 0 );
-	}
-	ListDestroy( &tp->highJobQ, 0 );
-
-	// clean up med priority jobs
-	while( tp->medJobQ.size ) {
-		head = ListHead( &tp->medJobQ );
-		temp = ( ThreadPoolJob *) head->item;
-		if( temp->free_func ) {
-			temp->free_func( temp->arg );
-		}
-		FreeThreadPoolJob( tp, temp );
-		ListDelNode( &tp->medJobQ, head, 0 );
-	}
-	ListDestroy( &tp->medJobQ, 0 );
-
-	// clean up low priority jobs
-		while( tp->lowJobQ.size ) {
-		head = ListHead( &tp->lowJobQ );
-		temp = ( ThreadPoolJob *) head->item;
-		if( temp->free_func ) {
-			temp->free_func( temp->arg );
-		}
-		FreeThreadPoolJob( tp, temp );
-		ListDelNode( &tp->lowJobQ, head, 0 );
-	}
-	ListDestroy( &tp->lowJobQ, 0 );
-
 	// clean up long term job
 	if( tp->persistentJob ) {
 		temp = tp->persistentJob;
@@ -1208,11 +1615,11 @@ int ThreadPoolShutdown( ThreadPool *tp )
 			temp->free_func( temp->arg );
 		}
 		FreeThreadPoolJob( tp, temp );
-		tp->persistentJob = NULL;
+		TP_STORE( &tp->persistentJob, NULL );
 	}
 
 	// signal shutdown
-	tp->shutdown = 1;
+	TP_STORE( &tp->shutdown, 1 );
 	ithread_cond_broadcast( &tp->condition );
 
 	// wait for all threads to finish
@@ -1220,14 +1627,51 @@ int ThreadPoolShutdown( ThreadPool *tp )
 		ithread_cond_wait( &tp->start_and_shutdown, &tp->mutex );
 	}
 
+	// and for the statistics reading the workers and the job Qs,
+	// the later ones are kept out of them
+	__atomic_fetch_or( &tp->statsReaders, TP_STATS_CLOSED, __ATOMIC_SEQ_CST );
+	while( TP_LOAD( &tp->statsReaders ) != TP_STATS_CLOSED ) {
+		sched_yield();
+	}
+
+	// clean up the jobs left, from high to low priority
+	for( i = HIGH_PRIORITY; i >= LOW_PRIORITY; i-- ) {
+		if( tp->lanes[i].cells == NULL ) {
+			continue;
+		}
+		while( ( temp = LanePop( &tp->lanes[i] ) ) != NULL ) {
+			if( temp->free_func ) {
+				temp->free_func( temp->arg );
+			}
+			FreeThreadPoolJob( tp, temp );
+		}
+		free( tp->lanes[i].cells );
+		tp->lanes[i].cells = NULL;
+	}
+	for( i = 0; tp->workers != NULL && i < tp->workerSlots; i++ ) {
+		while( ( temp = DequeSteal( &tp->workers[i] ) ) != NULL ) {
+			if( temp->free_func ) {
+				temp->free_func( temp->arg );
+			}
+			FreeThreadPoolJob( tp, temp );
+		}
+	}
+	tp->jobCount = 0;
+
+	// keep the statistics of the workers
+	if( tp->workers != NULL ) {
+		StatsAccountWorkers( tp, &tp->stats );
+		free( tp->workers );
+		tp->workers = NULL;
+	}
+	tp->workerSlots = 0;
+
 	// destroy condition
 	while( ithread_cond_destroy( &tp->condition ) != 0 ) {
 	}
 	while( ithread_cond_destroy( &tp->start_and_shutdown ) != 0 ) {
 	}
 
-	FreeListDestroy( &tp->jobFreeList );
-
 	ithread_mutex_unlock( &tp->mutex );
 
 	// destroy mutex
@@ -1262,6 +1706,7 @@ int TPAttrInit( ThreadPoolAttr *attr )
 	attr->schedPolicy    = DEFAULT_POLICY;
 	attr->starvationTime = DEFAULT_STARVATION_TIME;
 	attr->maxJobsTotal   = DEFAULT_MAX_JOBS_TOTAL;
+	attr->targetWaitTime = DEFAULT_TARGET_WAIT_TIME;
 
 	return 0;
 }
@@ -1506,7 +1951,30 @@ int TPAttrSetMaxJobsTotal( ThreadPoolAttr *attr, int  maxJobsTotal )
 	return 0;
 }
 
-#ifdef STATS
+/****************************************************************************
+ * Function: TPAttrSetTargetWaitTime
+ *
+ *  Description:
+ *      Sets the queueing delay the thread pool tries to keep
+ *      its jobs under, by adding and removing workers.
+ *  Parameters:
+ *      attr - must be valid thread pool attributes.
+ *      targetWaitTime - milliseconds, 0 to use jobsPerThread instead
+ *  Returns:
+ *      Always returns 0.
+ *****************************************************************************/
+int TPAttrSetTargetWaitTime( ThreadPoolAttr *attr, int targetWaitTime )
+{
+	assert( attr != NULL );
+	if( attr == NULL ) {
+		return EINVAL;
+	}
+
+	attr->targetWaitTime = targetWaitTime;
+
+	return 0;
+}
+
 void ThreadPoolPrintStats(ThreadPoolStats *stats)
 {
 	assert( stats != NULL );
@@ -1532,37 +2000,58 @@ void ThreadPoolPrintStats(ThreadPoolStats *stats)
 	printf("Total Threads : %d\n", stats->totalThreads);
 	printf("Total Time spent Working in seconds: %f\n", stats->totalWorkTime);
 	printf("Total Time spent Idle in seconds : %f\n", stats->totalIdleTime);
+	printf("Average Run in High Priority Q in milliseconds: %f\n", stats->avgRunTime[HIGH_PRIORITY]);
+	printf("Average Run in Med Priority Q in milliseconds: %f\n", stats->avgRunTime[MED_PRIORITY]);
+	printf("Average Run in Low Priority Q in milliseconds: %f\n", stats->avgRunTime[LOW_PRIORITY]);
+	printf("Jobs Stolen : %lu\n", stats->totalSteals);
+	printf("Idle Waits : %lu\n", stats->totalIdleWaits);
 }
-#endif /* STATS */
 
 /****************************************************************************
  * Function: ThreadPoolGetStats
  *
  *  Description:
  *      Returns various statistics about the
- *      thread pool.
- *      Only valid if STATS has been defined.
+ *      thread pool. Does not lock the pool, the counters of
+ *      the running workers are read as they are being updated.
+ *      ThreadPoolShutdown waits for the calls reading the workers
+ *      and the job Qs before freeing them; once it has begun, they
+ *      are not read.
  *  Parameters:
  *      ThreadPool *tp - valid initialized threadpool
  *      ThreadPoolStats *stats - valid stats, out parameter
  *  Returns:
  *      Always returns 0.
  *****************************************************************************/
-#ifdef STATS
 int ThreadPoolGetStats( ThreadPool *tp, ThreadPoolStats *stats )
 {
+	double jobs;
+	int readers;
+	int counted = 0;
+	int running = 0;
+	int i;
+
 	assert(tp != NULL);
 	assert(stats != NULL);
 	if (tp == NULL || stats == NULL) {
 		return EINVAL;
 	}
 
-	//if not shutdown then acquire mutex
-	if (!tp->shutdown) {
-		ithread_mutex_lock(&tp->mutex);
+	// counted unless the shutdown has begun, which then waits for us
+	readers = TP_LOAD( &tp->statsReaders );
+	while( !( readers & TP_STATS_CLOSED ) ) {
+		if( TP_CAS( &tp->statsReaders, &readers, readers + 1 ) ) {
+			counted = 1;
+			running = tp->workers != NULL;
+			break;
+		}
 	}
 
 	*stats = tp->stats;
+	if (running) {
+		StatsAccountWorkers(tp, stats);
+	}
+
 	if (stats->totalJobsHQ > 0) {
 		stats->avgWaitHQ = stats->totalTimeHQ / stats->totalJobsHQ;
 	} else {
@@ -1581,19 +2070,34 @@ int ThreadPoolGetStats( ThreadPool *tp, ThreadPoolStats *stats )
 		stats->avgWaitLQ = 0;
 	}
 
-	stats->totalThreads = tp->totalThreads;
-	stats->persistentThreads = tp->persistentThreads;
-	stats->currentJobsHQ = ListSize( &tp->highJobQ );
-	stats->currentJobsLQ = ListSize( &tp->lowJobQ );
-	stats->currentJobsMQ = ListSize( &tp->medJobQ );
+	for( i = LOW_PRIORITY; i <= HIGH_PRIORITY; i++ ) {
+		jobs = i == HIGH_PRIORITY ? stats->totalJobsHQ :
+			i == MED_PRIORITY ? stats->totalJobsMQ : stats->totalJobsLQ;
+		stats->avgRunTime[i] = jobs > 0 ? stats->totalRunTime[i] / jobs : 0;
+	}
+
+	stats->totalThreads = TP_LOAD( &tp->totalThreads );
+	stats->persistentThreads = TP_LOAD( &tp->persistentThreads );
+	stats->idleThreads = TP_LOAD( &tp->idleThreads );
+	stats->workerThreads = stats->totalThreads - stats->idleThreads -
+		stats->persistentThreads;
+	stats->currentJobsHQ = 0;
+	stats->currentJobsMQ = 0;
+	stats->currentJobsLQ = 0;
+	if( running && tp->lanes[HIGH_PRIORITY].cells != NULL ) {
+		stats->currentJobsHQ = LaneSize( &tp->lanes[HIGH_PRIORITY] );
+		stats->currentJobsMQ = LaneSize( &tp->lanes[MED_PRIORITY] );
+		stats->currentJobsLQ = LaneSize( &tp->lanes[LOW_PRIORITY] );
+	}
+	for( i = 0; running && i < tp->workerSlots; i++ ) {
+		// jobs kept by the workers are med priority jobs
+		stats->currentJobsMQ += TP_LOAD( &tp->workers[i].bottom ) -
+			TP_LOAD( &tp->workers[i].top );
+	}
 
-	//if not shutdown then release mutex
-	if( !tp->shutdown ) {
-		ithread_mutex_unlock( &tp->mutex );
+	if( counted ) {
+		TP_ADD( &tp->statsReaders, -1 );
 	}
 
 	return 0;
 }
-
-#endif /* STATS */
-
@@ -45,6 +45,12 @@ extern "C" {
 /* Size of job free list */
 #define JOBFREELISTSIZE 100
 
+/* Number of jobs a worker thread keeps for itself, must be a power of 2 */
+#define WORKER_DEQUE_SIZE 64
+
+/* Number of worker threads of a pool started with INFINITE_THREADS */
+#define INFINITE_THREADS_SLOTS 64
+
 #define INFINITE_THREADS -1
 
 #define EMAXTHREADS (-8 & 1<<29)
@@ -69,11 +75,15 @@ typedef enum priority {LOW_PRIORITY,
 #define DEFAULT_IDLE_TIME 10 * 1000   /* default idle time used by TPAttrInit */
 #define DEFAULT_FREE_ROUTINE NULL     /* default free routine used TPJobInit */
 #define DEFAULT_MAX_JOBS_TOTAL 100    /* default max jobs used TPAttrInit */
+#define DEFAULT_TARGET_WAIT_TIME 0    /* default target wait used by TPAttrInit, 0 disables it */
 
 /* Statistics */
-/* always include stats because code change is minimal */
+/* always kept, STATS stays defined for the code testing it */
 #define STATS 1
 
+/* Number of buckets of the wait and run time histograms */
+#define TP_HISTOGRAM_SIZE 16
+
 #ifdef _DEBUG
 	#define DEBUG 1
 #endif
@@ -130,6 +140,11 @@ typedef struct THREADPOOLATTR
 
 	/* scheduling policy to use */
 	PolicyType schedPolicy;
+
+	/* targetWaitTime (in milliseconds), when not 0 workers are added
+	 * when the jobs queued are expected to wait longer than this,
+	 * instead of using jobsPerThread */
+	int targetWaitTime;
 } ThreadPoolAttr;
 
 /****************************************************************************
@@ -148,6 +163,70 @@ typedef struct THREADPOOLJOB
 	int jobId;
 } ThreadPoolJob;
 
+/****************************************************************************
+ * Name: ThreadPoolCell
+ *
+ *  Description:
+ *     Slot of a job injection queue. Internal to the thread pool.
+ *****************************************************************************/
+typedef struct THREADPOOLCELL
+{
+	/* position the cell can be written or read at */
+	long sequence;
+	ThreadPoolJob *job;
+	/* time the job was queued, in milliseconds */
+	long long requestTime;
+} ThreadPoolCell;
+
+/****************************************************************************
+ * Name: ThreadPoolLane
+ *
+ *  Description:
+ *     Bounded lock-free queue of the jobs of a priority, which any thread
+ *     can add to and any worker can take from. Internal to the thread pool.
+ *****************************************************************************/
+typedef struct THREADPOOLLANE
+{
+	ThreadPoolCell *cells;
+	long mask;
+	long enqueuePos;
+	long dequeuePos;
+} ThreadPoolLane;
+
+/****************************************************************************
+ * Name: ThreadPoolWorker
+ *
+ *  Description:
+ *     Slot of a worker thread. The worker adds and takes the jobs it
+ *     schedules itself at the bottom of its deque, idle workers steal
+ *     them at the top. Internal to the thread pool.
+ *****************************************************************************/
+typedef struct THREADPOOLWORKER
+{
+	struct THREADPOOL *tp;
+	/* whether a thread uses the slot */
+	int inUse;
+	/* whether the thread runs a persistent job */
+	int persistent;
+	/* next worker to steal from */
+	int victim;
+	/* high priority jobs taken since the last starvation check */
+	int highRun;
+	long top;
+	long bottom;
+	ThreadPoolJob *deque[WORKER_DEQUE_SIZE];
+	/* statistics, only updated by the worker, read without locking */
+	unsigned long totalTime[HIGH_PRIORITY + 1];    /* wait, in ms */
+	unsigned long totalJobs[HIGH_PRIORITY + 1];
+	unsigned long totalRunTime[HIGH_PRIORITY + 1]; /* in ms */
+	unsigned long waitHistogram[HIGH_PRIORITY + 1][TP_HISTOGRAM_SIZE];
+	unsigned long runHistogram[HIGH_PRIORITY + 1][TP_HISTOGRAM_SIZE];
+	unsigned long steals;          /* jobs taken from other workers */
+	unsigned long idleWaits;       /* times the worker waited for a job */
+	unsigned long totalWorkTime;   /* in seconds */
+	unsigned long totalIdleTime;   /* in seconds */
+} ThreadPoolWorker;
+
 /****************************************************************************
  * Name: ThreadPoolStats
  *
@@ -176,6 +255,15 @@ typedef struct TPOOLSTATS
 	int currentJobsHQ;
 	int currentJobsLQ;
 	int currentJobsMQ;
+	/* time spent running jobs in milliseconds, by priority */
+	double totalRunTime[HIGH_PRIORITY + 1];
+	double avgRunTime[HIGH_PRIORITY + 1];
+	/* number of jobs by wait and run time, by priority: bucket 0 under
+	 * 1ms, bucket i between 2^(i-1) and 2^i ms, the last one above */
+	unsigned long waitHistogram[HIGH_PRIORITY + 1][TP_HISTOGRAM_SIZE];
+	unsigned long runHistogram[HIGH_PRIORITY + 1][TP_HISTOGRAM_SIZE];
+	unsigned long totalSteals;     /* jobs taken from another worker */
+	unsigned long totalIdleWaits;  /* times a worker waited for a job */
 } ThreadPoolStats;
 
 
@@ -196,24 +284,34 @@ typedef struct TPOOLSTATS
  *     becomes greater than the set ratio and the thread pool currently has
  *     less than the maximum threads then a new thread will
  *     be created.
+ *     Jobs are queued without locks: jobs added by a worker of the pool
+ *     go to its own deque, other jobs to the queue of their priority.
+ *     Idle workers steal from the deques of busy ones. The number of
+ *     workers can not grow beyond the maximum the pool was initialized
+ *     with.
  *
  *****************************************************************************/
 
 typedef struct THREADPOOL
 {
-	ithread_mutex_t mutex; /* mutex to protect job qs */
-	ithread_cond_t condition; /* condition variable to signal Q */
+	ithread_mutex_t mutex; /* mutex to protect threads and idle waits */
+	ithread_cond_t condition; /* condition variable to signal idle workers */
 	ithread_cond_t start_and_shutdown; /* condition variable for start 
 					and stop */
 	int lastJobId; /* ids for jobs */
 	int shutdown;  /* whether or not we are shutting down */
 	int totalThreads;      /* total number of threads */
 	int persistentThreads; /* number of persistent threads */
-	FreeList jobFreeList;  /* free list of jobs */
-	LinkedList lowJobQ;    /* low priority job Q */
-	LinkedList medJobQ;    /* med priority job Q */
-	LinkedList highJobQ;   /* high priority job Q */
+	int idleThreads;       /* number of threads waiting for a job */
+	int jobCount;          /* number of jobs queued */
+	ThreadPoolLane lanes[HIGH_PRIORITY + 1]; /* job Qs, by priority */
+	ThreadPoolWorker *workers; /* worker slots */
+	int workerSlots;       /* number of worker slots */
+	int statsReaders;      /* ThreadPoolGetStats calls reading the
+				  workers and the job Qs */
 	ThreadPoolJob *persistentJob; /* persistent job */
+	int waitTime[HIGH_PRIORITY + 1];    /* average job wait, by priority */
+	int serviceTime[HIGH_PRIORITY + 1]; /* average job run, by priority */
 
 	ThreadPoolAttr attr; /* thread pool attributes */
 
@@ -252,6 +350,10 @@ typedef struct THREADPOOL
  *                         if less than the maximum number of
  *                         workers are running then a new thread is 
  *                         started to help out with efficiency.
+ *      targetWaitTime   - if not 0, replaces jobsPerThread: a new thread
+ *                         is started when the jobs queued are expected
+ *                         to wait longer than this, from the average
+ *                         wait and run times of the jobs, by priority.
  *      schedPolicy      - scheduling policy to try and set (OS dependent)
  *  Returns:
  *      0 on success, nonzero on failure.
@@ -303,6 +405,8 @@ int ThreadPoolGetAttr(ThreadPool *tp, ThreadPoolAttr *out);
  *  Description:
  *      Sets the attributes for the thread pool.
  *      Only affects future calculations. 
+ *      maxThreads can not be raised above the
+ *      maxThreads the pool was initialized with.
  *  Parameters:
  *      tp - valid thread pool pointer
  *      attr - pointer to attributes, null sets attributes to default.
@@ -336,8 +440,9 @@ int ThreadPoolAdd (ThreadPool*tp, ThreadPoolJob *job, int *jobId);
  *
  *  Description:
  *      Removes a job from the thread pool.
- *      Can only remove jobs which are not
- *      currently running.
+ *      Can only remove a persistent job which
+ *      is not picked up yet, queued jobs can
+ *      not be removed.
  *  Parameters:
  *      tp - valid thread pool pointer
  *      jobid - id of job
@@ -513,28 +618,37 @@ int TPAttrSetSchedPolicy(ThreadPoolAttr *attr, PolicyType schedPolicy);
  *****************************************************************************/
 int TPAttrSetMaxJobsTotal(ThreadPoolAttr *attr, int maxJobsTotal);
 
+/****************************************************************************
+ * Function: TPAttrSetTargetWaitTime
+ *
+ *  Description:
+ *      Sets the queueing delay the thread pool tries to keep
+ *      its jobs under, by adding and removing workers.
+ *  Parameters:
+ *      attr - must be valid thread pool attributes.
+ *      targetWaitTime - milliseconds, 0 to use jobsPerThread instead
+ *  Returns:
+ *      Always returns 0.
+ *****************************************************************************/
+int TPAttrSetTargetWaitTime(ThreadPoolAttr *attr, int targetWaitTime);
+
 /****************************************************************************
  * Function: ThreadPoolGetStats
  *
  *  Description:
  *      Returns various statistics about the
- *      thread pool.
- *      Only valid if STATS has been defined.
+ *      thread pool. Does not lock the pool, the counters of
+ *      the running workers are read as they are being updated.
+ *      While the pool shuts down, they are not read.
  *  Parameters:
  *      ThreadPool *tp - valid initialized threadpool    
  *      ThreadPoolStats *stats - valid stats, out parameter
  *  Returns:
  *      Always returns 0.
  *****************************************************************************/
-#ifdef STATS
-	EXPORT int ThreadPoolGetStats(ThreadPool *tp, ThreadPoolStats *stats);
-
-	EXPORT void ThreadPoolPrintStats(ThreadPoolStats *stats);
-#else
-	static UPNP_INLINE int ThreadPoolGetStats(ThreadPool *tp, ThreadPoolStats *stats) {}
+EXPORT int ThreadPoolGetStats(ThreadPool *tp, ThreadPoolStats *stats);
 
-	static UPNP_INLINE void ThreadPoolPrintStats(ThreadPoolStats *stats) {}
-#endif
+EXPORT void ThreadPoolPrintStats(ThreadPoolStats *stats);
 
 #ifdef __cplusplus
 }
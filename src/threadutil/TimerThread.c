@@ -31,6 +31,23 @@
 
 #include "TimerThread.h"
 #include <assert.h>
+#include <stdlib.h>
+
+/****************************************************************************
+ * Function: TimerThreadNow
+ *
+ *  Description:
+ *      Returns the current time in ms since Jan 1, 1970.
+ *      Internal Only.
+ *****************************************************************************/
+static long long
+TimerThreadNow( void )
+{
+    struct timeval now;
+
+    gettimeofday( &now, NULL );
+    return ( long long )now.tv_sec * 1000 + now.tv_usec / 1000;
+}
 
 /****************************************************************************
  * Function: FreeTimerEvent
@@ -50,6 +67,198 @@ FreeTimerEvent( TimerThread * timer,
     FreeListFree( &timer->freeEvents, event );
 }
 
+/****************************************************************************
+ * Function: EventBefore
+ *
+ *  Description:
+ *      Tells whether an event is due before another one. Events due
+ *      the same second run in the order they were scheduled.
+ *      Internal Only.
+ *  Parameters:
+ *      TimerEvent *a, TimerEvent *b - events to compare
+ *****************************************************************************/
+static int
+EventBefore( TimerEvent * a,
+             TimerEvent * b )
+{
+    if( a->eventTime != b->eventTime ) {
+        return a->eventTime < b->eventTime;
+    }
+    return a->id < b->id;
+}
+
+/****************************************************************************
+ * Function: HeapSet
+ *
+ *  Description:
+ *      Puts an event at a position of the event heap.
+ *      Internal Only.
+ *****************************************************************************/
+static void
+HeapSet( TimerThread * timer,
+         int index,
+         TimerEvent * event )
+{
+    timer->eventHeap[index] = event;
+    event->heapIndex = index;
+}
+
+/****************************************************************************
+ * Function: HeapUpdate
+ *
+ *  Description:
+ *      Moves the event at a position of the event heap up or down
+ *      until the heap is ordered again.
+ *      Internal Only.
+ *****************************************************************************/
+static void
+HeapUpdate( TimerThread * timer,
+            int index )
+{
+    TimerEvent *event = timer->eventHeap[index];
+    int child;
+
+    while( index > 0 &&
+           EventBefore( event, timer->eventHeap[( index - 1 ) / 2] ) ) {
+        HeapSet( timer, index, timer->eventHeap[( index - 1 ) / 2] );
+        index = ( index - 1 ) / 2;
+    }
+    while( ( child = 2 * index + 1 ) < timer->eventCount ) {
+        if( child + 1 < timer->eventCount &&
+            EventBefore( timer->eventHeap[child + 1],
+                         timer->eventHeap[child] ) ) {
+            child++;
+        }
+        if( !EventBefore( timer->eventHeap[child], event ) ) {
+            break;
+        }
+        HeapSet( timer, index, timer->eventHeap[child] );
+        index = child;
+    }
+    HeapSet( timer, index, event );
+}
+
+/****************************************************************************
+ * Function: IndexBucket
+ *
+ *  Description:
+ *      Returns the bucket of the id index holding an event id.
+ *      Internal Only.
+ *****************************************************************************/
+static TimerEvent **
+IndexBucket( TimerThread * timer,
+             int id )
+{
+    return &timer->eventIndex[( unsigned int )id &
+                              ( unsigned int )( timer->eventMax - 1 )];
+}
+
+/****************************************************************************
+ * Function: AddEvent
+ *
+ *  Description:
+ *      Adds an event to the event heap and to the id index, growing
+ *      them when they are full.
+ *      Internal Only.
+ *  Returns:
+ *      0 on success, EOUTOFMEM on failure.
+ *****************************************************************************/
+static int
+AddEvent( TimerThread * timer,
+          TimerEvent * event )
+{
+    TimerEvent **heap;
+    TimerEvent **index;
+    TimerEvent **bucket;
+    int max;
+    int i;
+
+    if( timer->eventCount == timer->eventMax ) {
+        max = timer->eventMax ? timer->eventMax * 2 : 64;
+        heap = ( TimerEvent ** )realloc( timer->eventHeap,
+                                         max * sizeof( TimerEvent * ) );
+        if( heap == NULL ) {
+            return EOUTOFMEM;
+        }
+        timer->eventHeap = heap;
+        index = ( TimerEvent ** )calloc( max, sizeof( TimerEvent * ) );
+        if( index == NULL ) {
+            return EOUTOFMEM;
+        }
+        free( timer->eventIndex );
+        timer->eventIndex = index;
+        timer->eventMax = max;
+        // hash the events again, the number of buckets changed
+        for( i = 0; i < timer->eventCount; i++ ) {
+            bucket = IndexBucket( timer, timer->eventHeap[i]->id );
+            timer->eventHeap[i]->nextInIndex = *bucket;
+            *bucket = timer->eventHeap[i];
+        }
+    }
+
+    bucket = IndexBucket( timer, event->id );
+    event->nextInIndex = *bucket;
+    *bucket = event;
+
+    HeapSet( timer, timer->eventCount++, event );
+    HeapUpdate( timer, event->heapIndex );
+
+    return 0;
+}
+
+/****************************************************************************
+ * Function: RemoveEvent
+ *
+ *  Description:
+ *      Removes an event from the event heap and from the id index.
+ *      Internal Only.
+ *****************************************************************************/
+static void
+RemoveEvent( TimerThread * timer,
+             TimerEvent * event )
+{
+    TimerEvent **bucket = IndexBucket( timer, event->id );
+    TimerEvent *last;
+
+    while( *bucket != event ) {
+        bucket = &( *bucket )->nextInIndex;
+    }
+    *bucket = event->nextInIndex;
+
+    last = timer->eventHeap[--timer->eventCount];
+    if( last != event ) {
+        HeapSet( timer, event->heapIndex, last );
+        HeapUpdate( timer, last->heapIndex );
+    }
+}
+
+/****************************************************************************
+ * Function: FindEvent
+ *
+ *  Description:
+ *      Finds a scheduled event by its id.
+ *      Internal Only.
+ *  Returns:
+ *      the event, NULL if no event has this id.
+ *****************************************************************************/
+static TimerEvent *
+FindEvent( TimerThread * timer,
+           int id )
+{
+    TimerEvent *event;
+
+    if( timer->eventMax == 0 ) {
+        return NULL;
+    }
+    for( event = *IndexBucket( timer, id ); event != NULL;
+         event = event->nextInIndex ) {
+        if( event->id == id ) {
+            return event;
+        }
+    }
+    return NULL;
+}
+
 /****************************************************************************
  * Function: TimerThreadWorker
  *
@@ -65,12 +274,10 @@ static void *
 TimerThreadWorker( void *arg )
 {
     TimerThread *timer = ( TimerThread * ) arg;
-    ListNode *head = NULL;
 
     TimerEvent *nextEvent = NULL;
 
-    time_t currentTime = 0;
-    time_t nextEventTime = 0;
+    long long currentTime = 0;
     struct timespec timeToWait;
 
     int tempId;
@@ -96,23 +303,14 @@ TimerThreadWorker( void *arg )
 
         }
 
-        nextEvent = NULL;
+        currentTime = TimerThreadNow();
 
-        //Get the next event if possible
-        if( timer->eventQ.size > 0 )
-        {
-            head = ListHead( &timer->eventQ );
+        //Schedule all the jobs whose time has elapsed
 
-            nextEvent = ( TimerEvent * ) head->item;
-            nextEventTime = nextEvent->eventTime;
-        }
-
-        currentTime = time( NULL );
-
-        //If time has elapsed, schedule job
-
-        if( ( nextEvent != NULL ) && ( currentTime >= nextEventTime ) )
+        while( timer->eventCount > 0 &&
+               currentTime >= timer->eventHeap[0]->eventTime )
         {
+            nextEvent = timer->eventHeap[0];
 
             if( nextEvent->persistent ) {
 
@@ -123,21 +321,23 @@ TimerThreadWorker( void *arg )
                 ThreadPoolAdd( timer->tp, &nextEvent->job, &tempId );
             }
 
-            ListDelNode( &timer->eventQ, head, 0 );
+            RemoveEvent( timer, nextEvent );
             FreeTimerEvent( timer, nextEvent );
-
-            continue;
-
         }
 
-        if( nextEvent != NULL ) {
-            timeToWait.tv_nsec = 0;
-            timeToWait.tv_sec = nextEvent->eventTime;
+        //Wait for the next event, schedulers only signal
+        //an event due before it
+
+        if( timer->eventCount > 0 ) {
+            timer->wakeTime = timer->eventHeap[0]->eventTime;
+            timeToWait.tv_sec = timer->wakeTime / 1000;
+            timeToWait.tv_nsec = ( timer->wakeTime % 1000 ) * 1000000;
 
             ithread_cond_timedwait( &timer->condition, &timer->mutex,
                                     &timeToWait );
 
         } else {
+            timer->wakeTime = 0;
             ithread_cond_wait( &timer->condition, &timer->mutex );
         }
 
@@ -148,26 +348,30 @@ TimerThreadWorker( void *arg )
  * Function: CalculateEventTime
  *
  *  Description:
- *      Calculates the appropriate timeout in absolute seconds since
+ *      Calculates the appropriate timeout in absolute ms since
  *      Jan 1, 1970
  *      Internal Only.
  *  Parameters:
- *      time_t *timeout - timeout
+ *      time_t timeout - timeout
+ *      TimeoutType type - unit and origin of the timeout
+ *      long long *eventTime - absolute time of the event (out)
  *      
  *****************************************************************************/
 static int
-CalculateEventTime( time_t * timeout,
-                    TimeoutType type )
+CalculateEventTime( time_t timeout,
+                    TimeoutType type,
+                    long long *eventTime )
 {
-    time_t now;
+    assert( eventTime != NULL );
 
-    assert( timeout != NULL );
-
-    if( type == ABS_SEC )
+    if( type == ABS_SEC ) {
+        ( *eventTime ) = ( long long )timeout * 1000;
+        return 0;
+    } else if( type == REL_SEC ) {
+        ( *eventTime ) = TimerThreadNow(  ) + ( long long )timeout * 1000;
         return 0;
-    else if( type == REL_SEC ) {
-        time( &now );
-        ( *timeout ) += now;
+    } else if( type == REL_MSEC ) {
+        ( *eventTime ) = TimerThreadNow(  ) + timeout;
         return 0;
     }
 
@@ -186,7 +390,7 @@ CalculateEventTime( time_t * timeout,
  *      arg - argument to function.
  *      priority - priority of job.
  *      eventTime - the absoule time of the event
- *                  in seconds from Jan, 1970
+ *                  in ms from Jan, 1970
  *      id - id of job
  *      
  *  Returns:
@@ -196,7 +400,7 @@ static TimerEvent *
 CreateTimerEvent( TimerThread * timer,
                   ThreadPoolJob * job,
                   Duration persistent,
-                  time_t eventTime,
+                  long long eventTime,
                   int id )
 {
     TimerEvent *temp = NULL;
@@ -263,9 +467,11 @@ TimerThreadInit( TimerThread * timer,
     timer->shutdown = 0;
     timer->tp = tp;
     timer->lastEventId = 0;
-    rc += ListInit( &timer->eventQ, NULL, NULL );
-
-    assert( rc == 0 );
+    timer->eventHeap = NULL;
+    timer->eventIndex = NULL;
+    timer->eventCount = 0;
+    timer->eventMax = 0;
+    timer->wakeTime = 0;
 
     if( rc != 0 ) {
         rc = EAGAIN;
@@ -283,7 +489,6 @@ TimerThreadInit( TimerThread * timer,
         ithread_cond_destroy( &timer->condition );
         ithread_mutex_destroy( &timer->mutex );
         FreeListDestroy( &timer->freeEvents );
-        ListDestroy( &timer->eventQ, 0 );
     }
 
     return rc;
@@ -300,8 +505,8 @@ TimerThreadInit( TimerThread * timer,
  *             timer - valid timer thread pointer.
  *             time_t - time of event.
  *                      either in absolute seconds,
- *                      or relative seconds in the future.
- *             timeoutType - either ABS_SEC, or REL_SEC.
+ *                      or relative seconds or ms in the future.
+ *             timeoutType - either ABS_SEC, REL_SEC or REL_MSEC.
  *                           if REL_SEC, then the event
  *                           will be scheduled at the
  *                           current time + REL_SEC.
@@ -324,12 +529,10 @@ TimerThreadSchedule( TimerThread * timer,
 {
 
     int rc = EOUTOFMEM;
-    int found = 0;
     int tempId = 0;
 
-    ListNode *tempNode = NULL;
-    TimerEvent *temp = NULL;
     TimerEvent *newEvent = NULL;
+    long long eventTime = 0;
 
     assert( timer != NULL );
     assert( job != NULL );
@@ -338,7 +541,9 @@ TimerThreadSchedule( TimerThread * timer,
         return EINVAL;
     }
 
-    CalculateEventTime( &timeout, type );
+    if( CalculateEventTime( timeout, type, &eventTime ) != 0 ) {
+        return EINVAL;
+    }
     ithread_mutex_lock( &timer->mutex );
 
     if( id == NULL )
@@ -346,7 +551,7 @@ TimerThreadSchedule( TimerThread * timer,
 
     ( *id ) = INVALID_EVENT_ID;
 
-    newEvent = CreateTimerEvent( timer, job, duration, timeout,
+    newEvent = CreateTimerEvent( timer, job, duration, eventTime,
                                  timer->lastEventId );
 
     if( newEvent == NULL ) {
@@ -354,41 +559,19 @@ TimerThreadSchedule( TimerThread * timer,
         return rc;
     }
 
-    tempNode = ListHead( &timer->eventQ );
-    //add job to Q
-    //Q is ordered by eventTime
-    //with the head of the Q being the next event
-
-    while( tempNode != NULL ) {
-        temp = ( TimerEvent * ) tempNode->item;
-        if( temp->eventTime >= timeout )
-        {
-
-            if( ListAddBefore( &timer->eventQ, newEvent, tempNode ) !=
-                NULL )
-                rc = 0;
-            found = 1;
-            break;
-
-        }
-        tempNode = ListNext( &timer->eventQ, tempNode );
-    }
-
-    //add to the end of Q
-    if( !found ) {
-
-        if( ListAddTail( &timer->eventQ, newEvent ) != NULL )
-            rc = 0;
+    //add job to the heap
+    //with the top of the heap being the next event
+    rc = AddEvent( timer, newEvent );
 
-    }
-    //signal change in Q
     if( rc == 0 ) {
-
-        ithread_cond_signal( &timer->condition );
+        //wake the timer thread only if it waits for a later event
+        if( timer->wakeTime == 0 || eventTime < timer->wakeTime ) {
+            ithread_cond_signal( &timer->condition );
+        }
+        ( *id ) = timer->lastEventId++;
     } else {
         FreeTimerEvent( timer, newEvent );
     }
-    ( *id ) = timer->lastEventId++;
     ithread_mutex_unlock( &timer->mutex );
 
     return rc;
@@ -418,7 +601,6 @@ TimerThreadRemove( TimerThread * timer,
                    ThreadPoolJob * out )
 {
     int rc = INVALID_EVENT_ID;
-    ListNode *tempNode = NULL;
     TimerEvent *temp = NULL;
 
     assert( timer != NULL );
@@ -429,21 +611,13 @@ TimerThreadRemove( TimerThread * timer,
 
     ithread_mutex_lock( &timer->mutex );
 
-    tempNode = ListHead( &timer->eventQ );
-
-    while( tempNode != NULL ) {
-        temp = ( TimerEvent * ) tempNode->item;
-        if( temp->id == id )
-        {
-
-            ListDelNode( &timer->eventQ, tempNode, 0 );
-            if( out != NULL )
-                ( *out ) = temp->job;
-            FreeTimerEvent( timer, temp );
-            rc = 0;
-            break;
-        }
-        tempNode = ListNext( &timer->eventQ, tempNode );
+    temp = FindEvent( timer, id );
+    if( temp != NULL ) {
+        RemoveEvent( timer, temp );
+        if( out != NULL )
+            ( *out ) = temp->job;
+        FreeTimerEvent( timer, temp );
+        rc = 0;
     }
 
     ithread_mutex_unlock( &timer->mutex );
@@ -466,8 +640,7 @@ TimerThreadRemove( TimerThread * timer,
 int
 TimerThreadShutdown( TimerThread * timer )
 {
-    ListNode *tempNode2 = NULL;
-    ListNode *tempNode = NULL;
+    int i;
 
     assert( timer != NULL );
 
@@ -478,24 +651,25 @@ TimerThreadShutdown( TimerThread * timer )
     ithread_mutex_lock( &timer->mutex );
 
     timer->shutdown = 1;
-    tempNode = ListHead( &timer->eventQ );
 
-    //Delete nodes in Q
+    //Delete events in the heap
     //call registered free function 
     //on argument
-    while( tempNode != NULL ) {
-        TimerEvent *temp = ( TimerEvent * ) tempNode->item;
+    for( i = 0; i < timer->eventCount; i++ ) {
+        TimerEvent *temp = timer->eventHeap[i];
 
-        tempNode2 = ListNext( &timer->eventQ, tempNode );
-        ListDelNode( &timer->eventQ, tempNode, 0 );
         if( temp->job.free_func ) {
             temp->job.free_func( temp->job.arg );
         }
         FreeTimerEvent( timer, temp );
-        tempNode = tempNode2;
     }
 
-    ListDestroy( &timer->eventQ, 0 );
+    free( timer->eventHeap );
+    free( timer->eventIndex );
+    timer->eventHeap = NULL;
+    timer->eventIndex = NULL;
+    timer->eventCount = 0;
+    timer->eventMax = 0;
     FreeListDestroy( &timer->freeEvents );
 
     ithread_cond_broadcast( &timer->condition );
@@ -46,7 +46,8 @@ extern "C" {
 /* Timeout Types */
 /* absolute means in seconds from Jan 1, 1970 */
 /* relative means in seconds from current time */
-typedef enum timeoutType {ABS_SEC,REL_SEC} TimeoutType;
+/* relative msec means in milliseconds from current time */
+typedef enum timeoutType {ABS_SEC,REL_SEC,REL_MSEC} TimeoutType;
 
 
 /****************************************************************************
@@ -66,7 +67,14 @@ typedef struct TIMERTHREAD
   ithread_mutex_t mutex;
   ithread_cond_t condition;
   int lastEventId;
-  LinkedList eventQ;
+  /* events, min-heap ordered by time, the next event first */
+  struct TIMEREVENT **eventHeap;
+  int eventCount;
+  int eventMax;
+  /* events hashed by id, eventMax buckets */
+  struct TIMEREVENT **eventIndex;
+  /* time the timer thread waits for in ms, 0 if it waits for an event */
+  long long wakeTime;
   int shutdown;
   FreeList freeEvents;
   ThreadPool *tp;
@@ -85,9 +93,11 @@ typedef struct TIMERTHREAD
 typedef struct TIMEREVENT
 {
   ThreadPoolJob job;
-  time_t eventTime; /* absolute time for event in seconds since Jan 1, 1970 */
+  long long eventTime; /* absolute time for event in ms since Jan 1, 1970 */
   Duration persistent;  /* long term or short term job */
   int id;
+  int heapIndex;  /* position in the event heap */
+  struct TIMEREVENT *nextInIndex;  /* next event of the same id bucket */
 } TimerEvent;
 
 
@@ -124,8 +134,8 @@ int TimerThreadInit(TimerThread *timer,
  *             timer - valid timer thread pointer.
  *             time_t - time of event.
  *                      either in absolute seconds,
- *                      or relative seconds in the future.
- *             timeoutType - either ABS_SEC, or REL_SEC.
+ *                      or relative seconds or ms in the future.
+ *             timeoutType - either ABS_SEC, REL_SEC or REL_MSEC.
  *                           if REL_SEC, then the event
  *                           will be scheduled at the
  *                           current time + REL_SEC.
@@ -281,6 +281,22 @@ typedef pthread_rwlock_t ithread_rwlock_t;
  *      See man page for pthread_mutex_lock
  *****************************************************************************/
 #define ithread_mutex_lock pthread_mutex_lock
+
+
+/****************************************************************************
+ * Function: ithread_mutex_trylock
+ *
+ *  Description:
+ *      Locks mutex if it is not locked already.
+ *  Parameters:
+ *      ithread_mutex_t * mutex (must be valid non NULL pointer to pthread_mutex_t)
+ *      mutex must be initialized.
+ *      
+ *  Returns:
+ *      0 on success, EBUSY if the mutex is locked.
+ *      See man page for pthread_mutex_trylock
+ *****************************************************************************/
+#define ithread_mutex_trylock pthread_mutex_trylock
   
 
 /****************************************************************************
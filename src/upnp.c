@@ -505,6 +505,7 @@ upnp_uninit (dlna_t *dlna)
   dlna_log (dlna, DLNA_MSG_INFO, "Stopping UPnP A/V Service ...\n");
   dlnaUnRegisterRootDevice (dlna->dev);
   dlnaFinish ();
+  dlna_http_file_cache_flush (dlna);
 
   return DLNA_ST_OK;
 }
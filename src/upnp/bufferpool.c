@@ -0,0 +1,383 @@
+/*
+ * libdlna: reference DLNA standards implementation.
+ * Copyright (C) 2007-2008 Benjamin Zores <ben@geexbox.org>
+ *
+ * This file is part of libdlna.
+ *
+ * libdlna is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libdlna is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libdlna; if not, write to the Free Software
+ * Foundation, Inc, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/************************************************************************
+* Purpose: This file contains the pool of the buffers the web server
+*	reads the files into, to send them. The buffers are sized by class,
+*	from the length of the response, kept by the threads between their
+*	responses and bounded by a global cap on their memory.
+************************************************************************/
+
+#include "config.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "ithread.h"
+#include "bufferpool.h"
+
+// number of size classes, from BUFPOOL_MIN_SIZE by a factor 4
+#define BUFPOOL_CLASSES		5
+#define BUFPOOL_MIN_SIZE	4096
+
+// buffers of a class kept by each thread
+#define BUFPOOL_THREAD_SMALL	4
+#define BUFPOOL_THREAD_LARGE	1
+// classes from this one have BUFPOOL_THREAD_LARGE buffers by thread
+#define BUFPOOL_LARGE_CLASS	3
+
+// header of a buffer, before the memory given to the caller
+typedef union pool_buf
+{
+	struct
+	{
+		union pool_buf	*next;	// next free buffer of the class
+		int		class;
+	} h;
+	double		align;
+} pool_buf;
+
+// free buffers kept by a thread
+typedef struct pool_cache
+{
+	pool_buf	*free[BUFPOOL_CLASSES];
+	int		count[BUFPOOL_CLASSES];
+	int		used;		// registered for the thread exit
+} pool_cache;
+
+static ithread_mutex_t gPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pool_buf *gPoolFree[BUFPOOL_CLASSES];
+// memory of all the buffers, in use or free
+static size_t gPoolMemory = 0;
+// set by bufferpool_flush(): the buffers released afterwards are freed
+static int gPoolClosed = 0;
+
+static pthread_once_t gPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gPoolKey;
+
+static __thread pool_cache gThreadCache;
+
+/************************************************************************
+*	Function :	ClassSize
+*
+*	Parameters :
+*		IN int class ;	size class
+*
+*	Description :	Size of the buffers of a class, the largest class
+*		being WEB_SERVER_BUF_SIZE.
+*
+*	Return : size_t ;
+*
+*	Note :
+************************************************************************/
+static size_t
+ClassSize( IN int class )
+{
+    size_t size;
+
+    if( class == BUFPOOL_CLASSES - 1 ) {
+        return WEB_SERVER_BUF_SIZE;
+    }
+    size = ( size_t ) BUFPOOL_MIN_SIZE << ( 2 * class );
+
+    return size < WEB_SERVER_BUF_SIZE ? size : WEB_SERVER_BUF_SIZE;
+}
+
+/************************************************************************
+*	Function :	ThreadLimit
+*
+*	Parameters :
+*		IN int class ;	size class
+*
+*	Description :	Number of buffers of a class a thread keeps.
+*
+*	Return : int ;
+*
+*	Note :
+************************************************************************/
+static int
+ThreadLimit( IN int class )
+{
+    return class >= BUFPOOL_LARGE_CLASS ?
+        BUFPOOL_THREAD_LARGE : BUFPOOL_THREAD_SMALL;
+}
+
+/************************************************************************
+*	Function :	ReleaseBuffer
+*
+*	Parameters :
+*		IN pool_buf* pb ;	buffer released
+*
+*	Description :	Keep a buffer for the other threads while under the
+*		memory cap and the pool is not flushed, free it otherwise.
+*		gPoolMutex must be held.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static void
+ReleaseBuffer( IN pool_buf * pb )
+{
+    int class = pb->h.class;
+
+    if( gPoolClosed || gPoolMemory > WEB_SERVER_BUF_POOL_SIZE ) {
+        gPoolMemory -= ClassSize( class );
+        free( pb );
+        return;
+    }
+    pb->h.next = gPoolFree[class];
+    gPoolFree[class] = pb;
+}
+
+/************************************************************************
+*	Function :	ThreadExit
+*
+*	Parameters :
+*		IN void* arg ;	cache of the exiting thread
+*
+*	Description :	Give the buffers kept by an exiting thread back to
+*		the pool.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static void
+ThreadExit( IN void *arg )
+{
+    pool_cache *cache = ( pool_cache * ) arg;
+    pool_buf *pb;
+    int class;
+
+    ithread_mutex_lock( &gPoolMutex );
+    for( class = 0; class < BUFPOOL_CLASSES; class++ ) {
+        while( ( pb = cache->free[class] ) != NULL ) {
+            cache->free[class] = pb->h.next;
+            ReleaseBuffer( pb );
+        }
+        cache->count[class] = 0;
+    }
+    cache->used = 0;
+    ithread_mutex_unlock( &gPoolMutex );
+}
+
+/************************************************************************
+*	Function :	CreateKey
+*
+*	Parameters :	void
+*
+*	Description :	Create the key calling ThreadExit on the exit of the
+*		threads keeping buffers.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static void
+CreateKey( void )
+{
+    pthread_key_create( &gPoolKey, ThreadExit );
+}
+
+/************************************************************************
+*	Function :	FreeCached
+*
+*	Parameters :
+*		IN size_t needed ;	memory to be made room for
+*
+*	Description :	Free the buffers kept for the threads, the largest
+*		first, until the needed memory fits under the cap.
+*		gPoolMutex must be held.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static void
+FreeCached( IN size_t needed )
+{
+    pool_buf *pb;
+    int class;
+
+    for( class = BUFPOOL_CLASSES - 1; class >= 0; class-- ) {
+        while( gPoolMemory + needed > WEB_SERVER_BUF_POOL_SIZE &&
+               ( pb = gPoolFree[class] ) != NULL ) {
+            gPoolFree[class] = pb->h.next;
+            gPoolMemory -= ClassSize( class );
+            free( pb );
+        }
+    }
+}
+
+/************************************************************************
+*	Function :	bufferpool_get
+*
+*	Parameters :
+*		IN size_t wanted ;	size the caller would like
+*		OUT size_t* size ;	size of the buffer returned
+*
+*	Description :	Get a transfer buffer from the pool, of the smallest
+*		size class holding the wanted size, or of the largest class
+*		(WEB_SERVER_BUF_SIZE) for larger sizes. The buffers released
+*		by the thread are reused first, then those of the other
+*		threads. When the buffers would take more than
+*		WEB_SERVER_BUF_POOL_SIZE, a smaller class is returned: the
+*		smallest one is always granted.
+*
+*	Return : char* ;
+*		The buffer, to be released by bufferpool_put().
+*		NULL if memory cannot be allocated.
+*
+*	Note :
+************************************************************************/
+char *
+bufferpool_get( IN size_t wanted,
+                OUT size_t *size )
+{
+    pool_cache *cache = &gThreadCache;
+    pool_buf *pb;
+    int class;
+
+    assert( size );
+
+    for( class = 0; class < BUFPOOL_CLASSES - 1; class++ ) {
+        if( ClassSize( class ) >= wanted ) {
+            break;
+        }
+    }
+
+    // lock free for the responses following one another on a thread
+    pb = cache->free[class];
+    if( pb ) {
+        cache->free[class] = pb->h.next;
+        cache->count[class]--;
+        *size = ClassSize( class );
+        return ( char * )( pb + 1 );
+    }
+
+    ithread_mutex_lock( &gPoolMutex );
+    gPoolClosed = 0;
+    pb = gPoolFree[class];
+    if( pb ) {
+        gPoolFree[class] = pb->h.next;
+    } else {
+        // under the cap, with a smaller buffer if need be
+        FreeCached( ClassSize( class ) );
+        while( class > 0 &&
+               gPoolMemory + ClassSize( class ) > WEB_SERVER_BUF_POOL_SIZE ) {
+            class--;
+            if( gPoolFree[class] ) {
+                break;
+            }
+        }
+        pb = gPoolFree[class];
+        if( pb ) {
+            gPoolFree[class] = pb->h.next;
+        } else {
+            pb = ( pool_buf * ) malloc( sizeof( pool_buf ) +
+                                        ClassSize( class ) );
+            if( pb ) {
+                gPoolMemory += ClassSize( class );
+            }
+        }
+    }
+    ithread_mutex_unlock( &gPoolMutex );
+
+    if( !pb ) {
+        return NULL;
+    }
+    pb->h.class = class;
+    *size = ClassSize( class );
+
+    return ( char * )( pb + 1 );
+}
+
+/************************************************************************
+*	Function :	bufferpool_put
+*
+*	Parameters :
+*		IN char* buf ;	buffer from bufferpool_get(), or NULL
+*
+*	Description :	Give a transfer buffer back to the pool. It is kept
+*		by the thread for its next responses, or by the pool for the
+*		other threads while under the memory cap, and freed otherwise.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+void
+bufferpool_put( IN char *buf )
+{
+    pool_cache *cache = &gThreadCache;
+    pool_buf *pb;
+    int class;
+
+    if( !buf ) {
+        return;
+    }
+    pb = ( ( pool_buf * ) buf ) - 1;
+    class = pb->h.class;
+
+    // over the cap, the buffers are freed instead of kept
+    if( cache->count[class] < ThreadLimit( class ) &&
+        __atomic_load_n( &gPoolMemory, __ATOMIC_RELAXED ) <=
+        WEB_SERVER_BUF_POOL_SIZE ) {
+        if( !cache->used ) {
+            // the buffers go back to the pool when the thread exits
+            pthread_once( &gPoolOnce, CreateKey );
+            pthread_setspecific( gPoolKey, cache );
+            cache->used = 1;
+        }
+        pb->h.next = cache->free[class];
+        cache->free[class] = pb;
+        cache->count[class]++;
+        return;
+    }
+
+    ithread_mutex_lock( &gPoolMutex );
+    ReleaseBuffer( pb );
+    ithread_mutex_unlock( &gPoolMutex );
+}
+
+/************************************************************************
+*	Function :	bufferpool_flush
+*
+*	Parameters :	void
+*
+*	Description :	Free the buffers kept by the pool for the threads.
+*		The buffers kept by a thread are freed when it exits, even
+*		after the flush. To be called once the threads using the pool
+*		are shut down; the pool is used again by the next
+*		bufferpool_get().
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+void
+bufferpool_flush( void )
+{
+    ithread_mutex_lock( &gPoolMutex );
+    FreeCached( WEB_SERVER_BUF_POOL_SIZE + 1 );
+    gPoolClosed = 1;
+    ithread_mutex_unlock( &gPoolMutex );
+}
@@ -0,0 +1,92 @@
+/*
+ * libdlna: reference DLNA standards implementation.
+ * Copyright (C) 2007-2008 Benjamin Zores <ben@geexbox.org>
+ *
+ * This file is part of libdlna.
+ *
+ * libdlna is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libdlna is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libdlna; if not, write to the Free Software
+ * Foundation, Inc, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef GENLIB_UTIL_BUFFERPOOL_H
+#define GENLIB_UTIL_BUFFERPOOL_H
+
+#include <stdlib.h>
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/************************************************************************
+*	Function :	bufferpool_get
+*
+*	Parameters :
+*		IN size_t wanted ;	size the caller would like
+*		OUT size_t* size ;	size of the buffer returned
+*
+*	Description :	Get a transfer buffer from the pool, of the smallest
+*		size class holding the wanted size, or of the largest class
+*		(WEB_SERVER_BUF_SIZE) for larger sizes. The buffers released
+*		by the thread are reused first, then those of the other
+*		threads. When the buffers would take more than
+*		WEB_SERVER_BUF_POOL_SIZE, a smaller class is returned: the
+*		smallest one is always granted.
+*
+*	Return : char* ;
+*		The buffer, to be released by bufferpool_put().
+*		NULL if memory cannot be allocated.
+*
+*	Note :
+************************************************************************/
+char *bufferpool_get( IN size_t wanted, OUT size_t *size );
+
+/************************************************************************
+*	Function :	bufferpool_put
+*
+*	Parameters :
+*		IN char* buf ;	buffer from bufferpool_get(), or NULL
+*
+*	Description :	Give a transfer buffer back to the pool. It is kept
+*		by the thread for its next responses, or by the pool for the
+*		other threads while under the memory cap, and freed otherwise.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+void bufferpool_put( IN char *buf );
+
+/************************************************************************
+*	Function :	bufferpool_flush
+*
+*	Parameters :	void
+*
+*	Description :	Free the buffers kept by the pool for the threads.
+*		The buffers kept by a thread are freed when it exits, even
+*		after the flush. To be called once the threads using the pool
+*		are shut down; the pool is used again by the next
+*		bufferpool_get().
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+void bufferpool_flush( void );
+
+#ifdef __cplusplus
+}		// extern "C"
+#endif	// __cplusplus
+
+#endif // GENLIB_UTIL_BUFFERPOOL_H
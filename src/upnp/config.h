@@ -60,6 +60,19 @@
 #define THREAD_IDLE_TIME 5000
 //@}
 
+/** @name THREAD_TARGET_WAIT_TIME
+ *  The {\tt THREAD_TARGET_WAIT_TIME} constant is the queueing delay, in
+ *  milliseconds, the thread pools inside the SDK try to keep their jobs
+ *  under. A new thread (up to the max) is allocated when the jobs queued
+ *  are expected to wait longer, from the average wait and run times of
+ *  the jobs. With 0, the pools only grow on the {\tt JOBS_PER_THREAD}
+ *  ratio. The default value is 50 milliseconds.
+ */
+
+//@{
+#define THREAD_TARGET_WAIT_TIME 50
+//@}
+
 /** @name JOBS_PER_THREAD
  *  The {\tt JOBS_PER_THREAD} constant determines when a new thread will be
  *  allocated to the thread pool inside the  SDK. The thread pool will
@@ -111,6 +124,33 @@
 #define MAX_JOBS_TOTAL 100
 //@}
 
+/** @name STREAM_MIN_THREADS, STREAM_MAX_THREADS, STREAM_MAX_JOBS
+ *  HTTP requests answered by the web server (media transfers) are run
+ *  in their own thread pool, so that long-lived streams can not starve
+ *  SOAP actions, description fetches and GENA requests, which stay in
+ *  the mini server thread pool.  These constants size that pool.
+ *  {\tt STREAM_MAX_JOBS} is the number of streaming requests allowed to
+ *  wait for a thread; further requests are refused with
+ *  "503 Service Unavailable".
+ */
+
+//@{
+#define STREAM_MIN_THREADS 1
+#define STREAM_MAX_THREADS 16
+#define STREAM_MAX_JOBS 16
+//@}
+
+/** @name GENA_MAX_JOBS
+ *  GENA requests (NOTIFY, SUBSCRIBE and UNSUBSCRIBE) are run in the
+ *  receive thread pool, which also serves SSDP.  At most
+ *  {\tt GENA_MAX_JOBS} of them may wait or run there; further ones are
+ *  refused with "503 Service Unavailable", leaving room for SSDP.
+ */
+
+//@{
+#define GENA_MAX_JOBS 32
+//@}
+
 /** @name DEFAULT_SOAP_CONTENT_LENGTH
  * SOAP messages will read at most {\tt DEFAULT_SOAP_CONTENT_LENGTH} bytes.  
  * This prevents devices that have a misbehaving web server to send 
@@ -139,6 +179,69 @@
 #define SSDP_PAUSE  100
 //@}
 
+/** @name SSDP_TX_BATCH
+ * This configuration parameter sets the maximum number of SSDP datagrams
+ * the transmit scheduler hands to the kernel in a single call when they
+ * are due at the same time.
+ */
+//@{
+#define SSDP_TX_BATCH  32
+//@}
+
+/** @name SSDP_REQUESTER_MAX_PACKETS
+ * This configuration parameter sets the maximum number of search replies
+ * sent to a single control point during SSDP_REQUESTER_WINDOW seconds.
+ * Replies beyond that limit are dropped, so that a control point flooding
+ * M-SEARCH requests does not monopolize the transmit queue.
+ */
+//@{
+#define SSDP_REQUESTER_MAX_PACKETS  256
+//@}
+
+/** @name SSDP_REQUESTER_WINDOW
+ * This configuration parameter sets the length, in seconds, of the window
+ * over which the search replies to a control point are counted.
+ */
+//@{
+#define SSDP_REQUESTER_WINDOW  5
+//@}
+
+/** @name SSDP_MAX_REQUESTERS
+ * This configuration parameter sets the number of control points whose
+ * search replies are counted at the same time. The least recently seen
+ * control point is forgotten when the table is full.
+ */
+//@{
+#define SSDP_MAX_REQUESTERS  32
+//@}
+
+/** @name SSDP_RECV_BATCH
+ * This configuration parameter sets the maximum number of SSDP datagrams
+ * read from a socket in a single call. The datagrams read together are
+ * handled by a single job of the receive thread pool.
+ */
+//@{
+#define SSDP_RECV_BATCH  16
+//@}
+
+/** @name SSDP_RECV_POOL
+ * This configuration parameter sets how many SSDP request structures,
+ * with their receive buffer, are kept for reuse instead of being freed.
+ */
+//@{
+#define SSDP_RECV_POOL  32
+//@}
+
+/** @name SSDP_MAX_SEARCHES
+ * This configuration parameter sets the number of recent search requests
+ * remembered by the device. A copy of a search received from the same
+ * control point during the MX window of the first one is not answered
+ * again.
+ */
+//@{
+#define SSDP_MAX_SEARCHES  64
+//@}
+
 /** @name WEB_SERVER_BUF_SIZE 
  * This configuration parameter sets the maximum buffer size for the 
  * webserver.  The default value is 1MB.
@@ -147,6 +250,37 @@
 #define WEB_SERVER_BUF_SIZE  (1024*1024)
 //@}
 
+/** @name WEB_SERVER_BUF_POOL_SIZE
+ * The {\tt WEB_SERVER_BUF_POOL_SIZE} is the cap on the memory of the
+ * buffers the webserver sends the files with, in use or kept for the
+ * next responses. Past it, the responses get smaller buffers and the
+ * buffers released are freed.  The default value is 64MB.
+ */
+//@{
+#define WEB_SERVER_BUF_POOL_SIZE  (64*1024*1024)
+//@}
+
+/** @name WEB_SERVER_DESCRIPTION_MAX_AGE
+ * The {\tt WEB_SERVER_DESCRIPTION_MAX_AGE} is the time, in seconds, a
+ * control point may keep the device and service descriptions, and the
+ * other XML documents, before checking them again with a conditional
+ * request. The default value is 1800 seconds, the usual lifetime of the
+ * advertisements.
+ */
+//@{
+#define WEB_SERVER_DESCRIPTION_MAX_AGE  1800
+//@}
+
+/** @name WEB_SERVER_IMAGE_MAX_AGE
+ * The {\tt WEB_SERVER_IMAGE_MAX_AGE} is the time, in seconds, a control
+ * point may keep an image, album art and thumbnails included, before
+ * checking it again with a conditional request. The default value is
+ * one day.
+ */
+//@{
+#define WEB_SERVER_IMAGE_MAX_AGE  86400
+//@}
+
 /** @name AUTO_RENEW_TIME
  * The {\tt AUTO_RENEW_TIME} is the time, in seconds, before a subscription
  * expires that the SDK automatically resubscribes.  The default 
@@ -219,6 +353,61 @@
 #define SSDP_PACKET_DISTRIBUTE 1
 //@}
 
+/** @name GENA_KEEPALIVE_TIME
+ *  The {\tt GENA_KEEPALIVE_TIME} is the time, in seconds, an idle event
+ *  delivery connection to a subscriber is kept open for the next NOTIFY.
+ *  Past this time the connection is closed and a new one is made for the
+ *  next event.  The default time is 30 seconds.
+ */
+
+//@{
+#define GENA_KEEPALIVE_TIME 30
+//@}
+
+/** @name GENA_NOTIFY_TIMEOUT
+ *  The {\tt GENA_NOTIFY_TIMEOUT} is the time, in seconds, a subscriber is
+ *  given to accept the connection and answer a NOTIFY before the event
+ *  is considered undelivered.  The default time is 5 seconds.
+ */
+
+//@{
+#define GENA_NOTIFY_TIMEOUT 5
+//@}
+
+/** @name GENA_MAX_QUEUED_EVENTS
+ *  The {\tt GENA_MAX_QUEUED_EVENTS} is the number of events that can wait
+ *  for delivery to a single subscriber.  When a subscriber falls further
+ *  behind, its oldest event is dropped and the SEQ number skipped so that
+ *  the control point can tell.  Events only carrying LastChange replace
+ *  the previous such event still waiting instead of adding to the queue.
+ *  The default value is 20.
+ */
+
+//@{
+#define GENA_MAX_QUEUED_EVENTS 20
+//@}
+
+/** @name GENA_BACKOFF_TIME
+ *  The {\tt GENA_BACKOFF_TIME} is the time, in seconds, events to a
+ *  subscriber are dropped without trying after a failed delivery.  It is
+ *  doubled on each consecutive failure, up to 16 times the initial value.
+ *  The default time is 2 seconds.
+ */
+
+//@{
+#define GENA_BACKOFF_TIME 2
+//@}
+
+/** @name GENA_MAX_NOTIFY_FAILURES
+ *  The {\tt GENA_MAX_NOTIFY_FAILURES} is the number of consecutive failed
+ *  deliveries after which a subscription is cancelled.  The default
+ *  value is 8.
+ */
+
+//@{
+#define GENA_MAX_NOTIFY_FAILURES 8
+//@}
+
 /** @name Module Exclusion
  *  Depending on the requirements, the user can selectively discard any of 
  *  the major modules like SOAP, GENA, SSDP or the Internal web server. By 
@@ -108,17 +108,45 @@ extern ithread_mutex_t GlobalClientSubscribeMutex;
 		"Subscribe UnLock");
 
 
-// Structure to send NOTIFY message to all subscribed control points
-typedef struct NOTIFY_THREAD_STRUCT {
+// Event rendered once for all the subscribed control points. It is
+// shared, read-only, by the NOTIFY sent to each of them and freed when
+// the last reference is released (under the lock of the service).
+typedef struct NOTIFY_EVENT {
+  int reference_count;
+  char * servId;
+  char * UDN;
+  dlnaDevice_Handle device_handle;
+  // CONTENT-TYPE, CONTENT-LENGTH, NT and NTS headers
   char * headers;
+  size_t headers_length;
+  // sent with its null terminator
   DOMString propertySet;
+  size_t propertySet_length;
+  // names of the variables of an event carrying whole values only; a
+  // newer event with the same names replaces it in the queue. NULL when
+  // the event carries changes (LastChange) and must be delivered.
+  char * collapseKey;
+} notify_event;
+
+// Event queued on a subscription
+typedef struct NOTIFY_THREAD_STRUCT {
+  notify_event *event;
+  struct NOTIFY_THREAD_STRUCT *next;
+} notify_thread_struct;
+
+// Job delivering the queued events of one subscription
+typedef struct NOTIFY_JOB_STRUCT {
   char * servId;
   char * UDN;
   dlna_SID sid;
-  int eventKey;
-  int *reference_count;
   dlnaDevice_Handle device_handle;
-} notify_thread_struct;
+} notify_job_struct;
+
+// Timer job expiring the subscriptions of a device
+typedef struct EXPIRE_JOB_STRUCT {
+  dlnaDevice_Handle device_handle;
+  int eventId;
+} expire_job_struct;
 
 
 /************************************************************************
@@ -371,6 +399,23 @@ EXTERN_C  int genaInitNotifyExt(
 #endif
 
 
+/****************************************************************************
+*	Function :	genaFlushNotifyQueue
+*
+*	Parameters :
+*		INOUT subscription *sub :	subscription being freed
+*
+*	Description :	This function drops the events still waiting for
+*		delivery to a subscription. Must be called with the handle lock
+*		held.
+*
+*	Return :	void
+****************************************************************************/
+#ifdef INCLUDE_DEVICE_APIS
+void genaFlushNotifyQueue( INOUT subscription *sub );
+#endif
+
+
 /************************************************************************
 * Function : error_respond									
 *																	
@@ -45,6 +45,129 @@
 
 #include "unixutil.h"
 
+/************************************************************************
+* Function : genaScheduleExpiry
+*																	
+* Parameters:														
+*	IN dlnaDevice_Handle device_handle: Handle of the root device
+*	INOUT struct Handle_Info *handle_info: its handle info
+*
+* Description:														
+*	This function removes the subscriptions of the device which expired
+*	and makes sure the timer thread runs it again when the next one
+*	expires. Must be called holding a reference to the handle and none
+*	of the service locks.
+*
+* Returns: void
+****************************************************************************/
+static void genaExpireThread( IN void *input );
+
+static void
+genaScheduleExpiry( IN dlnaDevice_Handle device_handle,
+                    INOUT struct Handle_Info *handle_info )
+{
+    service_table *table = &handle_info->ServiceTable;
+    service_info *service;
+    expire_job_struct *expire_job;
+    ThreadPoolJob job;
+    time_t now = time( NULL );
+    time_t next = 0;
+    time_t expire;
+
+    ithread_mutex_lock( &table->expireLock );
+
+    for( service = table->serviceList; service; service = service->next ) {
+        ithread_mutex_lock( &service->lock );
+        expire = ExpireSubscriptions( service, now );
+        ithread_mutex_unlock( &service->lock );
+        if( expire != 0 && ( next == 0 || expire < next ) ) {
+            next = expire;
+        }
+    }
+
+    // a subscription expires once its expiration time is over
+    if( next == 0 ||
+        ( table->expireTimerTime != 0 && table->expireTimerTime <= next + 1 ) ) {
+        ithread_mutex_unlock( &table->expireLock );
+        return;
+    }
+
+    if( table->expireTimerTime != 0 &&
+        TimerThreadRemove( &gTimerThread, table->expireTimerId,
+                           &job ) == 0 ) {
+        free( job.arg );
+    }
+    table->expireTimerTime = 0;
+
+    expire_job = ( expire_job_struct * ) malloc( sizeof( expire_job_struct ) );
+    if( expire_job == NULL ) {
+        // lookups skip the expired subscriptions meanwhile
+        ithread_mutex_unlock( &table->expireLock );
+        return;
+    }
+    expire_job->device_handle = device_handle;
+
+    TPJobInit( &job, ( start_routine ) genaExpireThread, expire_job );
+    TPJobSetFreeFunction( &job, ( free_routine ) free );
+    TPJobSetPriority( &job, MED_PRIORITY );
+
+    if( TimerThreadSchedule( &gTimerThread, next + 1, ABS_SEC, &job,
+                             SHORT_TERM, &expire_job->eventId ) != 0 ) {
+        free( expire_job );
+        ithread_mutex_unlock( &table->expireLock );
+        return;
+    }
+    table->expireTimerId = expire_job->eventId;
+    table->expireTimerTime = next + 1;
+
+    ithread_mutex_unlock( &table->expireLock );
+}
+
+/************************************************************************
+* Function : genaExpireThread
+*																	
+* Parameters:														
+*	IN void *input: expire job structure
+*
+* Description:														
+*	Timer job removing the expired subscriptions of a device. A job
+*	which was replaced by a sooner one while waiting for the expiry lock
+*	does nothing.
+*
+* Returns: void
+****************************************************************************/
+static void
+genaExpireThread( IN void *input )
+{
+    expire_job_struct *expire_job = ( expire_job_struct * ) input;
+    struct Handle_Info *handle_info;
+    service_table *table;
+    int current;
+
+    if( AcquireHandleInfo( expire_job->device_handle, &handle_info ) !=
+        HND_DEVICE ) {
+        free( expire_job );
+        return;
+    }
+    table = &handle_info->ServiceTable;
+
+    ithread_mutex_lock( &table->expireLock );
+    current = table->expireTimerTime != 0 &&
+        table->expireTimerId == expire_job->eventId;
+    if( current ) {
+        table->expireTimerTime = 0;
+    }
+    ithread_mutex_unlock( &table->expireLock );
+
+    if( current ) {
+        genaScheduleExpiry( expire_job->device_handle, handle_info );
+    }
+
+    ReleaseHandleInfo( handle_info );
+
+    free( expire_job );
+}
+
 /************************************************************************
 * Function : genaUnregisterDevice
 *																	
@@ -52,7 +175,9 @@
 *	IN dlnaDevice_Handle device_handle: Handle of the root device
 *
 * Description:														
-*	This function cleans the service table of the device. 
+*	This function cleans the service table of the device. It stops
+*	giving references to the handle and waits for the jobs holding one
+*	to finish before freeing the table.
 *
 * Returns: int
 *	returns DLNA_E_SUCCESS if successful else returns GENA_E_BAD_HANDLE
@@ -61,9 +186,11 @@ int
 genaUnregisterDevice( IN dlnaDevice_Handle device_handle )
 {
     struct Handle_Info *handle_info;
+    ThreadPoolJob job;
 
     HandleLock();
-    if( GetHandleInfo( device_handle, &handle_info ) != HND_DEVICE ) {
+    if( GetHandleInfo( device_handle, &handle_info ) != HND_DEVICE ||
+        handle_info->Unregistering ) {
 
         dlnaPrintf( DLNA_CRITICAL, GENA, __FILE__, __LINE__,
             "genaUnregisterDevice : BAD Handle : %d\n",
@@ -72,6 +199,21 @@ genaUnregisterDevice( IN dlnaDevice_Handle device_handle )
         HandleUnlock();
         return GENA_E_BAD_HANDLE;
     }
+    handle_info->Unregistering = 1;
+    HandleUnlock();
+
+    // the handle is only freed by the caller, after this returns
+    WaitHandleInfo( handle_info );
+
+    HandleLock();
+
+    if( handle_info->ServiceTable.expireTimerTime != 0 &&
+        TimerThreadRemove( &gTimerThread,
+                           handle_info->ServiceTable.expireTimerId,
+                           &job ) == 0 ) {
+        free( job.arg );
+    }
+    handle_info->ServiceTable.expireTimerTime = 0;
 
     freeServiceTable( &handle_info->ServiceTable );
     HandleUnlock();
@@ -79,6 +221,29 @@ genaUnregisterDevice( IN dlnaDevice_Handle device_handle )
     return DLNA_E_SUCCESS;
 }
 
+/************************************************************************
+* Function : PropertySetAppend
+*																	
+* Parameters:														
+*	IN char *dest : where to copy the string
+*	IN const char *src : string to copy
+*
+* Description:														
+*	This function copies a string without its null terminator
+*
+* Returns: char *
+*	the end of the copied string in dest
+****************************************************************************/
+static DLNA_INLINE char *
+PropertySetAppend( IN char *dest,
+                   IN const char *src )
+{
+    size_t len = strlen( src );
+
+    memcpy( dest, src, len );
+    return dest + len;
+}
+
 /************************************************************************
 * Function : GeneratePropertySet
 *																	
@@ -89,7 +254,8 @@ genaUnregisterDevice( IN dlnaDevice_Handle device_handle )
 *   OUT DOMString *out: PropertySet node in the string format
 *
 * Description:														
-*	This function to generate XML propery Set for notifications				
+*	This function to generate XML propery Set for notifications. The
+*	property set is written in a single pass into the buffer returned.
 *
 * Returns: int
 *	returns DLNA_E_SUCCESS if successful else returns GENA_E_BAD_HANDLE
@@ -104,16 +270,16 @@ GeneratePropertySet( IN char **names,
                      OUT DOMString * out )
 {
     char *buffer;
+    char *pos;
     int counter = 0;
-    int size = 0;
-    int temp_counter = 0;
+    size_t size = 0;
 
     //size+=strlen(XML_VERSION);  the XML_VERSION is not interopeable with 
     //other vendors
     size += strlen( XML_PROPERTYSET_HEADER );
     size += strlen( "</e:propertyset>\n\n" );
 
-    for( temp_counter = 0, counter = 0; counter < count; counter++ ) {
+    for( counter = 0; counter < count; counter++ ) {
         size += strlen( "<e:property>\n</e:property>\n" );
         size +=
             ( 2 * strlen( names[counter] ) + strlen( values[counter] ) +
@@ -125,24 +291,128 @@ GeneratePropertySet( IN char **names,
     if( buffer == NULL ) {
         return DLNA_E_OUTOF_MEMORY;
     }
-    memset( buffer, 0, size + 1 );
 
-    //strcpy(buffer,XML_VERSION);  the XML_VERSION is not interopeable with 
-    //other vendors
-    strcpy( buffer, XML_PROPERTYSET_HEADER );
+    //the XML_VERSION is not interopeable with other vendors
+    pos = PropertySetAppend( buffer, XML_PROPERTYSET_HEADER );
 
     for( counter = 0; counter < count; counter++ ) {
-        strcat( buffer, "<e:property>\n" );
-        sprintf( &buffer[strlen( buffer )],
-                 "<%s>%s</%s>\n</e:property>\n", names[counter],
-                 values[counter], names[counter] );
-    }
-    strcat( buffer, "</e:propertyset>\n\n" );
-    ( *out ) = ixmlCloneDOMString( buffer );
-    free( buffer );
+        pos = PropertySetAppend( pos, "<e:property>\n<" );
+        pos = PropertySetAppend( pos, names[counter] );
+        pos = PropertySetAppend( pos, ">" );
+        pos = PropertySetAppend( pos, values[counter] );
+        pos = PropertySetAppend( pos, "</" );
+        pos = PropertySetAppend( pos, names[counter] );
+        pos = PropertySetAppend( pos, ">\n</e:property>\n" );
+    }
+    pos = PropertySetAppend( pos, "</e:propertyset>\n\n" );
+    *pos = '\0';
+
+    // buffer is handed over as is; DOMStrings are freed with free()
+    ( *out ) = buffer;
     return XML_SUCCESS;
 }
 
+/************************************************************************
+* Function : genaCreateEvent
+*																	
+* Parameters:														
+*	IN dlnaDevice_Handle device_handle : Device handle
+*	IN char *UDN : Device udn
+*	IN char *servId : Service ID
+*	IN DOMString propertySet : The evented XML, owned by the event
+*	IN char *collapseKey : variable names of a collapsible event, or
+*		NULL; owned by the event
+*
+* Description:														
+*	This function renders the part of a NOTIFY which is the same for
+*	every subscription: CONTENT-TYPE, CONTENT-LENGTH, NT and NTS headers
+*	and the property set. The caller holds the first reference; the
+*	property set and collapse key are freed if the event cannot be
+*	created.
+*
+* Returns: notify_event *
+*	the event, or NULL if out of memory
+****************************************************************************/
+static notify_event *
+genaCreateEvent( IN dlnaDevice_Handle device_handle,
+                 IN char *UDN,
+                 IN char *servId,
+                 IN DOMString propertySet,
+                 IN char *collapseKey )
+{
+    notify_event *event;
+    size_t headers_size;
+
+    event = ( notify_event * ) malloc( sizeof( notify_event ) );
+    if( event == NULL ) {
+        ixmlFreeDOMString( propertySet );
+        free( collapseKey );
+        return NULL;
+    }
+
+    headers_size = strlen( "CONTENT-TYPE: text/xml\r\n" ) +
+        strlen( "CONTENT-LENGTH: \r\n" ) + MAX_CONTENT_LENGTH +
+        strlen( "NT: dlna:event\r\n" ) +
+        strlen( "NTS: dlna:propchange\r\n" ) + 1;
+
+    event->reference_count = 1;
+    event->device_handle = device_handle;
+    event->collapseKey = collapseKey;
+    event->propertySet = propertySet;
+    //changed to add null terminator at end of content
+    //content length = (length in bytes of property set) + null char
+    event->propertySet_length = strlen( propertySet ) + 1;
+    event->servId = strdup( servId );
+    event->UDN = strdup( UDN );
+    event->headers = ( char * )malloc( headers_size );
+
+    if( event->servId == NULL || event->UDN == NULL ||
+        event->headers == NULL ) {
+        free( event->servId );
+        free( event->UDN );
+        free( event->headers );
+        ixmlFreeDOMString( propertySet );
+        free( collapseKey );
+        free( event );
+        return NULL;
+    }
+
+    event->headers_length = snprintf( event->headers, headers_size,
+        "CONTENT-TYPE: text/xml\r\nCONTENT-LENGTH: "
+        "%"PRIzu"\r\nNT: dlna:event\r\nNTS: dlna:propchange\r\n",
+        event->propertySet_length );
+
+    return event;
+}
+
+/************************************************************************
+* Function : genaReleaseEvent
+*																	
+* Parameters:														
+*	IN notify_event *event : Event
+*
+* Description:														
+*	This function drops a reference to an event and frees it with the
+*	last one. Must be called with the lock of the service of the event
+*	held, unless the event was never queued.
+*
+* Returns: VOID
+*	
+****************************************************************************/
+static void
+genaReleaseEvent( IN notify_event * event )
+{
+    event->reference_count--;
+    if( event->reference_count == 0 ) {
+        free( event->headers );
+        ixmlFreeDOMString( event->propertySet );
+        free( event->servId );
+        free( event->UDN );
+        free( event->collapseKey );
+        free( event );
+    }
+}
+
 /************************************************************************
 * Function : free_notify_struct
 *																	
@@ -150,8 +420,8 @@ GeneratePropertySet( IN char **names,
 *	IN notify_thread_struct * input : Notify structure
 *
 * Description:														
-*	This function frees memory used in notify_threads if the reference 
-*	count is 0 otherwise decrements the refrence count
+*	This function frees an event queued on a subscription and releases
+*	its reference to the shared event
 *
 * Returns: VOID
 *	
@@ -159,29 +429,303 @@ GeneratePropertySet( IN char **names,
 static void
 free_notify_struct( IN notify_thread_struct * input )
 {
-    ( *input->reference_count )--;
-    if( ( *input->reference_count ) == 0 ) {
-        free( input->headers );
-        ixmlFreeDOMString( input->propertySet );
-        free( input->servId );
-        free( input->UDN );
-        free( input->reference_count );
-    }
+    genaReleaseEvent( input->event );
+    free( input );
+}
+
+/************************************************************************
+* Function : free_notify_job
+*																	
+* Parameters:														
+*	IN notify_job_struct * input : Notify job structure
+*
+* Description:														
+*	This function frees the context of a notify job
+*
+* Returns: VOID
+*	
+****************************************************************************/
+static void
+free_notify_job( IN notify_job_struct * input )
+{
+    free( input->servId );
+    free( input->UDN );
     free( input );
 }
 
+/****************************************************************************
+*	Function :	genaFlushNotifyQueue
+*
+*	Parameters :
+*		INOUT subscription *sub :	subscription being freed
+*
+*	Description :	This function drops the events still waiting for
+*		delivery to a subscription. Must be called with the lock of the
+*		service held.
+*
+*	Return :	void
+****************************************************************************/
+void
+genaFlushNotifyQueue( INOUT subscription * sub )
+{
+    notify_thread_struct *next;
+
+    while( sub->notifyHead ) {
+        next = sub->notifyHead->next;
+        free_notify_struct( sub->notifyHead );
+        sub->notifyHead = next;
+    }
+    sub->notifyTail = NULL;
+    sub->notifyCount = 0;
+}
+
+/****************************************************************************
+*	Function :	genaSkipEventKey
+*
+*	Parameters :
+*		INOUT subscription *sub :	subscription
+*
+*	Description :	This function moves on to the SEQ number of the next
+*		event, whether the current one was delivered or dropped.
+*
+*	Return :	void
+****************************************************************************/
+static void
+genaSkipEventKey( INOUT subscription * sub )
+{
+    sub->ToSendEventKey++;
+
+    if( sub->ToSendEventKey < 0 )   //wrap to 1 for overflow
+        sub->ToSendEventKey = 1;
+}
+
+/****************************************************************************
+*	Function :	CollapseKeyAppend
+*
+*	Parameters :
+*		INOUT membuffer *key :	collapse key being built
+*		IN const char *name :	name of an evented variable
+*
+*	Description :	This function adds a variable to the collapse key of
+*		an event. LastChange (AVTransport, RenderingControl) and
+*		ContainerUpdateIDs (ContentDirectory) only carry what changed
+*		since the previous event: an event with them can't replace
+*		another one.
+*
+*	Return :	int
+*		0 if the variable was added, -1 if the event can't be collapsed
+****************************************************************************/
+static int
+CollapseKeyAppend( INOUT membuffer * key,
+                   IN const char *name )
+{
+    static const char *deltaVariables[] = {
+        "LastChange",
+        "ContainerUpdateIDs",
+        NULL
+    };
+    int i;
+
+    if( name == NULL ) {
+        return -1;
+    }
+    for( i = 0; deltaVariables[i]; i++ ) {
+        if( strcmp( name, deltaVariables[i] ) == 0 ) {
+            return -1;
+        }
+    }
+
+    if( ( key->length && membuffer_append_str( key, " " ) != 0 ) ||
+        membuffer_append_str( key, name ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+/****************************************************************************
+*	Function :	VarNamesCollapseKey
+*
+*	Parameters :
+*		IN char **VarNames :	names of the evented variables
+*		IN int var_count :	number of variables
+*
+*	Description :	This function builds the collapse key of an event
+*		from its variable names: a newer event with the same key carries
+*		the whole new values of the same variables and can replace it.
+*
+*	Return :	char *
+*		the key, or NULL if the event can't be collapsed
+****************************************************************************/
+static char *
+VarNamesCollapseKey( IN char **VarNames,
+                     IN int var_count )
+{
+    membuffer key;
+    int i;
+
+    membuffer_init( &key );
+    for( i = 0; i < var_count; i++ ) {
+        if( CollapseKeyAppend( &key, VarNames[i] ) != 0 ) {
+            membuffer_destroy( &key );
+            return NULL;
+        }
+    }
+
+    return membuffer_detach( &key );
+}
+
+/****************************************************************************
+*	Function :	PropertySetCollapseKey
+*
+*	Parameters :
+*		IN IXML_Document *PropSet :	XML document Event varible property set
+*
+*	Description :	This function builds the collapse key of an event
+*		from the variables of its property set, as VarNamesCollapseKey.
+*
+*	Return :	char *
+*		the key, or NULL if the event can't be collapsed
+****************************************************************************/
+static char *
+PropertySetCollapseKey( IN IXML_Document * PropSet )
+{
+    IXML_Node *property;
+    IXML_Node *var;
+    membuffer key;
+
+    property = ixmlNode_getFirstChild( ( IXML_Node * ) PropSet );
+    while( property &&
+           ixmlNode_getNodeType( property ) != eELEMENT_NODE ) {
+        property = ixmlNode_getNextSibling( property );
+    }
+    if( property == NULL ) {
+        return NULL;
+    }
+
+    membuffer_init( &key );
+
+    // walk e:property elements of the e:propertyset
+    for( property = ixmlNode_getFirstChild( property ); property;
+         property = ixmlNode_getNextSibling( property ) ) {
+        for( var = ixmlNode_getFirstChild( property ); var;
+             var = ixmlNode_getNextSibling( var ) ) {
+            if( ixmlNode_getNodeType( var ) != eELEMENT_NODE ) {
+                continue;
+            }
+            if( CollapseKeyAppend( &key,
+                                   ixmlNode_getNodeName( var ) ) != 0 ) {
+                membuffer_destroy( &key );
+                return NULL;
+            }
+        }
+    }
+
+    return membuffer_detach( &key );
+}
+
+/****************************************************************************
+*	Function :	notify_conn_close
+*
+*	Parameters :
+*		INOUT subscription* sub :	subscription owning the connection
+*
+*	Description :	This function closes the kept-alive event delivery
+*		connection of a subscription, if any.
+*
+*	Return : void
+****************************************************************************/
+static void
+notify_conn_close( INOUT subscription * sub )
+{
+    if( sub->notifyConn >= 0 ) {
+        shutdown( sub->notifyConn, SD_BOTH );
+        dlnaCloseSocket( sub->notifyConn );
+        sub->notifyConn = -1;
+    }
+}
+
+/****************************************************************************
+*	Function :	notify_conn_reusable
+*
+*	Parameters :
+*		IN http_parser_t* response : The response from the control point.
+*
+*	Description :	This function tells whether the connection a NOTIFY
+*		response was read from can carry the next NOTIFY. It can not when
+*		the control point asked to close, when an HTTP/1.0 control point
+*		did not ask to keep the connection alive, or when the body of the
+*		response was not entirely read (delimited by the close of the
+*		connection, followed by unread data, or too large).
+*
+*	Return : xboolean
+*		TRUE if the connection can be kept alive
+****************************************************************************/
+static xboolean
+notify_conn_reusable( IN http_parser_t * response )
+{
+    http_header_t *hdr;
+    memptr value;
+    xboolean keep_alive = FALSE;
+
+    hdr = httpmsg_find_hdr_str( &response->msg, "CONNECTION" );
+    if( hdr != NULL ) {
+        value.buf = hdr->value.buf;
+        value.length = hdr->value.length;
+        if( raw_find_str( &value, "close" ) >= 0 ) {
+            return FALSE;
+        }
+        keep_alive = ( raw_find_str( &value, "keep-alive" ) >= 0 );
+    }
+
+    if( response->msg.major_version < 1 ||
+        ( response->msg.major_version == 1 &&
+          response->msg.minor_version < 1 && !keep_alive ) ) {
+        return FALSE;
+    }
+
+    switch ( response->ent_position ) {
+        case ENTREAD_UNTIL_CLOSE:
+            return FALSE;
+
+        case ENTREAD_USING_CLEN:
+            // extra data after the body would be read as the next response
+            if( response->content_length >
+                ( unsigned int )g_maxContentLength ||
+                response->msg.msg.length !=
+                response->entity_start_position +
+                response->content_length ) {
+                return FALSE;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return TRUE;
+}
+
 /****************************************************************************
 *	Function :	notify_send_and_recv
 *
 *	Parameters :
-*		IN uri_type* destination_url : subscription callback URL 
-*										(URL of the control point)
-*		IN membuffer* mid_msg :	Common HTTP headers 
-*		IN char* propertySet :	The evented XML 
+*		INOUT subscription* sub :	subscription to be notified; its
+*										kept-alive connection is used and
+*										updated
+*		IN int url_index :	callback URL of the subscription to notify
+*		IN notify_event* event :	Common HTTP headers and evented XML
+*		IN char* sid_seq :	SID and SEQ headers, ending the header part
 *		OUT http_parser_t* response : The response from the control point.
 *
 *	Description :	This function sends the notify message and returns a 
-*					reply.
+*					reply. The message is gathered from the request line,
+*					the shared event and the SID and SEQ headers of the
+*					subscription and written with a single writev. The
+*					connection to the control point is kept open for the
+*					next event unless the control point closes it or stays
+*					idle for GENA_KEEPALIVE_TIME. A kept-alive connection
+*					that fails is replaced by a new one and the NOTIFY is
+*					sent again.
 *
 *	Return : int
 *		on success: returns DLNA_E_SUCCESS; else returns a DLNA error
@@ -189,18 +733,23 @@ free_notify_struct( IN notify_thread_struct * input )
 *	Note : called by genaNotify
 ****************************************************************************/
 static DLNA_INLINE int
-notify_send_and_recv( IN uri_type * destination_url,
-                      IN membuffer * mid_msg,
-                      IN char *propertySet,
+notify_send_and_recv( INOUT subscription * sub,
+                      IN int url_index,
+                      IN notify_event * event,
+                      IN char *sid_seq,
                       OUT http_parser_t * response )
 {
+    uri_type *destination_url = &sub->DeliveryURLs.parsedURLs[url_index];
     uri_type url;
     int conn_fd;
     membuffer start_msg;
+    struct iovec iov[4];
     int ret_code;
     int err_code;
     int timeout;
+    xboolean reused;
     SOCKINFO info;
+    time_t now = time( NULL );
 
     // connect
     dlnaPrintf( DLNA_ALL, GENA, __FILE__, __LINE__,
@@ -208,55 +757,88 @@ notify_send_and_recv( IN uri_type * destination_url,
         (int)destination_url->hostport.text.size,
         destination_url->hostport.text.buff );
 
-    conn_fd = http_Connect( destination_url, &url );
-    if( conn_fd < 0 ) {
-        return conn_fd;         // return DLNA error
-    }
-
-    if( ( ret_code = sock_init( &info, conn_fd ) ) != 0 ) {
-        sock_destroy( &info, SD_BOTH );
-        return ret_code;
-    }
     // make start line and HOST header
     membuffer_init( &start_msg );
     if (http_MakeMessage(
         &start_msg, 1, 1,
-        "q" "s",
-        HTTPMETHOD_NOTIFY, &url,
-        mid_msg->buf ) != 0 ) {
+        "q",
+        HTTPMETHOD_NOTIFY, destination_url ) != 0 ) {
         membuffer_destroy( &start_msg );
-        sock_destroy( &info, SD_BOTH );
         return DLNA_E_OUTOF_MEMORY;
     }
 
-    timeout = HTTP_DEFAULT_TIMEOUT;
-
-    // send msg (note +1 for propertyset; null-terminator is also sent)
-    if( ( ret_code = http_SendMessage( &info, &timeout,
-                                       "bb",
-                                       start_msg.buf, start_msg.length,
-                                       propertySet,
-                                       strlen( propertySet ) + 1 ) ) !=
-        0 ) {
-        membuffer_destroy( &start_msg );
-        sock_destroy( &info, SD_BOTH );
-        return ret_code;
+    // drop a connection made to another URL or left idle too long
+    if( sub->notifyConn >= 0 &&
+        ( sub->notifyConnURL != url_index ||
+          now - sub->notifyConnTime > GENA_KEEPALIVE_TIME ) ) {
+        notify_conn_close( sub );
     }
 
-    if( ( ret_code = http_RecvMessage( &info, response,
-                                       HTTPMETHOD_NOTIFY, &timeout,
-                                       &err_code ) ) != 0 ) {
-        membuffer_destroy( &start_msg );
+    while( TRUE ) {
+        reused = ( sub->notifyConn >= 0 );
+        if( reused ) {
+            conn_fd = sub->notifyConn;
+            sub->notifyConn = -1;
+        } else {
+            conn_fd = http_ConnectTimeout( destination_url, &url,
+                                           GENA_NOTIFY_TIMEOUT );
+            if( conn_fd < 0 ) {
+                membuffer_destroy( &start_msg );
+                return conn_fd; // return DLNA error
+            }
+        }
+
+        if( ( ret_code = sock_init( &info, conn_fd ) ) != 0 ) {
+            sock_destroy( &info, SD_BOTH );
+            membuffer_destroy( &start_msg );
+            return ret_code;
+        }
+
+        timeout = GENA_NOTIFY_TIMEOUT;
+
+        // send msg (the null-terminator of the propertyset is also sent)
+        iov[0].iov_base = start_msg.buf;
+        iov[0].iov_len = start_msg.length;
+        iov[1].iov_base = event->headers;
+        iov[1].iov_len = event->headers_length;
+        iov[2].iov_base = sid_seq;
+        iov[2].iov_len = strlen( sid_seq );
+        iov[3].iov_base = event->propertySet;
+        iov[3].iov_len = event->propertySet_length;
+        ret_code = sock_writev( &info, iov, 4, &timeout );
+        if( ret_code >= 0 ) {
+            ret_code = http_RecvMessage( &info, response,
+                                         HTTPMETHOD_NOTIFY, &timeout,
+                                         &err_code );
+            if( ret_code != 0 ) {
+                httpmsg_destroy( &response->msg );
+            }
+        }
+
+        if( ret_code == 0 ) {
+            break;
+        }
+
         sock_destroy( &info, SD_BOTH );
-        httpmsg_destroy( &response->msg );
-        return ret_code;
+        if( !reused || ret_code == DLNA_E_TIMEDOUT ) {
+            membuffer_destroy( &start_msg );
+            return ret_code;
+        }
+        // the control point closed the kept-alive connection; reconnect
+        dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
+            "gena notify: kept-alive connection failed, reconnecting\n" );
     }
 
-    sock_destroy( &info, SD_BOTH ); //should shutdown completely
-    //when closing socket
-    //  sock_destroy( &info,SD_RECEIVE);
     membuffer_destroy( &start_msg );
 
+    if( notify_conn_reusable( response ) ) {
+        sub->notifyConn = conn_fd;
+        sub->notifyConnURL = url_index;
+        sub->notifyConnTime = now;
+    } else {
+        sock_destroy( &info, SD_BOTH ); //should shutdown completely
+    }
+
     return DLNA_E_SUCCESS;
 }
 
@@ -264,17 +846,18 @@ notify_send_and_recv( IN uri_type * destination_url,
 *	Function :	genaNotify
 *
 *	Parameters :
-*		IN char *headers :	(null terminated) (includes all headers 
-*							(including \r\n) except SID and SEQ)
-*		IN char *propertySet :	The evented XML 
-*		IN subscription* sub :	subscription to be Notified, 
+*		IN notify_event *event :	event to send, shared with the other
+*									subscriptions
+*		INOUT subscription* sub :	subscription to be Notified, 
 *								Assumes this is valid for life of function)
+*								its kept-alive connection is updated
 *
 *	Description :	Function to Notify a particular subscription of a 
 *					particular event. In general the service should NOT be 
 *					blocked around this call. (this may cause deadlock 
 *					with a client) NOTIFY http request is sent and the 
-*					reply is processed.
+*					reply is processed. Only the SID and SEQ headers are
+*					rendered for the subscription.
 *
 *	Return :	int
 *		GENA_SUCCESS  if the event was delivered else returns appropriate 
@@ -282,45 +865,29 @@ notify_send_and_recv( IN uri_type * destination_url,
 *
 *	Note :
 ****************************************************************************/
-int
-genaNotify( IN char *headers,
-            IN char *propertySet,
-            IN subscription * sub )
+static int
+genaNotify( IN notify_event * event,
+            INOUT subscription * sub )
 {
     int i;
-    membuffer mid_msg;
-    membuffer endmsg;
-    uri_type *url;
+    char sid_seq[sizeof( dlna_SID ) + 32];
     http_parser_t response;
     int return_code = -1;
 
-    membuffer_init( &mid_msg );
-
-    // make 'end' msg (the part that won't vary with the destination)
-    endmsg.size_inc = 30;
-    if( http_MakeMessage(
-        &mid_msg, 1, 1,
-        "s" "ssc" "sdcc",
-        headers,
-        "SID: ", sub->sid,
-        "SEQ: ", sub->ToSendEventKey ) != 0 ) {
-        membuffer_destroy( &mid_msg );
-        return DLNA_E_OUTOF_MEMORY;
-    }
+    // make 'end' of the headers (the part that won't vary with the
+    // destination)
+    snprintf( sid_seq, sizeof( sid_seq ), "SID: %s\r\nSEQ: %d\r\n\r\n",
+              sub->sid, sub->ToSendEventKey );
+
     // send a notify to each url until one goes thru
     for( i = 0; i < sub->DeliveryURLs.size; i++ ) {
-        url = &sub->DeliveryURLs.parsedURLs[i];
-
-        if( ( return_code = notify_send_and_recv( url,
-                                                  &mid_msg, propertySet,
+        if( ( return_code = notify_send_and_recv( sub, i, event, sid_seq,
                                                   &response ) ) ==
             DLNA_E_SUCCESS ) {
             break;
         }
     }
 
-    membuffer_destroy( &mid_msg );
-
     if( return_code == DLNA_E_SUCCESS ) {
         if( response.msg.status_code == HTTP_OK ) {
             return_code = GENA_SUCCESS;
@@ -342,12 +909,19 @@ genaNotify( IN char *headers,
 *	Function :	genaNotifyThread
 *
 *	Parameters :
-*			IN void * input : notify thread structure containing all the 
-*								headers and property set info
+*			IN void * input : notify job structure identifying the
+*								subscription
 *
-*	Description :	Thread job to Notify a control point. It validates the
-*		subscription and copies the subscription. Also make sure that 
-*		events are sent in order. 
+*	Description :	Thread job delivering the events queued on a
+*		subscription, in order, until its queue is empty. It validates the
+*		subscription and copies it, so that no lock is held while the
+*		control point is contacted. The reference it holds to the handle
+*		keeps the service table in place meanwhile. A subscription that fails to take an
+*		event is left alone for a growing back-off time, during which its
+*		events are dropped, and is cancelled after
+*		GENA_MAX_NOTIFY_FAILURES consecutive failures. Only one such job
+*		runs per subscription so that a dead control point ties up at most
+*		one thread of the pool.
 *
 *	Return : void
 *
@@ -356,81 +930,319 @@ genaNotify( IN char *headers,
 static void
 genaNotifyThread( IN void *input )
 {
-
     subscription *sub;
     service_info *service;
     subscription sub_copy;
-    notify_thread_struct *in = ( notify_thread_struct * ) input;
+    notify_job_struct *job = ( notify_job_struct * ) input;
+    notify_thread_struct *in;
     int return_code;
+    int backoff;
     struct Handle_Info *handle_info;
-    ThreadPoolJob job;
 
-    HandleReadLock();
-    //validate context
-
-    if( GetHandleInfo( in->device_handle, &handle_info ) != HND_DEVICE ) {
-        free_notify_struct( in );
-        HandleUnlock();
+    if( AcquireHandleInfo( job->device_handle, &handle_info ) !=
+        HND_DEVICE ) {
+        free_notify_job( job );
+        return;
+    }
+    if( ( service = FindServiceId( &handle_info->ServiceTable,
+                                   job->servId, job->UDN ) ) == NULL ) {
+        ReleaseHandleInfo( handle_info );
+        free_notify_job( job );
         return;
     }
 
-    if( ( ( service = FindServiceId( &handle_info->ServiceTable,
-                                     in->servId, in->UDN ) ) == NULL )
-        || ( !service->active )
-        || ( ( sub = GetSubscriptionSID( in->sid, service ) ) == NULL )
-        || ( ( copy_subscription( sub, &sub_copy ) != HTTP_SUCCESS ) ) ) {
+    ithread_mutex_lock( &service->lock );
+
+    while( TRUE ) {
+        //validate context
+        if( ( !service->active )
+            || ( ( sub = GetSubscriptionSID( job->sid, service ) ) ==
+                 NULL ) ) {
+            break;
+        }
+
+        in = sub->notifyHead;
+        if( in == NULL ) {
+            break;
+        }
+        sub->notifyHead = in->next;
+        if( sub->notifyHead == NULL ) {
+            sub->notifyTail = NULL;
+        }
+        sub->notifyCount--;
+        in->next = NULL;
+
+        // drop events while the subscriber backs off, skipping their SEQ
+        // so that the control point can notice
+        if( sub->notifyRetryTime > time( NULL ) ||
+            copy_subscription( sub, &sub_copy ) != HTTP_SUCCESS ) {
+            genaSkipEventKey( sub );
+            free_notify_struct( in );
+            continue;
+        }
+
+        // take the kept-alive connection along
+        sub_copy.notifyConn = sub->notifyConn;
+        sub_copy.notifyConnURL = sub->notifyConnURL;
+        sub_copy.notifyConnTime = sub->notifyConnTime;
+        sub->notifyConn = -1;
+
+        ithread_mutex_unlock( &service->lock );
+
+        //send the notify
+        return_code = genaNotify( in->event, &sub_copy );
+
+        ithread_mutex_lock( &service->lock );
+
         free_notify_struct( in );
-        HandleUnlock();
-        return;
+
+        //validate context
+        if( ( !service->active )
+            || ( ( sub = GetSubscriptionSID( job->sid, service ) ) ==
+                 NULL ) ) {
+            freeSubscription( &sub_copy );
+            break;
+        }
+
+        // hand the connection back for the next event
+        if( sub->notifyConn < 0 ) {
+            sub->notifyConn = sub_copy.notifyConn;
+            sub->notifyConnURL = sub_copy.notifyConnURL;
+            sub->notifyConnTime = sub_copy.notifyConnTime;
+            sub_copy.notifyConn = -1;
+        }
+        freeSubscription( &sub_copy );
+
+        genaSkipEventKey( sub );
+
+        if( return_code == GENA_E_NOTIFY_UNACCEPTED_REMOVE_SUB ) {
+            RemoveSubscriptionSID( job->sid, service );
+            break;
+        }
+
+        if( return_code == GENA_SUCCESS ||
+            return_code == GENA_E_NOTIFY_UNACCEPTED ) {
+            // the control point is there
+            sub->notifyFailures = 0;
+            sub->notifyRetryTime = 0;
+            continue;
+        }
+
+        sub->notifyFailures++;
+        if( sub->notifyFailures >= GENA_MAX_NOTIFY_FAILURES ) {
+            dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
+                "gena notify: %s unreachable, removing subscription\n",
+                job->sid );
+            RemoveSubscriptionSID( job->sid, service );
+            break;
+        }
+
+        backoff = sub->notifyFailures - 1;
+        if( backoff > 4 ) {
+            backoff = 4;
+        }
+        sub->notifyRetryTime = time( NULL ) + ( GENA_BACKOFF_TIME << backoff );
+    }
+
+    // whichever way the loop ended, the next event queued on the
+    // subscription, if it is still there, starts a new job; look it up
+    // even when the service is inactive or the subscription expired
+    sub = NULL;
+    HASH_FIND_STR( service->subscriptionList, job->sid, sub );
+    if( sub != NULL ) {
+        sub->notifyBusy = 0;
+    }
+
+    ithread_mutex_unlock( &service->lock );
+    ReleaseHandleInfo( handle_info );
+
+    free_notify_job( job );
+}
+
+/****************************************************************************
+*	Function :	genaQueueNotify
+*
+*	Parameters :
+*		INOUT subscription *sub :	subscription to notify
+*		IN notify_event *event :	event to deliver
+*
+*	Description :	This function queues an event on a subscription and
+*		makes sure a job is there to deliver it. An event only carrying
+*		LastChange replaces the previous such event still waiting. When
+*		the queue is full its oldest event is dropped and its SEQ number
+*		skipped. The queue takes its own reference to the event. Must be
+*		called with the lock of the service held.
+*
+*	Return :	int
+*		returns GENA_SUCCESS if successful else returns appropriate error
+****************************************************************************/
+static int
+genaQueueNotify( INOUT subscription * sub,
+                 IN notify_event * event )
+{
+    notify_thread_struct *thread_struct;
+    notify_thread_struct *prev;
+    notify_job_struct *job_struct;
+    ThreadPoolJob job;
+    int return_code;
+
+    thread_struct =
+        ( notify_thread_struct * ) malloc( sizeof( notify_thread_struct ) );
+    if( thread_struct == NULL ) {
+        return DLNA_E_OUTOF_MEMORY;
     }
-    //If the event is out of order push it back to the job queue
-    if( in->eventKey != sub->ToSendEventKey ) {
 
-        TPJobInit( &job, ( start_routine ) genaNotifyThread, input );
-        TPJobSetFreeFunction( &job, ( free_function ) free_notify_struct );
+    if( !sub->notifyBusy ) {
+        job_struct =
+            ( notify_job_struct * ) malloc( sizeof( notify_job_struct ) );
+        if( job_struct == NULL ) {
+            free( thread_struct );
+            return DLNA_E_OUTOF_MEMORY;
+        }
+        job_struct->servId = strdup( event->servId );
+        job_struct->UDN = strdup( event->UDN );
+        if( job_struct->servId == NULL || job_struct->UDN == NULL ) {
+            free_notify_job( job_struct );
+            free( thread_struct );
+            return DLNA_E_OUTOF_MEMORY;
+        }
+        strcpy( job_struct->sid, sub->sid );
+        job_struct->device_handle = event->device_handle;
+
+        TPJobInit( &job, ( start_routine ) genaNotifyThread, job_struct );
+        TPJobSetFreeFunction( &job, ( free_routine ) free_notify_job );
         TPJobSetPriority( &job, MED_PRIORITY );
-        ThreadPoolAdd( &gSendThreadPool, &job, NULL );
 
-        freeSubscription( &sub_copy );
-        HandleUnlock();
-        return;
+        if( ( return_code =
+              ThreadPoolAdd( &gSendThreadPool, &job, NULL ) ) != 0 ) {
+            free_notify_job( job_struct );
+            free( thread_struct );
+            if( return_code == EOUTOFMEM ) {
+                return_code = DLNA_E_OUTOF_MEMORY;
+            }
+            return return_code;
+        }
+        sub->notifyBusy = 1;
+    }
+
+    event->reference_count++;
+    thread_struct->event = event;
+    thread_struct->next = NULL;
+
+    if( event->collapseKey && sub->notifyTail &&
+        sub->notifyTail->event->collapseKey &&
+        strcmp( event->collapseKey,
+                sub->notifyTail->event->collapseKey ) == 0 ) {
+        // replace the older values of the same variables still waiting
+        prev = NULL;
+        if( sub->notifyHead != sub->notifyTail ) {
+            for( prev = sub->notifyHead; prev->next != sub->notifyTail;
+                 prev = prev->next ) {
+            }
+        }
+        free_notify_struct( sub->notifyTail );
+        if( prev ) {
+            prev->next = thread_struct;
+        } else {
+            sub->notifyHead = thread_struct;
+        }
+        sub->notifyTail = thread_struct;
+        return GENA_SUCCESS;
     }
 
-    HandleUnlock();
+    if( sub->notifyCount >= GENA_MAX_QUEUED_EVENTS ) {
+        // subscriber too far behind: drop its oldest event
+        prev = sub->notifyHead;
+        sub->notifyHead = prev->next;
+        if( sub->notifyHead == NULL ) {
+            sub->notifyTail = NULL;
+        }
+        sub->notifyCount--;
+        free_notify_struct( prev );
+        genaSkipEventKey( sub );
+    }
 
-    //send the notify
-    return_code = genaNotify( in->headers, in->propertySet, &sub_copy );
+    if( sub->notifyTail ) {
+        sub->notifyTail->next = thread_struct;
+    } else {
+        sub->notifyHead = thread_struct;
+    }
+    sub->notifyTail = thread_struct;
+    sub->notifyCount++;
 
-    freeSubscription( &sub_copy );
+    return GENA_SUCCESS;
+}
 
-    HandleLock();
+/****************************************************************************
+*	Function :	genaInitNotifyEvent
+*
+*	Parameters :
+*		   IN dlnaDevice_Handle device_handle :	Device handle
+*		   IN char *UDN :	Device udn
+*		   IN char *servId :	Service ID
+*		   IN DOMString propertySet :	state table, freed by the function
+*		   IN dlna_SID sid :	subscription ID
+*
+*	Description :	This function queues the intial state table dump of a
+*		newly subscribed control point and makes the subscription active.
+*
+*	Return :	int
+*		returns GENA_E_SUCCESS if successful else returns appropriate error
+****************************************************************************/
+static int
+genaInitNotifyEvent( IN dlnaDevice_Handle device_handle,
+                     IN char *UDN,
+                     IN char *servId,
+                     IN DOMString propertySet,
+                     IN dlna_SID sid )
+{
+    subscription *sub = NULL;
+    service_info *service = NULL;
+    int return_code = GENA_SUCCESS;
+    struct Handle_Info *handle_info;
+    notify_event *event;
 
-    if( GetHandleInfo( in->device_handle, &handle_info ) != HND_DEVICE ) {
-        free_notify_struct( in );
-        HandleUnlock();
-        return;
+    // rendered once, before locking
+    event = genaCreateEvent( device_handle, UDN, servId, propertySet, NULL );
+    if( event == NULL ) {
+        return DLNA_E_OUTOF_MEMORY;
     }
-    //validate context
-    if( ( ( service = FindServiceId( &handle_info->ServiceTable,
-                                     in->servId, in->UDN ) ) == NULL )
-        || ( !service->active )
-        || ( ( sub = GetSubscriptionSID( in->sid, service ) ) == NULL ) ) {
-        free_notify_struct( in );
-        HandleUnlock();
-        return;
+
+    if( AcquireHandleInfo( device_handle, &handle_info ) != HND_DEVICE ) {
+        genaReleaseEvent( event );
+        return GENA_E_BAD_HANDLE;
     }
 
-    sub->ToSendEventKey++;
+    if( ( service = FindServiceId( &handle_info->ServiceTable,
+                                   servId, UDN ) ) == NULL ) {
+        genaReleaseEvent( event );
+        ReleaseHandleInfo( handle_info );
+        return GENA_E_BAD_SERVICE;
+    }
 
-    if( sub->ToSendEventKey < 0 )   //wrap to 1 for overflow
-        sub->ToSendEventKey = 1;
+    ithread_mutex_lock( &service->lock );
+
+    if( ( ( sub = GetSubscriptionSID( sid, service ) ) == NULL ) ||
+        ( sub->active ) ) {
+        return_code = GENA_E_BAD_SID;
+    } else {
+        dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
+            "FOUND SUBSCRIPTION IN INIT NOTIFY: UDN %s, ServID: %s, "
+            "SID %s\n", UDN, servId, sid );
+
+        sub->active = 1;
 
-    if( return_code == GENA_E_NOTIFY_UNACCEPTED_REMOVE_SUB ) {
-        RemoveSubscriptionSID( in->sid, service );
+        // nothing else was queued for the subscription before it got
+        // active, so the state table dump goes out first
+        return_code = genaQueueNotify( sub, event );
     }
 
-    free_notify_struct( in );
-    HandleUnlock();
+    genaReleaseEvent( event );
+
+    ithread_mutex_unlock( &service->lock );
+    ReleaseHandleInfo( handle_info );
+
+    return return_code;
 }
 
 /****************************************************************************
@@ -463,92 +1275,16 @@ genaInitNotify( IN dlnaDevice_Handle device_handle,
                 IN int var_count,
                 IN dlna_SID sid )
 {
-    char *UDN_copy = NULL;
-    char *servId_copy = NULL;
     char *propertySet = NULL;
-    char *headers = NULL;
-    subscription *sub = NULL;
-    service_info *service = NULL;
-    int return_code = GENA_SUCCESS;
-    int headers_size;
-    int *reference_count = NULL;
-    struct Handle_Info *handle_info;
-    ThreadPoolJob job;
-
-    notify_thread_struct *thread_struct = NULL;
+    int return_code;
 
     dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
         "GENA BEGIN INITIAL NOTIFY " );
 
-    reference_count = ( int * )malloc( sizeof( int ) );
-
-    if( reference_count == NULL )
-        return DLNA_E_OUTOF_MEMORY;
-
-    ( *reference_count ) = 0;
-
-    UDN_copy = ( char * )malloc( strlen( UDN ) + 1 );
-
-    if( UDN_copy == NULL ) {
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-    servId_copy = ( char * )malloc( strlen( servId ) + 1 );
-
-    if( servId_copy == NULL ) {
-        free( UDN_copy );
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    strcpy( UDN_copy, UDN );
-    strcpy( servId_copy, servId );
-
-    HandleLock();
-
-    if( GetHandleInfo( device_handle, &handle_info ) != HND_DEVICE ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
-        return GENA_E_BAD_HANDLE;
-    }
-
-    if( ( service = FindServiceId( &handle_info->ServiceTable,
-                                   servId, UDN ) ) == NULL ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
-        return GENA_E_BAD_SERVICE;
-    }
-
-    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
-        "FOUND SERVICE IN INIT NOTFY: UDN %s, ServID: %s ",
-        UDN, servId );
-
-    if( ( ( sub = GetSubscriptionSID( sid, service ) ) == NULL ) ||
-        ( sub->active ) ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
-        return GENA_E_BAD_SID;
-    }
-
-    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
-        "FOUND SUBSCRIPTION IN INIT NOTIFY: SID %s ", sid );
-
-    sub->active = 1;
-
     if( ( return_code = GeneratePropertySet( VarNames, VarValues,
                                              var_count,
                                              &propertySet ) ) !=
         XML_SUCCESS ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
         return return_code;
     }
 
@@ -556,73 +1292,8 @@ genaInitNotify( IN dlnaDevice_Handle device_handle,
         "GENERATED PROPERY SET IN INIT NOTIFY: \n'%s'\n",
         propertySet );
 
-    headers_size = strlen( "CONTENT-TYPE text/xml\r\n" ) +
-        strlen( "CONTENT-LENGTH: \r\n" ) + MAX_CONTENT_LENGTH +
-        strlen( "NT: dlna:event\r\n" ) +
-        strlen( "NTS: dlna:propchange\r\n" ) + 1;
-
-    headers = ( char * )malloc( headers_size );
-
-    if( headers == NULL ) {
-        ixmlFreeDOMString( propertySet );
-        free( UDN_copy );
-        free( servId_copy );
-        free( reference_count );
-        HandleUnlock();
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    sprintf( headers, "CONTENT-TYPE: text/xml\r\nCONTENT-LENGTH: "
-             "%"PRIzu"\r\nNT: dlna:event\r\nNTS: dlna:propchange\r\n",
-             strlen( propertySet ) + 1 );
-
-    //schedule thread for initial notification
-
-    thread_struct =
-        ( notify_thread_struct * )
-        malloc( sizeof( notify_thread_struct ) );
-
-    if( thread_struct == NULL ) {
-        return_code = DLNA_E_OUTOF_MEMORY;
-    } else {
-        ( *reference_count ) = 1;
-        thread_struct->servId = servId_copy;
-        thread_struct->UDN = UDN_copy;
-        thread_struct->headers = headers;
-        thread_struct->propertySet = propertySet;
-        strcpy( thread_struct->sid, sid );
-        thread_struct->eventKey = sub->eventKey++;
-        thread_struct->reference_count = reference_count;
-        thread_struct->device_handle = device_handle;
-
-        TPJobInit( &job, ( start_routine ) genaNotifyThread,
-                   thread_struct );
-        TPJobSetFreeFunction( &job, ( free_routine ) free_notify_struct );
-        TPJobSetPriority( &job, MED_PRIORITY );
-
-        if( ( return_code =
-              ThreadPoolAdd( &gSendThreadPool, &job, NULL ) ) != 0 ) {
-            if( return_code == EOUTOFMEM ) {
-                return_code = DLNA_E_OUTOF_MEMORY;
-            }
-        } else {
-            return_code = GENA_SUCCESS;
-        }
-    }
-
-    if( return_code != GENA_SUCCESS ) {
-
-        free( reference_count );
-        free( UDN_copy );
-        free( servId_copy );
-        free( thread_struct );
-        ixmlFreeDOMString( propertySet );
-        free( headers );
-    }
-
-    HandleUnlock();
-
-    return return_code;
+    return genaInitNotifyEvent( device_handle, UDN, servId, propertySet,
+                                sid );
 }
 
 /****************************************************************************
@@ -652,88 +1323,13 @@ genaInitNotifyExt( IN dlnaDevice_Handle device_handle,
                    IN IXML_Document * PropSet,
                    IN dlna_SID sid )
 {
-    char *UDN_copy = NULL;
-    char *servId_copy = NULL;
-    char *headers = NULL;
-    subscription *sub = NULL;
-    service_info *service = NULL;
-    int return_code = GENA_SUCCESS;
-    int headers_size;
-    int *reference_count = NULL;
-    struct Handle_Info *handle_info;
-    DOMString propertySet = NULL;
-
-    ThreadPoolJob job;
-
-    notify_thread_struct *thread_struct = NULL;
-
-    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
-        "GENA BEGIN INITIAL NOTIFY EXT" );
-    reference_count = ( int * )malloc( sizeof( int ) );
-
-    if( reference_count == NULL ) {
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    ( *reference_count ) = 0;
-
-    UDN_copy = ( char * )malloc( strlen( UDN ) + 1 );
-    if( UDN_copy == NULL ) {
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    servId_copy = ( char * )malloc( strlen( servId ) + 1 );
-    if( servId_copy == NULL ) {
-        free( UDN_copy );
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    strcpy( UDN_copy, UDN );
-    strcpy( servId_copy, servId );
-
-    HandleLock();
-
-    if( GetHandleInfo( device_handle, &handle_info ) != HND_DEVICE ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
-        return GENA_E_BAD_HANDLE;
-    }
-
-    if( ( service = FindServiceId( &handle_info->ServiceTable,
-                                   servId, UDN ) ) == NULL ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
-        return GENA_E_BAD_SERVICE;
-    }
-    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
-        "FOUND SERVICE IN INIT NOTFY EXT: UDN %s, ServID: %s\n",
-        UDN, servId );
-
-    if( ( ( sub = GetSubscriptionSID( sid, service ) ) == NULL ) ||
-        ( sub->active ) ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
-        return GENA_E_BAD_SID;
-    }
-    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
-        "FOUND SUBSCRIPTION IN INIT NOTIFY EXT: SID %s", sid );
+    DOMString propertySet = NULL;
 
-    sub->active = 1;
+    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
+        "GENA BEGIN INITIAL NOTIFY EXT" );
 
     propertySet = ixmlPrintNode( ( IXML_Node * ) PropSet );
     if( propertySet == NULL ) {
-        free( UDN_copy );
-        free( reference_count );
-        free( servId_copy );
-        HandleUnlock();
         return DLNA_E_INVALID_PARAM;
     }
 
@@ -741,68 +1337,75 @@ genaInitNotifyExt( IN dlnaDevice_Handle device_handle,
         "GENERATED PROPERY SET IN INIT EXT NOTIFY: %s",
         propertySet );
 
-    headers_size = strlen( "CONTENT-TYPE text/xml\r\n" ) +
-        strlen( "CONTENT-LENGTH: \r\n" ) + MAX_CONTENT_LENGTH +
-        strlen( "NT: dlna:event\r\n" ) +
-        strlen( "NTS: dlna:propchange\r\n" ) + 1;
+    return genaInitNotifyEvent( device_handle, UDN, servId, propertySet,
+                                sid );
+}
 
-    headers = ( char * )malloc( headers_size );
-    if( headers == NULL ) {
-        free( UDN_copy );
-        free( servId_copy );
-        free( reference_count );
-        ixmlFreeDOMString( propertySet );
-        HandleUnlock();
+/****************************************************************************
+*	Function :	genaNotifyAllEvent
+*
+*	Parameters :
+*			IN dlnaDevice_Handle device_handle : Device handle
+*			IN char *UDN :	Device udn
+*			IN char *servId :	Service ID
+*			IN DOMString propertySet :	evented XML, freed by the function
+*			IN char *collapseKey :	variable names of a collapsible event,
+*									or NULL; freed by the function
+*
+*	Description : 	This function renders an event once and queues it on
+*	all the subscribed control points
+*
+*	Return :	int
+*		returns GENA_E_SUCCESS if successful else returns appropriate error
+****************************************************************************/
+static int
+genaNotifyAllEvent( IN dlnaDevice_Handle device_handle,
+                    IN char *UDN,
+                    IN char *servId,
+                    IN DOMString propertySet,
+                    IN char *collapseKey )
+{
+    int return_code = GENA_SUCCESS;
+    struct Handle_Info *handle_info;
+    subscription *finger = NULL;
+    service_info *service = NULL;
+    notify_event *event;
+
+    event = genaCreateEvent( device_handle, UDN, servId, propertySet,
+                             collapseKey );
+    if( event == NULL ) {
         return DLNA_E_OUTOF_MEMORY;
     }
 
-    sprintf( headers, "CONTENT-TYPE: text/xml\r\nCONTENT-LENGTH: "
-             "%ld\r\nNT: dlna:event\r\nNTS: dlna:propchange\r\n",
-             (long) strlen( propertySet ) + 1 );
-
-    //schedule thread for initial notification
+    if( AcquireHandleInfo( device_handle, &handle_info ) != HND_DEVICE ) {
+        genaReleaseEvent( event );
+        return GENA_E_BAD_HANDLE;
+    }
 
-    thread_struct =
-        ( notify_thread_struct * )
-        malloc( sizeof( notify_thread_struct ) );
+    if( ( service = FindServiceId( &handle_info->ServiceTable,
+                                   servId, UDN ) ) == NULL ) {
+        genaReleaseEvent( event );
+        ReleaseHandleInfo( handle_info );
+        return GENA_E_BAD_SERVICE;
+    }
 
-    if( thread_struct == NULL ) {
-        return_code = DLNA_E_OUTOF_MEMORY;
-    } else {
-        ( *reference_count ) = 1;
-        thread_struct->servId = servId_copy;
-        thread_struct->UDN = UDN_copy;
-        thread_struct->headers = headers;
-        thread_struct->propertySet = propertySet;
-        strcpy( thread_struct->sid, sid );
-        thread_struct->eventKey = sub->eventKey++;
-        thread_struct->reference_count = reference_count;
-        thread_struct->device_handle = device_handle;
-
-        TPJobInit( &job, ( start_routine ) genaNotifyThread,
-                   thread_struct );
-        TPJobSetFreeFunction( &job, ( free_routine ) free_notify_struct );
-        TPJobSetPriority( &job, MED_PRIORITY );
+    ithread_mutex_lock( &service->lock );
 
-        if( ( return_code =
-              ThreadPoolAdd( &gSendThreadPool, &job, NULL ) ) != 0 ) {
-            if( return_code == EOUTOFMEM ) {
-                return_code = DLNA_E_OUTOF_MEMORY;
-            }
-        } else {
-            return_code = GENA_SUCCESS;
+    finger = GetFirstSubscription( service );
+    while( finger ) {
+        if( ( return_code = genaQueueNotify( finger, event ) ) !=
+            GENA_SUCCESS ) {
+            break;
         }
-    }
 
-    if( return_code != GENA_SUCCESS ) {
-        ixmlFreeDOMString( propertySet );
-        free( reference_count );
-        free( UDN_copy );
-        free( servId_copy );
-        free( thread_struct );
-        free( headers );
+        finger = GetNextSubscription( service, finger );
     }
-    HandleUnlock();
+
+    // the queues hold their own references
+    genaReleaseEvent( event );
+
+    ithread_mutex_unlock( &service->lock );
+    ReleaseHandleInfo( handle_info );
 
     return return_code;
 }
@@ -830,136 +1433,15 @@ genaNotifyAllExt( IN dlnaDevice_Handle device_handle,
                   IN char *servId,
                   IN IXML_Document * PropSet )
 {
-    char *headers = NULL;
-    int headers_size;
-    int return_code = GENA_SUCCESS;
-    char *UDN_copy = NULL;
-    char *servId_copy = NULL;
-    int *reference_count = NULL;
-    struct Handle_Info *handle_info;
     DOMString propertySet = NULL;
-    ThreadPoolJob job;
-    subscription *finger = NULL;
-
-    notify_thread_struct *thread_struct = NULL;
-
-    service_info *service = NULL;
-
-    reference_count = ( int * )malloc( sizeof( int ) );
-
-    if( reference_count == NULL )
-        return DLNA_E_OUTOF_MEMORY;
-
-    ( *reference_count = 0 );
-
-    UDN_copy = ( char * )malloc( strlen( UDN ) + 1 );
-
-    if( UDN_copy == NULL ) {
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    servId_copy = ( char * )malloc( strlen( servId ) + 1 );
-
-    if( servId_copy == NULL ) {
-        free( UDN_copy );
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    strcpy( UDN_copy, UDN );
-    strcpy( servId_copy, servId );
 
     propertySet = ixmlPrintNode( ( IXML_Node * ) PropSet );
     if( propertySet == NULL ) {
-        free( UDN_copy );
-        free( servId_copy );
-        free( reference_count );
         return DLNA_E_INVALID_PARAM;
     }
 
-    headers_size = strlen( "CONTENT-TYPE text/xml\r\n" ) +
-        strlen( "CONTENT-LENGTH: \r\n" ) + MAX_CONTENT_LENGTH +
-        strlen( "NT: dlna:event\r\n" ) +
-        strlen( "NTS: dlna:propchange\r\n" ) + 1;
-
-    headers = ( char * )malloc( headers_size );
-    if( headers == NULL ) {
-        free( UDN_copy );
-        free( servId_copy );
-        ixmlFreeDOMString( propertySet );
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-    //changed to add null terminator at end of content
-    //content length = (length in bytes of property set) + null char
-    sprintf( headers, "CONTENT-TYPE: text/xml\r\nCONTENT-LENGTH: "
-             "%ld\r\nNT: dlna:event\r\nNTS: dlna:propchange\r\n",
-             (long) strlen( propertySet ) + 1 );
-
-    HandleLock();
-
-    if( GetHandleInfo( device_handle, &handle_info ) != HND_DEVICE )
-        return_code = GENA_E_BAD_HANDLE;
-    else {
-        if( ( service = FindServiceId( &handle_info->ServiceTable,
-                                       servId, UDN ) ) != NULL ) {
-            finger = GetFirstSubscription( service );
-
-            while( finger ) {
-                thread_struct =
-                    ( notify_thread_struct * )
-                    malloc( sizeof( notify_thread_struct ) );
-                if( thread_struct == NULL ) {
-                    break;
-                    return_code = DLNA_E_OUTOF_MEMORY;
-                }
-
-                ( *reference_count )++;
-                thread_struct->reference_count = reference_count;
-                thread_struct->UDN = UDN_copy;
-                thread_struct->servId = servId_copy;
-                thread_struct->headers = headers;
-                thread_struct->propertySet = propertySet;
-                strcpy( thread_struct->sid, finger->sid );
-                thread_struct->eventKey = finger->eventKey++;
-                thread_struct->device_handle = device_handle;
-                //if overflow, wrap to 1
-                if( finger->eventKey < 0 ) {
-                    finger->eventKey = 1;
-                }
-
-                TPJobInit( &job, ( start_routine ) genaNotifyThread,
-                           thread_struct );
-                TPJobSetFreeFunction( &job,
-                                      ( free_routine )
-                                      free_notify_struct );
-                TPJobSetPriority( &job, MED_PRIORITY );
-                if( ( return_code = ThreadPoolAdd( &gSendThreadPool,
-                                                   &job, NULL ) ) != 0 ) {
-                    if( return_code == EOUTOFMEM ) {
-                        return_code = DLNA_E_OUTOF_MEMORY;
-                    }
-                    break;
-                }
-
-                finger = GetNextSubscription( service, finger );
-            }
-        } else
-            return_code = GENA_E_BAD_SERVICE;
-    }
-
-    if( ( *reference_count ) == 0 ) {
-        free( reference_count );
-        free( headers );
-        ixmlFreeDOMString( propertySet );
-        free( UDN_copy );
-        free( servId_copy );
-    }
-
-    HandleUnlock();
-
-    return return_code;
+    return genaNotifyAllEvent( device_handle, UDN, servId, propertySet,
+                               PropertySetCollapseKey( PropSet ) );
 }
 
 /****************************************************************************
@@ -989,150 +1471,31 @@ genaNotifyAll( IN dlnaDevice_Handle device_handle,
                IN char **VarValues,
                IN int var_count )
 {
-    char *headers = NULL;
     char *propertySet = NULL;
-    int headers_size;
-    int return_code = GENA_SUCCESS;
-    char *UDN_copy = NULL;
-    char *servId_copy = NULL;
-    int *reference_count = NULL;
-    struct Handle_Info *handle_info;
-    ThreadPoolJob job;
-
-    subscription *finger = NULL;
-
-    notify_thread_struct *thread_struct = NULL;
-
-    service_info *service = NULL;
-
-    reference_count = ( int * )malloc( sizeof( int ) );
-
-    if( reference_count == NULL ) {
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    ( *reference_count = 0 );
-
-    UDN_copy = ( char * )malloc( strlen( UDN ) + 1 );
-
-    if( UDN_copy == NULL ) {
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    servId_copy = ( char * )malloc( strlen( servId ) + 1 );
-    if( servId_copy == NULL ) {
-        free( UDN_copy );
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    strcpy( UDN_copy, UDN );
-    strcpy( servId_copy, servId );
+    int return_code;
 
     if( ( return_code = GeneratePropertySet( VarNames, VarValues,
                                              var_count,
                                              &propertySet ) ) !=
         XML_SUCCESS ) {
-        free( UDN_copy );
-        free( servId_copy );
-        free( reference_count );
         return return_code;
     }
 
-    headers_size = strlen( "CONTENT-TYPE text/xml\r\n" ) +
-        strlen( "CONTENT-LENGTH: \r\n" ) + MAX_CONTENT_LENGTH +
-        strlen( "NT: dlna:event\r\n" ) +
-        strlen( "NTS: dlna:propchange\r\n" ) + 1;
-
-    headers = ( char * )malloc( headers_size );
-    if( headers == NULL ) {
-        free( UDN_copy );
-        free( servId_copy );
-        ixmlFreeDOMString( propertySet );
-        free( reference_count );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-    //changed to add null terminator at end of content
-    //content length = (length in bytes of property set) + null char
-    sprintf( headers, "CONTENT-TYPE: text/xml\r\nCONTENT-LENGTH: %ld\r\nNT:"
-             " dlna:event\r\nNTS: dlna:propchange\r\n",
-             (long) strlen( propertySet ) + 1 );
-
-    HandleLock();
-
-    if( GetHandleInfo( device_handle, &handle_info ) != HND_DEVICE ) {
-        return_code = GENA_E_BAD_HANDLE;
-    } else {
-        if( ( service = FindServiceId( &handle_info->ServiceTable,
-                                       servId, UDN ) ) != NULL ) {
-            finger = GetFirstSubscription( service );
-
-            while( finger ) {
-                thread_struct =
-                    ( notify_thread_struct * )
-                    malloc( sizeof( notify_thread_struct ) );
-                if( thread_struct == NULL ) {
-                    return_code = DLNA_E_OUTOF_MEMORY;
-                    break;
-                }
-                ( *reference_count )++;
-                thread_struct->reference_count = reference_count;
-                thread_struct->UDN = UDN_copy;
-                thread_struct->servId = servId_copy;
-                thread_struct->headers = headers;
-                thread_struct->propertySet = propertySet;
-                strcpy( thread_struct->sid, finger->sid );
-                thread_struct->eventKey = finger->eventKey++;
-                thread_struct->device_handle = device_handle;
-                //if overflow, wrap to 1
-                if( finger->eventKey < 0 ) {
-                    finger->eventKey = 1;
-                }
-
-                TPJobInit( &job, ( start_routine ) genaNotifyThread,
-                           thread_struct );
-                TPJobSetFreeFunction( &job,
-                                      ( free_routine )
-                                      free_notify_struct );
-                TPJobSetPriority( &job, MED_PRIORITY );
-
-                if( ( return_code =
-                      ThreadPoolAdd( &gSendThreadPool, &job, NULL ) )
-                    != 0 ) {
-                    if( return_code == EOUTOFMEM ) {
-                        return_code = DLNA_E_OUTOF_MEMORY;
-                        break;
-                    }
-                }
-
-                finger = GetNextSubscription( service, finger );
-
-            }
-        } else {
-            return_code = GENA_E_BAD_SERVICE;
-        }
-    }
-
-    if( ( *reference_count ) == 0 ) {
-        free( reference_count );
-        free( headers );
-        ixmlFreeDOMString( propertySet );
-        free( UDN_copy );
-        free( servId_copy );
-    }
-    HandleUnlock();
-
-    return return_code;
+    return genaNotifyAllEvent( device_handle, UDN, servId, propertySet,
+                               VarNamesCollapseKey( VarNames,
+                                                    var_count ) );
 }
 
+// headers of the subscription responses
+static http_header_template gSubscribeHeaders;
+
 /****************************************************************************
 *	Function :	respond_ok
 *
 *	Parameters :
 *			IN SOCKINFO *info :	socket connection of request
 *			IN int time_out : accepted duration
-*			IN subscription *sub : accepted subscription
+*			IN const char *sid : SID of the accepted subscription
 *			IN http_message_t* request : http request
 *
 *	Description : Function to return OK message in the case 
@@ -1145,7 +1508,7 @@ genaNotifyAll( IN dlnaDevice_Handle device_handle,
 static int
 respond_ok( IN SOCKINFO * info,
             IN int time_out,
-            IN subscription * sub,
+            IN const char *sid,
             IN http_message_t * request )
 {
     int major,
@@ -1166,13 +1529,16 @@ respond_ok( IN SOCKINFO * info,
 
     membuffer_init( &response );
     response.size_inc = 30;
-    if( http_MakeMessage(
-        &response, major, minor,
-        "R" "D" "S" "N" "Xc" "ssc" "scc",
+    if( http_MakeTemplateMessage(
+        &response, &gSubscribeHeaders, major, minor,
+        "R" "D" "S" "N" "Xc",
         HTTP_OK,
         (off_t)0,
-        X_USER_AGENT,
-        "SID: ", sub->sid,
+        X_USER_AGENT ) != 0 ||
+        http_MakeMessage(
+        &response, major, minor,
+        "ssc" "scc",
+        "SID: ", sid,
         timeout_str ) != 0 ) {
         membuffer_destroy( &response );
         error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
@@ -1349,13 +1715,11 @@ gena_process_subscription_request( IN SOCKINFO * info,
         "SubscriptionRequest for event URL path: %s\n",
         event_url_path );
 
-    HandleLock();
-
     // CURRENTLY, ONLY ONE DEVICE
-    if( GetDeviceHandleInfo( &device_handle, &handle_info ) != HND_DEVICE ) {
+    if( AcquireDeviceHandleInfo( &device_handle, &handle_info ) !=
+        HND_DEVICE ) {
         free( event_url_path );
         error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
-        HandleUnlock();
         return;
     }
     service = FindServiceEventURLPath( &handle_info->ServiceTable,
@@ -1363,35 +1727,29 @@ gena_process_subscription_request( IN SOCKINFO * info,
     free( event_url_path );
 
     if( service == NULL || !service->active ) {
+        ReleaseHandleInfo( handle_info );
         error_respond( info, HTTP_NOT_FOUND, request );
-        HandleUnlock();
-        return;
-    }
-
-    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
-        "Subscription Request: Number of Subscriptions already %d\n "
-        "Max Subscriptions allowed: %d\n",
-        service->TotalSubscriptions,
-        handle_info->MaxSubscriptions );
-
-    // too many subscriptions
-    if( handle_info->MaxSubscriptions != -1 &&
-        service->TotalSubscriptions >= handle_info->MaxSubscriptions ) {
-        error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
-        HandleUnlock();
         return;
     }
     // generate new subscription
     sub = ( subscription * ) malloc( sizeof( subscription ) );
     if( sub == NULL ) {
+        ReleaseHandleInfo( handle_info );
         error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
-        HandleUnlock();
         return;
     }
-    sub->eventKey = 0;
     sub->ToSendEventKey = 0;
     sub->active = 0;
-    sub->next = NULL;
+    sub->expireIndex = -1;
+    sub->notifyConn = -1;
+    sub->notifyConnURL = 0;
+    sub->notifyConnTime = 0;
+    sub->notifyHead = NULL;
+    sub->notifyTail = NULL;
+    sub->notifyCount = 0;
+    sub->notifyBusy = 0;
+    sub->notifyFailures = 0;
+    sub->notifyRetryTime = 0;
     sub->DeliveryURLs.size = 0;
     sub->DeliveryURLs.URLs = NULL;
     sub->DeliveryURLs.parsedURLs = NULL;
@@ -1400,15 +1758,17 @@ gena_process_subscription_request( IN SOCKINFO * info,
     if( httpmsg_find_hdr( request, HDR_CALLBACK, &callback_hdr ) == NULL ||
         ( return_code = create_url_list( &callback_hdr,
                                          &sub->DeliveryURLs ) ) == 0 ) {
+        freeSubscription( sub );
+        free( sub );
+        ReleaseHandleInfo( handle_info );
         error_respond( info, HTTP_PRECONDITION_FAILED, request );
-        freeSubscriptionList( sub );
-        HandleUnlock();
         return;
     }
     if( return_code == DLNA_E_OUTOF_MEMORY ) {
+        freeSubscription( sub );
+        free( sub );
+        ReleaseHandleInfo( handle_info );
         error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
-        freeSubscriptionList( sub );
-        HandleUnlock();
         return;
     }
     // set the timeout
@@ -1440,28 +1800,59 @@ gena_process_subscription_request( IN SOCKINFO * info,
     uuid_create( &uid );
     uuid_unpack( &uid, temp_sid );
     sprintf( sub->sid, "uuid:%s", temp_sid );
+    strcpy( ( char * )request_struct.Sid, sub->sid );
 
-    // respond OK
-    if( respond_ok( info, time_out, sub, request ) != DLNA_E_SUCCESS ) {
-        freeSubscriptionList( sub );
-        HandleUnlock();
+    ithread_mutex_lock( &service->lock );
+
+    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
+        "Subscription Request: Number of Subscriptions already %d\n "
+        "Max Subscriptions allowed: %d\n",
+        service->TotalSubscriptions,
+        handle_info->MaxSubscriptions );
+
+    // too many subscriptions
+    if( handle_info->MaxSubscriptions != -1 &&
+        service->TotalSubscriptions >= handle_info->MaxSubscriptions ) {
+        ithread_mutex_unlock( &service->lock );
+        freeSubscription( sub );
+        free( sub );
+        ReleaseHandleInfo( handle_info );
+        error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
+        return;
+    }
+    // add to subscription list before responding, no event is sent to
+    // it until the device accepts it
+    if( AddSubscription( service, sub ) != HTTP_SUCCESS ) {
+        ithread_mutex_unlock( &service->lock );
+        freeSubscription( sub );
+        free( sub );
+        ReleaseHandleInfo( handle_info );
+        error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
         return;
     }
-    //add to subscription list
-    sub->next = service->subscriptionList;
-    service->subscriptionList = sub;
-    service->TotalSubscriptions++;
+
+    ithread_mutex_unlock( &service->lock );
+
+    // respond OK, without any lock held
+    if( respond_ok( info, time_out, request_struct.Sid, request ) !=
+        DLNA_E_SUCCESS ) {
+        ithread_mutex_lock( &service->lock );
+        RemoveSubscriptionSID( request_struct.Sid, service );
+        ithread_mutex_unlock( &service->lock );
+        ReleaseHandleInfo( handle_info );
+        return;
+    }
+    genaScheduleExpiry( device_handle, handle_info );
 
     //finally generate callback for init table dump
     request_struct.ServiceId = service->serviceId;
     request_struct.UDN = service->UDN;
-    strcpy( ( char * )request_struct.Sid, sub->sid );
 
     //copy callback
     callback_fun = handle_info->Callback;
     cookie = handle_info->Cookie;
 
-    HandleUnlock();
+    ReleaseHandleInfo( handle_info );
 
     //make call back with request struct
     //in the future should find a way of mainting
@@ -1524,38 +1915,20 @@ gena_process_subscription_renewal_request( IN SOCKINFO * info,
         return;
     }
 
-    HandleLock();
-
     // CURRENTLY, ONLY SUPPORT ONE DEVICE
-    if( GetDeviceHandleInfo( &device_handle, &handle_info ) != HND_DEVICE ) {
-        error_respond( info, HTTP_PRECONDITION_FAILED, request );
+    if( AcquireDeviceHandleInfo( &device_handle, &handle_info ) !=
+        HND_DEVICE ) {
         membuffer_destroy( &event_url_path );
+        error_respond( info, HTTP_PRECONDITION_FAILED, request );
         return;
     }
     service = FindServiceEventURLPath( &handle_info->ServiceTable,
                                        event_url_path.buf );
     membuffer_destroy( &event_url_path );
 
-    // get subscription
-    if( service == NULL ||
-        !service->active ||
-        ( ( sub = GetSubscriptionSID( sid, service ) ) == NULL ) ) {
+    if( service == NULL || !service->active ) {
+        ReleaseHandleInfo( handle_info );
         error_respond( info, HTTP_PRECONDITION_FAILED, request );
-        HandleUnlock();
-        return;
-    }
-
-    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
-        "Renew request: Number of subscriptions already: %d\n "
-        "Max Subscriptions allowed:%d\n",
-        service->TotalSubscriptions,
-        handle_info->MaxSubscriptions );
-    // too many subscriptions
-    if( handle_info->MaxSubscriptions != -1 &&
-            service->TotalSubscriptions > handle_info->MaxSubscriptions ) {
-        error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
-        RemoveSubscriptionSID( sub->sid, service );
-        HandleUnlock();
         return;
     }
     // set the timeout
@@ -1584,17 +1957,50 @@ gena_process_subscription_renewal_request( IN SOCKINFO * info,
         }
     }
 
-    if( time_out == -1 ) {
-        sub->expireTime = 0;
-    } else {
-        sub->expireTime = time( NULL ) + time_out;
+    ithread_mutex_lock( &service->lock );
+
+    // get subscription
+    if( ( sub = GetSubscriptionSID( sid, service ) ) == NULL ) {
+        ithread_mutex_unlock( &service->lock );
+        ReleaseHandleInfo( handle_info );
+        error_respond( info, HTTP_PRECONDITION_FAILED, request );
+        return;
     }
 
-    if( respond_ok( info, time_out, sub, request ) != DLNA_E_SUCCESS ) {
-        RemoveSubscriptionSID( sub->sid, service );
+    dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
+        "Renew request: Number of subscriptions already: %d\n "
+        "Max Subscriptions allowed:%d\n",
+        service->TotalSubscriptions,
+        handle_info->MaxSubscriptions );
+    // too many subscriptions
+    if( handle_info->MaxSubscriptions != -1 &&
+            service->TotalSubscriptions > handle_info->MaxSubscriptions ) {
+        RemoveSubscriptionSID( sid, service );
+        ithread_mutex_unlock( &service->lock );
+        ReleaseHandleInfo( handle_info );
+        error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
+        return;
     }
 
-    HandleUnlock();
+    if( SetSubscriptionExpiry( service, sub, time_out == -1 ? 0 :
+                               time( NULL ) + time_out ) != HTTP_SUCCESS ) {
+        ithread_mutex_unlock( &service->lock );
+        ReleaseHandleInfo( handle_info );
+        error_respond( info, HTTP_INTERNAL_SERVER_ERROR, request );
+        return;
+    }
+
+    ithread_mutex_unlock( &service->lock );
+
+    if( respond_ok( info, time_out, sid, request ) != DLNA_E_SUCCESS ) {
+        ithread_mutex_lock( &service->lock );
+        RemoveSubscriptionSID( sid, service );
+        ithread_mutex_unlock( &service->lock );
+    } else {
+        genaScheduleExpiry( device_handle, handle_info );
+    }
+
+    ReleaseHandleInfo( handle_info );
 }
 
 /****************************************************************************
@@ -1620,6 +2026,7 @@ gena_process_unsubscribe_request( IN SOCKINFO * info,
     service_info *service;
     struct Handle_Info *handle_info;
     dlnaDevice_Handle device_handle;
+    int found;
 
     memptr temp_hdr;
     membuffer event_url_path;
@@ -1647,13 +2054,11 @@ gena_process_unsubscribe_request( IN SOCKINFO * info,
         return;
     }
 
-    HandleLock();
-
     // CURRENTLY, ONLY SUPPORT ONE DEVICE
-    if( GetDeviceHandleInfo( &device_handle, &handle_info ) != HND_DEVICE ) {
-        error_respond( info, HTTP_PRECONDITION_FAILED, request );
+    if( AcquireDeviceHandleInfo( &device_handle, &handle_info ) !=
+        HND_DEVICE ) {
         membuffer_destroy( &event_url_path );
-        HandleUnlock();
+        error_respond( info, HTTP_PRECONDITION_FAILED, request );
         return;
     }
     service = FindServiceEventURLPath( &handle_info->ServiceTable,
@@ -1661,19 +2066,23 @@ gena_process_unsubscribe_request( IN SOCKINFO * info,
     membuffer_destroy( &event_url_path );
 
     // validate service
-    if( service == NULL ||
-        !service->active || GetSubscriptionSID( sid, service ) == NULL )
-        //CheckSubscriptionSID(sid, service) == NULL )
-    {
-        error_respond( info, HTTP_PRECONDITION_FAILED, request );
-        HandleUnlock();
-        return;
+    found = 0;
+    if( service != NULL && service->active ) {
+        ithread_mutex_lock( &service->lock );
+        if( GetSubscriptionSID( sid, service ) != NULL ) {
+            RemoveSubscriptionSID( sid, service );
+            found = 1;
+        }
+        ithread_mutex_unlock( &service->lock );
     }
 
-    RemoveSubscriptionSID( sid, service );
-    error_respond( info, HTTP_OK, request );    // success
+    ReleaseHandleInfo( handle_info );
 
-    HandleUnlock();
+    if( found ) {
+        error_respond( info, HTTP_OK, request );    // success
+    } else {
+        error_respond( info, HTTP_PRECONDITION_FAILED, request );
+    }
 }
 
 #endif // INCLUDE_DEVICE_APIS
@@ -61,7 +61,7 @@ static str_int_entry Http_Method_Table[NUM_HTTP_METHODS] = {
 
 };
 
-#define NUM_HTTP_HEADER_NAMES 33
+#define NUM_HTTP_HEADER_NAMES 36
 str_int_entry Http_Header_Names[NUM_HTTP_HEADER_NAMES] = {
     {"ACCEPT", HDR_ACCEPT},
     {"ACCEPT-CHARSET", HDR_ACCEPT_CHARSET},
@@ -79,6 +79,8 @@ str_int_entry Http_Header_Names[NUM_HTTP_HEADER_NAMES] = {
     {"DATE", HDR_DATE},
     {"EXT", HDR_EXT},
     {"HOST", HDR_HOST},
+    {"IF-MODIFIED-SINCE", HDR_IF_MODIFIED_SINCE},
+    {"IF-NONE-MATCH", HDR_IF_NONE_MATCH},
     {"IF-RANGE", HDR_IF_RANGE},
     {"LOCATION", HDR_LOCATION},
     {"MAN", HDR_MAN},
@@ -93,6 +95,7 @@ str_int_entry Http_Header_Names[NUM_HTTP_HEADER_NAMES] = {
     {"ST", HDR_ST},
     {"TE", HDR_TE},
     {"TIMEOUT", HDR_TIMEOUT},
+    {"TIMESEEKRANGE.DLNA.ORG", HDR_TIMESEEKRANGE},
     {"TRANSFER-ENCODING", HDR_TRANSFER_ENCODING},
     {"USER-AGENT", HDR_USER_AGENT},
     {"USN", HDR_USN}
@@ -111,7 +111,7 @@ typedef enum // http_method_t
 #define HDR_DATE				5
 #define HDR_EXT					6
 #define HDR_HOST				7
-//#define HDR_IF_MODIFIED_SINCE	8
+#define HDR_IF_MODIFIED_SINCE	8
 //#define HDR_IF_UNMODIFIED_SINCE	9
 //#define HDR_LAST_MODIFIED		10
 #define HDR_LOCATION			11
@@ -144,6 +144,12 @@ typedef enum // http_method_t
 #define HDR_TE                  36
 //End_Murari
 
+// DLNA headers
+#define HDR_TIMESEEKRANGE       37
+
+// conditional requests
+#define HDR_IF_NONE_MATCH       38
+
 // status of parsing
 typedef enum // parse_status_t
 {
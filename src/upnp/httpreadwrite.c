@@ -64,6 +64,7 @@
 #include "upnp.h"
 #include "upnpapi.h"
 #include "membuffer.h"
+#include "bufferpool.h"
 #include "uri.h"
 #include "statcodes.h"
 #include "httpreadwrite.h"
@@ -74,6 +75,13 @@
 const int CHUNK_HEADER_SIZE = 10;
 const int CHUNK_TAIL_SIZE = 10;
 
+// buffers gathered into a single writev by http_SendMessage
+#define HTTP_SEND_IOV_MAX 8
+// buffers of a chunk: size line, data and CRLF
+#define HTTP_CHUNK_IOV 3
+// size line of a chunk: hex length and CRLF
+#define HTTP_CHUNK_LINE_SIZE 16
+
 
 /************************************************************************
  * Function: http_FixUrl
@@ -162,8 +170,42 @@ http_FixStrUrl( IN char *urlstr,
 int
 http_Connect( IN uri_type * destination_url,
               OUT uri_type * url )
+{
+    return http_ConnectTimeout( destination_url, url, 0 );
+}
+
+
+/************************************************************************
+ * Function: http_ConnectTimeout
+ *
+ * Parameters:
+ *	IN uri_type* destination_url;	URL containing destination information
+ *	OUT uri_type *url;		Fixed and corrected URL
+ *	IN int timeout_secs;		time allowed to establish the
+ *					connection, 0 to wait for ever
+ *
+ * Description:
+ *	Same as http_Connect but gives up when the remote end does not
+ *	answer within timeout_secs
+ *
+ *  Returns:
+ *	socket descriptor on sucess
+ *	DLNA_E_OUTOF_SOCKET
+ *	DLNA_E_SOCKET_CONNECT on error
+ *	DLNA_E_TIMEDOUT if the remote end did not answer in time
+ ************************************************************************/
+int
+http_ConnectTimeout( IN uri_type * destination_url,
+                     OUT uri_type * url,
+                     IN int timeout_secs )
 {
     int connfd;
+    int ret_code = 0;
+    int flags = 0;
+    int sock_err;
+    socklen_t err_len = sizeof( sock_err );
+    fd_set writeSet;
+    struct timeval timeout;
 
     http_FixUrl( destination_url, url );
 
@@ -172,16 +214,58 @@ http_Connect( IN uri_type * destination_url,
         return DLNA_E_OUTOF_SOCKET;
     }
 
+#ifndef WIN32
+    if( timeout_secs > 0 ) {
+        flags = fcntl( connfd, F_GETFL, 0 );
+        fcntl( connfd, F_SETFL, flags | O_NONBLOCK );
+    }
+#endif
+
     if( connect( connfd, ( struct sockaddr * )&url->hostport.IPv4address,
                  sizeof( struct sockaddr_in ) ) == -1 ) {
+#ifndef WIN32
+        if( timeout_secs > 0 && errno == EINPROGRESS ) {
+            do {
+                FD_ZERO( &writeSet );
+                FD_SET( ( unsigned )connfd, &writeSet );
+                timeout.tv_sec = timeout_secs;
+                timeout.tv_usec = 0;
+                ret_code = select( connfd + 1, NULL, &writeSet, NULL,
+                                   &timeout );
+            } while( ret_code == -1 && errno == EINTR );
+
+            if( ret_code == 0 ) {
+                ret_code = DLNA_E_TIMEDOUT;
+            } else if( ret_code < 0 ||
+                       getsockopt( connfd, SOL_SOCKET, SO_ERROR,
+                                   &sock_err, &err_len ) == -1 ||
+                       sock_err != 0 ) {
+                ret_code = DLNA_E_SOCKET_CONNECT;
+            } else {
+                ret_code = 0;
+            }
+        } else
+#endif
+        {
 #ifdef WIN32
-        dlnaPrintf(DLNA_CRITICAL, HTTP, __FILE__, __LINE__,
-            "connect error: %d\n", WSAGetLastError());
+            dlnaPrintf(DLNA_CRITICAL, HTTP, __FILE__, __LINE__,
+                "connect error: %d\n", WSAGetLastError());
 #endif
-        shutdown( connfd, SD_BOTH );
-        dlnaCloseSocket( connfd );
-        return DLNA_E_SOCKET_CONNECT;
+            ret_code = DLNA_E_SOCKET_CONNECT;
+        }
+
+        if( ret_code != 0 ) {
+            shutdown( connfd, SD_BOTH );
+            dlnaCloseSocket( connfd );
+            return ret_code;
+        }
+    }
+
+#ifndef WIN32
+    if( timeout_secs > 0 ) {
+        fcntl( connfd, F_SETFL, flags );
     }
+#endif
 
     return connfd;
 }
@@ -275,6 +359,187 @@ http_RecvMessage( IN SOCKINFO * info,
 }
 
 
+/************************************************************************
+ * Function: SendBuffers
+ *
+ * Parameters:
+ *	IN SOCKINFO *info ;		Socket information object
+ *	INOUT struct iovec *iov ;	buffers to send, consumed
+ *	IN int iovcnt ;			number of buffers
+ *	IN OUT int * TimeOut ;		time out value
+ *
+ * Description:
+ *	Sends the buffers gathered by http_SendMessage, with a single
+ *	writev where it is available.
+ *
+ * Returns:
+ *	TRUE if all the data was sent, FALSE otherwise
+ ************************************************************************/
+static int
+SendBuffers( IN SOCKINFO * info,
+             INOUT struct iovec *iov,
+             IN int iovcnt,
+             IN OUT int *TimeOut )
+{
+    int i;
+    size_t total = 0;
+    int num_written;
+
+    for( i = 0; i < iovcnt; i++ ) {
+        total += iov[i].iov_len;
+        dlnaPrintf( DLNA_INFO, HTTP, __FILE__, __LINE__,
+            ">>> (SENT) >>>\n%.*s\n------------\n",
+            ( int )iov[i].iov_len, ( char * )iov[i].iov_base );
+    }
+    if( total == 0 ) {
+        return TRUE;
+    }
+#ifndef WIN32
+    num_written = sock_writev( info, iov, iovcnt, TimeOut );
+    return num_written >= 0 && ( size_t )num_written == total;
+#else
+    for( i = 0; i < iovcnt; i++ ) {
+        if( iov[i].iov_len == 0 ) {
+            continue;
+        }
+        num_written = sock_write( info, iov[i].iov_base, iov[i].iov_len,
+                                  TimeOut );
+        if( num_written < 0 || ( size_t )num_written != iov[i].iov_len ) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+#endif
+}
+
+/************************************************************************
+ * Function: ReadFileBlock
+ *
+ * Parameters:
+ *	IN struct SendInstruction *Instr ; send instructions
+ *	IN FILE *Fp ;			opened file, or virtual file handle
+ *	OUT char *file_buf ;		buffer to read into
+ *	IN int n ;			number of bytes to read
+ *
+ * Description:
+ *	Reads the next block of a file sent by http_SendMessage, from the
+ *	virtual directory callbacks or the file system.
+ *
+ * Returns:
+ *	The number of bytes read, 0 at the end of the file, a negative
+ *	value in case of error
+ ************************************************************************/
+static int
+ReadFileBlock( IN struct SendInstruction *Instr,
+               IN FILE * Fp,
+               OUT char *file_buf,
+               IN int n )
+{
+    if( Instr && Instr->IsVirtualFile ) {
+        return virtualDirCallback.read( virtualDirCallback.cookie,
+                                        Fp, file_buf, n );
+    }
+
+    return fread( file_buf, 1, n, Fp );
+}
+
+/************************************************************************
+ * Function: SendFileParts
+ *
+ * Parameters:
+ *	IN SOCKINFO *info ;		Socket information object
+ *	IN OUT int * TimeOut ;		time out value
+ *	IN struct SendInstruction *Instr ; instructions of a
+ *					multipart/byteranges response
+ *	IN FILE *Fp ;			opened file, or virtual file handle
+ *	IN char *file_buf ;		buffer of Data_Buf_Size bytes
+ *	IN int Data_Buf_Size ;		size of the buffer
+ *	IN struct iovec *iov ;		buffers waiting to be sent, of
+ *					HTTP_SEND_IOV_MAX entries
+ *	IN int iovcnt ;			number of buffers waiting
+ *
+ * Description:
+ *	Sends the ranges of a file as the parts of a multipart/byteranges
+ *	body. Each part is read and sent one buffer at a time, its headers
+ *	going along with its first block.
+ *
+ * Returns:
+ *	DLNA_E_SUCCESS
+ *	DLNA_E_FILE_READ_ERROR
+ *	DLNA_E_SOCKET_WRITE
+ *	DLNA_E_INTERNAL_ERROR
+ ************************************************************************/
+static int
+SendFileParts( IN SOCKINFO * info,
+               IN OUT int *TimeOut,
+               IN struct SendInstruction *Instr,
+               IN FILE * Fp,
+               IN char *file_buf,
+               IN int Data_Buf_Size,
+               IN struct iovec *iov,
+               IN int iovcnt )
+{
+    char PartHeader[HTTP_PART_HEADER_SIZE];
+    struct ByteRange *Range;
+    off_t left;
+    int num_read;
+    int len;
+    int n;
+    int Part;
+
+    for( Part = 0; Part <= Instr->NumRanges; Part++ ) {
+        len = http_MakeRangePartHeader( Instr, Part, PartHeader );
+        if( len < 0 ) {
+            return DLNA_E_INTERNAL_ERROR;
+        }
+        // keep a slot for the first block of the part
+        if( iovcnt > HTTP_SEND_IOV_MAX - 2 ) {
+            if( !SendBuffers( info, iov, iovcnt, TimeOut ) ) {
+                return DLNA_E_SOCKET_WRITE;
+            }
+            iovcnt = 0;
+        }
+        iov[iovcnt].iov_base = PartHeader;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+        if( Part == Instr->NumRanges ) {
+            break;
+        }
+
+        Range = &Instr->Ranges[Part];
+        if( Instr->IsVirtualFile ) {
+            if( virtualDirCallback.seek( virtualDirCallback.cookie, Fp,
+                                         Range->Offset, SEEK_SET ) != 0 ) {
+                return DLNA_E_FILE_READ_ERROR;
+            }
+        } else if( fseeko( Fp, Range->Offset, SEEK_SET ) != 0 ) {
+            return DLNA_E_FILE_READ_ERROR;
+        }
+
+        for( left = Range->Length; left > 0; left -= num_read ) {
+            n = ( left >= Data_Buf_Size ) ? Data_Buf_Size : ( int )left;
+            num_read = ReadFileBlock( Instr, Fp, file_buf, n );
+            if( num_read <= 0 ) {
+                // the file is shorter than announced
+                return DLNA_E_FILE_READ_ERROR;
+            }
+            iov[iovcnt].iov_base = file_buf;
+            iov[iovcnt].iov_len = num_read;
+            iovcnt++;
+            if( !SendBuffers( info, iov, iovcnt, TimeOut ) ) {
+                return DLNA_E_SOCKET_WRITE;
+            }
+            iovcnt = 0;
+        }
+    }
+
+    if( !SendBuffers( info, iov, iovcnt, TimeOut ) ) {
+        return DLNA_E_SOCKET_WRITE;
+    }
+
+    return DLNA_E_SUCCESS;
+}
+
 /************************************************************************
  * Function: http_SendMessage
  *
@@ -285,7 +550,12 @@ http_RecvMessage( IN SOCKINFO * info,
  *
  * Description:
  *	Sends a message to the destination based on the
- *	IN const char* fmt parameter
+ *	IN const char* fmt parameter. The memory buffers are gathered and
+ *	sent together with the next one, or with the first block of the
+ *	file which follows them, in a single writev.
+ *	In chunked mode, the size line and the CRLF of a chunk are sent
+ *	around the block read, in the same writev, and the last chunk
+ *	carries the zero chunk ending the body.
  *	fmt types:
  *		'f':	arg = const char * file name
  *		'm':	arg1 = const char * mem_buffer; arg2= size_t buf_length
@@ -318,11 +588,14 @@ http_SendMessage( IN SOCKINFO * info,
     va_list argp;
     char *file_buf = NULL;
     char *ChunkBuf = NULL;
+    size_t ChunkBuf_Size;
     struct SendInstruction *Instr = NULL;
-    char Chunk_Header[CHUNK_HEADER_SIZE];
+    char Chunk_Header[HTTP_CHUNK_LINE_SIZE];
+    int LastChunk = 0;
     int RetVal = 0;
+    struct iovec iov[HTTP_SEND_IOV_MAX];
+    int iovcnt = 0;
 
-    // 10 byte allocated for chunk header.
     int Data_Buf_Size = WEB_SERVER_BUF_SIZE;
 
     va_start( argp, fmt );
@@ -343,13 +616,14 @@ http_SendMessage( IN SOCKINFO * info,
                 Data_Buf_Size = amount_to_be_read;
             }
 
-            ChunkBuf = (char *)malloc(
-                Data_Buf_Size + CHUNK_HEADER_SIZE + CHUNK_TAIL_SIZE);
+            // buffer of the size class of the response
+            ChunkBuf = bufferpool_get( Data_Buf_Size, &ChunkBuf_Size );
             if( !ChunkBuf ) {
                 return DLNA_E_OUTOF_MEMORY;
             }
+            Data_Buf_Size = ( int )ChunkBuf_Size;
 
-            file_buf = ChunkBuf + CHUNK_HEADER_SIZE;
+            file_buf = ChunkBuf;
         } else if( c == 'f' ) {
             // file name
             filename = va_arg(argp, char *);
@@ -359,46 +633,64 @@ http_SendMessage( IN SOCKINFO * info,
                 Fp = fopen( filename, "rb" );
             }
             if( Fp == NULL ) {
-                free( ChunkBuf );
+                bufferpool_put( ChunkBuf );
                 return DLNA_E_FILE_READ_ERROR;
             }
 
+            if( Instr && Instr->IsRangeActive && Instr->NumRanges > 1 ) {
+                // multipart/byteranges body
+                RetVal = SendFileParts( info, TimeOut, Instr, Fp, file_buf,
+                                        Data_Buf_Size, iov, iovcnt );
+                iovcnt = 0;
+                goto Cleanup_File;
+            }
+
             if( Instr && Instr->IsRangeActive && Instr->IsVirtualFile ) {
                 if( virtualDirCallback.seek(virtualDirCallback.cookie, Fp, Instr->RangeOffset,
                                              SEEK_CUR ) != 0 ) {
-                    free( ChunkBuf );
+                    bufferpool_put( ChunkBuf );
                     return DLNA_E_FILE_READ_ERROR;
                 }
             } else if( Instr && Instr->IsRangeActive ) {
                 if( fseeko( Fp, Instr->RangeOffset, SEEK_CUR ) != 0 ) {
-                    free( ChunkBuf );
+                    bufferpool_put( ChunkBuf );
                     return DLNA_E_FILE_READ_ERROR;
                 }
             }
 
-            while( amount_to_be_read ) {
+            while( amount_to_be_read && !LastChunk ) {
                 if( Instr ) {
                     int n = (amount_to_be_read >= Data_Buf_Size) ?
                         Data_Buf_Size : amount_to_be_read;
-                    if( Instr->IsVirtualFile ) {
-                        num_read = virtualDirCallback.read(virtualDirCallback.cookie, Fp, file_buf, n );
-                    } else {
-                        num_read = fread( file_buf, 1, n, Fp );
-                    }
-                    amount_to_be_read = amount_to_be_read - num_read;
+                    num_read = ReadFileBlock( Instr, Fp, file_buf, n );
                     if( Instr->ReadSendSize < 0 ) {
-                        // read until close
+                        // read until close: a short read may be the end,
+                        // to be sent along with the zero chunk
+                        if( num_read > 0 && num_read < n ) {
+                            int more = ReadFileBlock( Instr, Fp,
+                                                      file_buf + num_read,
+                                                      n - num_read );
+                            if( more > 0 ) {
+                                num_read += more;
+                            } else {
+                                LastChunk = 1;
+                            }
+                        }
                         amount_to_be_read = Data_Buf_Size;
+                    } else if( num_read > 0 ) {
+                        amount_to_be_read = amount_to_be_read - num_read;
+                        LastChunk = ( amount_to_be_read == 0 );
                     }
                 } else {
                     num_read = fread( file_buf, 1, Data_Buf_Size, Fp );
                 }
 
-                if( num_read == 0 ) {
+                if( num_read <= 0 ) {
                     // EOF so no more to send.
                     if( Instr && Instr->IsChunkActive ) {
-                        char *str = "0\r\n\r\n";
-                        num_written = sock_write(info, str, strlen(str), TimeOut);
+                        iov[iovcnt].iov_base = "0\r\n\r\n";
+                        iov[iovcnt].iov_len = 5;
+                        iovcnt++;
                     } else {
                         RetVal = DLNA_E_FILE_READ_ERROR;
                     }
@@ -406,51 +698,53 @@ http_SendMessage( IN SOCKINFO * info,
                 }
                 // Create chunk for the current buffer.
                 if( Instr && Instr->IsChunkActive ) {
-                    // Copy CRLF at the end of the chunk
-                    memcpy( file_buf + num_read, "\r\n", 2 );
-
-                    // Hex length for the chunk size.
-                    sprintf( Chunk_Header, "%x", num_read );
-
-                    //itoa(num_read,Chunk_Header,16); 
-                    strcat( Chunk_Header, "\r\n" );
-
-                    // Copy the chunk size header 
-                    memcpy( file_buf - strlen( Chunk_Header ),
-                            Chunk_Header, strlen( Chunk_Header ) );
-
-                    // on the top of the buffer.
-                    //file_buf[num_read+strlen(Chunk_Header)] = NULL;
-                    //printf("Sending %s\n",file_buf-strlen(Chunk_Header));
-                    num_written = sock_write(
-                        info, file_buf - strlen( Chunk_Header ),
-                        num_read + strlen( Chunk_Header ) + 2, TimeOut );
-
-                    if( num_written !=
-                        num_read + ( int )strlen( Chunk_Header ) + 2 ) {
-                        // Send error nothing we can do.
-                        goto Cleanup_File;
+                    // size line, data left in place, then CRLF
+                    iov[iovcnt].iov_base = Chunk_Header;
+                    iov[iovcnt].iov_len = sprintf( Chunk_Header, "%x\r\n",
+                                                   num_read );
+                    iovcnt++;
+                    iov[iovcnt].iov_base = file_buf;
+                    iov[iovcnt].iov_len = num_read;
+                    iovcnt++;
+                    if( LastChunk ) {
+                        // the zero chunk goes in the same packet
+                        iov[iovcnt].iov_base = "\r\n0\r\n\r\n";
+                        iov[iovcnt].iov_len = 7;
+                    } else {
+                        iov[iovcnt].iov_base = "\r\n";
+                        iov[iovcnt].iov_len = 2;
                     }
                 } else {
                     // write data
-                    num_written = sock_write( info, file_buf, num_read, TimeOut );
-                    dlnaPrintf( DLNA_INFO, HTTP, __FILE__, __LINE__,
-                        ">>> (SENT) >>>\n%.*s\n------------\n",
-                        ( int )num_written, file_buf );
-                    // Send error nothing we can do
-                    if( num_written != num_read ) {
-                        goto Cleanup_File;
-                    }
+                    iov[iovcnt].iov_base = file_buf;
+                    iov[iovcnt].iov_len = num_read;
+                }
+                iovcnt++;
+
+                // the first block goes along with the headers
+                num_written = SendBuffers( info, iov, iovcnt, TimeOut );
+                iovcnt = 0;
+                if( !num_written ) {
+                    // Send error nothing we can do.
+                    goto Cleanup_File;
                 }
             } // while
+            if( Instr && Instr->IsChunkActive && !LastChunk ) {
+                // empty body
+                iov[iovcnt].iov_base = "0\r\n\r\n";
+                iov[iovcnt].iov_len = 5;
+                iovcnt++;
+            }
 Cleanup_File:
+            // headers of an empty file, or the last chunk
+            SendBuffers( info, iov, iovcnt, TimeOut );
             va_end( argp );
             if( Instr && Instr->IsVirtualFile ) {
                 virtualDirCallback.close(virtualDirCallback.cookie, Fp );
 	    } else {
                 fclose( Fp );
 	    }
-            free( ChunkBuf );
+            bufferpool_put( ChunkBuf );
             return RetVal;
 
         } else if( c == 'b' ) {
@@ -458,22 +752,26 @@ Cleanup_File:
             buf = va_arg(argp, char *);
             buf_length = va_arg(argp, size_t);
             if( buf_length > 0 ) {
-                num_written = sock_write( info, buf, buf_length, TimeOut );
-                dlnaPrintf( DLNA_INFO, HTTP, __FILE__, __LINE__,
-                    ">>> (SENT) >>>\n"
-		    "%.*s\nbuf_length=%d, num_written=%d\n"
-		    "------------\n",
-                    (int)buf_length, buf, (int)buf_length, num_written );
-                if( (size_t)num_written != buf_length ) {
-                    goto end;
-		}
+                // keep the slots for the first chunk of a file
+                if( iovcnt > HTTP_SEND_IOV_MAX - HTTP_CHUNK_IOV - 1 ) {
+                    num_written = SendBuffers( info, iov, iovcnt, TimeOut );
+                    iovcnt = 0;
+                    if( !num_written ) {
+                        goto end;
+                    }
+                }
+                iov[iovcnt].iov_base = buf;
+                iov[iovcnt].iov_len = buf_length;
+                iovcnt++;
             }
         }
     }
 
+    SendBuffers( info, iov, iovcnt, TimeOut );
+
 end:
     va_end( argp );
-    free( ChunkBuf );
+    bufferpool_put( ChunkBuf );
     return 0;
 }
 
@@ -1710,6 +2008,178 @@ http_SendStatusResponse( IN SOCKINFO * info,
 }
 
 
+// current date, formatted once per second. Two slots so that a slot
+// is rewritten while the readers use the other one; 'sec' is cleared
+// during the rewrite and checked again after the copy.
+typedef struct HTTP_DATE_CACHE {
+    time_t sec;
+    char str[HTTP_DATE_SIZE];
+} http_date_cache;
+
+static http_date_cache gDateCache[2];
+static int gDateSlot = 0;
+static ithread_mutex_t gDateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/************************************************************************
+ * Function: FormatDate
+ *
+ * Parameters:
+ *	IN time_t gmt_time;	time to format
+ *	OUT char *date;		buffer of HTTP_DATE_SIZE bytes
+ *
+ * Description:
+ *	Formats a time in the RFC 1123 format, using the reentrant gmtime_r.
+ *
+ * Return:
+ *	void
+ ************************************************************************/
+static void
+FormatDate( IN time_t gmt_time,
+            OUT char *date )
+{
+    static const char *weekday_str = "Sun\0Mon\0Tue\0Wed\0Thu\0Fri\0Sat";
+    static const char *month_str = "Jan\0Feb\0Mar\0Apr\0May\0Jun\0"
+        "Jul\0Aug\0Sep\0Oct\0Nov\0Dec";
+    struct tm tm;
+
+#ifdef WIN32
+    gmtime_s( &tm, &gmt_time );
+#else
+    gmtime_r( &gmt_time, &tm );
+#endif
+    if( snprintf( date, HTTP_DATE_SIZE, "%s, %02d %s %d %02d:%02d:%02d GMT",
+                  &weekday_str[tm.tm_wday * 4], tm.tm_mday,
+                  &month_str[tm.tm_mon * 4], tm.tm_year + 1900,
+                  tm.tm_hour, tm.tm_min, tm.tm_sec ) >= HTTP_DATE_SIZE ) {
+        // past year 9999
+        date[HTTP_DATE_SIZE - 1] = '\0';
+    }
+}
+
+/************************************************************************
+ * Function: http_FormatDate
+ *
+ * Parameters:
+ *	IN time_t gmt_time;	time to format
+ *	OUT char *date;		buffer of at least HTTP_DATE_SIZE bytes
+ *
+ * Description:
+ *	Formats a time in the RFC 1123 format of the HTTP dates. The
+ *	current time is copied from the cache, which the first thread seeing
+ *	a new second updates; the others format their own copy meanwhile.
+ *
+ * Return:
+ *	void
+ ************************************************************************/
+void
+http_FormatDate( IN time_t gmt_time,
+                 OUT char *date )
+{
+    http_date_cache *cache;
+    int slot;
+
+    slot = __atomic_load_n( &gDateSlot, __ATOMIC_ACQUIRE );
+    cache = &gDateCache[slot];
+    if( __atomic_load_n( &cache->sec, __ATOMIC_ACQUIRE ) == gmt_time ) {
+        memcpy( date, cache->str, HTTP_DATE_SIZE );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &cache->sec, __ATOMIC_RELAXED ) == gmt_time ) {
+            return;
+        }
+    }
+
+    FormatDate( gmt_time, date );
+
+    // only the current time is worth caching
+    if( gmt_time != time( NULL ) ||
+        ithread_mutex_trylock( &gDateMutex ) != 0 ) {
+        return;
+    }
+    slot = 1 - gDateSlot;
+    cache = &gDateCache[slot];
+    __atomic_store_n( &cache->sec, 0, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    memcpy( cache->str, date, HTTP_DATE_SIZE );
+    __atomic_store_n( &cache->sec, gmt_time, __ATOMIC_RELEASE );
+    __atomic_store_n( &gDateSlot, slot, __ATOMIC_RELEASE );
+    ithread_mutex_unlock( &gDateMutex );
+}
+
+/************************************************************************
+ * Function: http_ParseDate
+ *
+ * Parameters:
+ *	IN const char *date;	date to parse
+ *	OUT time_t *gmt_time;	the parsed time
+ *
+ * Description:
+ *	Parses a HTTP date in the RFC 1123 format, or in the obsolete
+ *	RFC 850 and asctime() formats, which are still to be accepted.
+ *
+ * Return: int
+ *	0 - On Success
+ *	-1 - the date is not valid
+ ************************************************************************/
+int
+http_ParseDate( IN const char *date,
+                OUT time_t *gmt_time )
+{
+    static const char *month_str = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    static const int month_days[12] =
+        { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+    char month[4];
+    const char *p;
+    int day,
+      year,
+      hour,
+      min,
+      sec;
+    int mon;
+    int n = 0;
+    long days;
+
+    p = strchr( date, ',' );
+    if( p == NULL ) {
+        // asctime(): Sun Nov  6 08:49:37 1994
+        if( sscanf( date, "%*3s %3s %2d %2d:%2d:%2d %4d",
+                    month, &day, &hour, &min, &sec, &year ) != 6 ) {
+            return -1;
+        }
+    } else if( sscanf( p + 1, " %2d %3s %4d %2d:%2d:%2d GMT%n",
+                       &day, month, &year, &hour, &min, &sec, &n ) != 6 ||
+               n == 0 ) {
+        // not RFC 1123, try RFC 850: Sunday, 06-Nov-94 08:49:37 GMT
+        n = 0;
+        if( sscanf( p + 1, " %2d-%3s-%2d %2d:%2d:%2d GMT%n",
+                    &day, month, &year, &hour, &min, &sec, &n ) != 6 ||
+            n == 0 ) {
+            return -1;
+        }
+        year += ( year < 70 ) ? 2000 : 1900;
+    }
+
+    p = strstr( month_str, month );
+    if( strlen( month ) != 3 || p == NULL || ( p - month_str ) % 3 != 0 ) {
+        return -1;
+    }
+    mon = ( p - month_str ) / 3;
+
+    if( year < 1970 || day < 1 || day > 31 || hour > 23 || min > 59 ||
+        sec > 60 ) {
+        return -1;
+    }
+
+    days = ( year - 1970 ) * 365L + ( year - 1969 ) / 4 -
+        ( year - 1901 ) / 100 + ( year - 1601 ) / 400 +
+        month_days[mon] + day - 1;
+    if( mon > 1 && year % 4 == 0 && ( year % 100 != 0 || year % 400 == 0 ) ) {
+        days++;                 // February 29th
+    }
+
+    *gmt_time = ( time_t ) ( ( ( days * 24 + hour ) * 60 + min ) * 60 + sec );
+    return 0;
+}
+
 /************************************************************************
  * Function: http_MakeMessage
  *
@@ -1736,6 +2206,8 @@ http_SendStatusResponse( IN SOCKINFO * info,
  *	'c':	(no args) appends CRLF "\r\n"
  *	'D':	(no args) appends HTTP DATE: header
  *	'd':	arg = int number            // appends decimal number
+ *	'E':	arg = const char* entity headers // appended as is, e.g.
+ *		ETAG: and CACHE-CONTROL: lines; NULL appends nothing
  *	'G':	arg = range information     // add range header
  *	'h':	arg = off_t number          // appends off_t number
  *	'K':	(no args)                   // add chunky header
@@ -1773,7 +2245,6 @@ http_MakeMessage( INOUT membuffer * buf,
     size_t length;
     time_t *loc_time;
     time_t curr_time;
-    struct tm *date;
     char *start_str,
      *end_str;
     int status_code;
@@ -1788,9 +2259,6 @@ http_MakeMessage( INOUT membuffer * buf,
 
     va_list argp;
     char tempbuf[200];
-    const char *weekday_str = "Sun\0Mon\0Tue\0Wed\0Thu\0Fri\0Sat";
-    const char *month_str = "Jan\0Feb\0Mar\0Apr\0May\0Jun\0"
-        "Jul\0Aug\0Sep\0Oct\0Nov\0Dec";
 
     va_start( argp, fmt );
 
@@ -1822,6 +2290,12 @@ http_MakeMessage( INOUT membuffer * buf,
                   strlen( RespInstr->RangeHeader ) ) != 0 ) {
                 goto error_handler;
             }
+        } else if( c == 'E' ) {
+            // entity headers, complete lines
+            s = ( char * )va_arg( argp, char * );
+            if( s != NULL && membuffer_append_str( buf, s ) != 0 ) {
+                goto error_handler;
+            }
         } else if( c == 'b' ) {
             // mem buffer
             s = ( char * )va_arg( argp, char * );
@@ -1864,22 +2338,19 @@ http_MakeMessage( INOUT membuffer * buf,
                 start_str = "DATE: ";
                 end_str = "\r\n";
                 curr_time = time( NULL );
-                date = gmtime( &curr_time );
             } else {
                 // date value only
                 start_str = end_str = "";
                 loc_time = ( time_t * ) va_arg( argp, time_t * );
                 assert( loc_time );
-                date = gmtime( loc_time );
+                curr_time = *loc_time;
             }
 
-            sprintf( tempbuf, "%s%s, %02d %s %d %02d:%02d:%02d GMT%s",
-                     start_str,
-                     &weekday_str[date->tm_wday * 4], date->tm_mday,
-                     &month_str[date->tm_mon * 4], date->tm_year + 1900,
-                     date->tm_hour, date->tm_min, date->tm_sec, end_str );
+            http_FormatDate( curr_time, tempbuf );
 
-            if( membuffer_append( buf, tempbuf, strlen( tempbuf ) ) != 0 ) {
+            if( membuffer_append_str( buf, start_str ) != 0 ||
+                membuffer_append( buf, tempbuf, strlen( tempbuf ) ) != 0 ||
+                membuffer_append_str( buf, end_str ) != 0 ) {
                 goto error_handler;
             }
         } else if( c == 'C' ) {
@@ -2013,6 +2484,326 @@ error_handler:
 }
 
 
+// directives formatted on each message with a header template
+#define HTTP_TEMPLATE_VARIABLE "DEGNTdht"
+
+// compiled header templates
+static http_header_template *gTemplateList = NULL;
+static ithread_mutex_t gTemplateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/************************************************************************
+ * Function: TemplateDirective
+ *
+ * Parameters:
+ *	INOUT membuffer* buf;		buffer to append to, NULL to skip
+ *	IN int http_major_version;	HTTP major version
+ *	IN int http_minor_version;	HTTP minor version
+ *	IN char c;			http_MakeMessage directive
+ *	INOUT va_list *argp;		its arguments, consumed
+ *
+ * Description:
+ *	Appends one directive of a template message with http_MakeMessage,
+ *	or only skips its arguments.
+ *
+ * Return: int
+ *	0 - On Success
+ *	DLNA_E_OUTOF_MEMORY
+ *	DLNA_E_INVALID_PARAM - directive not supported in templates
+ ************************************************************************/
+static int
+TemplateDirective( INOUT membuffer * buf,
+                   IN int http_major_version,
+                   IN int http_minor_version,
+                   IN char c,
+                   INOUT va_list * argp )
+{
+    char fmt[2] = { c, '\0' };
+    const char *str;
+    size_t length;
+    off_t bignum;
+    int num;
+    void *ptr;
+
+    switch ( c ) {
+        case 'c':
+        case 'C':
+        case 'D':
+        case 'K':
+        case 'S':
+        case 'U':
+            return buf ? http_MakeMessage( buf, http_major_version,
+                                           http_minor_version, fmt ) : 0;
+        case 'B':
+        case 'd':
+        case 'R':
+            num = va_arg( *argp, int );
+            return buf ? http_MakeMessage( buf, http_major_version,
+                                           http_minor_version, fmt,
+                                           num ) : 0;
+        case 'h':
+        case 'N':
+            bignum = va_arg( *argp, off_t );
+            return buf ? http_MakeMessage( buf, http_major_version,
+                                           http_minor_version, fmt,
+                                           bignum ) : 0;
+        case 's':
+        case 'T':
+        case 'X':
+        case 'E':
+        case 'G':
+        case 't':
+            ptr = va_arg( *argp, void * );
+            return buf ? http_MakeMessage( buf, http_major_version,
+                                           http_minor_version, fmt,
+                                           ptr ) : 0;
+        case 'b':
+            str = va_arg( *argp, const char * );
+            length = va_arg( *argp, size_t );
+            return buf ? http_MakeMessage( buf, http_major_version,
+                                           http_minor_version, fmt,
+                                           str, length ) : 0;
+        default:
+            return DLNA_E_INVALID_PARAM;
+    }
+}
+
+/************************************************************************
+ * Function: CompileTemplate
+ *
+ * Parameters:
+ *	OUT http_template_version *tmpl;	template to compile
+ *	IN int http_major_version;	HTTP major version
+ *	IN int http_minor_version;	HTTP minor version
+ *	IN const char* fmt;		Pattern format
+ *	INOUT va_list *argp;		its arguments, consumed
+ *
+ * Description:
+ *	Renders the static directives of a template message and notes
+ *	where its variable fields go.
+ *
+ * Return: int
+ *	0 - On Success
+ *	DLNA_E_OUTOF_MEMORY
+ *	DLNA_E_INVALID_PARAM
+ ************************************************************************/
+static int
+CompileTemplate( OUT http_template_version * tmpl,
+                 IN int http_major_version,
+                 IN int http_minor_version,
+                 IN const char *fmt,
+                 INOUT va_list * argp )
+{
+    char c;
+    int ret_code;
+
+    membuffer_init( &tmpl->text );
+    tmpl->num_fields = 0;
+
+    while( ( c = *fmt++ ) != 0 ) {
+        if( strchr( HTTP_TEMPLATE_VARIABLE, c ) != NULL ) {
+            if( tmpl->num_fields == HTTP_TEMPLATE_MAX_FIELDS ) {
+                membuffer_destroy( &tmpl->text );
+                return DLNA_E_INVALID_PARAM;
+            }
+            tmpl->fields[tmpl->num_fields].offset = tmpl->text.length;
+            tmpl->fields[tmpl->num_fields].type = c;
+            tmpl->num_fields++;
+            ret_code = TemplateDirective( NULL, http_major_version,
+                                          http_minor_version, c, argp );
+        } else {
+            ret_code = TemplateDirective( &tmpl->text, http_major_version,
+                                          http_minor_version, c, argp );
+        }
+        if( ret_code != 0 ) {
+            membuffer_destroy( &tmpl->text );
+            return ret_code;
+        }
+    }
+
+    return 0;
+}
+
+/************************************************************************
+ * Function: FillTemplate
+ *
+ * Parameters:
+ *	INOUT membuffer* buf;		buffer with the contents of the
+ *					message
+ *	IN const http_template_version *tmpl;	compiled template
+ *	IN int http_major_version;	HTTP major version
+ *	IN int http_minor_version;	HTTP minor version
+ *	IN const char* fmt;		Pattern format it was compiled with
+ *	INOUT va_list *argp;		its arguments, consumed
+ *
+ * Description:
+ *	Appends the static text of a template with its variable fields
+ *	formatted in between.
+ *
+ * Return: int
+ *	0 - On Success
+ *	DLNA_E_OUTOF_MEMORY
+ ************************************************************************/
+static int
+FillTemplate( INOUT membuffer * buf,
+              IN const http_template_version * tmpl,
+              IN int http_major_version,
+              IN int http_minor_version,
+              IN const char *fmt,
+              INOUT va_list * argp )
+{
+    char c;
+    size_t pos = 0;
+    int field = 0;
+
+    while( ( c = *fmt++ ) != 0 ) {
+        if( strchr( HTTP_TEMPLATE_VARIABLE, c ) == NULL ) {
+            TemplateDirective( NULL, http_major_version,
+                               http_minor_version, c, argp );
+            continue;
+        }
+        if( membuffer_append( buf, tmpl->text.buf + pos,
+                              tmpl->fields[field].offset - pos ) != 0 ) {
+            return DLNA_E_OUTOF_MEMORY;
+        }
+        pos = tmpl->fields[field].offset;
+        field++;
+        if( TemplateDirective( buf, http_major_version,
+                               http_minor_version, c, argp ) != 0 ) {
+            return DLNA_E_OUTOF_MEMORY;
+        }
+    }
+
+    if( membuffer_append( buf, tmpl->text.buf + pos,
+                          tmpl->text.length - pos ) != 0 ) {
+        return DLNA_E_OUTOF_MEMORY;
+    }
+
+    return 0;
+}
+
+/************************************************************************
+ * Function: http_MakeTemplateMessage
+ *
+ * Parameters:
+ *	INOUT membuffer* buf;		buffer with the contents of the
+ *					message
+ *	INOUT http_header_template *tmpl;	template of the message
+ *	IN int http_major_version;	HTTP major version
+ *	IN int http_minor_version;	HTTP minor version
+ *	IN const char* fmt;		Pattern format, as http_MakeMessage
+ *	...;
+ *
+ * Description:
+ *	Same as http_MakeMessage for the headers of a common response,
+ *	rendering only the fields which change between messages. The
+ *	template is compiled by the first thread using it for an HTTP
+ *	version; other versions than 1.0 and 1.1 use a throw-away one.
+ *
+ * Return: int
+ *	0 - On Success
+ *	DLNA_E_OUTOF_MEMORY
+ *	DLNA_E_INVALID_PARAM
+ ************************************************************************/
+int
+http_MakeTemplateMessage( INOUT membuffer * buf,
+                          INOUT http_header_template * tmpl,
+                          IN int http_major_version,
+                          IN int http_minor_version,
+                          IN const char *fmt,
+                          ... )
+{
+    http_template_version temp;
+    http_template_version *version;
+    va_list argp;
+    va_list compile_argp;
+    int ret_code = 0;
+
+    va_start( argp, fmt );
+
+    if( http_major_version == 1 &&
+        ( http_minor_version == 0 || http_minor_version == 1 ) ) {
+        version = &tmpl->version[http_minor_version];
+        if( !__atomic_load_n( &version->compiled, __ATOMIC_ACQUIRE ) ) {
+            ithread_mutex_lock( &gTemplateMutex );
+            if( !version->compiled ) {
+                va_copy( compile_argp, argp );
+                ret_code = CompileTemplate( version, http_major_version,
+                                            http_minor_version, fmt,
+                                            &compile_argp );
+                va_end( compile_argp );
+                if( ret_code == 0 ) {
+                    if( !tmpl->listed ) {
+                        tmpl->next = gTemplateList;
+                        gTemplateList = tmpl;
+                        tmpl->listed = 1;
+                    }
+                    __atomic_store_n( &version->compiled, 1,
+                                      __ATOMIC_RELEASE );
+                }
+            }
+            ithread_mutex_unlock( &gTemplateMutex );
+        }
+        if( ret_code == 0 ) {
+            ret_code = FillTemplate( buf, version, http_major_version,
+                                     http_minor_version, fmt, &argp );
+        }
+    } else {
+        va_copy( compile_argp, argp );
+        ret_code = CompileTemplate( &temp, http_major_version,
+                                    http_minor_version, fmt,
+                                    &compile_argp );
+        va_end( compile_argp );
+        if( ret_code == 0 ) {
+            ret_code = FillTemplate( buf, &temp, http_major_version,
+                                     http_minor_version, fmt, &argp );
+            membuffer_destroy( &temp.text );
+        }
+    }
+
+    va_end( argp );
+
+    if( ret_code != 0 ) {
+        // as http_MakeMessage
+        membuffer_destroy( buf );
+    }
+
+    return ret_code;
+}
+
+/************************************************************************
+ * Function: http_FreeTemplates
+ *
+ * Parameters:
+ *	none
+ *
+ * Description:
+ *	Releases the compiled header templates. Must not be called while
+ *	messages are made with them.
+ *
+ * Return: void
+ ************************************************************************/
+void
+http_FreeTemplates( void )
+{
+    http_header_template *tmpl;
+    int i;
+
+    ithread_mutex_lock( &gTemplateMutex );
+    while( gTemplateList != NULL ) {
+        tmpl = gTemplateList;
+        gTemplateList = tmpl->next;
+        for( i = 0; i < 2; i++ ) {
+            if( tmpl->version[i].compiled ) {
+                membuffer_destroy( &tmpl->version[i].text );
+                tmpl->version[i].compiled = 0;
+            }
+        }
+        tmpl->listed = 0;
+        tmpl->next = NULL;
+    }
+    ithread_mutex_unlock( &gTemplateMutex );
+}
+
 /************************************************************************
  * Function: http_CalcResponseVersion
  *
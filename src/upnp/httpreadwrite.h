@@ -40,6 +40,34 @@
 // timeout in secs
 #define HTTP_DEFAULT_TIMEOUT	30
 
+// size of an RFC 1123 date, "Sun, 06 Nov 1994 08:49:37 GMT", with its NUL
+#define HTTP_DATE_SIZE	30
+
+// variable fields of a header template, see http_MakeTemplateMessage
+#define HTTP_TEMPLATE_MAX_FIELDS	8
+
+// field of a header template formatted on each message
+typedef struct HTTP_TEMPLATE_FIELD {
+    size_t offset;		// where it goes in the static text
+    char type;			// http_MakeMessage directive
+} http_template_field;
+
+// header template compiled for one HTTP version
+typedef struct HTTP_TEMPLATE_VERSION {
+    int compiled;
+    membuffer text;		// static part of the headers
+    int num_fields;
+    http_template_field fields[HTTP_TEMPLATE_MAX_FIELDS];
+} http_template_version;
+
+// headers of a common response, compiled on first use. Declare it
+// static, zero filled; it is released by http_FreeTemplates.
+typedef struct HTTP_HEADER_TEMPLATE {
+    http_template_version version[2];	// HTTP/1.0 and HTTP/1.1
+    int listed;
+    struct HTTP_HEADER_TEMPLATE *next;
+} http_header_template;
+
 
 
 #ifdef __cplusplus
@@ -102,6 +130,29 @@ int http_FixStrUrl( IN char* urlstr, IN int urlstrlen, OUT uri_type* fixed_url )
 int http_Connect( IN uri_type* destination_url, OUT uri_type *url );
 
 
+/************************************************************************
+ * Function: http_ConnectTimeout
+ *
+ * Parameters:
+ *	IN uri_type* destination_url;	URL containing destination information
+ *	OUT uri_type *url;		Fixed and corrected URL
+ *	IN int timeout_secs;		time allowed to establish the
+ *					connection, 0 to wait for ever
+ *
+ * Description:
+ *	Same as http_Connect but gives up when the remote end does not
+ *	answer within timeout_secs
+ *
+ *  Returns:
+ *	socket descriptor on sucess
+ *	DLNA_E_OUTOF_SOCKET
+ *	DLNA_E_SOCKET_CONNECT on error
+ *	DLNA_E_TIMEDOUT if the remote end did not answer in time
+ ************************************************************************/
+int http_ConnectTimeout( IN uri_type* destination_url, OUT uri_type *url,
+                         IN int timeout_secs );
+
+
 /************************************************************************
  * Function: http_RecvMessage
  *
@@ -496,6 +547,8 @@ int http_SendStatusResponse(
  *	'c':	(no args) appends CRLF "\r\n"
  *	'D':	(no args) appends HTTP DATE: header
  *	'd':	arg = int number            // appends decimal number
+ *	'E':	arg = const char* entity headers // appended as is, e.g.
+ *		ETAG: and CACHE-CONTROL: lines; NULL appends nothing
  *	'G':	arg = range information     // add range header
  *	'h':	arg = off_t number          // appends off_t number
  *	'K':	(no args)                   // add chunky header
@@ -526,6 +579,54 @@ int http_MakeMessage(
 	IN const char* fmt, ... );
 
 
+/************************************************************************
+ * Function: http_MakeTemplateMessage
+ *
+ * Parameters:
+ *	INOUT membuffer* buf;		buffer with the contents of the
+ *					message
+ *	INOUT http_header_template *tmpl;	template of the message
+ *	IN int http_major_version;	HTTP major version
+ *	IN int http_minor_version;	HTTP minor version
+ *	IN const char* fmt;		Pattern format, as http_MakeMessage
+ *	...;
+ *
+ * Description:
+ *	Same as http_MakeMessage for the headers of a common response. The
+ *	first call for an HTTP version renders the directives which do not
+ *	change between messages into the template; the next ones only
+ *	format its fields, 'D', 'd', 'E', 'G', 'h', 'N', 'T' and 't', between
+ *	the static text. The other directives, 's' included, must take the
+ *	same arguments on each call with the template, and fmt must be the
+ *	same. 'q' and 'Q' are not supported.
+ *
+ * Return: int
+ *	0 - On Success
+ *	DLNA_E_OUTOF_MEMORY
+ *	DLNA_E_INVALID_PARAM
+ ************************************************************************/
+int http_MakeTemplateMessage(
+	INOUT membuffer* buf,
+	INOUT http_header_template *tmpl,
+	IN int http_major_version,
+	IN int http_minor_version,
+	IN const char* fmt, ... );
+
+/************************************************************************
+ * Function: http_FreeTemplates
+ *
+ * Parameters:
+ *	none
+ *
+ * Description:
+ *	Releases the compiled header templates. They are compiled again on
+ *	their next use.
+ *
+ * Return: void
+ ************************************************************************/
+void http_FreeTemplates( void );
+
+
 /************************************************************************
  * Function: http_CalcResponseVersion
  *
@@ -582,6 +683,41 @@ int http_OpenHttpGetEx(IN const char *url_str,
 		     IN int timeout);
 
 
+/************************************************************************
+ * Function: http_FormatDate
+ *
+ * Parameters:
+ *	IN time_t gmt_time;	time to format
+ *	OUT char *date;		buffer of at least HTTP_DATE_SIZE bytes
+ *
+ * Description:
+ *	Formats a time in the RFC 1123 format of the HTTP dates. The
+ *	current time is taken from a string cached for the whole second.
+ *	Thread safe.
+ *
+ * Return:
+ *	void
+ ************************************************************************/
+void http_FormatDate( IN time_t gmt_time, OUT char *date );
+
+
+/************************************************************************
+ * Function: http_ParseDate
+ *
+ * Parameters:
+ *	IN const char *date;	date to parse
+ *	OUT time_t *gmt_time;	the parsed time
+ *
+ * Description:
+ *	Parses a HTTP date in the RFC 1123, RFC 850 or asctime() format.
+ *
+ * Return: int
+ *	0 - On Success
+ *	-1 - the date is not valid
+ ************************************************************************/
+int http_ParseDate( IN const char *date, OUT time_t *gmt_time );
+
+
 /************************************************************************
  * Function: get_sdk_info
  *
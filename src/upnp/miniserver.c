@@ -67,6 +67,7 @@
 #include "statcodes.h"
 #include "upnp.h"
 #include "upnpapi.h"
+#include "webserver.h"
 
 #define APPLICATION_LISTENING_PORT 49152
 
@@ -74,8 +75,16 @@ struct mserv_request_t {
     int connfd;                 // connection handle
     struct in_addr foreign_ip_addr;
     unsigned short foreign_ip_port;
+    SOCKINFO info;              // valid once the request is read
+    http_parser_t parser;       // parsed request
 };
 
+typedef enum {
+    MSERV_CLASS_CONTROL,        // SOAP actions, descriptions
+    MSERV_CLASS_EVENT,          // GENA
+    MSERV_CLASS_STREAM          // media transfers
+} MiniServerClass;
+
 typedef enum { MSERV_IDLE, MSERV_RUNNING, MSERV_STOPPING } MiniServerState;
 
 unsigned short miniStopSockPort;
@@ -86,6 +95,8 @@ static MiniServerCallback gGetCallback = NULL;
 static MiniServerCallback gSoapCallback = NULL;
 static MiniServerCallback gGenaCallback = NULL;
 static MiniServerState gMServState = MSERV_IDLE;
+// GENA requests handed over to gRecvThreadPool, waiting or running
+static int gEventJobs = 0;
 
 /************************************************************************
  * Function: SetHTTPGetCallback
@@ -241,6 +252,160 @@ free_handle_request_arg( void *args )
     free( request );
 }
 
+/************************************************************************
+ * Function: classify_request
+ *
+ * Parameters:
+ *	http_message_t *hmsg - Parsed request
+ *
+ * Description:
+ * 	Find the traffic class of a request, from its request line only.
+ *	GET and HEAD requests for the description, images and text
+ *	documents are quick control traffic; any other request for the
+ *	web server is a media transfer.
+ *
+ * Return: MiniServerClass
+ ************************************************************************/
+static MiniServerClass
+classify_request( IN http_message_t * hmsg )
+{
+    switch ( hmsg->method ) {
+        case HTTPMETHOD_NOTIFY:
+        case HTTPMETHOD_SUBSCRIBE:
+        case HTTPMETHOD_UNSUBSCRIBE:
+            return MSERV_CLASS_EVENT;
+
+        case HTTPMETHOD_GET:
+        case HTTPMETHOD_HEAD:
+        case HTTPMETHOD_SIMPLEGET:
+            if( web_server_is_quick_request( hmsg ) ) {
+                return MSERV_CLASS_CONTROL;
+            }
+            return MSERV_CLASS_STREAM;
+
+        case HTTPMETHOD_POST:
+            return MSERV_CLASS_STREAM;
+
+        default:
+            return MSERV_CLASS_CONTROL;
+    }
+}
+
+/************************************************************************
+ * Function: finish_request
+ *
+ * Parameters:
+ *	struct mserv_request_t *request - Request read by handle_request
+ *	int http_error_code - HTTP Error Code to send, 0 if none
+ *
+ * Description:
+ * 	Send the error message if any, then close the connection and
+ *	free the request
+ *
+ * Return: void
+ ************************************************************************/
+static void
+finish_request( IN struct mserv_request_t *request,
+                IN int http_error_code )
+{
+    http_message_t *hmsg = &request->parser.msg;
+
+    if( http_error_code > 0 ) {
+        handle_error( &request->info, http_error_code,
+                      hmsg->major_version, hmsg->minor_version );
+    }
+
+    dlnaPrintf( DLNA_INFO, MSERV, __FILE__, __LINE__,
+        "miniserver %d: COMPLETE\n", request->connfd );
+    sock_destroy( &request->info, SD_BOTH ); //should shutdown completely
+
+    httpmsg_destroy( hmsg );
+    free( request );
+}
+
+/************************************************************************
+ * Function: free_dispatch_request_arg
+ *
+ * Parameters:
+ *	void *args ; Request to be freed
+ *
+ * Description:
+ * 	Close a request handed over to another thread pool which was
+ *	never run
+ *
+ * Return: void
+ ************************************************************************/
+static void
+free_dispatch_request_arg( void *args )
+{
+    finish_request( ( struct mserv_request_t * )args, 0 );
+}
+
+/************************************************************************
+ * Function: dispatch_request_job
+ *
+ * Parameters:
+ *	void *args - Request read by handle_request
+ *
+ * Description:
+ * 	Dispatch a request handed over to another thread pool
+ *
+ * Return: void *
+ *	NULL
+ ************************************************************************/
+static void *
+dispatch_request_job( void *args )
+{
+    struct mserv_request_t *request = ( struct mserv_request_t * )args;
+
+    dlnaPrintf( DLNA_INFO, MSERV, __FILE__, __LINE__,
+        "miniserver %d: PROCESSING...\n", request->connfd );
+    finish_request( request,
+                    dispatch_request( &request->info, &request->parser ) );
+
+    return NULL;
+}
+
+/************************************************************************
+ * Function: free_dispatch_event_arg
+ *
+ * Parameters:
+ *	void *args ; GENA request to be freed
+ *
+ * Description:
+ * 	Close a GENA request handed over to the receive thread pool which
+ *	was never run
+ *
+ * Return: void
+ ************************************************************************/
+static void
+free_dispatch_event_arg( void *args )
+{
+    free_dispatch_request_arg( args );
+    __atomic_sub_fetch( &gEventJobs, 1, __ATOMIC_RELAXED );
+}
+
+/************************************************************************
+ * Function: dispatch_event_job
+ *
+ * Parameters:
+ *	void *args - GENA request read by handle_request
+ *
+ * Description:
+ * 	Dispatch a GENA request handed over to the receive thread pool
+ *
+ * Return: void *
+ *	NULL
+ ************************************************************************/
+static void *
+dispatch_event_job( void *args )
+{
+    dispatch_request_job( args );
+    __atomic_sub_fetch( &gEventJobs, 1, __ATOMIC_RELAXED );
+
+    return NULL;
+}
+
 /************************************************************************
  * Function: handle_request
  *
@@ -248,67 +413,80 @@ free_handle_request_arg( void *args )
  *	void *args - Request Message to be handled
  *
  * Description:
- * 	Receive the request and dispatch it for handling
+ * 	Receive the request and dispatch it for handling. Control
+ *	requests are handled in place, media transfers are handed over
+ *	to the stream thread pool and GENA requests to the receive thread
+ *	pool, up to GENA_MAX_JOBS of them. A request which can not be
+ *	queued is refused with "503 Service Unavailable".
  *
  * Return: void
  ************************************************************************/
 static void
 handle_request( void *args )
 {
-    SOCKINFO info;
     int http_error_code;
     int ret_code;
-    int major = 1;
-    int minor = 1;
-    http_parser_t parser;
-    http_message_t *hmsg = NULL;
     int timeout = HTTP_DEFAULT_TIMEOUT;
     struct mserv_request_t *request = ( struct mserv_request_t * )args;
     int connfd = request->connfd;
+    ThreadPool *pool;
+    ThreadPoolJob job;
 
     dlnaPrintf( DLNA_INFO, MSERV, __FILE__, __LINE__,
         "miniserver %d: READING\n", connfd );
-    //parser_request_init( &parser ); ////LEAK_FIX_MK
-    hmsg = &parser.msg;
 
-    if( sock_init_with_ip( &info, connfd, request->foreign_ip_addr,
+    if( sock_init_with_ip( &request->info, connfd, request->foreign_ip_addr,
                            request->foreign_ip_port ) != DLNA_E_SUCCESS ) {
         free( request );
-        httpmsg_destroy( hmsg );
         return;
     }
     // read
-    ret_code = http_RecvMessage( &info, &parser, HTTPMETHOD_UNKNOWN,
-                                 &timeout, &http_error_code );
+    ret_code = http_RecvMessage( &request->info, &request->parser,
+                                 HTTPMETHOD_UNKNOWN, &timeout,
+                                 &http_error_code );
     if( ret_code != 0 ) {
-        goto error_handler;
+        finish_request( request, http_error_code );
+        return;
     }
 
-    dlnaPrintf( DLNA_INFO, MSERV, __FILE__, __LINE__,
-        "miniserver %d: PROCESSING...\n", connfd );
-    // dispatch
-    http_error_code = dispatch_request( &info, &parser );
-    if( http_error_code != 0 ) {
-        goto error_handler;
+    switch ( classify_request( &request->parser.msg ) ) {
+        case MSERV_CLASS_STREAM:
+            pool = &gStreamThreadPool;
+            TPJobInit( &job, dispatch_request_job,
+                       ( void * )request );
+            TPJobSetFreeFunction( &job, free_dispatch_request_arg );
+            break;
+        case MSERV_CLASS_EVENT:
+            // SSDP shares the pool: a burst of GENA must leave it room
+            if( __atomic_add_fetch( &gEventJobs, 1, __ATOMIC_RELAXED ) >
+                GENA_MAX_JOBS ) {
+                __atomic_sub_fetch( &gEventJobs, 1, __ATOMIC_RELAXED );
+                dlnaPrintf( DLNA_INFO, MSERV, __FILE__, __LINE__,
+                    "miniserver %d: too many GENA requests, refused\n",
+                    connfd );
+                finish_request( request, HTTP_SERVICE_UNAVAILABLE );
+                return;
+            }
+            pool = &gRecvThreadPool;
+            TPJobInit( &job, dispatch_event_job,
+                       ( void * )request );
+            TPJobSetFreeFunction( &job, free_dispatch_event_arg );
+            break;
+        default:
+            dispatch_request_job( request );
+            return;
     }
 
-    http_error_code = 0;
+    TPJobSetPriority( &job, MED_PRIORITY );
 
-  error_handler:
-    if( http_error_code > 0 ) {
-        if( hmsg ) {
-            major = hmsg->major_version;
-            minor = hmsg->minor_version;
+    if( ThreadPoolAdd( pool, &job, NULL ) != 0 ) {
+        dlnaPrintf( DLNA_INFO, MSERV, __FILE__, __LINE__,
+            "miniserver %d: too busy, request refused\n", connfd );
+        if( pool == &gRecvThreadPool ) {
+            __atomic_sub_fetch( &gEventJobs, 1, __ATOMIC_RELAXED );
         }
-        handle_error( &info, http_error_code, major, minor );
+        finish_request( request, HTTP_SERVICE_UNAVAILABLE );
     }
-
-    dlnaPrintf( DLNA_INFO, MSERV, __FILE__, __LINE__,
-        "miniserver %d: COMPLETE\n", connfd );
-    sock_destroy( &info, SD_BOTH ); //should shutdown completely
-
-    httpmsg_destroy( hmsg );
-    free( request );
 }
 
 /************************************************************************
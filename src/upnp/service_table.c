@@ -38,6 +38,8 @@
 
 #include "config.h"
 #include "service_table.h"
+#include "sock.h"
+#include "gena.h"
 
 #ifdef INCLUDE_DEVICE_APIS
 
@@ -63,7 +65,6 @@ copy_subscription( subscription * in,
 
     memcpy( out->sid, in->sid, SID_SIZE );
     out->sid[SID_SIZE] = 0;
-    out->eventKey = in->eventKey;
     out->ToSendEventKey = in->ToSendEventKey;
     out->expireTime = in->expireTime;
     out->active = in->active;
@@ -71,10 +72,219 @@ copy_subscription( subscription * in,
           copy_URL_list( &in->DeliveryURLs, &out->DeliveryURLs ) )
         != HTTP_SUCCESS )
         return return_code;
-    out->next = NULL;
+    // the kept-alive connection stays owned by the original
+    out->notifyConn = -1;
+    out->notifyConnURL = 0;
+    out->notifyConnTime = 0;
+    // so do the queued events
+    out->notifyHead = NULL;
+    out->notifyTail = NULL;
+    out->notifyCount = 0;
+    out->notifyBusy = 0;
+    out->notifyFailures = in->notifyFailures;
+    out->notifyRetryTime = in->notifyRetryTime;
+    // copies are not indexed
+    out->expireIndex = -1;
+    memset( &out->hh, 0, sizeof( out->hh ) );
     return HTTP_SUCCESS;
 }
 
+/************************************************************************
+*	Function :	ExpireHeapSet
+*
+*	Parameters :
+*		service_info * service ;	service owning the heap
+*		int index ;	position in the heap
+*		subscription * sub ;	subscription to put there
+*
+*	Description :	Stores a subscription in the expiration heap and
+*		records its position in it.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static DLNA_INLINE void
+ExpireHeapSet( service_info * service,
+               int index,
+               subscription * sub )
+{
+    service->expireHeap[index] = sub;
+    sub->expireIndex = index;
+}
+
+/************************************************************************
+*	Function :	ExpireHeapUpdate
+*
+*	Parameters :
+*		service_info * service ;	service owning the heap
+*		int index ;	position of the entry whose time changed
+*
+*	Description :	Moves an entry of the expiration heap up or down
+*		until the heap is in order again.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static void
+ExpireHeapUpdate( service_info * service,
+                  int index )
+{
+    subscription **heap = service->expireHeap;
+    subscription *sub = heap[index];
+    int parent;
+    int child;
+
+    while( index > 0 ) {
+        parent = ( index - 1 ) / 2;
+        if( heap[parent]->expireTime <= sub->expireTime )
+            break;
+        ExpireHeapSet( service, index, heap[parent] );
+        index = parent;
+    }
+
+    while( ( child = 2 * index + 1 ) < service->expireHeapSize ) {
+        if( child + 1 < service->expireHeapSize &&
+            heap[child + 1]->expireTime < heap[child]->expireTime )
+            child++;
+        if( sub->expireTime <= heap[child]->expireTime )
+            break;
+        ExpireHeapSet( service, index, heap[child] );
+        index = child;
+    }
+
+    ExpireHeapSet( service, index, sub );
+}
+
+/************************************************************************
+*	Function :	ExpireHeapInsert
+*
+*	Parameters :
+*		service_info * service ;	service owning the heap
+*		subscription * sub ;	subscription which expires
+*
+*	Description :	Adds a subscription to the expiration heap.
+*
+*	Return : int ;
+*		HTTP_SUCCESS - On Sucess
+*		DLNA_E_OUTOF_MEMORY - On Failure
+*
+*	Note :
+************************************************************************/
+static int
+ExpireHeapInsert( service_info * service,
+                  subscription * sub )
+{
+    subscription **heap;
+    int max;
+
+    if( service->expireHeapSize == service->expireHeapMax ) {
+        max = service->expireHeapMax ? 2 * service->expireHeapMax : 8;
+        heap = ( subscription ** ) realloc( service->expireHeap,
+                                           max * sizeof( subscription * ) );
+        if( heap == NULL )
+            return DLNA_E_OUTOF_MEMORY;
+        service->expireHeap = heap;
+        service->expireHeapMax = max;
+    }
+
+    ExpireHeapSet( service, service->expireHeapSize++, sub );
+    ExpireHeapUpdate( service, sub->expireIndex );
+
+    return HTTP_SUCCESS;
+}
+
+/************************************************************************
+*	Function :	ExpireHeapRemove
+*
+*	Parameters :
+*		service_info * service ;	service owning the heap
+*		subscription * sub ;	subscription to take out of the heap
+*
+*	Description :	Removes a subscription from the expiration heap, if
+*		it is in it.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static void
+ExpireHeapRemove( service_info * service,
+                  subscription * sub )
+{
+    int index = sub->expireIndex;
+
+    if( index < 0 )
+        return;
+
+    sub->expireIndex = -1;
+    service->expireHeapSize--;
+    if( index < service->expireHeapSize ) {
+        // fill the hole with the last entry
+        ExpireHeapSet( service, index,
+                       service->expireHeap[service->expireHeapSize] );
+        ExpireHeapUpdate( service, index );
+    }
+}
+
+/************************************************************************
+*	Function :	AddSubscription
+*
+*	Parameters :
+*		service_info * service ;	service object providing the list of
+*						subscriptions
+*		subscription * sub ;	subscription to add, allocated by malloc
+*
+*	Description :	Adds a subscription to the service, indexing it by
+*		sid and by expiration time. The service owns it afterwards.
+*
+*	Return : int ;
+*		HTTP_SUCCESS - On Sucess
+*		DLNA_E_OUTOF_MEMORY - On Failure, the subscription is not added
+*
+*	Note :
+************************************************************************/
+int
+AddSubscription( service_info * service,
+                 subscription * sub )
+{
+    sub->expireIndex = -1;
+    if( sub->expireTime != 0 &&
+        ExpireHeapInsert( service, sub ) != HTTP_SUCCESS )
+        return DLNA_E_OUTOF_MEMORY;
+
+    HASH_ADD_STR( service->subscriptionList, sid, sub );
+    service->TotalSubscriptions++;
+
+    return HTTP_SUCCESS;
+}
+
+/************************************************************************
+*	Function :	RemoveSubscription
+*
+*	Parameters :
+*		service_info * service ;	service object providing the list of
+*						subscriptions
+*		subscription * sub ;	subscription of the service
+*
+*	Description :	Takes a subscription out of the service and frees it.
+*
+*	Return : void ;
+*
+*	Note :
+************************************************************************/
+static void
+RemoveSubscription( service_info * service,
+                    subscription * sub )
+{
+    ExpireHeapRemove( service, sub );
+    HASH_DEL( service->subscriptionList, sub );
+    service->TotalSubscriptions--;
+    freeSubscription( sub );
+    free( sub );
+}
+
 /************************************************************************
 *	Function :	RemoveSubscriptionSID
 *
@@ -95,25 +305,89 @@ void
 RemoveSubscriptionSID( dlna_SID sid,
                        service_info * service )
 {
-    subscription *finger = service->subscriptionList;
-    subscription *previous = NULL;
-
-    while( finger ) {
-        if( !( strcmp( sid, finger->sid ) ) ) {
-            if( previous )
-                previous->next = finger->next;
-            else
-                service->subscriptionList = finger->next;
-            finger->next = NULL;
-            freeSubscriptionList( finger );
-            finger = NULL;
-            service->TotalSubscriptions--;
-        } else {
-            previous = finger;
-            finger = finger->next;
+    subscription *found = NULL;
+
+    HASH_FIND_STR( service->subscriptionList, sid, found );
+    if( found )
+        RemoveSubscription( service, found );
+}
+
+/************************************************************************
+*	Function :	SetSubscriptionExpiry
+*
+*	Parameters :
+*		service_info * service ;	service object providing the list of
+*						subscriptions
+*		subscription * sub ;	subscription of the service
+*		time_t expireTime ;	new expiration time, 0 for never
+*
+*	Description :	Changes the expiration time of a subscription, as on
+*		renewal, keeping the expiration heap of the service in order.
+*
+*	Return : int ;
+*		HTTP_SUCCESS - On Sucess
+*		DLNA_E_OUTOF_MEMORY - On Failure, the expiration is unchanged
+*
+*	Note :
+************************************************************************/
+int
+SetSubscriptionExpiry( service_info * service,
+                       subscription * sub,
+                       time_t expireTime )
+{
+    if( expireTime == 0 ) {
+        ExpireHeapRemove( service, sub );
+        sub->expireTime = 0;
+        return HTTP_SUCCESS;
+    }
+
+    if( sub->expireIndex < 0 ) {
+        sub->expireTime = expireTime;
+        if( ExpireHeapInsert( service, sub ) != HTTP_SUCCESS ) {
+            sub->expireTime = 0;
+            return DLNA_E_OUTOF_MEMORY;
         }
+        return HTTP_SUCCESS;
     }
 
+    sub->expireTime = expireTime;
+    ExpireHeapUpdate( service, sub->expireIndex );
+    return HTTP_SUCCESS;
+}
+
+/************************************************************************
+*	Function :	ExpireSubscriptions
+*
+*	Parameters :
+*		service_info * service ;	service object providing the list of
+*						subscriptions
+*		time_t now ;	current time
+*
+*	Description :	Removes the subscriptions of the service which
+*		expired before now, taking them off the top of its expiration
+*		heap.
+*
+*	Return : time_t ;
+*		expiration time of the next subscription to expire, 0 if none
+*
+*	Note :
+************************************************************************/
+time_t
+ExpireSubscriptions( service_info * service,
+                     time_t now )
+{
+    subscription *sub;
+
+    while( service->expireHeapSize > 0 ) {
+        sub = service->expireHeap[0];
+        if( sub->expireTime >= now )
+            return sub->expireTime;
+        dlnaPrintf( DLNA_INFO, GENA, __FILE__, __LINE__,
+            "subscription %s expired\n", sub->sid );
+        RemoveSubscription( service, sub );
+    }
+
+    return 0;
 }
 
 /************************************************************************
@@ -125,7 +399,8 @@ RemoveSubscriptionSID( dlna_SID sid,
 *						subscriptions
 *
 *	Description :	Return the subscription from the service table 
-*		that matches const dlna_SID sid value. 
+*		that matches const dlna_SID sid value. A subscription which
+*		expired, but was not purged yet, is not returned.
 *
 *	Return : subscription * - Pointer to the matching subscription 
 *		node;
@@ -136,37 +411,13 @@ subscription *
 GetSubscriptionSID( dlna_SID sid,
                     service_info * service )
 {
-    subscription *next = service->subscriptionList;
-    subscription *previous = NULL;
     subscription *found = NULL;
 
-    time_t current_time;
-
-    while( ( next ) && ( found == NULL ) ) {
-        if( !strcmp( next->sid, sid ) )
-            found = next;
-        else {
-            previous = next;
-            next = next->next;
-        }
-    }
-    if( found ) {
-        //get the current_time
-        time( &current_time );
-        if( ( found->expireTime != 0 )
-            && ( found->expireTime < current_time ) ) {
-            if( previous )
-                previous->next = found->next;
-            else
-                service->subscriptionList = found->next;
-            found->next = NULL;
-            freeSubscriptionList( found );
-            found = NULL;
-            service->TotalSubscriptions--;
-        }
-    }
+    HASH_FIND_STR( service->subscriptionList, sid, found );
+    if( found && found->expireTime != 0 &&
+        found->expireTime < time( NULL ) )
+        found = NULL;
     return found;
-
 }
 
 /************************************************************************
@@ -189,33 +440,17 @@ GetNextSubscription( service_info * service,
                      subscription * current )
 {
     time_t current_time;
-    subscription *next = NULL;
-    subscription *previous = NULL;
-    int notDone = 1;
 
     //get the current_time
     time( &current_time );
-    while( ( notDone ) && ( current ) ) {
-        previous = current;
-        current = current->next;
-
-        if( current == NULL ) {
-            notDone = 0;
-            next = current;
-        } else
-            if( ( current->expireTime != 0 )
-                && ( current->expireTime < current_time ) ) {
-            previous->next = current->next;
-            current->next = NULL;
-            freeSubscriptionList( current );
-            current = previous;
-            service->TotalSubscriptions--;
-        } else if( current->active ) {
-            notDone = 0;
-            next = current;
-        }
+    while( current ) {
+        current = ( subscription * ) current->hh.next;
+        if( current && current->active &&
+            ( current->expireTime == 0 ||
+              current->expireTime >= current_time ) )
+            break;
     }
-    return next;
+    return current;
 }
 
 /************************************************************************
@@ -235,14 +470,12 @@ GetNextSubscription( service_info * service,
 subscription *
 GetFirstSubscription( service_info * service )
 {
-    subscription temp;
-    subscription *next = NULL;
-
-    temp.next = service->subscriptionList;
-    next = GetNextSubscription( service, &temp );
-    service->subscriptionList = temp.next;
-    //  service->subscriptionList=next;
-    return next;
+    subscription *first = service->subscriptionList;
+
+    if( first && first->active &&
+        ( first->expireTime == 0 || first->expireTime >= time( NULL ) ) )
+        return first;
+    return GetNextSubscription( service, first );
 }
 
 /************************************************************************
@@ -252,7 +485,8 @@ GetFirstSubscription( service_info * service )
 *		subscription * sub ;	subscription to be freed
 *
 *	Description :	Free's the memory allocated for storing the URL of 
-*		the subscription.
+*		the subscription, drops its undelivered events and closes its
+*		kept-alive notify connection.
 *
 *	Return : void ;
 *
@@ -263,6 +497,14 @@ freeSubscription( subscription * sub )
 {
     if( sub ) {
         free_URL_list( &sub->DeliveryURLs );
+#if EXCLUDE_GENA == 0
+        genaFlushNotifyQueue( sub );
+#endif
+        if( sub->notifyConn >= 0 ) {
+            shutdown( sub->notifyConn, SD_BOTH );
+            dlnaCloseSocket( sub->notifyConn );
+            sub->notifyConn = -1;
+        }
     }
 }
 
@@ -270,7 +512,8 @@ freeSubscription( subscription * sub )
 *	Function :	freeSubscriptionList
 *
 *	Parameters :
-*		subscription * head ;	head of the subscription list
+*		service_info * service ;	service object providing the list of
+*						subscriptions
 *
 *	Description :	Free's memory allocated for all the subscriptions 
 *		in the service table. 
@@ -280,16 +523,15 @@ freeSubscription( subscription * sub )
 *	Note :
 ************************************************************************/
 void
-freeSubscriptionList( subscription * head )
+freeSubscriptionList( service_info * service )
 {
-    subscription *next = NULL;
+    while( service->subscriptionList )
+        RemoveSubscription( service, service->subscriptionList );
 
-    while( head ) {
-        next = head->next;
-        freeSubscription( head );
-        free( head );
-        head = next;
-    }
+    free( service->expireHeap );
+    service->expireHeap = NULL;
+    service->expireHeapSize = 0;
+    service->expireHeapMax = 0;
 }
 
 /************************************************************************
@@ -606,8 +848,8 @@ void freeService( service_info * in )
         if( in->UDN )
             ixmlFreeDOMString( in->UDN );
 
-        if( in->subscriptionList )
-            freeSubscriptionList( in->subscriptionList );
+        freeSubscriptionList( in );
+        ithread_mutex_destroy( &in->lock );
 
         in->TotalSubscriptions = 0;
         free( in );
@@ -645,8 +887,8 @@ freeServiceList( service_info * head )
             free( head->eventURL );
         if( head->UDN )
             ixmlFreeDOMString( head->UDN );
-        if( head->subscriptionList )
-            freeSubscriptionList( head->subscriptionList );
+        freeSubscriptionList( head );
+        ithread_mutex_destroy( &head->lock );
 
         head->TotalSubscriptions = 0;
         next = head->next;
@@ -676,6 +918,7 @@ freeServiceTable( service_table * table )
     freeServiceList( table->serviceList );
     table->serviceList = NULL;
     table->endServiceList = NULL;
+    ithread_mutex_destroy( &table->expireLock );
 }
 
 /************************************************************************
@@ -832,6 +1075,7 @@ getServiceList( IXML_Node * node,
                     return NULL;
                 }
 
+                ithread_mutex_init( &current->lock, NULL );
                 current->next = NULL;
                 current->controlURL = NULL;
                 current->eventURL = NULL;
@@ -840,6 +1084,9 @@ getServiceList( IXML_Node * node,
                 current->SCPDURL = NULL;
                 current->active = 1;
                 current->subscriptionList = NULL;
+                current->expireHeap = NULL;
+                current->expireHeapSize = 0;
+                current->expireHeapMax = 0;
                 current->TotalSubscriptions = 0;
 
                 if( !( current->UDN = getElementValue( UDN ) ) )
@@ -1142,6 +1389,10 @@ getServiceTable( IXML_Node * node,
     IXML_Node *root = NULL;
     IXML_Node *URLBase = NULL;
 
+    ithread_mutex_init( &out->expireLock, NULL );
+    out->expireTimerId = -1;
+    out->expireTimerTime = 0;
+
     if( getSubElement( "root", node, &root ) ) {
         if( getSubElement( "URLBase", root, &URLBase ) ) {
             out->URLBase = getElementValue( URLBase );
@@ -41,6 +41,8 @@ extern "C" {
 #include "ixml.h"
 
 #include "upnp.h"
+#include "uthash.h"
+#include "ithread.h"
 #include <stdio.h>
 //#include <malloc.h>
 #include <time.h>
@@ -49,14 +51,34 @@ extern "C" {
 
 #ifdef INCLUDE_DEVICE_APIS
 
+struct NOTIFY_THREAD_STRUCT;
+
 typedef struct SUBSCRIPTION {
   dlna_SID sid;
-  int eventKey;
   int ToSendEventKey;
   time_t expireTime;
   int active;
   URL_list DeliveryURLs;
-  struct SUBSCRIPTION *next;
+  // kept-alive connection used to deliver events, -1 if none
+  int notifyConn;
+  // DeliveryURLs entry notifyConn is connected to
+  int notifyConnURL;
+  // time notifyConn was last used, for idle timeout
+  time_t notifyConnTime;
+  // events waiting for delivery, oldest first
+  struct NOTIFY_THREAD_STRUCT *notifyHead;
+  struct NOTIFY_THREAD_STRUCT *notifyTail;
+  int notifyCount;
+  // a job is delivering the queued events
+  int notifyBusy;
+  // consecutive failed deliveries, and time before which events are
+  // dropped without trying
+  int notifyFailures;
+  time_t notifyRetryTime;
+  // position in the expiration heap of the service, -1 if not in it
+  int expireIndex;
+  // subscriptions of a service are hashed by sid
+  UT_hash_handle hh;
 } subscription;
 
 
@@ -69,7 +91,15 @@ typedef struct SERVICE_INFO {
   DOMString	UDN;
   int		active;
   int		TotalSubscriptions;
+  // hash of the subscriptions, by sid
   subscription	*subscriptionList;
+  // subscriptions which expire, soonest first (binary min-heap)
+  subscription	**expireHeap;
+  int		expireHeapSize;
+  int		expireHeapMax;
+  // guards the subscriptions, their notify queues and the events queued
+  // on them
+  ithread_mutex_t	lock;
   struct SERVICE_INFO	 *next;
 } service_info;
 
@@ -78,6 +108,11 @@ typedef struct SERVICE_TABLE {
   DOMString URLBase;
   service_info *serviceList;
   service_info *endServiceList;
+  // timer event expiring the subscriptions, none if expireTimerTime is 0,
+  // guarded by expireLock which is taken before the service locks
+  ithread_mutex_t expireLock;
+  int expireTimerId;
+  time_t expireTimerTime;
 } service_table;
 
 
@@ -99,6 +134,25 @@ typedef struct SERVICE_TABLE {
 ************************************************************************/
 int copy_subscription(subscription *in, subscription *out);
 
+/************************************************************************
+*	Function :	AddSubscription
+*
+*	Parameters :
+*		service_info * service ;	service object providing the list of
+*						subscriptions
+*		subscription * sub ;	subscription to add, allocated by malloc
+*
+*	Description :	Adds a subscription to the service, indexing it by
+*		sid and by expiration time. The service owns it afterwards.
+*
+*	Return : int ;
+*		HTTP_SUCCESS - On Sucess
+*		DLNA_E_OUTOF_MEMORY - On Failure, the subscription is not added
+*
+*	Note :
+************************************************************************/
+int AddSubscription(service_info * service, subscription * sub);
+
 /************************************************************************
 *	Function :	RemoveSubscriptionSID
 *
@@ -117,6 +171,46 @@ int copy_subscription(subscription *in, subscription *out);
 ************************************************************************/
 void RemoveSubscriptionSID(dlna_SID sid, service_info * service);
 
+/************************************************************************
+*	Function :	SetSubscriptionExpiry
+*
+*	Parameters :
+*		service_info * service ;	service object providing the list of
+*						subscriptions
+*		subscription * sub ;	subscription of the service
+*		time_t expireTime ;	new expiration time, 0 for never
+*
+*	Description :	Changes the expiration time of a subscription, as on
+*		renewal, keeping the expiration heap of the service in order.
+*
+*	Return : int ;
+*		HTTP_SUCCESS - On Sucess
+*		DLNA_E_OUTOF_MEMORY - On Failure, the expiration is unchanged
+*
+*	Note :
+************************************************************************/
+int SetSubscriptionExpiry(service_info * service, subscription * sub,
+			  time_t expireTime);
+
+/************************************************************************
+*	Function :	ExpireSubscriptions
+*
+*	Parameters :
+*		service_info * service ;	service object providing the list of
+*						subscriptions
+*		time_t now ;	current time
+*
+*	Description :	Removes the subscriptions of the service which
+*		expired before now, taking them off the top of its expiration
+*		heap.
+*
+*	Return : time_t ;
+*		expiration time of the next subscription to expire, 0 if none
+*
+*	Note :
+************************************************************************/
+time_t ExpireSubscriptions(service_info * service, time_t now);
+
 /************************************************************************
 *	Function :	GetSubscriptionSID
 *
@@ -166,7 +260,8 @@ subscription * GetNextSubscription(service_info * service, subscription *current
 *		subscription * sub ;	subscription to be freed
 *
 *	Description :	Free's the memory allocated for storing the URL of 
-*		the subscription.
+*		the subscription, drops its undelivered events and closes its
+*		kept-alive notify connection.
 *
 *	Return : void ;
 *
@@ -178,7 +273,8 @@ void freeSubscription(subscription * sub);
 *	Function :	freeSubscriptionList
 *
 *	Parameters :
-*		subscription * head ;	head of the subscription list
+*		service_info * service ;	service object providing the list of
+*						subscriptions
 *
 *	Description :	Free's memory allocated for all the subscriptions 
 *		in the service table. 
@@ -187,7 +283,7 @@ void freeSubscription(subscription * sub);
 *
 *	Note :
 ************************************************************************/
-void freeSubscriptionList(subscription * head);
+void freeSubscriptionList(service_info * service);
 
 /************************************************************************
 *	Function :	FindServiceId
@@ -72,6 +72,10 @@ static const char *Soap_Invalid_Var = "Invalid Var";
 const char *ContentTypeHeader =
     "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n";
 
+// headers of the SOAP responses
+static http_header_template gResponseHeaders;
+static http_header_template gErrorHeaders;
+
 /****************************************************************************
 *	Function :	get_request_type
 *
@@ -228,14 +232,17 @@ send_error_response( IN SOCKINFO * info,
 
     // make headers
     membuffer_init( &headers );
-    if (http_MakeMessage(
-        &headers, major, minor,
-        "RNsDsSXcc" "sssss",
+    if (http_MakeTemplateMessage(
+        &headers, &gErrorHeaders, major, minor,
+        "RNsDsSXcc",
         500,
         content_length,
         ContentTypeHeader,
         "EXT:\r\n",
-        X_USER_AGENT,
+        X_USER_AGENT ) != 0 ||
+        http_MakeMessage(
+        &headers, major, minor,
+        "sssss",
         start_body, err_code_str, mid_body, err_msg,
         end_body ) != 0 ) {
         membuffer_destroy( &headers );
@@ -295,14 +302,17 @@ send_var_query_response( IN SOCKINFO * info,
     // make headers
     membuffer_init( &response );
     
-    if (http_MakeMessage(
-        &response, major, minor,
-        "RNsDsSXcc" "sss",
+    if (http_MakeTemplateMessage(
+        &response, &gResponseHeaders, major, minor,
+        "RNsDsSXcc",
         HTTP_OK,
         content_length,
         ContentTypeHeader,
         "EXT:\r\n",
-        X_USER_AGENT,
+        X_USER_AGENT ) != 0 ||
+        http_MakeMessage(
+        &response, major, minor,
+        "sss",
         start_body, var_value, end_body ) != 0 ) {
         membuffer_destroy( &response );
         return;                 // out of mem
@@ -607,7 +617,7 @@ get_device_info( IN http_message_t * request,
     save_char = control_url[request->uri.pathquery.size];
     ((char *)control_url)[request->uri.pathquery.size] = '\0';
 
-    HandleLock(  );
+    HandleReadLock();
 
     if( GetDeviceHandleInfo( &device_hnd, &device_info ) != HND_DEVICE ) {
         goto error_handler;
@@ -719,8 +729,8 @@ send_action_response( IN SOCKINFO * info,
         strlen( end_body );
 
     // make headers
-    if (http_MakeMessage(
-        &headers, major, minor,
+    if (http_MakeTemplateMessage(
+        &headers, &gResponseHeaders, major, minor,
         "RNsDsSXcc",
         HTTP_OK,   // status code
         content_length,
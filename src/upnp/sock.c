@@ -332,3 +332,102 @@ sock_write( IN SOCKINFO * info,
 {
     return sock_read_write( info, buffer, bufsize, timeoutSecs, FALSE );
 }
+
+/************************************************************************
+*	Function :	sock_writev
+*
+*	Parameters :
+*		IN SOCKINFO *info ;	Socket Information Object
+*		INOUT struct iovec* iov ;	Buffers to send data from, in order
+*		IN int iovcnt ;	Number of buffers
+*	    IN int *timeoutSecs ;	timeout value
+*
+*	Description :	Writes several buffers on the socket in sockinfo with
+*		as few system calls as possible, without gathering them first.
+*		The iov array is consumed as data is sent.
+*
+*	Return : int;
+*		numBytes - On Success, no of bytes sent		
+*		DLNA_E_TIMEDOUT - Timeout
+*		DLNA_E_SOCKET_ERROR - Error on socket calls
+*
+*	Note :
+************************************************************************/
+#ifndef WIN32
+int
+sock_writev( IN SOCKINFO * info,
+             INOUT struct iovec *iov,
+             IN int iovcnt,
+             INOUT int *timeoutSecs )
+{
+    int retCode;
+    fd_set writeSet;
+    struct timeval timeout;
+    struct msghdr msg;
+    time_t start_time = time( NULL );
+    int sockfd = info->socket;
+    long bytes_sent = 0,
+      num_written;
+
+    if( *timeoutSecs < 0 ) {
+        return DLNA_E_TIMEDOUT;
+    }
+
+    FD_ZERO( &writeSet );
+    FD_SET( ( unsigned )sockfd, &writeSet );
+
+    timeout.tv_sec = *timeoutSecs;
+    timeout.tv_usec = 0;
+
+    while( TRUE ) {
+        if( *timeoutSecs == 0 ) {
+            retCode = select( sockfd + 1, NULL, &writeSet, NULL, NULL );
+        } else {
+            retCode = select( sockfd + 1, NULL, &writeSet, NULL, &timeout );
+        }
+
+        if( retCode == 0 ) {
+            return DLNA_E_TIMEDOUT;
+        }
+        if( retCode == -1 ) {
+            if( errno == EINTR )
+                continue;
+            return DLNA_E_SOCKET_ERROR; // error
+        } else {
+            break;              // write
+        }
+    }
+
+    while( iovcnt > 0 ) {
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        num_written = sendmsg( sockfd, &msg, MSG_DONTROUTE|MSG_NOSIGNAL );
+        if( num_written == -1 ) {
+            if( errno == EINTR )
+                continue;
+            return DLNA_E_SOCKET_ERROR;
+        }
+        bytes_sent += num_written;
+
+        // skip the buffers sent, resume within a partly sent one
+        while( iovcnt > 0 && ( size_t )num_written >= iov->iov_len ) {
+            num_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if( iovcnt > 0 ) {
+            iov->iov_base = ( char * )iov->iov_base + num_written;
+            iov->iov_len -= num_written;
+        }
+    }
+
+    // subtract time used for writing
+    if( *timeoutSecs != 0 ) {
+        *timeoutSecs -= time( NULL ) - start_time;
+    }
+
+    return bytes_sent;
+}
+#endif
@@ -36,6 +36,13 @@
 
 #ifndef WIN32
  #include <netinet/in.h>
+ #include <sys/uio.h>
+#else
+// gathered buffers, written one by one on winsock
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
 #endif
 
 //Following variable is not defined under winsock.h
@@ -143,6 +150,31 @@ int sock_read( IN SOCKINFO *info, OUT char* buffer, IN size_t bufsize,
 int sock_write( IN SOCKINFO *info, IN char* buffer, IN size_t bufsize,
 		    		 INOUT int *timeoutSecs );
 
+/************************************************************************
+*	Function :	sock_writev
+*
+*	Parameters :
+*		IN SOCKINFO *info ;	Socket Information Object
+*		INOUT struct iovec* iov ;	Buffers to send data from, in order
+*		IN int iovcnt ;	Number of buffers
+*	    IN int *timeoutSecs ;	timeout value
+*
+*	Description :	Writes several buffers on the socket in sockinfo with
+*		as few system calls as possible, without gathering them first.
+*		The iov array is consumed as data is sent.
+*
+*	Return : int;
+*		numBytes - On Success, no of bytes sent		
+*		DLNA_E_TIMEDOUT - Timeout
+*		DLNA_E_SOCKET_ERROR - Error on socket calls
+*
+*	Note :
+************************************************************************/
+#ifndef WIN32
+int sock_writev( IN SOCKINFO *info, INOUT struct iovec* iov, IN int iovcnt,
+		    		 INOUT int *timeoutSecs );
+#endif
+
 /************************************************************************
 *	Function :	sock_destroy
 *
@@ -136,7 +136,7 @@ ssdp_handle_device_request( IN http_message_t * hmsg,
         return;                 // bad ST header
     }
 
-    HandleLock();
+    HandleReadLock();
     // device info
     if( GetDeviceHandleInfo( &handle, &dev_info ) != HND_DEVICE ) {
         HandleUnlock();
@@ -193,6 +193,374 @@ ssdp_handle_device_request( IN http_message_t * hmsg,
 }
 #endif
 
+// Datagram waiting in the SSDP transmit queue
+typedef struct SSDP_TX_PACKET {
+    struct sockaddr_in dest;
+    // time the datagram is due, in ms
+    long long due;
+    size_t length;
+    struct SSDP_TX_PACKET *next;
+    char data[1];
+} SsdpTxPacket;
+
+// Recent unicast destination of replies, for rate limiting
+typedef struct SSDP_REQUESTER {
+    struct in_addr addr;
+    time_t window;
+    int count;
+} SsdpRequester;
+
+// State of the SSDP transmit scheduler
+static struct {
+    // mutex and condition are valid, they are never destroyed
+    int initialized;
+    int running;
+    // timer jobs sending datagrams
+    int sending;
+    // due time of the earliest timer event scheduled, 0 if none
+    long long timerDue;
+    SOCKET sock;
+    ithread_mutex_t mutex;
+    ithread_cond_t cond;
+    // queued datagrams, by due time
+    SsdpTxPacket *head;
+    SsdpRequester requesters[SSDP_MAX_REQUESTERS];
+} gSsdpTx = { .sock = DLNA_INVALID_SOCKET };
+
+/************************************************************************
+* Function : SsdpTxNow
+*
+* Parameters:
+*
+* Description:
+*	This function returns the current time in ms.
+*
+* Returns: long long
+***************************************************************************/
+static long long
+SsdpTxNow( void )
+{
+    struct timeval now;
+
+    gettimeofday( &now, NULL );
+    return ( long long )now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/************************************************************************
+* Function : SsdpTxSend
+*
+* Parameters:
+*	IN SsdpTxPacket **packets: datagrams to send
+*	IN int count: number of datagrams
+*
+* Description:
+*	This function sends datagrams on the transmit socket, with a single
+*	system call where sendmmsg is available.
+*
+* Returns: void
+***************************************************************************/
+static void
+SsdpTxSend( IN SsdpTxPacket ** packets,
+            IN int count )
+{
+    int i;
+#if defined( __linux__ ) && defined( _GNU_SOURCE )
+    struct mmsghdr msgs[SSDP_TX_BATCH];
+    struct iovec iov[SSDP_TX_BATCH];
+    int sent = 0;
+    int rc;
+
+    memset( msgs, 0, sizeof( msgs ) );
+    for( i = 0; i < count; i++ ) {
+        iov[i].iov_base = packets[i]->data;
+        iov[i].iov_len = packets[i]->length;
+        msgs[i].msg_hdr.msg_name = &packets[i]->dest;
+        msgs[i].msg_hdr.msg_namelen = sizeof( struct sockaddr_in );
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while( sent < count ) {
+        rc = sendmmsg( gSsdpTx.sock, &msgs[sent], count - sent, 0 );
+        if( rc <= 0 ) {
+            if( rc < 0 && errno == EINTR ) {
+                continue;
+            }
+            dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
+                "SSDP_LIB: sendmmsg failed, %d datagrams lost\n",
+                count - sent );
+            break;
+        }
+        sent += rc;
+    }
+#else
+    for( i = 0; i < count; i++ ) {
+        sendto( gSsdpTx.sock, packets[i]->data, packets[i]->length, 0,
+                ( struct sockaddr * )&packets[i]->dest,
+                sizeof( struct sockaddr_in ) );
+    }
+#endif
+    for( i = 0; i < count; i++ ) {
+        dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
+            ">>> SSDP SEND >>>\n%s\n", packets[i]->data );
+        free( packets[i] );
+    }
+}
+
+static void *SsdpTransmitTimer( IN void *arg );
+
+/************************************************************************
+* Function : SsdpTxSchedule
+*
+* Parameters:
+*
+* Description:
+*	This function schedules a timer event for the first queued datagram,
+*	unless an event due no later is already scheduled. Must be called
+*	with the scheduler mutex held.
+*
+* Returns: void
+***************************************************************************/
+static void
+SsdpTxSchedule( void )
+{
+    ThreadPoolJob job;
+    long long delay;
+
+    if( gSsdpTx.head == NULL ||
+        ( gSsdpTx.timerDue != 0 && gSsdpTx.timerDue <= gSsdpTx.head->due ) ) {
+        return;
+    }
+
+    delay = gSsdpTx.head->due - SsdpTxNow(  );
+    if( delay < 0 ) {
+        delay = 0;
+    }
+
+    TPJobInit( &job, SsdpTransmitTimer, NULL );
+    TPJobSetPriority( &job, MED_PRIORITY );
+    if( TimerThreadSchedule( &gTimerThread, ( time_t ) delay, REL_MSEC,
+                             &job, SHORT_TERM, NULL ) != 0 ) {
+        // the datagrams go with the next ones queued
+        dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
+            "SSDP_LIB: cannot schedule the transmit timer\n" );
+        return;
+    }
+    gSsdpTx.timerDue = gSsdpTx.head->due;
+}
+
+/************************************************************************
+* Function : SsdpTransmitTimer
+*
+* Parameters:
+*	IN void *arg: unused
+*
+* Description:
+*	This function runs from the timer thread when the first queued
+*	datagram is due: it sends all the datagrams due, then schedules the
+*	timer again for the next one.
+*
+* Returns: void *
+*	NULL
+***************************************************************************/
+static void *
+SsdpTransmitTimer( IN void *arg )
+{
+    SsdpTxPacket *batch[SSDP_TX_BATCH];
+    long long now;
+    int count;
+
+    ithread_mutex_lock( &gSsdpTx.mutex );
+    if( !gSsdpTx.running ) {
+        ithread_mutex_unlock( &gSsdpTx.mutex );
+        return NULL;
+    }
+    gSsdpTx.timerDue = 0;
+    gSsdpTx.sending++;
+
+    while( TRUE ) {
+        now = SsdpTxNow(  );
+        count = 0;
+        while( gSsdpTx.head && count < SSDP_TX_BATCH &&
+               gSsdpTx.head->due <= now ) {
+            batch[count++] = gSsdpTx.head;
+            gSsdpTx.head = gSsdpTx.head->next;
+        }
+        if( count == 0 ) {
+            break;
+        }
+
+        ithread_mutex_unlock( &gSsdpTx.mutex );
+        SsdpTxSend( batch, count );
+        ithread_mutex_lock( &gSsdpTx.mutex );
+    }
+
+    if( gSsdpTx.running ) {
+        SsdpTxSchedule(  );
+    }
+    gSsdpTx.sending--;
+    ithread_cond_broadcast( &gSsdpTx.cond );
+    ithread_mutex_unlock( &gSsdpTx.mutex );
+
+    return NULL;
+}
+
+/************************************************************************
+* Function : SsdpTransmitInit
+*
+* Parameters:
+*
+* Description:
+*	This function opens the SSDP transmit socket and starts the
+*	scheduler sending the queued advertisements and replies from the
+*	timer thread.
+*
+* Returns: int
+*	DLNA_E_SUCCESS if successful else appropriate error
+***************************************************************************/
+int
+SsdpTransmitInit( void )
+{
+    unsigned long replyAddr = inet_addr( LOCAL_HOST );
+    int ttl = 4;                //a/c to DLNA Spec
+
+    if( !gSsdpTx.initialized ) {
+        ithread_mutex_init( &gSsdpTx.mutex, NULL );
+        ithread_cond_init( &gSsdpTx.cond, NULL );
+        gSsdpTx.initialized = 1;
+    }
+
+    ithread_mutex_lock( &gSsdpTx.mutex );
+    if( gSsdpTx.running ) {
+        ithread_mutex_unlock( &gSsdpTx.mutex );
+        return DLNA_E_SUCCESS;
+    }
+
+    gSsdpTx.sock = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( gSsdpTx.sock == DLNA_INVALID_SOCKET ) {
+        ithread_mutex_unlock( &gSsdpTx.mutex );
+        dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
+            "SSDP_LIB: SsdpTransmitInit:"
+            "Error in socket operation !!!\n" );
+        return DLNA_E_OUTOF_SOCKET;
+    }
+
+    setsockopt( gSsdpTx.sock, IPPROTO_IP, IP_MULTICAST_IF,
+                ( char * )&replyAddr, sizeof( replyAddr ) );
+    setsockopt( gSsdpTx.sock, IPPROTO_IP, IP_MULTICAST_TTL,
+                ( char * )&ttl, sizeof( int ) );
+
+    gSsdpTx.head = NULL;
+    gSsdpTx.timerDue = 0;
+    memset( gSsdpTx.requesters, 0, sizeof( gSsdpTx.requesters ) );
+    gSsdpTx.running = 1;
+    ithread_mutex_unlock( &gSsdpTx.mutex );
+
+    return DLNA_E_SUCCESS;
+}
+
+/************************************************************************
+* Function : SsdpTransmitShutdown
+*
+* Parameters:
+*
+* Description:
+*	This function stops the SSDP transmit scheduler, sends the datagrams
+*	still queued, such as the last shutdown messages, and closes its
+*	socket. It waits for the timer jobs sending datagrams, so it must be
+*	called before the send thread pool is shut down; packets queued
+*	afterwards are refused.
+*
+* Returns: void
+***************************************************************************/
+void
+SsdpTransmitShutdown( void )
+{
+    SsdpTxPacket *batch[SSDP_TX_BATCH];
+    int count;
+
+    if( !gSsdpTx.initialized ) {
+        return;
+    }
+
+    ithread_mutex_lock( &gSsdpTx.mutex );
+    if( gSsdpTx.running ) {
+        gSsdpTx.running = 0;
+        while( gSsdpTx.sending > 0 ) {
+            ithread_cond_wait( &gSsdpTx.cond, &gSsdpTx.mutex );
+        }
+
+        // send the rest without waiting for the due times
+        while( gSsdpTx.head ) {
+            count = 0;
+            while( gSsdpTx.head && count < SSDP_TX_BATCH ) {
+                batch[count++] = gSsdpTx.head;
+                gSsdpTx.head = gSsdpTx.head->next;
+            }
+            SsdpTxSend( batch, count );
+        }
+        gSsdpTx.timerDue = 0;
+
+        shutdown( gSsdpTx.sock, SD_BOTH );
+        dlnaCloseSocket( gSsdpTx.sock );
+        gSsdpTx.sock = DLNA_INVALID_SOCKET;
+    }
+    ithread_mutex_unlock( &gSsdpTx.mutex );
+}
+
+/************************************************************************
+* Function : SsdpRequesterAllows
+*
+* Parameters:
+*	IN struct sockaddr_in *DestAddr: destination of the replies
+*	IN int NumPacket: number of replies
+*
+* Description:
+*	This function accounts the replies sent to a control point and tells
+*	whether it is still below SSDP_REQUESTER_MAX_PACKETS in the last
+*	SSDP_REQUESTER_WINDOW seconds. Must be called with the scheduler
+*	mutex held.
+*
+* Returns: int
+*	1 if the replies can be sent, else 0
+***************************************************************************/
+static int
+SsdpRequesterAllows( IN struct sockaddr_in *DestAddr,
+                     IN int NumPacket )
+{
+    SsdpRequester *requester;
+    SsdpRequester *oldest = &gSsdpTx.requesters[0];
+    time_t now = time( NULL );
+    int i;
+
+    for( i = 0; i < SSDP_MAX_REQUESTERS; i++ ) {
+        requester = &gSsdpTx.requesters[i];
+        if( requester->count != 0 &&
+            requester->addr.s_addr == DestAddr->sin_addr.s_addr ) {
+            break;
+        }
+        if( requester->window < oldest->window ) {
+            oldest = requester;
+        }
+    }
+
+    if( i == SSDP_MAX_REQUESTERS ) {
+        // recycle the least recently seen entry
+        requester = oldest;
+        requester->addr = DestAddr->sin_addr;
+        requester->count = 0;
+        requester->window = now;
+    } else if( now - requester->window >= SSDP_REQUESTER_WINDOW ) {
+        requester->count = 0;
+        requester->window = now;
+    }
+
+    if( requester->count + NumPacket > SSDP_REQUESTER_MAX_PACKETS ) {
+        return 0;
+    }
+    requester->count += NumPacket;
+    return 1;
+}
+
 /************************************************************************
 * Function : NewRequestHandler
 *
@@ -202,40 +570,35 @@ ssdp_handle_device_request( IN http_message_t * hmsg,
 *		IN char **RqPacket:Number of packet to be sent.
 *
 * Description:
-*	This function works as a request handler which passes the HTTP
-*	request string to multicast channel then
+*	This function queues the packets on the SSDP transmit scheduler,
+*	SSDP_PAUSE ms apart, and returns without waiting for them to be
+*	sent. Replies to a control point asking too often are dropped.
 *
-* Returns: void *
-*	1 if successful else appropriate error
+* Returns: int
+*	DLNA_E_SUCCESS if successful else appropriate error
 ***************************************************************************/
-static int
+int
 NewRequestHandler( IN struct sockaddr_in *DestAddr,
                    IN int NumPacket,
                    IN char **RqPacket )
 {
-    int ReplySock,
-      socklen = sizeof( struct sockaddr_in );
+    SsdpTxPacket *packets = NULL;
+    SsdpTxPacket *packet;
+    SsdpTxPacket **prev;
+    SsdpTxPacket *next;
+    long long due;
+    size_t length;
     int NumCopy,
       Index;
-    unsigned long replyAddr = inet_addr( LOCAL_HOST );
-    int ttl = 4;                //a/c to DLNA Spec
-
-    ReplySock = socket( AF_INET, SOCK_DGRAM, 0 );
-    if( ReplySock == DLNA_INVALID_SOCKET ) {
-        dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
-            "SSDP_LIB: New Request Handler:"
-            "Error in socket operation !!!\n" );
 
+    if( !gSsdpTx.initialized ) {
         return DLNA_E_OUTOF_SOCKET;
     }
 
-    setsockopt( ReplySock, IPPROTO_IP, IP_MULTICAST_IF,
-                ( char * )&replyAddr, sizeof( replyAddr ) );
-    setsockopt( ReplySock, IPPROTO_IP, IP_MULTICAST_TTL,
-                ( char * )&ttl, sizeof( int ) );
-
+    // copy the packets, they are sent later
+    due = SsdpTxNow();
+    prev = &packets;
     for( Index = 0; Index < NumPacket; Index++ ) {
-        int rc;
         // The reason to keep this loop is purely historical/documentation,
         // according to section 9.2 of HTTPU spec:
         // 
@@ -247,21 +610,71 @@ NewRequestHandler( IN struct sockaddr_in *DestAddr,
         // http://www.dlna.org/download/draft-goland-http-udp-04.txt
         //
         // So, NUM_COPY has been changed from 2 to 1.
-        NumCopy = 0;
-        while( NumCopy < NUM_COPY ) {
-            dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
-                ">>> SSDP SEND >>>\n%s\n",
-                *( RqPacket + Index ) );
-            rc = sendto( ReplySock, *( RqPacket + Index ),
-                         strlen( *( RqPacket + Index ) ),
-                         0, ( struct sockaddr * )DestAddr, socklen );
-            imillisleep( SSDP_PAUSE );
-            ++NumCopy;
+        for( NumCopy = 0; NumCopy < NUM_COPY; NumCopy++ ) {
+            length = strlen( RqPacket[Index] );
+            packet = ( SsdpTxPacket * ) malloc( sizeof( SsdpTxPacket ) +
+                                                length );
+            if( packet == NULL ) {
+                while( packets ) {
+                    next = packets->next;
+                    free( packets );
+                    packets = next;
+                }
+                return DLNA_E_OUTOF_MEMORY;
+            }
+            packet->dest = *DestAddr;
+            packet->due = due;
+            packet->length = length;
+            memcpy( packet->data, RqPacket[Index], length + 1 );
+            packet->next = NULL;
+            *prev = packet;
+            prev = &packet->next;
+            due += SSDP_PAUSE;
         }
     }
 
-    shutdown( ReplySock, SD_BOTH );
-    dlnaCloseSocket( ReplySock );
+    ithread_mutex_lock( &gSsdpTx.mutex );
+
+    if( !gSsdpTx.running ) {
+        ithread_mutex_unlock( &gSsdpTx.mutex );
+        while( packets ) {
+            next = packets->next;
+            free( packets );
+            packets = next;
+        }
+        return DLNA_E_OUTOF_SOCKET;
+    }
+
+    if( !IN_MULTICAST( ntohl( DestAddr->sin_addr.s_addr ) ) &&
+        !SsdpRequesterAllows( DestAddr, NumPacket ) ) {
+        ithread_mutex_unlock( &gSsdpTx.mutex );
+        dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
+            "SSDP_LIB: too many searches from %s, replies dropped\n",
+            inet_ntoa( DestAddr->sin_addr ) );
+        while( packets ) {
+            next = packets->next;
+            free( packets );
+            packets = next;
+        }
+        return DLNA_E_SUCCESS;
+    }
+
+    // merge the packets in the queue, by due time
+    prev = &gSsdpTx.head;
+    while( packets ) {
+        while( *prev && ( *prev )->due <= packets->due ) {
+            prev = &( *prev )->next;
+        }
+        next = packets->next;
+        packets->next = *prev;
+        *prev = packets;
+        prev = &packets->next;
+        packets = next;
+    }
+    SsdpTxSchedule(  );
+
+    ithread_mutex_unlock( &gSsdpTx.mutex );
+
     return DLNA_E_SUCCESS;
 }
 
@@ -358,461 +771,301 @@ CreateServicePacket( IN int msg_type,
 }
 
 /************************************************************************
-* Function : DeviceAdvertisement
+* Function : GetNodeText
 *
 * Parameters:
-*	IN char * DevType : type of the device
-*	IN int RootDev: flag to indicate if the device is root device
-*	IN char * nt : ssdp type
-*	IN char * usn : unique service name
-*	IN char * location :Location URL.
-*	IN int  duration :Service duration in sec.
+*	IN IXML_Node *node: element to search in
+*	IN char *tag: name of the sub element
 *
 * Description:
-*	This function creates the device advertisement request based on 
-*	the input parameter, and send it to the multicast channel.
+*	This function returns the text of the first sub element of a
+*	description element with the given name.
 *
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+* Returns: const DOMString
+*	the text, NULL if not found
 ***************************************************************************/
-int
-DeviceAdvertisement( IN char *DevType,
-                     int RootDev,
-                     char *Udn,
-                     IN char *Location,
-                     IN int Duration )
+static const DOMString
+GetNodeText( IN IXML_Node * node,
+             IN char *tag )
 {
-    struct sockaddr_in DestAddr;
-
-    //char Mil_Nt[LINE_SIZE]
-    char Mil_Usn[LINE_SIZE];
-    char *msgs[3];
-    int ret_code;
-
-    dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
-        "In function SendDeviceAdvertisemenrt\n" );
-
-    DestAddr.sin_family = AF_INET;
-    DestAddr.sin_addr.s_addr = inet_addr( SSDP_IP );
-    DestAddr.sin_port = htons( SSDP_PORT );
-
-    msgs[0] = NULL;
-    msgs[1] = NULL;
-    msgs[2] = NULL;
-
-    //If deviceis a root device , here we need to 
-    //send 3 advertisement or reply
-    if( RootDev ) {
-        sprintf( Mil_Usn, "%s::dlna:rootdevice", Udn );
-        CreateServicePacket( MSGTYPE_ADVERTISEMENT, "dlna:rootdevice",
-                             Mil_Usn, Location, Duration, &msgs[0] );
+    IXML_NodeList *nodeList;
+    IXML_Node *textNode = NULL;
+    const DOMString value = NULL;
+
+    nodeList = ixmlElement_getElementsByTagName( ( IXML_Element * ) node,
+                                                 tag );
+    if( nodeList == NULL ) {
+        return NULL;
     }
-    // both root and sub-devices need to send these two messages
-    //
-
-    CreateServicePacket( MSGTYPE_ADVERTISEMENT, Udn, Udn,
-                         Location, Duration, &msgs[1] );
-
-    sprintf( Mil_Usn, "%s::%s", Udn, DevType );
-    CreateServicePacket( MSGTYPE_ADVERTISEMENT, DevType, Mil_Usn,
-                         Location, Duration, &msgs[2] );
-
-    // check error
-    if( ( RootDev && msgs[0] == NULL ) ||
-        msgs[1] == NULL || msgs[2] == NULL ) {
-        free( msgs[0] );
-        free( msgs[1] );
-        free( msgs[2] );
-        return DLNA_E_OUTOF_MEMORY;
+    node = ixmlNodeList_item( nodeList, 0 );
+    if( node != NULL ) {
+        textNode = ixmlNode_getFirstChild( node );
     }
-    // send packets
-    if( RootDev ) {
-        // send 3 msg types
-        ret_code = NewRequestHandler( &DestAddr, 3, &msgs[0] );
-    } else                      // sub-device
-    {
-        // send 2 msg types
-        ret_code = NewRequestHandler( &DestAddr, 2, &msgs[1] );
+    if( textNode != NULL ) {
+        value = ixmlNode_getNodeValue( textNode );
     }
+    ixmlNodeList_free( nodeList );
 
-    // free msgs
-    free( msgs[0] );
-    free( msgs[1] );
-    free( msgs[2] );
-
-    return ret_code;
+    return value;
 }
 
 /************************************************************************
-* Function : SendReply
+* Function : AddPacket
 *
 * Parameters:
-*	IN struct sockaddr_in * DestAddr:destination IP address.
-*	IN char *DevType: Device type
-*	IN int RootDev: 1 means root device 0 means embedded device.
-*	IN char * Udn: Device UDN
-*	IN char * Location: Location of Device description document.
-*	IN int  Duration :Life time of this device.
-*	IN int ByType:
+*	INOUT SsdpPacketSet *set: set of packets being compiled
+*	IN enum SsdpSearchType type: kind of target of the packets
+*	IN char *nt: ssdp type (NT of the advertisements, ST of the replies)
+*	IN char *usn: unique service name
+*	IN char *udn: UDN of the device
+*	IN char *location: Location URL.
+*	IN int duration: Service duration in sec.
 *
 * Description:
-*	This function creates the reply packet based on the input parameter, 
-*	and send it to the client addesss given in its input parameter DestAddr.
+*	This function renders the advertisement, shutdown and search reply
+*	datagrams of one target and appends them to the set. The place of
+*	the DATE header value of the reply is recorded so that it can be
+*	patched when the reply is sent.
 *
 * Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+*	DLNA_E_SUCCESS if successful else DLNA_E_OUTOF_MEMORY
 ***************************************************************************/
-int
-SendReply( IN struct sockaddr_in *DestAddr,
-           IN char *DevType,
-           IN int RootDev,
-           IN char *Udn,
-           IN char *Location,
-           IN int Duration,
-           IN int ByType )
+static int
+AddPacket( INOUT SsdpPacketSet * set,
+           IN enum SsdpSearchType type,
+           IN char *nt,
+           IN char *usn,
+           IN char *udn,
+           IN char *location,
+           IN int duration )
 {
-    int ret_code;
-    char *msgs[2];
-    int num_msgs;
-    char Mil_Usn[LINE_SIZE];
-    int i;
-
-    msgs[0] = NULL;
-    msgs[1] = NULL;
-
-    if( RootDev ) {
-        // one msg for root device
-        num_msgs = 1;
-
-        sprintf( Mil_Usn, "%s::dlna:rootdevice", Udn );
-        CreateServicePacket( MSGTYPE_REPLY, "dlna:rootdevice",
-                             Mil_Usn, Location, Duration, &msgs[0] );
-    } else {
-        // two msgs for embedded devices
-        num_msgs = 1;
-
-        //NK: FIX for extra response when someone searches by udn
-        if( !ByType ) {
-            CreateServicePacket( MSGTYPE_REPLY, Udn, Udn, Location,
-                                 Duration, &msgs[0] );
-        } else {
-            sprintf( Mil_Usn, "%s::%s", Udn, DevType );
-            CreateServicePacket( MSGTYPE_REPLY, DevType, Mil_Usn,
-                                 Location, Duration, &msgs[0] );
-        }
-    }
-
-    // check error
-    for( i = 0; i < num_msgs; i++ ) {
-        if( msgs[i] == NULL ) {
-            free( msgs[0] );
+    SsdpPacket *packets;
+    SsdpPacket *packet;
+    char *date;
+
+    if( set->count == set->size ) {
+        packets = ( SsdpPacket * ) realloc( set->packets,
+            ( set->size + 8 ) * sizeof( SsdpPacket ) );
+        if( packets == NULL ) {
             return DLNA_E_OUTOF_MEMORY;
         }
+        set->packets = packets;
+        set->size += 8;
     }
 
-    // send msgs
-    ret_code = NewRequestHandler( DestAddr, num_msgs, msgs );
-    for( i = 0; i < num_msgs; i++ ) {
-        if( msgs[i] != NULL )
-            free( msgs[i] );
-    }
-
-    return ret_code;
-}
-
-/************************************************************************
-* Function : DeviceReply
-*
-* Parameters:
-*	IN struct sockaddr_in * DestAddr:destination IP address.
-*	IN char *DevType: Device type
-*	IN int RootDev: 1 means root device 0 means embedded device.
-*	IN char * Udn: Device UDN
-*	IN char * Location: Location of Device description document.
-*	IN int  Duration :Life time of this device.
-* Description:
-*	This function creates the reply packet based on the input parameter, 
-*	and send it to the client address given in its input parameter DestAddr.
-*
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
-***************************************************************************/
-int
-DeviceReply( IN struct sockaddr_in *DestAddr,
-             IN char *DevType,
-             IN int RootDev,
-             IN char *Udn,
-             IN char *Location,
-             IN int Duration )
-{
-    char *szReq[3],
-      Mil_Nt[LINE_SIZE],
-      Mil_Usn[LINE_SIZE];
-    int RetVal;
-
-    szReq[0] = NULL;
-    szReq[1] = NULL;
-    szReq[2] = NULL;
-
-    // create 2 or 3 msgs
-
-    if( RootDev ) {
-        // 3 replies for root device
-        strcpy( Mil_Nt, "dlna:rootdevice" );
-        sprintf( Mil_Usn, "%s::dlna:rootdevice", Udn );
-        CreateServicePacket( MSGTYPE_REPLY, Mil_Nt, Mil_Usn,
-                             Location, Duration, &szReq[0] );
-    }
-
-    sprintf( Mil_Nt, "%s", Udn );
-    sprintf( Mil_Usn, "%s", Udn );
-    CreateServicePacket( MSGTYPE_REPLY, Mil_Nt, Mil_Usn,
-                         Location, Duration, &szReq[1] );
-
-    sprintf( Mil_Nt, "%s", DevType );
-    sprintf( Mil_Usn, "%s::%s", Udn, DevType );
-    CreateServicePacket( MSGTYPE_REPLY, Mil_Nt, Mil_Usn,
-                         Location, Duration, &szReq[2] );
-
-    // check error
-
-    if( ( RootDev && szReq[0] == NULL ) ||
-        szReq[1] == NULL || szReq[2] == NULL ) {
-        free( szReq[0] );
-        free( szReq[1] );
-        free( szReq[2] );
+    packet = &set->packets[set->count];
+    memset( packet, 0, sizeof( SsdpPacket ) );
+    packet->type = type;
+    packet->target = strdup( nt );
+    packet->UDN = strdup( udn );
+    CreateServicePacket( MSGTYPE_ADVERTISEMENT, nt, usn, location,
+                         duration, &packet->alive );
+    CreateServicePacket( MSGTYPE_SHUTDOWN, nt, usn, location,
+                         duration, &packet->byebye );
+    CreateServicePacket( MSGTYPE_REPLY, nt, usn, location,
+                         duration, &packet->reply );
+
+    if( packet->target == NULL || packet->UDN == NULL ||
+        packet->alive == NULL || packet->byebye == NULL ||
+        packet->reply == NULL ||
+        ( date = strstr( packet->reply, "\r\nDATE: " ) ) == NULL ) {
+        SsdpFreePacket( packet );
         return DLNA_E_OUTOF_MEMORY;
     }
-    // send replies
-    if( RootDev ) {
-        RetVal = NewRequestHandler( DestAddr, 3, szReq );
-    } else {
-        RetVal = NewRequestHandler( DestAddr, 2, &szReq[1] );
-    }
+    packet->reply_length = strlen( packet->reply );
+    packet->reply_date = date + strlen( "\r\nDATE: " ) - packet->reply;
+    set->count++;
 
-    // free
-    free( szReq[0] );
-    free( szReq[1] );
-    free( szReq[2] );
-
-    return RetVal;
+    return DLNA_E_SUCCESS;
 }
 
 /************************************************************************
-* Function : ServiceAdvertisement
+* Function : SsdpFreePacket
 *
 * Parameters:
-*	IN char * Udn: Device UDN
-*	IN char *ServType: Service Type.
-*	IN char * Location: Location of Device description document.
-*	IN int  Duration :Life time of this device.
+*	IN SsdpPacket *packet: packet to free
+*
 * Description:
-*	This function creates the advertisement packet based
-*	on the input parameter, and send it to the multicast channel.
+*	This function frees the datagrams of one target.
 *
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+* Returns: void
 ***************************************************************************/
-int
-ServiceAdvertisement( IN char *Udn,
-                      IN char *ServType,
-                      IN char *Location,
-                      IN int Duration )
+void
+SsdpFreePacket( IN SsdpPacket * packet )
 {
-    char Mil_Usn[LINE_SIZE];
-    char *szReq[1];
-    struct sockaddr_in DestAddr;
-    int RetVal;
-
-    DestAddr.sin_family = AF_INET;
-    DestAddr.sin_addr.s_addr = inet_addr( SSDP_IP );
-    DestAddr.sin_port = htons( SSDP_PORT );
-
-    sprintf( Mil_Usn, "%s::%s", Udn, ServType );
-
-    //CreateServiceRequestPacket(1,szReq[0],Mil_Nt,Mil_Usn,
-    //Server,Location,Duration);
-    CreateServicePacket( MSGTYPE_ADVERTISEMENT, ServType, Mil_Usn,
-                         Location, Duration, &szReq[0] );
-    if( szReq[0] == NULL ) {
-        return DLNA_E_OUTOF_MEMORY;
-    }
-
-    RetVal = NewRequestHandler( &DestAddr, 1, szReq );
-
-    free( szReq[0] );
-    return RetVal;
+    free( packet->target );
+    free( packet->UDN );
+    free( packet->alive );
+    free( packet->byebye );
+    free( packet->reply );
 }
 
 /************************************************************************
-* Function : ServiceReply
+* Function : SsdpFreePackets
 *
 * Parameters:
-*	IN struct sockaddr_in *DestAddr:
-*	IN char * Udn: Device UDN
-*	IN char *ServType: Service Type.
-*	IN char * Location: Location of Device description document.
-*	IN int  Duration :Life time of this device.
+*	IN SsdpPacketSet *set: set of packets to free, may be NULL
+*
 * Description:
-*	This function creates the advertisement packet based 
-*	on the input parameter, and send it to the multicast channel.
+*	This function frees the packets compiled for a device.
 *
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+* Returns: void
 ***************************************************************************/
-int
-ServiceReply( IN struct sockaddr_in *DestAddr,
-              IN char *ServType,
-              IN char *Udn,
-              IN char *Location,
-              IN int Duration )
+void
+SsdpFreePackets( IN SsdpPacketSet * set )
 {
-    char Mil_Usn[LINE_SIZE];
-    char *szReq[1];
-    int RetVal;
-
-    szReq[0] = NULL;
-
-    sprintf( Mil_Usn, "%s::%s", Udn, ServType );
+    int i;
 
-    CreateServicePacket( MSGTYPE_REPLY, ServType, Mil_Usn,
-                         Location, Duration, &szReq[0] );
-    if( szReq[0] == NULL ) {
-        return DLNA_E_OUTOF_MEMORY;
+    if( set == NULL ) {
+        return;
     }
-
-    RetVal = NewRequestHandler( DestAddr, 1, szReq );
-
-    free( szReq[0] );
-    return RetVal;
+    for( i = 0; i < set->count; i++ ) {
+        SsdpFreePacket( &set->packets[i] );
+    }
+    free( set->packets );
+    free( set );
 }
 
 /************************************************************************
-* Function : ServiceShutdown
+* Function : SsdpCompilePackets
 *
 * Parameters:
-*	IN char * Udn: Device UDN
-*	IN char *ServType: Service Type.
-*	IN char * Location: Location of Device description document.
-*	IN int  Duration :Service duration in sec.
+*	IN IXML_NodeList *DeviceList: devices of the description
+*	IN IXML_NodeList *ServiceList: service lists of the description
+*	IN char *Location: Location URL of the description.
+*	IN int Duration: advertisement age in sec.
+*	OUT SsdpPacketSet **Packets: compiled packets
+*
 * Description:
-*	This function creates a HTTP service shutdown request packet 
-*	and sent it to the multicast channel through RequestHandler.
+*	This function walks the device description once and renders all
+*	the NOTIFY alive and byebye datagrams and search replies of the
+*	device, in the order they are to be sent: for each device, the root
+*	device (first device only), UDN and device type targets followed by
+*	the service types of the device.
 *
 * Returns: int
 *	DLNA_E_SUCCESS if successful else appropriate error
 ***************************************************************************/
 int
-ServiceShutdown( IN char *Udn,
-                 IN char *ServType,
-                 IN char *Location,
-                 IN int Duration )
+SsdpCompilePackets( IN IXML_NodeList * DeviceList,
+                    IN IXML_NodeList * ServiceList,
+                    IN char *Location,
+                    IN int Duration,
+                    OUT SsdpPacketSet ** Packets )
 {
-    char Mil_Usn[LINE_SIZE];
-    char *szReq[1];
-    struct sockaddr_in DestAddr;
-    int RetVal;
-
-    DestAddr.sin_family = AF_INET;
-    DestAddr.sin_addr.s_addr = inet_addr( SSDP_IP );
-    DestAddr.sin_port = htons( SSDP_PORT );
-
-    //sprintf(Mil_Nt,"%s",ServType);
-    sprintf( Mil_Usn, "%s::%s", Udn, ServType );
-    //CreateServiceRequestPacket(0,szReq[0],Mil_Nt,Mil_Usn,
-    //Server,Location,Duration);
-    CreateServicePacket( MSGTYPE_SHUTDOWN, ServType, Mil_Usn,
-                         Location, Duration, &szReq[0] );
-    if( szReq[0] == NULL ) {
+    SsdpPacketSet *set;
+    IXML_NodeList *nodeList;
+    IXML_Node *tmpNode;
+    const DOMString tmpStr;
+    char UDNstr[LINE_SIZE];
+    char devType[LINE_SIZE];
+    char Mil_Usn[2 * LINE_SIZE + 2];
+    int ret_code = DLNA_E_SUCCESS;
+    int i,
+      j;
+
+    set = ( SsdpPacketSet * ) malloc( sizeof( SsdpPacketSet ) );
+    if( set == NULL ) {
         return DLNA_E_OUTOF_MEMORY;
     }
-    RetVal = NewRequestHandler( &DestAddr, 1, szReq );
+    set->packets = NULL;
+    set->count = 0;
+    set->size = 0;
+    set->duration = Duration;
+
+    for( i = 0; ret_code == DLNA_E_SUCCESS; i++ ) {
+        tmpNode = ixmlNodeList_item( DeviceList, i );
+        if( tmpNode == NULL ) {
+            break;
+        }
 
-    free( szReq[0] );
-    return RetVal;
-}
+        // extract device type
+        tmpStr = GetNodeText( tmpNode, "deviceType" );
+        if( tmpStr == NULL ) {
+            continue;
+        }
+        strncpy( devType, tmpStr, LINE_SIZE - 1 );
+        devType[LINE_SIZE - 1] = '\0';
+
+        // extract UDN
+        tmpStr = GetNodeText( tmpNode, "UDN" );
+        if( tmpStr == NULL ) {
+            dlnaPrintf( DLNA_CRITICAL, API, __FILE__, __LINE__,
+                "UDN not found!!!\n" );
+            continue;
+        }
+        strncpy( UDNstr, tmpStr, LINE_SIZE - 1 );
+        UDNstr[LINE_SIZE - 1] = '\0';
 
-/************************************************************************
-* Function : DeviceShutdown
-*
-* Parameters:
-*	IN char *DevType: Device Type.
-*	IN int RootDev:1 means root device.
-*	IN char * Udn: Device UDN
-*	IN char * Location: Location URL
-*	IN int  Duration :Device duration in sec.
-*
-* Description:
-*	This function creates a HTTP device shutdown request packet 
-*	and sent it to the multicast channel through RequestHandler.
-*
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
-***************************************************************************/
-int
-DeviceShutdown( IN char *DevType,
-                IN int RootDev,
-                IN char *Udn,
-                IN char *_Server dlna_unused,
-                IN char *Location,
-                IN int Duration )
-{
-    struct sockaddr_in DestAddr;
-    char *msgs[3];
-    char Mil_Usn[LINE_SIZE];
-    int ret_code;
+        dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
+            "Compiling SSDP packets of %s (%s)\n", UDNstr, devType );
+
+        //If deviceis a root device , here we need to 
+        //send 3 advertisement or reply
+        if( i == 0 ) {
+            snprintf( Mil_Usn, sizeof( Mil_Usn ), "%s::dlna:rootdevice", UDNstr );
+            ret_code = AddPacket( set, SSDP_ROOTDEVICE, "dlna:rootdevice",
+                                  Mil_Usn, UDNstr, Location, Duration );
+            if( ret_code != DLNA_E_SUCCESS ) {
+                break;
+            }
+        }
+        // both root and sub-devices need to send these two messages
+        ret_code = AddPacket( set, SSDP_DEVICEUDN, UDNstr, UDNstr, UDNstr,
+                              Location, Duration );
+        if( ret_code != DLNA_E_SUCCESS ) {
+            break;
+        }
+        snprintf( Mil_Usn, sizeof( Mil_Usn ), "%s::%s", UDNstr, devType );
+        ret_code = AddPacket( set, SSDP_DEVICETYPE, devType, Mil_Usn,
+                              UDNstr, Location, Duration );
+        if( ret_code != DLNA_E_SUCCESS ) {
+            break;
+        }
 
-    msgs[0] = NULL;
-    msgs[1] = NULL;
-    msgs[2] = NULL;
-
-    DestAddr.sin_family = AF_INET;
-    DestAddr.sin_addr.s_addr = inet_addr( SSDP_IP );
-    DestAddr.sin_port = htons( SSDP_PORT );
-
-    // root device has one extra msg
-    if( RootDev ) {
-        sprintf( Mil_Usn, "%s::dlna:rootdevice", Udn );
-        CreateServicePacket( MSGTYPE_SHUTDOWN, "dlna:rootdevice",
-                             Mil_Usn, Location, Duration, &msgs[0] );
-    }
-
-    dlnaPrintf( DLNA_INFO, SSDP, __FILE__, __LINE__,
-        "In function DeviceShutdown\n" );
-    // both root and sub-devices need to send these two messages
-    CreateServicePacket( MSGTYPE_SHUTDOWN, Udn, Udn,
-                         Location, Duration, &msgs[1] );
-
-    sprintf( Mil_Usn, "%s::%s", Udn, DevType );
-    CreateServicePacket( MSGTYPE_SHUTDOWN, DevType, Mil_Usn,
-                         Location, Duration, &msgs[2] );
-
-    // check error
-    if( ( RootDev && msgs[0] == NULL ) ||
-        msgs[1] == NULL || msgs[2] == NULL ) {
-        free( msgs[0] );
-        free( msgs[1] );
-        free( msgs[2] );
-        return DLNA_E_OUTOF_MEMORY;
-    }
-    // send packets
-    if( RootDev ) {
-        // send 3 msg types
-        ret_code = NewRequestHandler( &DestAddr, 3, &msgs[0] );
-    } else                      // sub-device
-    {
-        // send 2 msg types
-        ret_code = NewRequestHandler( &DestAddr, 2, &msgs[1] );
+        // services corresponding to the same device
+        tmpNode = ixmlNodeList_item( ServiceList, i );
+        if( tmpNode == NULL ) {
+            continue;
+        }
+        nodeList = ixmlElement_getElementsByTagName( ( IXML_Element * )
+                                                     tmpNode, "service" );
+        if( nodeList == NULL ) {
+            continue;
+        }
+        for( j = 0;; j++ ) {
+            tmpNode = ixmlNodeList_item( nodeList, j );
+            if( tmpNode == NULL ) {
+                break;
+            }
+            // servType is of format Servicetype:ServiceVersion
+            tmpStr = GetNodeText( tmpNode, "serviceType" );
+            if( tmpStr == NULL ) {
+                dlnaPrintf( DLNA_CRITICAL, API, __FILE__, __LINE__,
+                    "ServiceType not found \n" );
+                continue;
+            }
+            if( snprintf( Mil_Usn, sizeof( Mil_Usn ), "%s::%s", UDNstr,
+                          tmpStr ) >= ( int )sizeof( Mil_Usn ) ) {
+                continue;
+            }
+            ret_code = AddPacket( set, SSDP_SERVICE, ( char * )tmpStr,
+                                  Mil_Usn, UDNstr, Location, Duration );
+            if( ret_code != DLNA_E_SUCCESS ) {
+                break;
+            }
+        }
+        ixmlNodeList_free( nodeList );
     }
 
-    // free msgs
-    free( msgs[0] );
-    free( msgs[1] );
-    free( msgs[2] );
+    if( ret_code != DLNA_E_SUCCESS ) {
+        SsdpFreePackets( set );
+        return ret_code;
+    }
 
-    return ret_code;
+    *Packets = set;
+    return DLNA_E_SUCCESS;
 }
 
 #endif // EXCLUDE_SSDP
 #endif // INCLUDE_DEVICE_APIS
-
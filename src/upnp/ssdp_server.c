@@ -35,6 +35,7 @@
 #include "membuffer.h"
 #include "ssdplib.h"
 #include <stdio.h>
+#include <ctype.h>
 #include "ThreadPool.h"
 #include "miniserver.h"
 
@@ -87,6 +88,10 @@ struct SSDPSockArray {
  *
  * Description:
  *	This function sends SSDP advertisements, replies and shutdown messages.
+ *	The datagrams are compiled when the device is registered; only the
+ *	DATE of the replies is filled in here. They advertise the max-age
+ *	they were compiled with, which dlnaSendAdvertisement keeps equal to
+ *	Exp.
  *
  * Returns: int
  *	DLNA_E_SUCCESS if successful else appropriate error
@@ -100,22 +105,21 @@ int AdvertiseAndReply( IN int AdFlag,
                        IN char *ServiceType,
                        int Exp )
 {
-    int i,
-      j;
-    int defaultExp = DEFAULT_MAXAGE;
+    int i;
+    int ret_code;
+    int num_msgs = 0;
     struct Handle_Info *SInfo = NULL;
-    char UDNstr[100],
-      devType[100],
-      servType[100];
-    IXML_NodeList *nodeList = NULL;
-    IXML_NodeList *tmpNodeList = NULL;
-    IXML_Node *tmpNode = NULL;
-    IXML_Node *tmpNode2 = NULL;
-    IXML_Node *textNode = NULL;
-    const DOMString tmpStr;
-    char SERVER[200];
-
-    const DOMString dbgStr;
+    SsdpPacketSet *set;
+    SsdpPacket *packet;
+    struct sockaddr_in MultiAddr;
+    char **msgs = NULL;
+    char *replies = NULL;
+    char *reply;
+    size_t replies_size = 0;
+    int *match = NULL;
+    membuffer date;
+    time_t now;
+
     dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
         "Inside AdvertiseAndReply with AdFlag = %d\n",
         AdFlag );
@@ -126,272 +130,123 @@ int AdvertiseAndReply( IN int AdFlag,
         HandleUnlock();
         return DLNA_E_INVALID_HANDLE;
     }
-    defaultExp = SInfo->MaxAge;
-
-    //get server info
-
-    get_sdk_info( SERVER );
-
-    // parse the device list and send advertisements/replies 
-    for( i = 0;; i++ ) {
-
-        dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-            "Entering new device list with i = %d\n\n", i );
-
-        tmpNode = ixmlNodeList_item( SInfo->DeviceList, i );
-        if( tmpNode == NULL ) {
-            dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-                "Exiting new device list with i = %d\n\n", i );
-            break;
-        }
-
-        dbgStr = ixmlNode_getNodeName( tmpNode );
+    set = SInfo->SsdpPackets;
+    if( set == NULL ) {
+        HandleUnlock();
+        return DLNA_E_OUTOF_MEMORY;
+    }
+    if( set->count == 0 ) {
+        HandleUnlock();
+        return DLNA_E_SUCCESS;
+    }
+    if( AdFlag && Exp != set->duration ) {
         dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-            "Extracting device type once for %s\n", dbgStr );
-        // extract device type 
-        ixmlNodeList_free( nodeList );
-        nodeList = NULL;
-        nodeList = ixmlElement_getElementsByTagName(
-            ( IXML_Element * ) tmpNode, "deviceType" );
-        if( nodeList == NULL ) {
-            continue;
-        }
+            "Advertising max-age %d instead of %d\n",
+            set->duration, Exp );
+    }
 
-        dbgStr = ixmlNode_getNodeName( tmpNode );
-        dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-            "Extracting UDN for %s\n", dbgStr );
-        dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-            "Extracting device type\n" );
+    msgs = ( char ** )malloc( set->count * sizeof( char * ) );
+    match = ( int * )malloc( set->count * sizeof( int ) );
+    if( msgs == NULL || match == NULL ) {
+        HandleUnlock();
+        free( msgs );
+        free( match );
+        return DLNA_E_OUTOF_MEMORY;
+    }
 
-        tmpNode2 = ixmlNodeList_item( nodeList, 0 );
-        if( tmpNode2 == NULL ) {
-            continue;
-        }
-        textNode = ixmlNode_getFirstChild( tmpNode2 );
-        if( textNode == NULL ) {
+    // pick the packets to send
+    for( i = 0; i < set->count; i++ ) {
+        packet = &set->packets[i];
+        match[i] = 0;
+        if( AdFlag ) {
+            match[i] = 1;
             continue;
         }
-
-        dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-            "Extracting device type \n" );
-
-        tmpStr = ixmlNode_getNodeValue( textNode );
-        if( tmpStr == NULL ) {
-            continue;
+        switch ( SearchType ) {
+            case SSDP_ALL:
+                match[i] = 1;
+                break;
+            case SSDP_ROOTDEVICE:
+                match[i] = ( packet->type == SSDP_ROOTDEVICE );
+                break;
+            case SSDP_DEVICEUDN:
+                if( DeviceUDN != NULL && strlen( DeviceUDN ) != 0 ) {
+                    match[i] = ( packet->type == SSDP_DEVICEUDN &&
+                                 !strcasecmp( DeviceUDN, packet->UDN ) );
+                    break;
+                }
+                // search for any UDN: answer as for a device type
+            case SSDP_DEVICETYPE:
+                match[i] = ( packet->type == SSDP_DEVICETYPE &&
+                             !strncasecmp( DeviceType, packet->target,
+                                           strlen( DeviceType ) ) );
+                break;
+            case SSDP_SERVICE:
+                match[i] = ( packet->type == SSDP_SERVICE &&
+                             ServiceType != NULL &&
+                             !strncasecmp( ServiceType, packet->target,
+                                           strlen( ServiceType ) ) );
+                break;
+            default:
+                break;
         }
-
-        strcpy( devType, tmpStr );
-        if( devType == NULL ) {
-            continue;
+        if( match[i] ) {
+            replies_size += packet->reply_length + 1;
         }
+    }
 
-        dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-            "Extracting device type = %s\n", devType );
-        if( tmpNode == NULL ) {
-            dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-                "TempNode is NULL\n" );
-	}
-        dbgStr = ixmlNode_getNodeName( tmpNode );
-        dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
-            "Extracting UDN for %s\n", dbgStr );
-        // extract UDN 
-        ixmlNodeList_free( nodeList );
-        nodeList = NULL;
-        nodeList = ixmlElement_getElementsByTagName( ( IXML_Element * )
-                                                     tmpNode, "UDN" );
-        if( nodeList == NULL ) {
-            dlnaPrintf( DLNA_CRITICAL, API, __FILE__,
-                __LINE__, "UDN not found!!!\n" );
-                continue;
+    if( AdFlag ) {
+        for( i = 0; i < set->count; i++ ) {
+            msgs[num_msgs++] = ( AdFlag == 1 ) ?
+                set->packets[i].alive : set->packets[i].byebye;
         }
-        tmpNode2 = ixmlNodeList_item( nodeList, 0 );
-        if( tmpNode2 == NULL ) {
-            dlnaPrintf( DLNA_CRITICAL, API, __FILE__,
-                __LINE__, "UDN not found!!!\n" );
-            continue;
-        }
-        textNode = ixmlNode_getFirstChild( tmpNode2 );
-        if( textNode == NULL ) {
-            dlnaPrintf( DLNA_CRITICAL, API, __FILE__,
-                __LINE__, "UDN not found!!!\n" );
-            continue;
+        MultiAddr.sin_family = AF_INET;
+        MultiAddr.sin_addr.s_addr = inet_addr( SSDP_IP );
+        MultiAddr.sin_port = htons( SSDP_PORT );
+        DestAddr = &MultiAddr;
+    } else if( replies_size > 0 ) {
+        // copy the replies, patching in the current date
+        membuffer_init( &date );
+        now = time( NULL );
+        replies = ( char * )malloc( replies_size );
+        if( replies == NULL ||
+            http_MakeMessage( &date, 1, 1, "t", &now ) != 0 ) {
+            HandleUnlock();
+            membuffer_destroy( &date );
+            free( replies );
+            free( msgs );
+            free( match );
+            return DLNA_E_OUTOF_MEMORY;
         }
-        tmpStr = ixmlNode_getNodeValue( textNode );
-        if( tmpStr == NULL ) {
-            dlnaPrintf( DLNA_CRITICAL, API, __FILE__, __LINE__,
-                "UDN not found!!!!\n" );
+        reply = replies;
+        for( i = 0; i < set->count; i++ ) {
+            packet = &set->packets[i];
+            if( !match[i] ) {
                 continue;
-        }
-        strcpy( UDNstr, tmpStr );
-        if( UDNstr == NULL ) {
-            continue;
-        }
-
-        dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-            "Sending UDNStr = %s \n", UDNstr );
-        if( AdFlag ) {
-            // send the device advertisement 
-            if( AdFlag == 1 ) {
-                DeviceAdvertisement( devType, i == 0,
-                                     UDNstr, SInfo->DescURL, Exp );
-            } else {             // AdFlag == -1
-                DeviceShutdown( devType, i == 0, UDNstr,
-                                SERVER, SInfo->DescURL, Exp );
-            }
-        } else {
-            switch ( SearchType ) {
-
-                case SSDP_ALL:
-                    DeviceReply( DestAddr,
-                                 devType, i == 0,
-                                 UDNstr, SInfo->DescURL, defaultExp );
-                    break;
-
-                case SSDP_ROOTDEVICE:
-                    if( i == 0 ) {
-                        SendReply( DestAddr, devType, 1,
-                                   UDNstr, SInfo->DescURL, defaultExp, 0 );
-                    }
-                    break;
-                case SSDP_DEVICEUDN:
-                    {
-                        if( DeviceUDN != NULL && strlen( DeviceUDN ) != 0 ) {
-                            if( strcasecmp( DeviceUDN, UDNstr ) ) {
-                                dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-                                    "DeviceUDN=%s and search "
-                                    "UDN=%s did not match\n",
-                                    UDNstr, DeviceUDN );
-                                    break;
-                            } else {
-                                dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-                                    "DeviceUDN=%s and search "
-                                    "UDN=%s MATCH\n", UDNstr,
-                                    DeviceUDN );
-                                    SendReply( DestAddr, devType, 0,
-                                               UDNstr, SInfo->DescURL,
-                                               defaultExp, 0 );
-                                break;
-                            }
-                        }
-                    }
-                case SSDP_DEVICETYPE:
-                    {
-                        if( !strncasecmp
-                            ( DeviceType, devType,
-                              strlen( DeviceType ) ) ) {
-                            dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-                                "DeviceType=%s and search devType=%s MATCH\n",
-                                devType, DeviceType );
-                            SendReply( DestAddr, devType, 0, UDNstr,
-                                       SInfo->DescURL, defaultExp, 1 );
-                        } else {
-                            dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-                                "DeviceType=%s and search devType=%s"
-                                " DID NOT MATCH\n",
-                                devType, DeviceType );
-			}
-                        break;
-                    }
-                default:
-                    break;
             }
+            memcpy( reply, packet->reply, packet->reply_length + 1 );
+            memcpy( reply + packet->reply_date, date.buf, date.length );
+            msgs[num_msgs++] = reply;
+            reply += packet->reply_length + 1;
         }
-        // send service advertisements for services corresponding 
-        // to the same device 
-        dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-            "Sending service Advertisement\n" );
-
-        tmpNode = ixmlNodeList_item( SInfo->ServiceList, i );
-        if( tmpNode == NULL ) {
-            continue;
-        }
-        ixmlNodeList_free( nodeList );
-        nodeList = NULL;
-        nodeList = ixmlElement_getElementsByTagName( ( IXML_Element * )
-                                                     tmpNode, "service" );
-        if( nodeList == NULL ) {
-            dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-                "Service not found 3\n" );
-            continue;
-        }
-        for( j = 0;; j++ ) {
-            tmpNode = ixmlNodeList_item( nodeList, j );
-            if( tmpNode == NULL ) {
-                break;
-            }
-
-            ixmlNodeList_free( tmpNodeList );
-            tmpNodeList = NULL;
-            tmpNodeList = ixmlElement_getElementsByTagName(
-                ( IXML_Element *)tmpNode, "serviceType" );
-            if( tmpNodeList == NULL ) {
-                dlnaPrintf( DLNA_CRITICAL, API, __FILE__, __LINE__,
-                    "ServiceType not found \n" );
-                continue;
-            }
-            tmpNode2 = ixmlNodeList_item( tmpNodeList, 0 );
-            if( tmpNode2 == NULL ) {
-                continue;
-            }
-            textNode = ixmlNode_getFirstChild( tmpNode2 );
-            if( textNode == NULL ) {
-                continue;
-            }
-            // servType is of format Servicetype:ServiceVersion
-            tmpStr = ixmlNode_getNodeValue( textNode );
-            if( tmpStr == NULL ) {
-                continue;
-            }
-            strcpy( servType, tmpStr );
-            if( servType == NULL ) {
-                continue;
-            }
-
-            dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
-                "ServiceType = %s\n", servType );
-            if( AdFlag ) {
-                if( AdFlag == 1 ) {
-                    ServiceAdvertisement( UDNstr, servType,
-                                          SInfo->DescURL, Exp );
-                } else {         // AdFlag == -1
-                    ServiceShutdown( UDNstr, servType,
-                                     SInfo->DescURL, Exp );
-                }
-            } else {
-                switch ( SearchType ) {
-                    case SSDP_ALL:
-                        ServiceReply( DestAddr, servType,
-                                      UDNstr, SInfo->DescURL,
-                                      defaultExp );
-                        break;
-                    case SSDP_SERVICE:
-                        if( ServiceType != NULL ) {
-                            if( !strncasecmp( ServiceType,
-                                              servType,
-                                              strlen( ServiceType ) ) ) {
-                                ServiceReply( DestAddr, servType,
-                                              UDNstr, SInfo->DescURL,
-                                              defaultExp );
-                            }
-                        }
-                        break;
-                    default:
-                        break;
-                }               // switch(SearchType)               
+        membuffer_destroy( &date );
+    }
 
-            }
-        }
-        ixmlNodeList_free( tmpNodeList );
-        tmpNodeList = NULL;
-        ixmlNodeList_free( nodeList );
-        nodeList = NULL;
+    ret_code = DLNA_E_SUCCESS;
+    if( num_msgs > 0 ) {
+        ret_code = NewRequestHandler( DestAddr, num_msgs, msgs );
     }
+
     dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
         "Exiting AdvertiseAndReply : \n" );
 
     HandleUnlock();
 
-    return DLNA_E_SUCCESS;
+    free( replies );
+    free( msgs );
+    free( match );
+
+    return ret_code;
 
 }  /****************** End of AdvertiseAndReply *********************/
 
@@ -589,15 +444,175 @@ ssdp_request_type( IN char *cmd,
     return 0;
 }
 
+// Search recently received, to answer each copy of a search only once
+typedef struct SSDP_SEARCH {
+    struct sockaddr_in from;
+    // hash of the ST header
+    unsigned int target;
+    // end of the MX window of the search
+    time_t expires;
+} SsdpSearch;
+
+static SsdpSearch gSsdpSearches[SSDP_MAX_SEARCHES];
+
+// Request structures the next datagrams are read into, with the socket
+// their parser was prepared for; only used by the miniserver thread
+static ssdp_thread_data *gSsdpRecvSlots[SSDP_RECV_BATCH];
+static SOCKET gSsdpRecvSlotSocket[SSDP_RECV_BATCH];
+
+// Request structures released by the receive threads, kept for reuse
+static struct {
+    int initialized;
+    ithread_mutex_t mutex;
+    ssdp_thread_data *free;
+    int count;
+} gSsdpRecvPool;
+
+static void free_ssdp_event_handler_data( void *the_data );
+
+/************************************************************************
+ * Function : SsdpReceiveInit
+ *
+ * Parameters:
+ *
+ * Description:
+ *	This function prepares the pool of SSDP request structures.
+ *
+ * Returns: void
+ ***************************************************************************/
+void
+SsdpReceiveInit( void )
+{
+    if( !gSsdpRecvPool.initialized ) {
+        ithread_mutex_init( &gSsdpRecvPool.mutex, NULL );
+        gSsdpRecvPool.initialized = 1;
+    }
+    memset( gSsdpSearches, 0, sizeof( gSsdpSearches ) );
+}
+
+/************************************************************************
+ * Function : SsdpReceiveShutdown
+ *
+ * Parameters:
+ *
+ * Description:
+ *	This function frees the pooled SSDP request structures. It must be
+ *	called once the receive thread pool is shut down.
+ *
+ * Returns: void
+ ***************************************************************************/
+void
+SsdpReceiveShutdown( void )
+{
+    ssdp_thread_data *data;
+    int i;
+
+    if( !gSsdpRecvPool.initialized ) {
+        return;
+    }
+    for( i = 0; i < SSDP_RECV_BATCH; i++ ) {
+        if( gSsdpRecvSlots[i] != NULL ) {
+            free_ssdp_event_handler_data( gSsdpRecvSlots[i] );
+            gSsdpRecvSlots[i] = NULL;
+        }
+    }
+    ithread_mutex_lock( &gSsdpRecvPool.mutex );
+    while( ( data = gSsdpRecvPool.free ) != NULL ) {
+        gSsdpRecvPool.free = data->next;
+        free( data->buf );
+        free( data );
+    }
+    gSsdpRecvPool.count = 0;
+    ithread_mutex_unlock( &gSsdpRecvPool.mutex );
+}
+
+/************************************************************************
+ * Function : init_ssdp_event_handler_parser
+ *
+ * Parameters:
+ *	INOUT ssdp_thread_data *data: request structure holding its receive
+ *			buffer in data->buf
+ *	IN SOCKET socket: SSDP socket the request is read from
+ *
+ * Description:
+ *	This function prepares the parser of a request for the socket it is
+ *	read from, and hands it the receive buffer of BUFSIZE bytes.
+ *
+ * Returns: void
+ ***************************************************************************/
+static void
+init_ssdp_event_handler_parser( INOUT ssdp_thread_data * data,
+                                IN SOCKET socket )
+{
+#ifdef INCLUDE_CLIENT_APIS
+    if( socket == gSsdpReqSocket ) {
+        parser_response_init( &data->parser, HTTPMETHOD_MSEARCH );
+    } else {
+        parser_request_init( &data->parser );
+    }
+#else
+    parser_request_init( &data->parser );
+#endif
+
+    membuffer_attach( &data->parser.msg.msg, data->buf, BUFSIZE );
+    data->parser.msg.msg.length = 0;
+    data->buf = NULL;
+}
+
+/************************************************************************
+ * Function : alloc_ssdp_event_handler_data
+ *
+ * Parameters:
+ *	IN SOCKET socket: SSDP socket the request is read from
+ *
+ * Description:
+ *	This function takes a request structure from the pool, or allocates
+ *	one, and prepares its parser and its receive buffer of BUFSIZE bytes.
+ *
+ * Returns: ssdp_thread_data *
+ *	the request structure, NULL if memory is missing
+ ***************************************************************************/
+static ssdp_thread_data *
+alloc_ssdp_event_handler_data( IN SOCKET socket )
+{
+    ssdp_thread_data *data;
+
+    ithread_mutex_lock( &gSsdpRecvPool.mutex );
+    data = gSsdpRecvPool.free;
+    if( data != NULL ) {
+        gSsdpRecvPool.free = data->next;
+        gSsdpRecvPool.count--;
+    }
+    ithread_mutex_unlock( &gSsdpRecvPool.mutex );
+
+    if( data == NULL ) {
+        data = ( ssdp_thread_data * ) malloc( sizeof( ssdp_thread_data ) );
+        if( data == NULL ) {
+            return NULL;
+        }
+        data->buf = ( char * )malloc( BUFSIZE );
+        if( data->buf == NULL ) {
+            free( data );
+            return NULL;
+        }
+    }
+    data->next = NULL;
+
+    init_ssdp_event_handler_parser( data, socket );
+
+    return data;
+}
+
 /************************************************************************
  * Function : free_ssdp_event_handler_data
  *
  * Parameters:
- *	IN void *the_data: ssdp_thread_data structure. This structure contains
- *			SSDP request message.
+ *	IN void *the_data: list of ssdp_thread_data structures. These
+ *			structures contain SSDP request messages.
  *
  * Description:
- *	This function frees the ssdp request
+ *	This function frees the ssdp requests, keeping up to SSDP_RECV_POOL
+ *	of them with their buffer for the next datagrams.
  *
  * Returns: VOID
  *
@@ -606,13 +621,33 @@ static void
 free_ssdp_event_handler_data( void *the_data )
 {
     ssdp_thread_data *data = ( ssdp_thread_data * ) the_data;
+    ssdp_thread_data *next;
 
-    if( data != NULL ) {
+    while( data != NULL ) {
         http_message_t *hmsg = &data->parser.msg;
 
-        // free data
+        next = data->next;
+        // keep the buffer, free the parsed message
+        data->buf = NULL;
+        if( hmsg->msg.capacity >= BUFSIZE ) {
+            data->buf = membuffer_detach( &hmsg->msg );
+        }
         httpmsg_destroy( hmsg );
-        free( data );
+
+        ithread_mutex_lock( &gSsdpRecvPool.mutex );
+        if( data->buf != NULL && gSsdpRecvPool.count < SSDP_RECV_POOL ) {
+            data->next = gSsdpRecvPool.free;
+            gSsdpRecvPool.free = data;
+            gSsdpRecvPool.count++;
+            data = NULL;
+        }
+        ithread_mutex_unlock( &gSsdpRecvPool.mutex );
+
+        if( data != NULL ) {
+            free( data->buf );
+            free( data );
+        }
+        data = next;
     }
 }
 
@@ -665,7 +700,8 @@ valid_ssdp_msg( IN http_message_t * hmsg )
  *			SSDP request message.
  *
  * Description:
- *	This function parses the message and dispatches it to a handler
+ *	This function parses the message and checks it before it is
+ *	dispatched to a handler
  *	which handles the ssdp request msg
  *
  * Returns: int
@@ -705,7 +741,6 @@ start_event_handler( void *Data )
     return 0;                   //////// done; thread will free 'data'
 
   error_handler:
-    free_ssdp_event_handler_data( data );
     return -1;
 }
 
@@ -713,11 +748,11 @@ start_event_handler( void *Data )
  * Function : ssdp_event_handler_thread
  *
  * Parameters:
- *	IN void *the_data: ssdp_thread_data structure. This structure contains
- *			SSDP request message.
+ *	IN void *the_data: list of ssdp_thread_data structures. These
+ *			structures contain SSDP request messages.
  *
  * Description:
- *	This function is a thread that handles SSDP requests.
+ *	This function is a thread that handles SSDP requests read together.
  *
  * Returns: void
  *
@@ -726,21 +761,274 @@ static void
 ssdp_event_handler_thread( void *the_data )
 {
     ssdp_thread_data *data = ( ssdp_thread_data * ) the_data;
-    http_message_t *hmsg = &data->parser.msg;
+    ssdp_thread_data *next;
+    http_message_t *hmsg;
+
+    while( data != NULL ) {
+        next = data->next;
+        data->next = NULL;
+        hmsg = &data->parser.msg;
+
+        if( start_event_handler( data ) == 0 ) {
+            // send msg to device or ctrlpt
+            if( ( hmsg->method == HTTPMETHOD_NOTIFY ) ||
+                ( hmsg->request_method == HTTPMETHOD_MSEARCH ) ) {
+                CLIENTONLY( ssdp_handle_ctrlpt_msg( hmsg, &data->dest_addr, FALSE, NULL );)
+            } else {
+                ssdp_handle_device_request( hmsg, &data->dest_addr );
+            }
+        }
 
-    if( start_event_handler( the_data ) != 0 ) {
-        return;
+        // free data
+        free_ssdp_event_handler_data( data );
+        data = next;
     }
-    // send msg to device or ctrlpt
-    if( ( hmsg->method == HTTPMETHOD_NOTIFY ) ||
-        ( hmsg->request_method == HTTPMETHOD_MSEARCH ) ) {
-        CLIENTONLY( ssdp_handle_ctrlpt_msg( hmsg, &data->dest_addr, FALSE, NULL );)
-    } else {
-        ssdp_handle_device_request( hmsg, &data->dest_addr );
+}
+
+/************************************************************************
+ * Function : ssdp_find_raw_hdr
+ *
+ * Parameters:
+ *	IN char *msg: datagram, null-terminated
+ *	IN char *name: header name, with its colon
+ *	OUT size_t *length: length of the header value
+ *
+ * Description:
+ *	This function finds a header in a datagram which is not parsed yet.
+ *
+ * Returns: char *
+ *	the value of the header, without the leading blanks, NULL if the
+ *	header is missing
+ ***************************************************************************/
+static char *
+ssdp_find_raw_hdr( IN char *msg,
+                   IN const char *name,
+                   OUT size_t *length )
+{
+    size_t name_length = strlen( name );
+    char *line = msg;
+    char *value;
+
+    while( ( line = strchr( line, '\n' ) ) != NULL ) {
+        line++;
+        if( strncasecmp( line, name, name_length ) != 0 ) {
+            continue;
+        }
+        value = line + name_length;
+        while( *value == ' ' || *value == '\t' ) {
+            value++;
+        }
+        *length = strcspn( value, "\r\n" );
+        while( *length > 0 && ( value[*length - 1] == ' ' ||
+                                value[*length - 1] == '\t' ) ) {
+            ( *length )--;
+        }
+        return value;
     }
+    return NULL;
+}
 
-    // free data
-    free_ssdp_event_handler_data( data );
+#ifdef INCLUDE_DEVICE_APIS
+/************************************************************************
+ * Function : ssdp_device_has_target
+ *
+ * Parameters:
+ *	IN char *st: ST header of a search request, null-terminated
+ *
+ * Description:
+ *	This function tells whether the device could answer a search
+ *	request, comparing its ST header with the compiled advertisements
+ *	of the device. Search targets not understood here are let through,
+ *	the request parser decides.
+ *
+ * Returns: xboolean
+ *	FALSE if the search can be dropped, else TRUE
+ ***************************************************************************/
+static xboolean
+ssdp_device_has_target( IN char *st )
+{
+    enum SsdpSearchType type;
+    int handle;
+    struct Handle_Info *dev_info = NULL;
+    SsdpPacketSet *set;
+    SsdpPacket *packet;
+    xboolean found = TRUE;
+    size_t length;
+    char *version;
+    int i;
+
+    type = ssdp_request_type1( st );
+    switch ( type ) {
+        case SSDP_SERROR:
+            return FALSE;
+        case SSDP_DEVICEUDN:
+            if( strncasecmp( st, "uuid:", 5 ) != 0 ) {
+                return TRUE;
+            }
+            length = strlen( st );
+            break;
+        case SSDP_DEVICETYPE:
+        case SSDP_SERVICE:
+            if( strncasecmp( st, "urn:", 4 ) != 0 ) {
+                return TRUE;
+            }
+            // any version of the type may be asked for
+            version = strrchr( st, ':' );
+            length = version - st;
+            break;
+        default:
+            return TRUE;
+    }
+    if( strstr( st, "::" ) != NULL ) {
+        return TRUE;
+    }
+
+    HandleReadLock();
+    if( GetDeviceHandleInfo( &handle, &dev_info ) != HND_DEVICE ) {
+        HandleUnlock();
+        return FALSE;
+    }
+    set = dev_info->SsdpPackets;
+    if( set != NULL ) {
+        found = FALSE;
+        for( i = 0; i < set->count && !found; i++ ) {
+            packet = &set->packets[i];
+            if( packet->type != type ) {
+                continue;
+            }
+            if( type == SSDP_DEVICEUDN ) {
+                found = !strcasecmp( st, packet->UDN );
+            } else {
+                found = !strncasecmp( st, packet->target, length );
+            }
+        }
+    }
+    HandleUnlock();
+
+    return found;
+}
+
+/************************************************************************
+ * Function : ssdp_search_is_duplicate
+ *
+ * Parameters:
+ *	IN struct sockaddr_in *from: control point sending the search
+ *	IN char *st: ST header of the search
+ *	IN int mx: MX header of the search
+ *	IN time_t now: current time
+ *
+ * Description:
+ *	This function records a search request and tells whether the same
+ *	control point already sent it during its MX window. Only called by
+ *	the miniserver thread.
+ *
+ * Returns: xboolean
+ *	TRUE if the search is already answered, else FALSE
+ ***************************************************************************/
+static xboolean
+ssdp_search_is_duplicate( IN struct sockaddr_in *from,
+                          IN char *st,
+                          IN int mx,
+                          IN time_t now )
+{
+    SsdpSearch *search;
+    SsdpSearch *oldest = &gSsdpSearches[0];
+    unsigned int target = 5381;
+    int i;
+
+    for( ; *st != '\0'; st++ ) {
+        target = target * 33 + tolower( ( unsigned char )*st );
+    }
+
+    for( i = 0; i < SSDP_MAX_SEARCHES; i++ ) {
+        search = &gSsdpSearches[i];
+        if( search->target == target &&
+            search->from.sin_addr.s_addr == from->sin_addr.s_addr &&
+            search->from.sin_port == from->sin_port ) {
+            if( search->expires > now ) {
+                return TRUE;
+            }
+            oldest = search;
+            break;
+        }
+        if( search->expires < oldest->expires ) {
+            oldest = search;
+        }
+    }
+
+    oldest->from = *from;
+    oldest->target = target;
+    oldest->expires = now + MAXVAL( mx, 1 );
+    return FALSE;
+}
+#endif
+
+/************************************************************************
+ * Function : ssdp_prefilter
+ *
+ * Parameters:
+ *	IN SOCKET socket: SSDP socket the datagram is read from
+ *	IN char *msg: datagram, null-terminated
+ *	IN struct sockaddr_in *from: sender of the datagram
+ *	IN time_t now: current time
+ *
+ * Description:
+ *	This function drops the datagrams which would be parsed for nothing:
+ *	messages nobody handles in this build, searches for targets the
+ *	device does not have, and copies of a search already answered.
+ *
+ * Returns: xboolean
+ *	TRUE if the datagram must be handled, else FALSE
+ ***************************************************************************/
+static xboolean
+ssdp_prefilter( IN SOCKET socket,
+                IN char *msg,
+                IN struct sockaddr_in *from,
+                IN time_t now )
+{
+#ifdef INCLUDE_DEVICE_APIS
+    char st[LINE_SIZE];
+    char *value;
+    size_t length;
+    int mx;
+#endif
+
+#ifdef INCLUDE_CLIENT_APIS
+    if( socket == gSsdpReqSocket ) {
+        return strncmp( msg, "HTTP/", 5 ) == 0;
+    }
+    if( strncmp( msg, "NOTIFY ", 7 ) == 0 ) {
+        return TRUE;
+    }
+#endif
+    if( strncmp( msg, "M-SEARCH ", 9 ) != 0 ) {
+        return FALSE;
+    }
+#ifdef INCLUDE_DEVICE_APIS
+    value = ssdp_find_raw_hdr( msg, "ST:", &length );
+    if( value == NULL || length == 0 ) {
+        return FALSE;
+    }
+    if( length >= LINE_SIZE ) {
+        // let the request parser reject it
+        return TRUE;
+    }
+    memcpy( st, value, length );
+    st[length] = '\0';
+    if( !ssdp_device_has_target( st ) ) {
+        return FALSE;
+    }
+
+    value = ssdp_find_raw_hdr( msg, "MX:", &length );
+    if( value == NULL || length == 0 ||
+        ( mx = atoi( value ) ) < 0 ) {
+        // let the request parser reject it
+        return TRUE;
+    }
+    return !ssdp_search_is_duplicate( from, st, mx, now );
+#else
+    return FALSE;
+#endif
 }
 
 /************************************************************************
@@ -750,7 +1038,12 @@ ssdp_event_handler_thread( void *the_data )
  *	IN SOCKET socket: SSDP socket
  *
  * Description:
- *	This function reads the data from the ssdp socket.
+ *	This function reads the datagrams waiting on the ssdp socket, up to
+ *	SSDP_RECV_BATCH of them with a single system call where recvmmsg is
+ *	available, and hands the ones to handle to a single job. They are
+ *	read straight into the buffers of the request structures, which the
+ *	job takes over; the slots they leave are filled again on the next
+ *	call.
  *
  * Returns: void
  *
@@ -758,55 +1051,76 @@ ssdp_event_handler_thread( void *the_data )
 void
 readFromSSDPSocket( SOCKET socket )
 {
-    char *requestBuf = NULL;
-    char staticBuf[BUFSIZE];
-    struct sockaddr_in clientAddr;
+    struct sockaddr_in clientAddr[SSDP_RECV_BATCH];
+    int byteReceived[SSDP_RECV_BATCH];
     ThreadPoolJob job;
     ssdp_thread_data *data = NULL;
-    socklen_t socklen = 0;
-    int byteReceived = 0;
-
-    requestBuf = staticBuf;
-
-    //in case memory
-    //can't be allocated, still drain the 
-    //socket using a static buffer
-
-    socklen = sizeof( struct sockaddr_in );
-
-    data = ( ssdp_thread_data * )
-        malloc( sizeof( ssdp_thread_data ) );
-
-    if( data != NULL ) {
-        //initialize parser
-
-#ifdef INCLUDE_CLIENT_APIS
-        if( socket == gSsdpReqSocket ) {
-            parser_response_init( &data->parser, HTTPMETHOD_MSEARCH );
-        } else {
-            parser_request_init( &data->parser );
-        }
+    ssdp_thread_data *batch = NULL;
+    ssdp_thread_data **last = &batch;
+    char *requestBuf;
+    time_t now;
+    int slots;
+    int count;
+    int i;
+#if defined( __linux__ ) && defined( _GNU_SOURCE )
+    struct mmsghdr msgs[SSDP_RECV_BATCH];
+    struct iovec iov[SSDP_RECV_BATCH];
 #else
-        parser_request_init( &data->parser );
+    socklen_t socklen = sizeof( struct sockaddr_in );
 #endif
 
-        //set size of parser buffer
-
-        if( membuffer_set_size( &data->parser.msg.msg, BUFSIZE ) == 0 ) {
-            //use this as the buffer for recv
-            requestBuf = data->parser.msg.msg.buf;
-
-        } else {
-            free( data );
-            data = NULL;
+    // request structures to read into, their parser set for the socket
+    for( slots = 0; slots < SSDP_RECV_BATCH; slots++ ) {
+        data = gSsdpRecvSlots[slots];
+        if( data == NULL ) {
+            data = alloc_ssdp_event_handler_data( socket );
+            if( data == NULL ) {
+                break;
+            }
+            gSsdpRecvSlots[slots] = data;
+        } else if( gSsdpRecvSlotSocket[slots] != socket ) {
+            data->buf = membuffer_detach( &data->parser.msg.msg );
+            httpmsg_destroy( &data->parser.msg );
+            init_ssdp_event_handler_parser( data, socket );
         }
+        gSsdpRecvSlotSocket[slots] = socket;
+    }
+    if( slots == 0 ) {
+        return;
     }
-    byteReceived = recvfrom( socket, requestBuf,
-                             BUFSIZE - 1, 0,
-                             ( struct sockaddr * )&clientAddr, &socklen );
 
-    if( byteReceived > 0 ) {
-        requestBuf[byteReceived] = '\0';
+#if defined( __linux__ ) && defined( _GNU_SOURCE )
+    memset( msgs, 0, sizeof( msgs ) );
+    for( i = 0; i < slots; i++ ) {
+        iov[i].iov_base = gSsdpRecvSlots[i]->parser.msg.msg.buf;
+        iov[i].iov_len = BUFSIZE - 1;
+        msgs[i].msg_hdr.msg_name = &clientAddr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof( struct sockaddr_in );
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    // the socket is readable, do not wait for a full batch
+    count = recvmmsg( socket, msgs, slots, MSG_DONTWAIT, NULL );
+    for( i = 0; i < count; i++ ) {
+        byteReceived[i] = msgs[i].msg_len;
+    }
+#else
+    byteReceived[0] = recvfrom( socket,
+                                gSsdpRecvSlots[0]->parser.msg.msg.buf,
+                                BUFSIZE - 1, 0,
+                                ( struct sockaddr * )&clientAddr[0],
+                                &socklen );
+    count = byteReceived[0] > 0 ? 1 : 0;
+#endif
+
+    now = time( NULL );
+    for( i = 0; i < count; i++ ) {
+        if( byteReceived[i] <= 0 ) {
+            continue;
+        }
+        data = gSsdpRecvSlots[i];
+        requestBuf = data->parser.msg.msg.buf;
+        requestBuf[byteReceived[i]] = '\0';
         dlnaPrintf( DLNA_INFO, SSDP,
             __FILE__, __LINE__,
             "Start of received response ----------------------------------------------------\n"
@@ -814,29 +1128,38 @@ readFromSSDPSocket( SOCKET socket )
             "End of received response ------------------------------------------------------\n"
             "From host %s\n",
             requestBuf,
-            inet_ntoa( clientAddr.sin_addr ) );
+            inet_ntoa( clientAddr[i].sin_addr ) );
         dlnaPrintf( DLNA_PACKET, SSDP, __FILE__, __LINE__,
             "Start of received multicast packet --------------------------------------------\n"
             "%s\n"
             "End of received multicast packet ----------------------------------------------\n",
             requestBuf );
-        //add thread pool job to handle request
-        if( data != NULL ) {
-            data->parser.msg.msg.length += byteReceived;
-            // null-terminate
-            data->parser.msg.msg.buf[byteReceived] = 0;
-            data->dest_addr = clientAddr;
-            TPJobInit( &job, ( start_routine )
-                       ssdp_event_handler_thread, data );
-            TPJobSetFreeFunction( &job, free_ssdp_event_handler_data );
-            TPJobSetPriority( &job, MED_PRIORITY );
-
-            if( ThreadPoolAdd( &gRecvThreadPool, &job, NULL ) != 0 ) {
-                free_ssdp_event_handler_data( data );
-            }
+
+        if( !ssdp_prefilter( socket, requestBuf, &clientAddr[i], now ) ) {
+            // the slot keeps its structure for the next datagram
+            continue;
         }
-    } else {
-        free_ssdp_event_handler_data( data );
+
+        // the job takes the structure over
+        gSsdpRecvSlots[i] = NULL;
+        data->parser.msg.msg.length = byteReceived[i];
+        data->dest_addr = clientAddr[i];
+        *last = data;
+        last = &data->next;
+    }
+
+    if( batch == NULL ) {
+        return;
+    }
+
+    //add thread pool job to handle the requests
+    TPJobInit( &job, ( start_routine )
+               ssdp_event_handler_thread, batch );
+    TPJobSetFreeFunction( &job, free_ssdp_event_handler_data );
+    TPJobSetPriority( &job, MED_PRIORITY );
+
+    if( ThreadPoolAdd( &gRecvThreadPool, &job, NULL ) != 0 ) {
+        free_ssdp_event_handler_data( batch );
     }
 }
 
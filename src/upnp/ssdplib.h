@@ -165,10 +165,41 @@ typedef struct ssdpsearcharg
 } SsdpSearchArg;
 
 
-typedef struct 
+// Datagrams announcing a target of a device and answering searches for it
+typedef struct SsdpPacketStruct
+{
+  // SSDP_ROOTDEVICE, SSDP_DEVICEUDN, SSDP_DEVICETYPE or SSDP_SERVICE
+  enum SsdpSearchType type;
+  // NT of the advertisements, ST of the replies
+  char *target;
+  // device the target belongs to
+  char *UDN;
+  char *alive;
+  char *byebye;
+  // search reply; its DATE is patched in at reply_date when sent
+  char *reply;
+  size_t reply_length;
+  size_t reply_date;
+} SsdpPacket;
+
+// Packets of a root device, compiled when it is registered
+typedef struct SsdpPacketSetStruct
+{
+  SsdpPacket *packets;
+  int count;
+  int size;
+  // max-age the packets advertise
+  int duration;
+} SsdpPacketSet;
+
+typedef struct SsdpThreadDataStruct
 {
   http_parser_t parser;
   struct sockaddr_in dest_addr;
+  // receive buffer kept while the structure is pooled
+  char *buf;
+  // next request read in the same batch, or next pooled structure
+  struct SsdpThreadDataStruct *next;
 } ssdp_thread_data;
 
 
@@ -288,13 +319,38 @@ int get_ssdp_sockets(MiniServerSockArray *out);
 *	IN SOCKET socket: SSDP socket
 *
 * Description:
-*	This function reads the data from the ssdp socket.
+*	This function reads the datagrams waiting on the ssdp socket and
+*	hands the ones to handle to the receive thread pool.
 *
 * Returns: void
 *	
 ***************************************************************************/
 void readFromSSDPSocket(SOCKET socket);
 
+/************************************************************************
+* Function : SsdpReceiveInit
+*
+* Parameters:
+*
+* Description:
+*	This function prepares the pool of SSDP request structures.
+*
+* Returns: void
+***************************************************************************/
+void SsdpReceiveInit(void);
+
+/************************************************************************
+* Function : SsdpReceiveShutdown
+*
+* Parameters:
+*
+* Description:
+*	This function frees the pooled SSDP request structures.
+*
+* Returns: void
+***************************************************************************/
+void SsdpReceiveShutdown(void);
+
 
 /************************************************************************
 * Function : ssdp_request_type1
@@ -348,179 +404,129 @@ int ssdp_request_type(IN char * cmd, OUT SsdpEvent * Evt);
 int SearchByTarget(IN int Mx, IN char *St, IN void *Cookie);
 
 /************************************************************************
-* Function : DeviceAdvertisement
+* Function : NewRequestHandler
 *
 * Parameters:
-*	IN char *DevType : type of the device
-*	IN int RootDev   : flag to indicate if the device is root device
-*	IN char *Udn     :
-*	IN char *Location: Location URL.
-*	IN int Duration  : Service duration in sec.
+*	IN struct sockaddr_in * DestAddr: Ip address, to send the reply.
+*	IN int NumPacket: Number of packet to be sent.
+*	IN char **RqPacket: packets to be sent.
 *
 * Description:
-*	This function creates the device advertisement request based on
-*	the input parameter, and send it to the multicast channel.
+*	This function queues the packets on the SSDP transmit scheduler,
+*	SSDP_PAUSE ms apart, and returns without waiting for them to be sent.
 *
 * Returns: int
 *	DLNA_E_SUCCESS if successful else appropriate error
 ***************************************************************************/
-int DeviceAdvertisement(
-	IN char *DevType,
-	IN int RootDev,
-	IN char *Udn, 
-	IN char *Location,
-	IN int Duration);
-
+int NewRequestHandler(
+	IN struct sockaddr_in *DestAddr,
+	IN int NumPacket,
+	IN char **RqPacket);
 
 /************************************************************************
-* Function : DeviceShutdown
+* Function : SsdpTransmitInit
 *
-* Parameters:	
-*	IN char *DevType: Device Type.
-*	IN int RootDev:1 means root device.
-*	IN char *Udn: Device UDN
-*	IN char *_Server:
-*	IN char *Location: Location URL
-*	IN int Duration :Device duration in sec.
+* Parameters:
 *
 * Description:
-*	This function creates a HTTP device shutdown request packet 
-*	and sent it to the multicast channel through RequestHandler.
+*	This function opens the SSDP transmit socket and starts the
+*	scheduler sending the queued advertisements and replies.
 *
 * Returns: int
 *	DLNA_E_SUCCESS if successful else appropriate error
 ***************************************************************************/
-int DeviceShutdown(
-	IN char *DevType, 
-	IN int RootDev,
-	IN char *Udn, 
-	IN char *_Server, 
-	IN char *Location, 
-	IN int Duration);
+int SsdpTransmitInit(void);
 
 /************************************************************************
-* Function : DeviceReply
+* Function : SsdpTransmitShutdown
 *
-* Parameters:	
-*	IN struct sockaddr_in * DestAddr:destination IP address.
-*	IN char *DevType: Device type
-*	IN int RootDev: 1 means root device 0 means embedded device.
-*	IN char *Udn: Device UDN
-*	IN char *Location: Location of Device description document.
-*	IN int Duration :Life time of this device.
+* Parameters:
 *
 * Description:
-*	This function creates the reply packet based on the input parameter, 
-*	and send it to the client address given in its input parameter DestAddr.
+*	This function sends the datagrams still queued, stops the SSDP
+*	transmit scheduler and closes its socket.
 *
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+* Returns: void
 ***************************************************************************/
-int DeviceReply(
-	IN struct sockaddr_in * DestAddr, 
-	IN char *DevType, 
-	IN int RootDev, 
-	IN char *Udn, 
-	IN char *Location, IN int  Duration);
+void SsdpTransmitShutdown(void);
 
 /************************************************************************
-* Function : SendReply
-*
-* Parameters:	
-*	IN struct sockaddr_in * DestAddr:destination IP address.
-*	IN char *DevType: Device type
-*	IN int RootDev: 1 means root device 0 means embedded device.
-*	IN char * Udn: Device UDN
-*	IN char *_Server:
-*	IN char *Location: Location of Device description document.
-*	IN int Duration :Life time of this device.
-*	IN int ByType:
+* Function : CreateServicePacket
+*
+* Parameters:
+*	IN int msg_type : type of the message ( Search Reply, Advertisement
+*		or Shutdown )
+*	IN char * nt : ssdp type
+*	IN char * usn : unique service name ( go in the HTTP Header)
+*	IN char * location :Location URL.
+*	IN int  duration :Service duration in sec.
+*	OUT char** packet :Output buffer filled with HTTP statement.
 *
 * Description:
-*	This function creates the reply packet based on the input parameter, 
-*	and send it to the client addesss given in its input parameter DestAddr.
+*	This function creates a HTTP request packet.  Depending
+*	on the input parameter it either creates a service advertisement
+*	request or service shutdown request etc.
 *
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+* Returns: void
 ***************************************************************************/
-int SendReply(
-	IN struct sockaddr_in * DestAddr, 
-	IN char *DevType, 
-	IN int RootDev, 
-	IN char *Udn, 
-	IN char *Location, 
-	IN int Duration, 
-	IN int ByType );
+void CreateServicePacket(
+	IN int msg_type,
+	IN char *nt,
+	IN char *usn,
+	IN char *location,
+	IN int duration,
+	OUT char **packet);
 
 /************************************************************************
-* Function : ServiceAdvertisement
+* Function : SsdpCompilePackets
 *
-* Parameters:	
-*	IN char * Udn: Device UDN
-*	IN char *ServType: Service Type.
-*	IN char * Location: Location of Device description document.
-*	IN int Duration :Life time of this device.
+* Parameters:
+*	IN IXML_NodeList *DeviceList: devices of the description
+*	IN IXML_NodeList *ServiceList: service lists of the description
+*	IN char *Location: Location URL of the description.
+*	IN int Duration: advertisement age in sec.
+*	OUT SsdpPacketSet **Packets: compiled packets
 *
 * Description:
-*	This function creates the advertisement packet based 
-*	on the input parameter, and send it to the multicast channel.
+*	This function walks the device description once and renders all
+*	the NOTIFY alive and byebye datagrams and search replies of the
+*	device, in the order they are to be sent.
 *
 * Returns: int
 *	DLNA_E_SUCCESS if successful else appropriate error
 ***************************************************************************/
-int ServiceAdvertisement(
-	IN char *Udn, 
-	IN char *ServType,
+int SsdpCompilePackets(
+	IN IXML_NodeList *DeviceList,
+	IN IXML_NodeList *ServiceList,
 	IN char *Location,
-	IN int Duration);
+	IN int Duration,
+	OUT SsdpPacketSet **Packets);
 
 /************************************************************************
-* Function : ServiceReply
+* Function : SsdpFreePacket
 *
-* Parameters:	
-*	IN struct sockaddr_in *DestAddr:
-*	IN char *Udn: Device UDN
-*	IN char *ServType: Service Type.
-*	IN char *Server: Not used
-*	IN char *Location: Location of Device description document.
-*	IN int Duration :Life time of this device.
+* Parameters:
+*	IN SsdpPacket *packet: packet to free
 *
 * Description:
-*	This function creates the advertisement packet based 
-*	on the input parameter, and send it to the multicast channel.
+*	This function frees the datagrams of one target.
 *
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+* Returns: void
 ***************************************************************************/
-int ServiceReply(
-	IN struct sockaddr_in *DestAddr,  
-	IN char *ServType, 
-	IN char *Udn, 
-	IN char *Location,
-	IN int Duration);
+void SsdpFreePacket(IN SsdpPacket *packet);
 
 /************************************************************************
-* Function : ServiceShutdown
+* Function : SsdpFreePackets
 *
 * Parameters:
-*	IN char *Udn: Device UDN
-*	IN char *ServType: Service Type.
-*	IN char *Location: Location of Device description document.
-*	IN int Duration :Service duration in sec.
+*	IN SsdpPacketSet *set: set of packets to free, may be NULL
 *
 * Description:
-*	This function creates a HTTP service shutdown request packet 
-*	and sent it to the multicast channel through RequestHandler.
+*	This function frees the packets compiled for a device.
 *
-* Returns: int
-*	DLNA_E_SUCCESS if successful else appropriate error
+* Returns: void
 ***************************************************************************/
-int ServiceShutdown(
-	IN char *Udn,
-	IN char *ServType,
-	IN char *Location,
-	IN int Duration);
-
+void SsdpFreePackets(IN SsdpPacketSet *set);
 
 /************************************************************************
 * Function : advertiseAndReplyThread
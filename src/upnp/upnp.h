@@ -708,6 +708,29 @@ enum dlna_DescType_e {
 
 typedef enum dlna_DescType_e dlna_DescType;
 
+/** @name dlna_ThreadPoolType
+    @memo Specifies a thread pool of the SDK in
+          {\bf dlnaSetThreadPoolPolicy}.
+   */
+enum dlna_ThreadPoolType_e {
+
+	/** Sends SSDP and GENA messages and runs the timer jobs. */
+	DLNA_TP_SEND,
+
+	/** Handles SSDP messages and GENA requests received. */
+	DLNA_TP_RECV,
+
+	/** Reads HTTP requests, handles SOAP actions and description
+	    fetches. */
+	DLNA_TP_MINISERVER,
+
+	/** Serves media transfers from the web server. */
+	DLNA_TP_STREAM
+
+};
+
+typedef enum dlna_ThreadPoolType_e dlna_ThreadPoolType;
+
 /** Returned as part of a {\bf DLNA_CONTROL_ACTION_COMPLETE} callback.  */
 
 struct dlna_Action_Request
@@ -933,6 +956,13 @@ struct File_Info
    
   DOMString content_type;
 
+  /** The entity tag of the file, without the quotes, or {\tt NULL} to
+   *  let the web server derive one from the name, length and modification
+   *  time. A tag given here must change whenever the contents change.
+   *  It is allocated and freed like {\bf content_type}. */
+
+  DOMString etag;
+
 };
 
 /* The type of handle returned by the web server for open requests. */
@@ -1037,6 +1067,24 @@ struct dlnaVirtualDirCallbacks
      IN dlnaWebFileHandle fileHnd   /** The handle of the file to close. */
      );
 
+   /** Called by the web server to map a play time range of a file to the
+    *  bytes to send, for a {\tt TimeSeekRange.dlna.org} request.  The
+    *  times are moved to the points the bytes actually start and end at.
+    *  This callback is optional.  It should return 0 on success, a
+    *  negative value if the file can't be seeked by time, or a positive
+    *  value if the time range is out of the file.
+    */
+   int (*time_seek) (
+     IN void *cookie,
+     IN const char *filename,       /** The name of the file to seek. */
+     INOUT int64_t *StartTime,      /** The first play time, in ms. */
+     INOUT int64_t *EndTime,        /** The last play time, in ms, or -1
+                                        for the end of the file. */
+     OUT int64_t *Duration,         /** The play time of the file, in ms. */
+     OUT off_t *FirstByte,          /** The first byte to send. */
+     OUT off_t *LastByte            /** The last byte to send. */
+     );
+
 };
 
 typedef struct virtual_Dir_List
@@ -1394,6 +1442,59 @@ EXPORT_SPEC int dlnaSetMaxContentLength(
 			           for incoming SOAP actions, in bytes. */
     );
 
+/** Sets the sizing policy of one of the thread pools of the SDK.
+ *  Between its bounds, a pool adds threads when the jobs queued are
+ *  expected to wait longer than {\bf targetWaitTime}, from the wait and
+ *  run times measured for each job priority, and releases the threads
+ *  idle for longer than {\bf idleTime}. A negative value keeps the
+ *  current setting.
+ *
+ *  Called before {\bf dlnaInit}, the policy is used to start the pool.
+ *  Called after, the running pool is updated, but its maximum number
+ *  of threads can not be raised above the one it was started with.
+ *
+ *  @return [int] An integer representing one of the following:
+ *    \begin{itemize}
+ *      \item {\tt DLNA_E_SUCCESS}: The operation completed successfully.
+ *      \item {\tt DLNA_E_INVALID_PARAM}: The pool or the bounds are
+ *              not valid.
+ *      \item {\tt DLNA_E_INTERNAL_ERROR}: The running pool could not be
+ *              updated.
+ *    \end{itemize}
+ */
+EXPORT_SPEC int dlnaSetThreadPoolPolicy(
+    IN dlna_ThreadPoolType type, /** The thread pool to size. */
+    IN int minThreads,           /** Minimum number of threads. */
+    IN int maxThreads,           /** Maximum number of threads. */
+    IN int targetWaitTime,       /** Queueing delay to keep the jobs under,
+                                     in milliseconds, 0 to grow on the
+                                     queue length only. */
+    IN int idleTime              /** Time an idle thread is kept, in
+                                     milliseconds. */
+    );
+
+/** Returns the statistics of one of the thread pools of the SDK: the
+ *  jobs queued, the wait and run times of the jobs with their
+ *  histograms, by priority, the jobs stolen between threads and the
+ *  times threads waited for a job. The counters are kept by each thread
+ *  and read without locking the pool, so this can be called at any
+ *  rate while the SDK runs.
+ *
+ *  @return [int] An integer representing one of the following:
+ *    \begin{itemize}
+ *      \item {\tt DLNA_E_SUCCESS}: The operation completed successfully.
+ *      \item {\tt DLNA_E_INVALID_PARAM}: The pool or {\bf stats} is not
+ *              valid.
+ *      \item {\tt DLNA_E_FINISH}: The SDK is not running.
+ *    \end{itemize}
+ */
+struct TPOOLSTATS;
+EXPORT_SPEC int dlnaGetThreadPoolStats(
+    IN dlna_ThreadPoolType type,   /** The thread pool. */
+    OUT struct TPOOLSTATS *stats   /** The statistics, see
+                                       {\tt ThreadPool.h}. */
+    );
+
 /*! @} */ /* Initialization and Registration */
 
 /******************************************************************************
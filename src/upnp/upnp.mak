@@ -15,6 +15,7 @@ UPNP_SRCS += \
 	upnp/miniserver.c \
 	upnp/service_table.c \
 	upnp/membuffer.c \
+	upnp/bufferpool.c \
 	upnp/strintmap.c \
 	upnp/upnp_timeout.c \
 	upnp/util.c \
@@ -51,6 +52,7 @@ UPNP_SRCS += upnp/urlconfig.c
 
 
 UPNP_EXTRADIST = \
+	upnp/bufferpool.h \
 	upnp/client_table.h \
 	upnp/config.h \
 	upnp/gena_ctrlpt.h \
@@ -73,6 +73,7 @@
 #include "gena.h"
 #include "service_table.h"
 #include "miniserver.h"
+#include "bufferpool.h"
 
 #ifdef INTERNAL_WEB_SERVER
 	#include "webserver.h"
@@ -87,6 +88,10 @@ CLIENTONLY( ithread_mutex_t GlobalClientSubscribeMutex; )
 // rwlock to synchronize handles (root device or control point handle)
     ithread_rwlock_t GlobalHndRWLock;
 
+// Mutex and condition counting the references taken to the handles
+    ithread_mutex_t gHandleRefMutex;
+    ithread_cond_t gHandleRefCond;
+
 // Mutex to synchronize the uuid creation process
     ithread_mutex_t gUUIDMutex;
 
@@ -95,6 +100,7 @@ CLIENTONLY( ithread_mutex_t GlobalClientSubscribeMutex; )
     ThreadPool gSendThreadPool;
     ThreadPool gRecvThreadPool;
     ThreadPool gMiniServerThreadPool;
+    ThreadPool gStreamThreadPool;
 
 //Flag to indicate the state of web server
      WebServerState bWebServerState = WEB_SERVER_DISABLED;
@@ -123,6 +129,103 @@ size_t g_maxContentLength = DEFAULT_SOAP_CONTENT_LENGTH; // in bytes
 //    = 0 if uninitialized, = 1 if initialized.
      int dlnaSdkInit = 0;
 
+// Sizing policy of the thread pools, by dlna_ThreadPoolType
+     static struct ThreadPoolPolicy {
+         int minThreads;
+         int maxThreads;
+         int maxJobsTotal;
+         int targetWaitTime;
+         int idleTime;
+     } gThreadPoolPolicy[] = {
+         { MIN_THREADS, MAX_THREADS, MAX_JOBS_TOTAL,
+           THREAD_TARGET_WAIT_TIME, THREAD_IDLE_TIME },  // DLNA_TP_SEND
+         { MIN_THREADS, MAX_THREADS, MAX_JOBS_TOTAL,
+           THREAD_TARGET_WAIT_TIME, THREAD_IDLE_TIME },  // DLNA_TP_RECV
+         { 4, MAX_THREADS, MAX_JOBS_TOTAL,
+           THREAD_TARGET_WAIT_TIME, THREAD_IDLE_TIME },  // DLNA_TP_MINISERVER
+         { STREAM_MIN_THREADS, STREAM_MAX_THREADS, STREAM_MAX_JOBS,
+           THREAD_TARGET_WAIT_TIME, THREAD_IDLE_TIME }   // DLNA_TP_STREAM
+     };
+
+/****************************************************************************
+ * Function: GetThreadPool
+ *
+ * Parameters:
+ *	IN dlna_ThreadPoolType type: thread pool
+ *
+ * Description:
+ *	Returns the thread pool of a type
+ *
+ * Returns:
+ *	The thread pool, NULL if the type is not valid
+ *****************************************************************************/
+static ThreadPool *
+GetThreadPool( IN dlna_ThreadPoolType type )
+{
+    switch ( type ) {
+        case DLNA_TP_SEND:
+            return &gSendThreadPool;
+        case DLNA_TP_RECV:
+            return &gRecvThreadPool;
+        case DLNA_TP_MINISERVER:
+            return &gMiniServerThreadPool;
+        case DLNA_TP_STREAM:
+            return &gStreamThreadPool;
+        default:
+            return NULL;
+    }
+}
+
+/****************************************************************************
+ * Function: GetThreadPoolAttr
+ *
+ * Parameters:
+ *	IN dlna_ThreadPoolType type: thread pool
+ *	OUT ThreadPoolAttr *attr: attributes of the thread pool
+ *
+ * Description:
+ *	Fills the attributes of a thread pool from its sizing policy
+ *
+ * Returns: void
+ *****************************************************************************/
+static void
+GetThreadPoolAttr( IN dlna_ThreadPoolType type,
+                   OUT ThreadPoolAttr * attr )
+{
+    TPAttrInit( attr );
+    TPAttrSetMaxThreads( attr, gThreadPoolPolicy[type].maxThreads );
+    TPAttrSetMinThreads( attr, gThreadPoolPolicy[type].minThreads );
+    TPAttrSetJobsPerThread( attr, JOBS_PER_THREAD );
+    TPAttrSetIdleTime( attr, gThreadPoolPolicy[type].idleTime );
+    TPAttrSetMaxJobsTotal( attr, gThreadPoolPolicy[type].maxJobsTotal );
+    TPAttrSetTargetWaitTime( attr, gThreadPoolPolicy[type].targetWaitTime );
+}
+
+/****************************************************************************
+ * Function: InitThreadPool
+ *
+ * Parameters:
+ *	IN dlna_ThreadPoolType type: thread pool
+ *
+ * Description:
+ *	Starts a thread pool with its sizing policy
+ *
+ * Returns:
+ *	DLNA_E_SUCCESS on success, DLNA_E_INIT_FAILED on failure
+ *****************************************************************************/
+static int
+InitThreadPool( IN dlna_ThreadPoolType type )
+{
+    ThreadPoolAttr attr;
+
+    GetThreadPoolAttr( type, &attr );
+    if( ThreadPoolInit( GetThreadPool( type ), &attr ) != 0 ) {
+        return DLNA_E_INIT_FAILED;
+    }
+
+    return DLNA_E_SUCCESS;
+}
+
 // Global variable to denote the state of dlna SDK device registration.
 // = 0 if unregistered, = 1 if registered.
      int dlnaSdkDeviceRegistered = 0;
@@ -159,7 +262,6 @@ int dlnaInit( IN const char *HostIP,
               IN unsigned short DestPort )
 {
     int retVal = 0;
-    ThreadPoolAttr attr;
 #ifdef WIN32
 	WORD wVersionRequested;
 	WSADATA wsaData;
@@ -217,6 +319,13 @@ int dlnaInit( IN const char *HostIP,
         return DLNA_E_INIT_FAILED;
     }
 
+    if (ithread_mutex_init(&gHandleRefMutex, NULL) != 0) {
+        return DLNA_E_INIT_FAILED;
+    }
+    if (ithread_cond_init(&gHandleRefCond, NULL) != 0) {
+        return DLNA_E_INIT_FAILED;
+    }
+
     if (ithread_mutex_init(&gUUIDMutex, NULL) != 0) {
         return DLNA_E_INIT_FAILED;
     }
@@ -245,28 +354,25 @@ int dlnaInit( IN const char *HostIP,
     InitHandleList();
     HandleUnlock();
 
-    TPAttrInit( &attr );
-    TPAttrSetMaxThreads( &attr, MAX_THREADS );
-    TPAttrSetMinThreads( &attr, MIN_THREADS );
-    TPAttrSetJobsPerThread( &attr, JOBS_PER_THREAD );
-    TPAttrSetIdleTime( &attr, THREAD_IDLE_TIME );
-    TPAttrSetMaxJobsTotal( &attr, MAX_JOBS_TOTAL );
+    if( InitThreadPool( DLNA_TP_SEND ) != DLNA_E_SUCCESS ) {
+        dlnaSdkInit = 0;
+        dlnaFinish();
+        return DLNA_E_INIT_FAILED;
+    }
 
-    if( ThreadPoolInit( &gSendThreadPool, &attr ) != DLNA_E_SUCCESS ) {
+    if( InitThreadPool( DLNA_TP_RECV ) != DLNA_E_SUCCESS ) {
         dlnaSdkInit = 0;
         dlnaFinish();
         return DLNA_E_INIT_FAILED;
     }
 
-    if( ThreadPoolInit( &gRecvThreadPool, &attr ) != DLNA_E_SUCCESS ) {
+    if( InitThreadPool( DLNA_TP_MINISERVER ) != DLNA_E_SUCCESS ) {
         dlnaSdkInit = 0;
         dlnaFinish();
         return DLNA_E_INIT_FAILED;
     }
 
-    TPAttrSetMinThreads( &attr, 4 );
-    
-    if( ThreadPoolInit( &gMiniServerThreadPool, &attr ) != DLNA_E_SUCCESS ) {
+    if( InitThreadPool( DLNA_TP_STREAM ) != DLNA_E_SUCCESS ) {
         dlnaSdkInit = 0;
         dlnaFinish();
         return DLNA_E_INIT_FAILED;
@@ -287,6 +393,14 @@ int dlnaInit( IN const char *HostIP,
         dlnaFinish();
         return retVal;
     }
+#if EXCLUDE_SSDP == 0
+    SsdpReceiveInit();
+    if( ( retVal = SsdpTransmitInit() ) != DLNA_E_SUCCESS ) {
+        dlnaSdkInit = 0;
+        dlnaFinish();
+        return retVal;
+    }
+#endif
 #if EXCLUDE_MINISERVER == 0
     if( ( retVal = StartMiniServer( DestPort ) ) <= 0 ) {
         dlnaPrintf( DLNA_CRITICAL, API, __FILE__, __LINE__,
@@ -345,7 +459,12 @@ PrintThreadPoolStats(
 		"Idle Threads: %d\n"
 		"Total Threads: %d\n"
 		"Total Work Time: %lf\n"
-		"Total Idle Time: %lf\n",
+		"Total Idle Time: %lf\n"
+		"Average run in High Q in milliseconds: %lf\n"
+		"Average run in Med Q in milliseconds: %lf\n"
+		"Average run in Low Q in milliseconds: %lf\n"
+		"Jobs Stolen: %lu\n"
+		"Idle Waits: %lu\n",
 		msg,
 		stats.currentJobsHQ,
 		stats.currentJobsMQ,
@@ -359,7 +478,12 @@ PrintThreadPoolStats(
 		stats.idleThreads,
 		stats.totalThreads,
 		stats.totalWorkTime,
-		stats.totalIdleTime);
+		stats.totalIdleTime,
+		stats.avgRunTime[HIGH_PRIORITY],
+		stats.avgRunTime[MED_PRIORITY],
+		stats.avgRunTime[LOW_PRIORITY],
+		stats.totalSteals,
+		stats.totalIdleWaits);
 }
 #else /* DEBUG */
 static DLNA_INLINE void 
@@ -418,6 +542,7 @@ dlnaFinish()
     PrintThreadPoolStats(&gSendThreadPool, __FILE__, __LINE__, "Send Thread Pool");
     PrintThreadPoolStats(&gRecvThreadPool, __FILE__, __LINE__, "Recv Thread Pool");
     PrintThreadPoolStats(&gMiniServerThreadPool, __FILE__, __LINE__, "MiniServer Thread Pool");
+    PrintThreadPoolStats(&gStreamThreadPool, __FILE__, __LINE__, "Stream Thread Pool");
 
 #ifdef INCLUDE_DEVICE_APIS
     if( GetDeviceHandleInfo( &device_handle, &temp ) == HND_DEVICE )
@@ -436,18 +561,32 @@ dlnaFinish()
     web_server_destroy();
 #endif
 
+    // requests handed over by the mini server go to the stream and recv pools
     ThreadPoolShutdown(&gMiniServerThreadPool);
+    ThreadPoolShutdown(&gStreamThreadPool);
     ThreadPoolShutdown(&gRecvThreadPool);
+#if EXCLUDE_SSDP == 0
+    SsdpReceiveShutdown();
+    // the transmit scheduler runs in the send thread pool
+    SsdpTransmitShutdown();
+#endif
     ThreadPoolShutdown(&gSendThreadPool);
+    // no thread sends anymore, those still exiting free their buffers
+    bufferpool_flush();
 
     PrintThreadPoolStats(&gSendThreadPool, __FILE__, __LINE__, "Send Thread Pool");
     PrintThreadPoolStats(&gRecvThreadPool, __FILE__, __LINE__, "Recv Thread Pool");
     PrintThreadPoolStats(&gMiniServerThreadPool, __FILE__, __LINE__, "MiniServer Thread Pool");
+    PrintThreadPoolStats(&gStreamThreadPool, __FILE__, __LINE__, "Stream Thread Pool");
+
+    http_FreeTemplates();
 
 #ifdef INCLUDE_CLIENT_APIS
     ithread_mutex_destroy(&GlobalClientSubscribeMutex);
 #endif
     ithread_rwlock_destroy(&GlobalHndRWLock);
+    ithread_mutex_destroy(&gHandleRefMutex);
+    ithread_cond_destroy(&gHandleRefCond);
     ithread_mutex_destroy(&gUUIDMutex);
 
     // remove all virtual dirs
@@ -643,6 +782,8 @@ dlnaRegisterRootDevice( IN const char *DescUrl,
         "Root device URL is %s\n", DescUrl );
 
     HInfo->aliasInstalled = 0;
+    HInfo->RefCount = 0;
+    HInfo->Unregistering = 0;
     HInfo->HType = HND_DEVICE;
     strcpy( HInfo->DescURL, DescUrl );
     HInfo->Callback = Fun;
@@ -650,6 +791,7 @@ dlnaRegisterRootDevice( IN const char *DescUrl,
     HInfo->MaxAge = DEFAULT_MAXAGE;
     HInfo->DeviceList = NULL;
     HInfo->ServiceList = NULL;
+    HInfo->SsdpPackets = NULL;
     HInfo->DescDocument = NULL;
     CLIENTONLY( ListInit( &HInfo->SsdpSearchList, NULL, NULL ); )
     CLIENTONLY( HInfo->ClientSubList = NULL; )
@@ -707,6 +849,16 @@ dlnaRegisterRootDevice( IN const char *DescUrl,
             "\ndlnaRegisterRootDevice2: Empty service table\n" );
     }
 
+#if EXCLUDE_SSDP == 0
+    // render the SSDP datagrams once, not on each advertisement or search
+    if( SsdpCompilePackets( HInfo->DeviceList, HInfo->ServiceList,
+                            HInfo->DescURL, HInfo->MaxAge,
+                            &HInfo->SsdpPackets ) != DLNA_E_SUCCESS ) {
+        dlnaPrintf( DLNA_CRITICAL, API, __FILE__, __LINE__,
+            "dlnaRegisterRootDevice: SSDP packets not compiled\n" );
+    }
+#endif
+
     dlnaSdkDeviceRegistered = 1;
     HandleUnlock();
     dlnaPrintf( DLNA_INFO, API, __FILE__, __LINE__,
@@ -848,6 +1000,10 @@ dlnaUnRegisterRootDevice( IN dlnaDevice_Handle Hnd )
     //info = (struct Handle_Info *) HandleTable[Hnd];
     ixmlNodeList_free( HInfo->DeviceList );
     ixmlNodeList_free( HInfo->ServiceList );
+#if EXCLUDE_SSDP == 0
+    SsdpFreePackets( HInfo->SsdpPackets );
+    HInfo->SsdpPackets = NULL;
+#endif
     ixmlDocument_free( HInfo->DescDocument );
 
     CLIENTONLY( ListDestroy( &HInfo->SsdpSearchList, 0 ); )
@@ -1198,6 +1354,8 @@ dlnaRegisterRootDevice2( IN dlna_DescType descriptionType,
 
     // prevent accidental removal of a non-existent alias
     HInfo->aliasInstalled = 0;
+    HInfo->RefCount = 0;
+    HInfo->Unregistering = 0;
 
     retVal = GetDescDocumentAndURL(
         descriptionType, description, bufferLen,
@@ -1217,6 +1375,7 @@ dlnaRegisterRootDevice2( IN dlna_DescType descriptionType,
     HInfo->MaxAge = DEFAULT_MAXAGE;
     HInfo->DeviceList = NULL;
     HInfo->ServiceList = NULL;
+    HInfo->SsdpPackets = NULL;
 
     CLIENTONLY( ListInit( &HInfo->SsdpSearchList, NULL, NULL ); )
     CLIENTONLY( HInfo->ClientSubList = NULL; )
@@ -1266,6 +1425,16 @@ dlnaRegisterRootDevice2( IN dlna_DescType descriptionType,
             "\ndlnaRegisterRootDevice2: Empty service table\n" );
     }
 
+#if EXCLUDE_SSDP == 0
+    // render the SSDP datagrams once, not on each advertisement or search
+    if( SsdpCompilePackets( HInfo->DeviceList, HInfo->ServiceList,
+                            HInfo->DescURL, HInfo->MaxAge,
+                            &HInfo->SsdpPackets ) != DLNA_E_SUCCESS ) {
+        dlnaPrintf( DLNA_CRITICAL, API, __FILE__, __LINE__,
+            "dlnaRegisterRootDevice: SSDP packets not compiled\n" );
+    }
+#endif
+
     dlnaSdkDeviceRegistered = 1;
     HandleUnlock();
     dlnaPrintf( DLNA_ALL, API, __FILE__, __LINE__,
@@ -1330,6 +1499,8 @@ dlnaRegisterClient( IN dlna_FunPtr Fun,
     }
 
     HInfo->HType = HND_CLIENT;
+    HInfo->RefCount = 0;
+    HInfo->Unregistering = 0;
     HInfo->Callback = Fun;
     HInfo->Cookie = ( void * )Cookie;
     HInfo->ClientSubList = NULL;
@@ -1470,6 +1641,19 @@ dlnaSendAdvertisement( IN dlnaDevice_Handle Hnd,
     if( Exp < 1 )
         Exp = DEFAULT_MAXAGE;
     SInfo->MaxAge = Exp;
+    // recompile the packets advertising another max-age
+    if( SInfo->SsdpPackets == NULL || SInfo->SsdpPackets->duration != Exp ) {
+        SsdpFreePackets( SInfo->SsdpPackets );
+        SInfo->SsdpPackets = NULL;
+        if( ( retVal = SsdpCompilePackets( SInfo->DeviceList,
+                                           SInfo->ServiceList,
+                                           SInfo->DescURL, Exp,
+                                           &SInfo->SsdpPackets ) ) !=
+            DLNA_E_SUCCESS ) {
+            HandleUnlock();
+            return retVal;
+        }
+    }
     HandleUnlock();
     retVal = AdvertiseAndReply( 1, Hnd, 0, ( struct sockaddr_in * )NULL,
                                 ( char * )NULL, ( char * )NULL,
@@ -3599,6 +3783,136 @@ GetHandleInfo( dlnaClient_Handle Hnd,
 
 }  /****************** End of GetHandleInfo *********************/
 
+/**************************************************************************
+ * Function: AcquireHandleInfo
+ *
+ * Parameters:
+ *	IN dlnaClient_Handle Hnd: handle index
+ *	OUT struct Handle_Info **HndInfo: handle structure passed by
+ *		this function.
+ *
+ * Description:
+ *	This function takes a reference to a handle, so that a job can use
+ *	it, and its service table, without holding the handle lock. The
+ *	handle is not freed before the reference is released with
+ *	ReleaseHandleInfo. No reference is given to a handle which is
+ *	being unregistered.
+ *
+ * Return Values: dlna_Handle_Type
+ *	type of the handle, HND_INVALID if no reference was taken
+ ***************************************************************************/
+dlna_Handle_Type
+AcquireHandleInfo( dlnaClient_Handle Hnd,
+                   struct Handle_Info ** HndInfo )
+{
+    dlna_Handle_Type ret;
+
+    HandleReadLock();
+
+    ret = GetHandleInfo( Hnd, HndInfo );
+    if( ret == HND_CLIENT || ret == HND_DEVICE ) {
+        if( ( *HndInfo )->Unregistering ) {
+            ret = HND_INVALID;
+        } else {
+            ithread_mutex_lock( &gHandleRefMutex );
+            ( *HndInfo )->RefCount++;
+            ithread_mutex_unlock( &gHandleRefMutex );
+        }
+    } else {
+        ret = HND_INVALID;
+    }
+
+    HandleUnlock();
+
+    return ret;
+
+}  /****************** End of AcquireHandleInfo *********************/
+
+/**************************************************************************
+ * Function: AcquireDeviceHandleInfo
+ *
+ * Parameters:
+ * 	OUT dlnaDevice_Handle * device_handle_out: device handle pointer
+ *	OUT struct Handle_Info **HndInfo: Device handle structure passed by
+ *		this function.
+ *
+ * Description:
+ *	This function is to take a reference to the device handle, see
+ *	AcquireHandleInfo.
+ *
+ * Return Values: dlna_Handle_Type
+ *	HND_DEVICE, HND_INVALID if no reference was taken
+ ***************************************************************************/
+dlna_Handle_Type
+AcquireDeviceHandleInfo( dlnaDevice_Handle * device_handle_out,
+                         struct Handle_Info ** HndInfo )
+{
+    dlna_Handle_Type ret = HND_INVALID;
+
+    HandleReadLock();
+
+    if( GetDeviceHandleInfo( device_handle_out, HndInfo ) == HND_DEVICE &&
+        !( *HndInfo )->Unregistering ) {
+        ithread_mutex_lock( &gHandleRefMutex );
+        ( *HndInfo )->RefCount++;
+        ithread_mutex_unlock( &gHandleRefMutex );
+        ret = HND_DEVICE;
+    }
+
+    HandleUnlock();
+
+    return ret;
+
+}  /****************** End of AcquireDeviceHandleInfo *********************/
+
+/**************************************************************************
+ * Function: ReleaseHandleInfo
+ *
+ * Parameters:
+ *	IN struct Handle_Info *HndInfo: handle structure
+ *
+ * Description:
+ *	This function releases a reference taken with AcquireHandleInfo or
+ *	AcquireDeviceHandleInfo, waking up WaitHandleInfo with the last one.
+ *
+ * Return Values: void
+ ***************************************************************************/
+void
+ReleaseHandleInfo( struct Handle_Info *HndInfo )
+{
+    ithread_mutex_lock( &gHandleRefMutex );
+    if( --HndInfo->RefCount == 0 ) {
+        ithread_cond_broadcast( &gHandleRefCond );
+    }
+    ithread_mutex_unlock( &gHandleRefMutex );
+
+}  /****************** End of ReleaseHandleInfo *********************/
+
+/**************************************************************************
+ * Function: WaitHandleInfo
+ *
+ * Parameters:
+ *	IN struct Handle_Info *HndInfo: handle structure
+ *
+ * Description:
+ *	This function waits until all the references to a handle are
+ *	released. Unregistering must have been set, under the handle write
+ *	lock, beforehand so that no reference is taken meanwhile. Must be
+ *	called without the handle lock.
+ *
+ * Return Values: void
+ ***************************************************************************/
+void
+WaitHandleInfo( struct Handle_Info *HndInfo )
+{
+    ithread_mutex_lock( &gHandleRefMutex );
+    while( HndInfo->RefCount > 0 ) {
+        ithread_cond_wait( &gHandleRefCond, &gHandleRefMutex );
+    }
+    ithread_mutex_unlock( &gHandleRefMutex );
+
+}  /****************** End of WaitHandleInfo *********************/
+
 /**************************************************************************
  * Function: FreeHandle 
  *
@@ -4303,4 +4617,117 @@ dlnaSetMaxContentLength (
 
 }
 
+/**************************************************************************
+ * Function: dlnaSetThreadPoolPolicy
+ *
+ * Parameters:
+ *	IN dlna_ThreadPoolType type: The thread pool to size
+ *	IN int minThreads: Minimum number of threads
+ *	IN int maxThreads: Maximum number of threads
+ *	IN int targetWaitTime: Queueing delay to keep the jobs under, in
+ *		milliseconds, 0 to grow on the queue length only
+ *	IN int idleTime: Time an idle thread is kept, in milliseconds
+ *
+ * Description:
+ *	Sets the sizing policy of a thread pool. A negative value keeps
+ *	the current setting. Called before {\bf dlnaInit}, the policy is
+ *	used to start the pool; called after, the running pool is updated,
+ *	but its maximum number of threads can not be raised above the one
+ *	it was started with. On failure, the policy is left unchanged.
+ *
+ * Return Values: int
+ *	DLNA_E_SUCCESS: The operation completed successfully.
+ *	DLNA_E_INVALID_PARAM: The pool or the bounds are not valid.
+ *	DLNA_E_INTERNAL_ERROR: The running pool could not be updated.
+ *
+ ***************************************************************************/
+int
+dlnaSetThreadPoolPolicy( IN dlna_ThreadPoolType type,
+                         IN int minThreads,
+                         IN int maxThreads,
+                         IN int targetWaitTime,
+                         IN int idleTime )
+{
+    ThreadPoolAttr attr;
+    ThreadPool *tp;
+    int min;
+    int max;
+    struct ThreadPoolPolicy previous;
+
+    tp = GetThreadPool( type );
+    if( tp == NULL ) {
+        return DLNA_E_INVALID_PARAM;
+    }
+
+    min = minThreads >= 0 ? minThreads : gThreadPoolPolicy[type].minThreads;
+    max = maxThreads >= 0 ? maxThreads : gThreadPoolPolicy[type].maxThreads;
+    if( max < 1 || min > max ) {
+        return DLNA_E_INVALID_PARAM;
+    }
+    // the worker slots of a running pool are fixed
+    if( dlnaSdkInit == 1 && max > tp->workerSlots ) {
+        return DLNA_E_INVALID_PARAM;
+    }
+
+    previous = gThreadPoolPolicy[type];
+
+    gThreadPoolPolicy[type].minThreads = min;
+    gThreadPoolPolicy[type].maxThreads = max;
+    if( targetWaitTime >= 0 ) {
+        gThreadPoolPolicy[type].targetWaitTime = targetWaitTime;
+    }
+    if( idleTime >= 0 ) {
+        gThreadPoolPolicy[type].idleTime = idleTime;
+    }
+
+    if( dlnaSdkInit != 1 ) {
+        return DLNA_E_SUCCESS;
+    }
+
+    GetThreadPoolAttr( type, &attr );
+    if( ThreadPoolSetAttr( tp, &attr ) != 0 ) {
+        // the pool kept its attributes
+        gThreadPoolPolicy[type] = previous;
+        return DLNA_E_INTERNAL_ERROR;
+    }
+
+    return DLNA_E_SUCCESS;
+}
+
+/**************************************************************************
+ * Function: dlnaGetThreadPoolStats
+ *
+ * Parameters:
+ *	IN dlna_ThreadPoolType type: The thread pool
+ *	OUT ThreadPoolStats *stats: The statistics of the pool
+ *
+ * Description:
+ *	Returns the statistics of a thread pool: the jobs queued, the wait
+ *	and run times of the jobs and their histograms, by priority, and
+ *	the activity of the threads. The statistics are read without
+ *	locking the pool.
+ *
+ * Return Values: int
+ *	DLNA_E_SUCCESS: The operation completed successfully.
+ *	DLNA_E_INVALID_PARAM: The pool or the stats are not valid.
+ *	DLNA_E_FINISH: The SDK is not running.
+ *
+ ***************************************************************************/
+int
+dlnaGetThreadPoolStats( IN dlna_ThreadPoolType type,
+                        OUT ThreadPoolStats * stats )
+{
+    if( GetThreadPool( type ) == NULL || stats == NULL ) {
+        return DLNA_E_INVALID_PARAM;
+    }
+
+    if( dlnaSdkInit != 1 ) {
+        return DLNA_E_FINISH;
+    }
+
+    ThreadPoolGetStats( GetThreadPool( type ), stats );
+
+    return DLNA_E_SUCCESS;
+}
+
 /*********************** END OF FILE dlnaapi.c :) ************************/
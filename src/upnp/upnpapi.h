@@ -84,6 +84,8 @@ struct Handle_Info
                                 //description document
     IXML_NodeList *ServiceList; // List of services in the 
                                 // description document
+    struct SsdpPacketSetStruct *SsdpPackets; // SSDP datagrams compiled
+                                // from the description
     service_table ServiceTable; //table holding subscriptions and 
                                 //URL information
     int MaxSubscriptions;
@@ -96,6 +98,10 @@ struct Handle_Info
     LinkedList SsdpSearchList; // active ssdp searches   
 #endif
     int   aliasInstalled;       // 0 = not installed; otherwise installed
+
+    int   RefCount;             // references taken by the jobs working
+                                // on the handle without the handle lock
+    int   Unregistering;        // no new reference can be taken
 };
 
 extern ithread_rwlock_t GlobalHndRWLock;
@@ -123,6 +129,12 @@ dlna_Handle_Type GetClientHandleInfo(int *client_handle_out,
 dlna_Handle_Type GetDeviceHandleInfo(int *device_handle_out, 
                                      struct Handle_Info **HndInfo);
 
+dlna_Handle_Type AcquireHandleInfo(int Hnd, struct Handle_Info **HndInfo);
+dlna_Handle_Type AcquireDeviceHandleInfo(int *device_handle_out,
+                                         struct Handle_Info **HndInfo);
+void ReleaseHandleInfo(struct Handle_Info *HndInfo);
+void WaitHandleInfo(struct Handle_Info *HndInfo);
+
 
 extern char LOCAL_HOST[LINE_SIZE];
 
@@ -132,6 +144,7 @@ extern TimerThread gTimerThread;
 extern ThreadPool gRecvThreadPool;
 extern ThreadPool gSendThreadPool;
 extern ThreadPool gMiniServerThreadPool;
+extern ThreadPool gStreamThreadPool;
 
 typedef enum {
     SUBSCRIBE,
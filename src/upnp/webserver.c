@@ -53,6 +53,8 @@
 #include "upnp.h"
 #include "upnpapi.h"
 #include "ssdplib.h"
+#include "global.h"
+#include "md5.h"
 
 #ifndef WIN32
     #include <unistd.h>
@@ -78,10 +80,14 @@ struct document_type_t {
     const char *content_subtype;
 };
 
+// size of an entity tag, quotes included
+#define ETAG_SIZE 64
+
 struct xml_alias_t {
     membuffer name;             // name of DOC from root; e.g.: /foo/bar/mydesc.xml
     membuffer doc;              // the XML document contents
     time_t last_modified;
+    char etag[ETAG_SIZE];       // hash of the contents
     int *ct;
 };
 
@@ -106,12 +112,13 @@ static const char *gMediaTypes[] = {
 #define TEXT_STR         "\5"
 
 // int index
+#define IMAGE_INDEX       3
 #define APPLICATION_INDEX 4
 #define TEXT_INDEX        5
 
 // general
 #define NUM_MEDIA_TYPES       69
-#define NUM_HTTP_HEADER_NAMES 33
+#define NUM_HTTP_HEADER_NAMES 36
 
 // sorted by file extension; must have 'NUM_MEDIA_TYPES' extensions
 static const char *gEncodedMediaTypes =
@@ -193,6 +200,13 @@ static struct document_type_t gMediaTypeList[NUM_MEDIA_TYPES];
 membuffer gDocumentRootDir;     // a local dir which serves as webserver root
 static struct xml_alias_t gAliasDoc;    // XML document
 static ithread_mutex_t gWebMutex;
+
+// headers of the file responses, by range and transfer encoding
+static http_header_template gPartialChunkedHeaders;
+static http_header_template gPartialHeaders;
+static http_header_template gChunkedHeaders;
+static http_header_template gFileHeaders;
+static http_header_template gFileCloseHeaders;
 extern str_int_entry Http_Header_Names[NUM_HTTP_HEADER_NAMES];
 
 /************************************************************************
@@ -358,6 +372,7 @@ glob_alias_init( void )
     membuffer_init( &alias->name );
     alias->ct = NULL;
     alias->last_modified = 0;
+    alias->etag[0] = '\0';
 }
 
 /************************************************************************
@@ -436,6 +451,41 @@ alias_release( IN struct xml_alias_t *alias )
     ithread_mutex_unlock( &gWebMutex );
 }
 
+/************************************************************************
+ * Function: MakeHash
+ *
+ * Parameters:
+ *	IN const char *Data ; data to hash
+ *	IN size_t Length ; its length
+ *	IN int Size ; number of bytes of the hash kept, at most 16
+ *	OUT char *Hash ; buffer of 2 * Size + 1 bytes for the hash in hex
+ *
+ * Description: Formats the start of the MD5 digest of the data, used in
+ *	the entity tags.
+ *
+ * Returns:
+ *	void
+ ************************************************************************/
+static void
+MakeHash( IN const char *Data,
+          IN size_t Length,
+          IN int Size,
+          OUT char *Hash )
+{
+    MD5_CTX c;
+    unsigned char digest[16];
+    int i;
+
+    MD5Init( &c );
+    MD5Update( &c, ( unsigned char * )Data, ( unsigned int )Length );
+    MD5Final( digest, &c );
+
+    for( i = 0; i < Size; i++ ) {
+        sprintf( Hash + 2 * i, "%02x", digest[i] );
+    }
+    Hash[2 * Size] = '\0';
+}
+
 /************************************************************************
  * Function: web_server_set_alias
  *
@@ -499,6 +549,11 @@ web_server_set_alias( IN const char *alias_name,
 
         alias.last_modified = last_modified;
 
+        // strong entity tag of the contents
+        alias.etag[0] = '"';
+        MakeHash( alias_content, alias_content_length, 16, alias.etag + 1 );
+        strcat( alias.etag, "\"" );
+
         // save in module var
         ithread_mutex_lock( &gWebMutex );
         gAliasDoc = alias;
@@ -609,6 +664,7 @@ get_file_info( IN const char *filename,
     struct stat s;
     FILE *fp;
     int rc = 0;
+    char date[HTTP_DATE_SIZE];
 
     info->content_type = NULL;
 
@@ -637,10 +693,10 @@ get_file_info( IN const char *filename,
 
     rc = get_content_type( filename, &info->content_type );
 
+    http_FormatDate( info->last_modified, date );
     dlnaPrintf( DLNA_INFO, HTTP, __FILE__, __LINE__,
         "file info: %s, length: %lld, last_mod=%s readable=%d\n",
-        filename, (long long)info->file_length,
-        asctime( gmtime( &info->last_modified ) ),
+        filename, (long long)info->file_length, date,
         info->is_readable );
 
     return rc;
@@ -922,6 +978,62 @@ GetNextRange( char **SrcRangeStr,
     return 1;
 }
 
+/************************************************************************
+ * Function: AddByteRange
+ *
+ * Parameters:
+ *	INOUT struct SendInstruction * Instr ; SendInstruction object
+ *		holding the sorted ranges
+ *	off_t FirstByte ; first byte of the range to add
+ *	off_t LastByte ; last byte of the range to add
+ *
+ * Description: Adds a range to the sorted ranges of the response,
+ *	coalescing it with the ranges it overlaps or is adjacent to.
+ *
+ * Returns: int
+ *	0 on success, -1 if there are too many disjoint ranges
+ ************************************************************************/
+static int
+AddByteRange( INOUT struct SendInstruction *Instr,
+              off_t FirstByte,
+              off_t LastByte )
+{
+    struct ByteRange *Range;
+    int i;
+
+    for( i = 0; i < Instr->NumRanges; ) {
+        Range = &Instr->Ranges[i];
+        if( Range->Offset > LastByte + 1 ||
+            Range->Offset + Range->Length < FirstByte ) {
+            i++;
+            continue;
+        }
+        // overlapping or adjacent: merge and look again
+        if( Range->Offset < FirstByte ) {
+            FirstByte = Range->Offset;
+        }
+        if( Range->Offset + Range->Length - 1 > LastByte ) {
+            LastByte = Range->Offset + Range->Length - 1;
+        }
+        memmove( Range, Range + 1,
+                 ( Instr->NumRanges - i - 1 ) * sizeof( *Range ) );
+        Instr->NumRanges--;
+    }
+
+    if( Instr->NumRanges == HTTP_MAX_BYTE_RANGES ) {
+        return -1;
+    }
+    for( i = Instr->NumRanges; i > 0 &&
+         Instr->Ranges[i - 1].Offset > FirstByte; i-- ) {
+        Instr->Ranges[i] = Instr->Ranges[i - 1];
+    }
+    Instr->Ranges[i].Offset = FirstByte;
+    Instr->Ranges[i].Length = LastByte - FirstByte + 1;
+    Instr->NumRanges++;
+
+    return 0;
+}
+
 /************************************************************************
  * Function: CreateHTTPRangeResponseHeader
  *
@@ -932,7 +1044,11 @@ GetNextRange( char **SrcRangeStr,
  *		where the range operations will be stored
  *
  * Description: Fills in the Offset, read size and contents to send out
- *	as an HTTP Range Response
+ *	as an HTTP Range Response. The satisfiable ranges are sorted and
+ *	coalesced; when more than one remain, they are stored in Instr to
+ *	be sent as a multipart/byteranges response. When there are too
+ *	many of them, the Range header is ignored and the whole file is
+ *	sent.
  *
  * Returns:
  *	HTTP_BAD_REQUEST
@@ -950,9 +1066,11 @@ CreateHTTPRangeResponseHeader( char *ByteRangeSpecifier,
       LastByte;
     char *RangeInput,
      *Ptr;
+    static unsigned int BoundaryCount = 0;
 
     Instr->IsRangeActive = 1;
     Instr->ReadSendSize = FileLength;
+    Instr->NumRanges = 0;
 
     if( !ByteRangeSpecifier )
         return HTTP_BAD_REQUEST;
@@ -977,60 +1095,342 @@ CreateHTTPRangeResponseHeader( char *ByteRangeSpecifier,
         return HTTP_REQUEST_RANGE_NOT_SATISFIABLE;
     }
 
-    if( GetNextRange( &Ptr, &FirstByte, &LastByte ) != -1 ) {
-
-        if( FileLength < FirstByte ) {
+    while( Ptr != NULL ) {
+        if( GetNextRange( &Ptr, &FirstByte, &LastByte ) == -1 ) {
             free( RangeInput );
             return HTTP_REQUEST_RANGE_NOT_SATISFIABLE;
         }
 
-        if( FirstByte >= 0 && LastByte >= 0 && LastByte >= FirstByte ) {
+        if( FirstByte >= 0 && LastByte >= FirstByte
+            && FirstByte < FileLength ) {
+            // data between two bytes
             if( LastByte >= FileLength )
                 LastByte = FileLength - 1;
-
-            Instr->RangeOffset = FirstByte;
-            Instr->ReadSendSize = LastByte - FirstByte + 1;
-            sprintf( Instr->RangeHeader,
-                "CONTENT-RANGE: bytes %"PRId64"-%"PRId64"/%"PRId64"\r\n",
-                (int64_t)FirstByte,
-                (int64_t)LastByte,
-                (int64_t)FileLength );   //Data between two range.
         } else if( FirstByte >= 0 && LastByte == -1
                    && FirstByte < FileLength ) {
-            Instr->RangeOffset = FirstByte;
-            Instr->ReadSendSize = FileLength - FirstByte;
-            sprintf( Instr->RangeHeader,
-                     "CONTENT-RANGE: bytes %"PRId64"-%"PRId64"/%"PRId64"\r\n",
-                     (int64_t)FirstByte,
-                     (int64_t)(FileLength - 1),
-                     (int64_t)FileLength );
-        } else if( FirstByte == -1 && LastByte > 0 ) {
-            if( LastByte >= FileLength ) {
-                Instr->RangeOffset = 0;
-                Instr->ReadSendSize = FileLength;
-                sprintf( Instr->RangeHeader,
-                         "CONTENT-RANGE: bytes 0-%"PRId64"/%"PRId64"\r\n",
-                         (int64_t)(FileLength - 1),
-                         (int64_t)FileLength );
-            } else {
-                Instr->RangeOffset = FileLength - LastByte;
-                Instr->ReadSendSize = LastByte;
-                sprintf( Instr->RangeHeader,
-                         "CONTENT-RANGE: bytes %"PRId64"-%"PRId64"/%"PRId64"\r\n",
-                         (int64_t)(FileLength - LastByte + 1),
-                         (int64_t)FileLength,
-                         (int64_t)FileLength );
-            }
+            // data from a byte to the end
+            LastByte = FileLength - 1;
+        } else if( FirstByte == -1 && LastByte > 0 && FileLength > 0 ) {
+            // last bytes of the file
+            FirstByte = LastByte >= FileLength ? 0 : FileLength - LastByte;
+            LastByte = FileLength - 1;
         } else {
+            // not satisfiable, the other ranges may be
+            continue;
+        }
+
+        if( AddByteRange( Instr, FirstByte, LastByte ) != 0 ) {
+            // too many ranges: send the whole file
             free( RangeInput );
-            return HTTP_REQUEST_RANGE_NOT_SATISFIABLE;
+            Instr->IsRangeActive = 0;
+            Instr->NumRanges = 0;
+            return HTTP_OK;
         }
+    }
+    free( RangeInput );
+
+    if( Instr->NumRanges == 0 ) {
+        return HTTP_REQUEST_RANGE_NOT_SATISFIABLE;
+    }
+
+    Instr->FileLength = FileLength;
+    Instr->RangeOffset = Instr->Ranges[0].Offset;
+    if( Instr->NumRanges == 1 ) {
+        Instr->ReadSendSize = Instr->Ranges[0].Length;
+        sprintf( Instr->RangeHeader,
+                 "CONTENT-RANGE: bytes %"PRId64"-%"PRId64"/%"PRId64"\r\n",
+                 (int64_t)Instr->RangeOffset,
+                 (int64_t)(Instr->RangeOffset + Instr->ReadSendSize - 1),
+                 (int64_t)FileLength );
     } else {
-        free( RangeInput );
+        // the parts carry their Content-Range, and the length of the
+        // body is known once the content type of the parts is
+        Instr->RangeHeader[0] = '\0';
+        sprintf( Instr->Boundary, "%08lx%08x",
+                 ( unsigned long )time( NULL ),
+                 __atomic_add_fetch( &BoundaryCount, 1, __ATOMIC_RELAXED ) );
+    }
+
+    return HTTP_OK;
+}
+
+/************************************************************************
+ * Function: http_MakeRangePartHeader
+ *
+ * Parameters:
+ *	IN struct SendInstruction *Instr ; Send Instruction object of a
+ *		multipart/byteranges response
+ *	IN int Part ; index of the part, NumRanges for the final delimiter
+ *	OUT char *Buf ; buffer of HTTP_PART_HEADER_SIZE bytes
+ *
+ * Description: Formats the delimiter and headers that come before the
+ *	data of a part of a multipart/byteranges response, or the final
+ *	delimiter after the last part.
+ *
+ * Returns: int
+ *	the length of the headers, -1 on error
+ ************************************************************************/
+int
+http_MakeRangePartHeader( IN struct SendInstruction *Instr,
+                          IN int Part,
+                          OUT char *Buf )
+{
+    struct ByteRange *Range;
+    int len;
+
+    if( Part < 0 || Part > Instr->NumRanges ) {
+        return -1;
+    }
+
+    if( Part == Instr->NumRanges ) {
+        len = snprintf( Buf, HTTP_PART_HEADER_SIZE, "\r\n--%s--\r\n",
+                        Instr->Boundary );
+    } else {
+        Range = &Instr->Ranges[Part];
+        len = snprintf( Buf, HTTP_PART_HEADER_SIZE,
+                        "%s--%s\r\n"
+                        "CONTENT-TYPE: %s\r\n"
+                        "CONTENT-RANGE: bytes %"PRId64"-%"PRId64"/%"PRId64"\r\n"
+                        "\r\n",
+                        Part ? "\r\n" : "", Instr->Boundary,
+                        Instr->PartContentType,
+                        (int64_t)Range->Offset,
+                        (int64_t)(Range->Offset + Range->Length - 1),
+                        (int64_t)Instr->FileLength );
+    }
+    if( len < 0 || len >= HTTP_PART_HEADER_SIZE ) {
+        return -1;
+    }
+
+    return len;
+}
+
+/************************************************************************
+ * Function: CreateHTTPMultipartResponse
+ *
+ * Parameters:
+ *	INOUT struct SendInstruction * Instr ; SendInstruction object
+ *		holding several ranges
+ *	IN const char * ContentType ; content type of the file
+ *	OUT char * MultipartType ; gets the content type of the response,
+ *		of LINE_SIZE bytes
+ *
+ * Description: Completes the instructions of a multipart/byteranges
+ *	response: the parts carry the content type of the file and the
+ *	body is sent with its length rather than chunked.
+ *
+ * Returns:
+ *	HTTP_INTERNAL_SERVER_ERROR
+ *	HTTP_OK
+ ************************************************************************/
+static int
+CreateHTTPMultipartResponse( INOUT struct SendInstruction *Instr,
+                             IN const char *ContentType,
+                             OUT char *MultipartType )
+{
+    char PartHeader[HTTP_PART_HEADER_SIZE];
+    int Part;
+    int len;
+
+    if( ContentType == NULL ) {
+        ContentType = "application/octet-stream";
+    }
+    if( strlen( ContentType ) >= sizeof( Instr->PartContentType ) ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    strcpy( Instr->PartContentType, ContentType );
+
+    Instr->ReadSendSize = 0;
+    for( Part = 0; Part <= Instr->NumRanges; Part++ ) {
+        len = http_MakeRangePartHeader( Instr, Part, PartHeader );
+        if( len < 0 ) {
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        Instr->ReadSendSize += len;
+        if( Part < Instr->NumRanges ) {
+            Instr->ReadSendSize += Instr->Ranges[Part].Length;
+        }
+    }
+    Instr->IsChunkActive = 0;
+    Instr->IsTrailers = 0;
+
+    snprintf( MultipartType, LINE_SIZE, "multipart/byteranges; boundary=%s",
+              Instr->Boundary );
+
+    return HTTP_OK;
+}
+
+// size of a formatted NPT time
+#define NPT_TIME_SIZE 32
+
+/************************************************************************
+ * Function: GetNptTime
+ *
+ * Parameters:
+ *	INOUT char ** SrcTimeStr ; string starting with the time, moved
+ *		past it
+ *	OUT int64_t * Time ; gets the time, in ms
+ *
+ * Description: Parses a DLNA NPT time, either as seconds (npt-sec) or
+ *	as hours, minutes and seconds (npt-hhmmss), with optional
+ *	fractions of second.
+ *
+ * Returns: int	;
+ *	0 on success, -1 if the time is not valid
+ ************************************************************************/
+static int
+GetNptTime( INOUT char **SrcTimeStr,
+            OUT int64_t * Time )
+{
+    char *Ptr = *SrcTimeStr;
+    int64_t Seconds = 0;
+    int64_t Value;
+    int Fields = 0;
+    int Digits;
+    int Scale;
+
+    for( ;; ) {
+        Value = 0;
+        for( Digits = 0; isdigit( ( unsigned char )*Ptr ); Digits++ ) {
+            if( Digits == 9 ) {
+                return -1;
+            }
+            Value = Value * 10 + ( *Ptr++ - '0' );
+        }
+        if( Digits == 0 || ( Fields > 0 && Value > 59 ) ) {
+            return -1;
+        }
+        Seconds = Seconds * 60 + Value;
+        if( ++Fields == 3 || *Ptr != ':' ) {
+            break;
+        }
+        Ptr++;
+    }
+    // hours and minutes come together with the seconds
+    if( Fields == 2 ) {
+        return -1;
+    }
+
+    *Time = Seconds * 1000;
+    if( *Ptr == '.' ) {
+        Ptr++;
+        for( Scale = 100; isdigit( ( unsigned char )*Ptr ); Scale /= 10 ) {
+            *Time += ( *Ptr++ - '0' ) * Scale;
+        }
+    }
+
+    *SrcTimeStr = Ptr;
+    return 0;
+}
+
+/************************************************************************
+ * Function: FormatNptTime
+ *
+ * Parameters:
+ *	IN int64_t Time ; time, in ms
+ *	OUT char * TimeStr ; gets the NPT time, of NPT_TIME_SIZE bytes
+ *
+ * Description: Formats a time as a DLNA npt-hhmmss time.
+ *
+ * Returns: void
+ ************************************************************************/
+static void
+FormatNptTime( IN int64_t Time,
+               OUT char *TimeStr )
+{
+    snprintf( TimeStr, NPT_TIME_SIZE, "%"PRId64":%02d:%02d.%03d",
+              Time / 3600000, ( int )( Time / 60000 % 60 ),
+              ( int )( Time / 1000 % 60 ), ( int )( Time % 1000 ) );
+}
+
+/************************************************************************
+ * Function: CreateHTTPTimeSeekResponseHeader
+ *
+ * Parameters:
+ *	char * TimeSeekSpecifier ; String containing the NPT time range
+ *	const char * FileName ; Name of the virtual file, NULL for a file
+ *		of the document root
+ *	off_t FileLength ; Length of the file
+ *	OUT struct SendInstruction * Instr ; SendInstruction object
+ *		where the range operations will be stored
+ *
+ * Description: Maps a TimeSeekRange.dlna.org time range to bytes of the
+ *	file through the time_seek callback of the virtual directory, and
+ *	fills in the Offset, read size and the TimeSeekRange.dlna.org and
+ *	Content-Range headers of the response.
+ *
+ * Returns:
+ *	HTTP_BAD_REQUEST
+ *	HTTP_NOT_ACCEPTABLE
+ *	HTTP_REQUEST_RANGE_NOT_SATISFIABLE
+ *	HTTP_OK
+ ************************************************************************/
+static int
+CreateHTTPTimeSeekResponseHeader( char *TimeSeekSpecifier,
+                                  const char *FileName,
+                                  off_t FileLength,
+                                  OUT struct SendInstruction *Instr )
+{
+    int64_t StartTime;
+    int64_t EndTime = -1;
+    int64_t Duration;
+    off_t FirstByte,
+      LastByte;
+    char Start[NPT_TIME_SIZE],
+      End[NPT_TIME_SIZE],
+      Total[NPT_TIME_SIZE];
+    char *Ptr = TimeSeekSpecifier;
+    int ret;
+
+    while( isspace( ( unsigned char )*Ptr ) ) {
+        Ptr++;
+    }
+    if( strncasecmp( Ptr, "npt=", strlen( "npt=" ) ) != 0 ) {
+        return HTTP_BAD_REQUEST;
+    }
+    Ptr += strlen( "npt=" );
+
+    if( GetNptTime( &Ptr, &StartTime ) != 0 || *Ptr++ != '-' ) {
+        return HTTP_BAD_REQUEST;
+    }
+    if( isdigit( ( unsigned char )*Ptr ) &&
+        GetNptTime( &Ptr, &EndTime ) != 0 ) {
+        return HTTP_BAD_REQUEST;
+    }
+
+    // only files with a time index can be seeked by time
+    if( FileName == NULL || virtualDirCallback.time_seek == NULL ||
+        FileLength <= 0 ) {
+        return HTTP_NOT_ACCEPTABLE;
+    }
+    ret = virtualDirCallback.time_seek( virtualDirCallback.cookie, FileName,
+                                        &StartTime, &EndTime, &Duration,
+                                        &FirstByte, &LastByte );
+    if( ret < 0 ) {
+        return HTTP_NOT_ACCEPTABLE;
+    }
+    if( ret > 0 || FirstByte < 0 || LastByte < FirstByte ||
+        LastByte >= FileLength ) {
         return HTTP_REQUEST_RANGE_NOT_SATISFIABLE;
     }
 
-    free( RangeInput );
+    Instr->IsRangeActive = 1;
+    Instr->RangeOffset = FirstByte;
+    Instr->ReadSendSize = LastByte - FirstByte + 1;
+
+    FormatNptTime( StartTime, Start );
+    FormatNptTime( EndTime, End );
+    FormatNptTime( Duration, Total );
+    snprintf( Instr->RangeHeader, sizeof( Instr->RangeHeader ),
+              "TimeSeekRange.dlna.org: npt=%s-%s/%s "
+              "bytes=%"PRId64"-%"PRId64"/%"PRId64"\r\n"
+              "CONTENT-RANGE: bytes %"PRId64"-%"PRId64"/%"PRId64"\r\n",
+              Start, End, Total,
+              ( int64_t )FirstByte, ( int64_t )LastByte,
+              ( int64_t )FileLength,
+              ( int64_t )FirstByte, ( int64_t )LastByte,
+              ( int64_t )FileLength );
+
     return HTTP_OK;
 }
 
@@ -1041,6 +1441,8 @@ CreateHTTPRangeResponseHeader( char *ByteRangeSpecifier,
  *	IN http_message_t * Req ;  HTTP Request message
  *	OUT struct SendInstruction * RespInstr ; Send Instruction object to
  *		data for the response
+ *	IN const char * FileName ; Name of the requested virtual file,
+ *		NULL for a file of the document root
  *	int FileSize ;	Size of the file containing the request document
  *
  * Description: Get header id from the request parameter and take
@@ -1049,6 +1451,7 @@ CreateHTTPRangeResponseHeader( char *ByteRangeSpecifier,
  *
  * Returns:
  *	HTTP_BAD_REQUEST
+ *	HTTP_NOT_ACCEPTABLE
  *	DLNA_E_OUTOF_MEMORY
  *	HTTP_REQUEST_RANGE_NOT_SATISFIABLE
  *	HTTP_OK
@@ -1056,6 +1459,7 @@ CreateHTTPRangeResponseHeader( char *ByteRangeSpecifier,
 int
 CheckOtherHTTPHeaders( IN http_message_t * Req,
                        OUT struct SendInstruction *RespInstr,
+                       IN const char *FileName,
                        off_t FileSize )
 {
     http_header_t *header;
@@ -1064,6 +1468,7 @@ CheckOtherHTTPHeaders( IN http_message_t * Req,
     //NNS: dlist_node* node;
     int index,
       RetCode = HTTP_OK;
+    int Seeks = 0;
     char *TmpBuf;
 
     TmpBuf = ( char * )malloc( LINE_SIZE );
@@ -1110,6 +1515,10 @@ CheckOtherHTTPHeaders( IN http_message_t * Req,
                     }
 
                 case HDR_RANGE:
+                    if( ++Seeks > 1 ) {
+                        free( TmpBuf );
+                        return HTTP_BAD_REQUEST;
+                    }
                     if( ( RetCode = CreateHTTPRangeResponseHeader( TmpBuf,
                                                                    FileSize,
                                                                    RespInstr ) )
@@ -1118,6 +1527,22 @@ CheckOtherHTTPHeaders( IN http_message_t * Req,
                         return RetCode;
                     }
                     break;
+
+                case HDR_TIMESEEKRANGE:
+                    // a byte range and a time range can't be combined
+                    if( ++Seeks > 1 ) {
+                        free( TmpBuf );
+                        return HTTP_BAD_REQUEST;
+                    }
+                    if( ( RetCode =
+                          CreateHTTPTimeSeekResponseHeader( TmpBuf, FileName,
+                                                            FileSize,
+                                                            RespInstr ) )
+                        != HTTP_OK ) {
+                        free( TmpBuf );
+                        return RetCode;
+                    }
+                    break;
                 default:
                     /*
                        TODO 
@@ -1165,6 +1590,201 @@ CheckOtherHTTPHeaders( IN http_message_t * Req,
     return RetCode;
 }
 
+/************************************************************************
+ * Function: GetETag
+ *
+ * Parameters:
+ *	IN const char *FileName ; name of the requested file
+ *	IN const struct File_Info *finfo ; its information
+ *	OUT char *ETag ; buffer of ETAG_SIZE bytes for the quoted tag
+ *
+ * Description: Gets the strong entity tag of a file: the one given by the
+ *	virtual directory, or else one derived from the name, the length
+ *	and the modification time. A file which has no modification time
+ *	or no length gets no tag, as its contents can't be told apart.
+ *
+ * Returns:
+ *	void
+ ************************************************************************/
+static void
+GetETag( IN const char *FileName,
+         IN const struct File_Info *finfo,
+         OUT char *ETag )
+{
+    char hash[9];
+
+    if( finfo->etag != NULL &&
+        snprintf( ETag, ETAG_SIZE, "\"%s\"", finfo->etag ) < ETAG_SIZE ) {
+        return;
+    }
+
+    if( finfo->last_modified == 0 || finfo->file_length < 0 ) {
+        ETag[0] = '\0';
+        return;
+    }
+
+    MakeHash( FileName, strlen( FileName ), 4, hash );
+    snprintf( ETag, ETAG_SIZE, "\"%s-%"PRIx64"-%lx\"", hash,
+              ( int64_t ) finfo->file_length,
+              ( unsigned long )finfo->last_modified );
+}
+
+/************************************************************************
+ * Function: MakeEntityHeaders
+ *
+ * Parameters:
+ *	IN const char *ETag ; entity tag, empty if none
+ *	IN const char *ContentType ; content type of the entity
+ *	OUT char *Headers ; buffer of LINE_SIZE bytes
+ *
+ * Description: Formats the ETAG header, and the CACHE-CONTROL header of
+ *	the XML documents and of the images which have a tag. These are
+ *	mostly the descriptions and the album art, which the control points
+ *	ask for again and again.
+ *
+ * Returns:
+ *	void
+ ************************************************************************/
+static void
+MakeEntityHeaders( IN const char *ETag,
+                   IN const char *ContentType,
+                   OUT char *Headers )
+{
+    int max_age = 0;
+
+    Headers[0] = '\0';
+    if( ETag[0] == '\0' ) {
+        return;
+    }
+
+    sprintf( Headers, "ETAG: %s\r\n", ETag );
+
+    if( ContentType == NULL ) {
+        return;
+    }
+    if( strncasecmp( ContentType, "text/xml", strlen( "text/xml" ) ) == 0 ) {
+        max_age = WEB_SERVER_DESCRIPTION_MAX_AGE;
+    } else if( strncasecmp( ContentType, "image/",
+                            strlen( "image/" ) ) == 0 ) {
+        max_age = WEB_SERVER_IMAGE_MAX_AGE;
+    }
+    if( max_age > 0 ) {
+        sprintf( Headers + strlen( Headers ),
+                 "CACHE-CONTROL: max-age=%d\r\n", max_age );
+    }
+}
+
+/************************************************************************
+ * Function: MatchETag
+ *
+ * Parameters:
+ *	IN const char *List ; value of an If-None-Match header
+ *	IN const char *ETag ; entity tag of the file, empty if none
+ *
+ * Description: Looks for the tag of the file in a list of entity tags,
+ *	with the weak comparison of the GET and HEAD requests: a W/ prefix
+ *	is ignored. "*" matches any file.
+ *
+ * Returns:
+ *	TRUE if the tag is in the list
+ ************************************************************************/
+static xboolean
+MatchETag( IN const char *List,
+           IN const char *ETag )
+{
+    const char *p = List;
+    const char *end;
+    size_t length = strlen( ETag );
+
+    while( *p != '\0' ) {
+        while( *p == ' ' || *p == '\t' || *p == ',' ) {
+            p++;
+        }
+        if( *p == '*' ) {
+            return TRUE;
+        }
+        if( strncmp( p, "W/", 2 ) == 0 ) {
+            p += 2;
+        }
+        if( *p != '"' ) {
+            // not a tag, skip to the next one
+            end = strchr( p, ',' );
+        } else {
+            end = strchr( p + 1, '"' );
+            if( end == NULL ) {
+                break;
+            }
+            end++;
+            if( length > 0 && ( size_t ) ( end - p ) == length &&
+                strncmp( p, ETag, length ) == 0 ) {
+                return TRUE;
+            }
+        }
+        if( end == NULL ) {
+            break;
+        }
+        p = end;
+    }
+
+    return FALSE;
+}
+
+/************************************************************************
+ * Function: CheckConditionalHTTPHeaders
+ *
+ * Parameters:
+ *	IN http_message_t *Req ; HTTP Request message
+ *	IN const char *ETag ; entity tag of the file, empty if none
+ *	IN time_t LastModified ; time of the last change of the file, 0 if
+ *		unknown
+ *
+ * Description: Evaluates the If-None-Match header of a GET or HEAD
+ *	request, or the If-Modified-Since header when there is none, as
+ *	RFC 2616 asks.
+ *
+ * Returns:
+ *	HTTP_NOT_MODIFIED - the copy of the client is up to date
+ *	DLNA_E_OUTOF_MEMORY
+ *	HTTP_OK
+ ************************************************************************/
+static int
+CheckConditionalHTTPHeaders( IN http_message_t * Req,
+                             IN const char *ETag,
+                             IN time_t LastModified )
+{
+    memptr value;
+    char *str;
+    time_t since;
+    int ret = HTTP_OK;
+
+    if( httpmsg_find_hdr( Req, HDR_IF_NONE_MATCH, &value ) != NULL ) {
+        str = str_alloc( value.buf, value.length );
+        if( str == NULL ) {
+            return DLNA_E_OUTOF_MEMORY;
+        }
+        if( MatchETag( str, ETag ) ) {
+            ret = HTTP_NOT_MODIFIED;
+        }
+    } else if( LastModified != 0 &&
+               httpmsg_find_hdr( Req, HDR_IF_MODIFIED_SINCE,
+                                 &value ) != NULL ) {
+        str = str_alloc( value.buf, value.length );
+        if( str == NULL ) {
+            return DLNA_E_OUTOF_MEMORY;
+        }
+        // a date in the future is not valid
+        if( http_ParseDate( str, &since ) == 0 && since <= time( NULL ) &&
+            LastModified <= since ) {
+            ret = HTTP_NOT_MODIFIED;
+        }
+    } else {
+        return HTTP_OK;
+    }
+
+    free( str );
+    return ret;
+}
+
 /************************************************************************
  * Function: process_request
  *
@@ -1209,6 +1829,10 @@ process_request( IN http_message_t * req,
     xboolean alias_grabbed;
     size_t dummy;
     struct dlnaVirtualDirCallbacks *pVirtualDirCallback;
+    const char *content_type;
+    char multipart_type[LINE_SIZE];
+    char etag[ETAG_SIZE];
+    char entity_headers[LINE_SIZE];
 
     print_http_headers( req );
 
@@ -1221,6 +1845,7 @@ process_request( IN http_message_t * req,
     // init
     request_doc = NULL;
     finfo.content_type = NULL;
+    finfo.etag = NULL;
     alias_grabbed = FALSE;
     err_code = HTTP_INTERNAL_SERVER_ERROR;  // default error
     using_virtual_dir = FALSE;
@@ -1372,11 +1997,43 @@ process_request( IN http_message_t * req,
         //      }
     }
 
+    if( using_alias ) {
+        strcpy( etag, alias->etag );
+    } else if( req->method != HTTPMETHOD_POST ) {
+        GetETag( filename->buf, &finfo, etag );
+    } else {
+        etag[0] = '\0';
+    }
+    MakeEntityHeaders( etag, finfo.content_type, entity_headers );
+
+    // conditional request, before the ranges
+    if( req->method == HTTPMETHOD_GET || req->method == HTTPMETHOD_HEAD ) {
+        err_code = CheckConditionalHTTPHeaders( req, etag,
+                                                finfo.last_modified );
+        if( err_code == HTTP_NOT_MODIFIED ) {
+            if( http_MakeMessage(
+                headers, resp_major, resp_minor,
+                "R" "D" "E" "S" "XcCc",
+                HTTP_NOT_MODIFIED,  // status code
+                entity_headers,     // ETag, Cache-Control
+                X_USER_AGENT ) != 0 ) {
+                err_code = HTTP_INTERNAL_SERVER_ERROR;
+                goto error_handler;
+            }
+            *rtype = RESP_HEADERS;
+            err_code = DLNA_E_SUCCESS;
+            goto error_handler;
+        } else if( err_code != HTTP_OK ) {
+            goto error_handler;
+        }
+    }
+
     RespInstr->ReadSendSize = finfo.file_length;
 
     // Check other header field.
     if( ( err_code =
           CheckOtherHTTPHeaders( req, RespInstr,
+                                 using_virtual_dir ? filename->buf : NULL,
                                  finfo.file_length ) ) != HTTP_OK ) {
         goto error_handler;
     }
@@ -1387,15 +2044,27 @@ process_request( IN http_message_t * req,
         goto error_handler;
     }
 
+    content_type = finfo.content_type;
+    if( RespInstr->IsRangeActive && RespInstr->NumRanges > 1 ) {
+        // Content-Type: multipart/byteranges; boundary=...
+        if( ( err_code =
+              CreateHTTPMultipartResponse( RespInstr, finfo.content_type,
+                                           multipart_type ) ) != HTTP_OK ) {
+            goto error_handler;
+        }
+        content_type = multipart_type;
+    }
+
     if( RespInstr->IsRangeActive && RespInstr->IsChunkActive ) {
         // Content-Range: bytes 222-3333/4000  HTTP_PARTIAL_CONTENT
         // Transfer-Encoding: chunked
-        if (http_MakeMessage(
-            headers, resp_major, resp_minor,
-            "R" "T" "GKD" "s" "tcS" "XcCc",
+        if (http_MakeTemplateMessage(
+            headers, &gPartialChunkedHeaders, resp_major, resp_minor,
+            "R" "T" "GKD" "E" "s" "tcS" "XcCc",
             HTTP_PARTIAL_CONTENT, // status code
-            finfo.content_type,   // content type
+            content_type,         // content type
             RespInstr,            // range info
+            entity_headers,       // ETag, Cache-Control
             "LAST-MODIFIED: ",
 	    &finfo.last_modified,
             X_USER_AGENT) != 0 ) {
@@ -1405,13 +2074,14 @@ process_request( IN http_message_t * req,
 
         // Content-Range: bytes 222-3333/4000  HTTP_PARTIAL_CONTENT
         // Transfer-Encoding: chunked
-        if (http_MakeMessage(
-            headers, resp_major, resp_minor,
-            "R" "N" "T" "GD" "s" "tcS" "XcCc",
+        if (http_MakeTemplateMessage(
+            headers, &gPartialHeaders, resp_major, resp_minor,
+            "R" "N" "T" "GD" "E" "s" "tcS" "XcCc",
             HTTP_PARTIAL_CONTENT,     // status code
             RespInstr->ReadSendSize,  // content length
-            finfo.content_type,       // content type
+            content_type,             // content type
             RespInstr,                // range info
+            entity_headers,           // ETag, Cache-Control
             "LAST-MODIFIED: ",
 	    &finfo.last_modified,
             X_USER_AGENT) != 0 ) {
@@ -1421,11 +2091,12 @@ process_request( IN http_message_t * req,
     } else if( !RespInstr->IsRangeActive && RespInstr->IsChunkActive ) {
         // Content-Range: bytes 222-3333/4000  HTTP_PARTIAL_CONTENT
         // Transfer-Encoding: chunked
-        if (http_MakeMessage(
-            headers, resp_major, resp_minor,
-            "RK" "TD" "s" "tcS" "XcCc",
+        if (http_MakeTemplateMessage(
+            headers, &gChunkedHeaders, resp_major, resp_minor,
+            "RK" "TD" "E" "s" "tcS" "XcCc",
             HTTP_OK,            // status code
             finfo.content_type, // content type
+            entity_headers,     // ETag, Cache-Control
             "LAST-MODIFIED: ",
 	    &finfo.last_modified,
             X_USER_AGENT) != 0 ) {
@@ -1436,12 +2107,13 @@ process_request( IN http_message_t * req,
         if (RespInstr->ReadSendSize >= 0) {
             // Content-Range: bytes 222-3333/4000  HTTP_PARTIAL_CONTENT
             // Transfer-Encoding: chunked
-            if (http_MakeMessage(
-                headers, resp_major, resp_minor,
-                "R" "N" "TD" "s" "tcS" "XcCc",
+            if (http_MakeTemplateMessage(
+                headers, &gFileHeaders, resp_major, resp_minor,
+                "R" "N" "TD" "E" "s" "tcS" "XcCc",
                 HTTP_OK,                 // status code
                 RespInstr->ReadSendSize, // content length
                 finfo.content_type,      // content type
+                entity_headers,          // ETag, Cache-Control
                 "LAST-MODIFIED: ",
 		&finfo.last_modified,
                 X_USER_AGENT) != 0 ) {
@@ -1450,11 +2122,12 @@ process_request( IN http_message_t * req,
         } else {
             // Content-Range: bytes 222-3333/4000  HTTP_PARTIAL_CONTENT
             // Transfer-Encoding: chunked
-            if (http_MakeMessage(
-                headers, resp_major, resp_minor,
-                "R" "TD" "s" "tcS" "XcCc",
+            if (http_MakeTemplateMessage(
+                headers, &gFileCloseHeaders, resp_major, resp_minor,
+                "R" "TD" "E" "s" "tcS" "XcCc",
                 HTTP_OK,            // status code
                 finfo.content_type, // content type
+                entity_headers,     // ETag, Cache-Control
                 "LAST-MODIFIED: ",
 		&finfo.last_modified,
                 X_USER_AGENT) != 0 ) {
@@ -1486,7 +2159,10 @@ process_request( IN http_message_t * req,
   error_handler:
     free( request_doc );
     ixmlFreeDOMString( finfo.content_type );
-    if( err_code != DLNA_E_SUCCESS && alias_grabbed ) {
+    ixmlFreeDOMString( finfo.etag );
+    // only the XML document response keeps the alias until it is sent
+    if( alias_grabbed &&
+        ( err_code != DLNA_E_SUCCESS || *rtype != RESP_XMLDOC ) ) {
         alias_release( alias );
     }
 
@@ -1657,6 +2333,74 @@ http_RecvPostMessage( http_parser_t * parser,
     return HTTP_OK;
 }
 
+/************************************************************************
+ * Function: web_server_is_quick_request
+ *
+ * Parameters:
+ *	IN http_message_t *req ; GET or HEAD request
+ *
+ * Description: Tells whether the resource a request asks for is quick
+ *	to send, from the URL alone: the XML description document, or an
+ *	image or text resource by its extension. Nothing is looked up, the
+ *	request is still read from the mini server thread.
+ *
+ * Returns:
+ *	TRUE if the resource is quick to send, FALSE otherwise
+ ************************************************************************/
+xboolean
+web_server_is_quick_request( IN http_message_t * req )
+{
+    const char *path = req->uri.pathquery.buff;
+    size_t len = req->uri.pathquery.size;
+    const char *query;
+    const char *extension;
+    const char *type;
+    const char *subtype;
+    char ext[8];
+    size_t ext_len;
+    xboolean quick = FALSE;
+
+    if( bWebServerState != WEB_SERVER_ENABLED || path == NULL ) {
+        return FALSE;
+    }
+    query = memchr( path, '?', len );
+    if( query != NULL ) {
+        len = query - path;
+    }
+
+    // the description document
+    ithread_mutex_lock( &gWebMutex );
+    if( is_valid_alias( &gAliasDoc ) && gAliasDoc.name.length == len &&
+        strncmp( gAliasDoc.name.buf, path, len ) == 0 ) {
+        quick = TRUE;
+    }
+    ithread_mutex_unlock( &gWebMutex );
+    if( quick ) {
+        return TRUE;
+    }
+
+    // images and text documents
+    extension = path + len;
+    while( extension > path && extension[-1] != '.' &&
+           extension[-1] != '/' ) {
+        extension--;
+    }
+    if( extension == path || extension[-1] != '.' ) {
+        return FALSE;
+    }
+    ext_len = path + len - extension;
+    if( ext_len == 0 || ext_len >= sizeof( ext ) ) {
+        return FALSE;
+    }
+    memcpy( ext, extension, ext_len );
+    ext[ext_len] = '\0';
+    if( search_extension( ext, &type, &subtype ) != 0 ) {
+        return FALSE;
+    }
+
+    return type == gMediaTypes[IMAGE_INDEX] || type == gMediaTypes[TEXT_INDEX];
+}
+
 /************************************************************************
  * Function: web_server_callback
  *
@@ -1689,6 +2433,7 @@ web_server_callback( IN http_parser_t * parser,
     RespInstr.IsChunkActive = 0;
     RespInstr.IsRangeActive = 0;
     RespInstr.IsTrailers = 0;
+    RespInstr.NumRanges = 0;
     // init
     membuffer_init( &headers );
     membuffer_init( &filename );
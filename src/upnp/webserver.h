@@ -41,20 +41,61 @@ extern "C" {
 #endif
 
 
+// most byte ranges sent in a multipart/byteranges response
+#define HTTP_MAX_BYTE_RANGES 16
+#define HTTP_BOUNDARY_SIZE 40
+#define HTTP_PART_TYPE_SIZE 128
+// size of the headers of a part of a multipart/byteranges response
+#define HTTP_PART_HEADER_SIZE 320
+
+struct ByteRange
+{
+   off_t Offset;
+   off_t Length;
+};
+
 struct SendInstruction
 {
    int  IsVirtualFile;
    int  IsChunkActive;
    int  IsRangeActive;
    int  IsTrailers;
-   char RangeHeader[200];
+   char RangeHeader[320]; // Content-Range, and TimeSeekRange.dlna.org
    off_t RangeOffset;
    off_t ReadSendSize;  // Read from local source and send on the network.
    long RecvWriteSize; // Recv from the network and write into local file.
 
+   // Sorted and coalesced byte ranges. When there are more than one,
+   // they are sent as the parts of a multipart/byteranges response.
+   int NumRanges;
+   struct ByteRange Ranges[HTTP_MAX_BYTE_RANGES];
+   off_t FileLength;
+   char Boundary[HTTP_BOUNDARY_SIZE];
+   char PartContentType[HTTP_PART_TYPE_SIZE];
+
    //Later few more member could be added depending on the requirement.
 };
 
+/************************************************************************
+* Function: http_MakeRangePartHeader
+*
+* Parameters:
+*	IN struct SendInstruction *Instr ; Send Instruction object of a
+*		multipart/byteranges response
+*	IN int Part ; index of the part, NumRanges for the final delimiter
+*	OUT char *Buf ; buffer of HTTP_PART_HEADER_SIZE bytes
+*
+* Description: Formats the delimiter and headers that come before the
+*	data of a part of a multipart/byteranges response, or the final
+*	delimiter after the last part.
+*
+* Returns: int
+*	the length of the headers, -1 on error
+************************************************************************/
+int http_MakeRangePartHeader( IN struct SendInstruction *Instr,
+                              IN int Part,
+                              OUT char *Buf );
+
 /************************************************************************
 * Function: web_server_init												
 *																		
@@ -125,6 +166,21 @@ int web_server_set_alias( IN const char* alias_name,
 ************************************************************************/
 int web_server_set_root_dir( IN const char* root_dir );
 
+/************************************************************************
+* Function: web_server_is_quick_request
+*
+* Parameters:
+*	IN http_message_t *req ; GET or HEAD request
+*
+* Description: Tells whether the resource a request asks for is quick
+*	to send, from the URL alone: the XML description document, or an
+*	image or text resource by its extension.
+*
+* Returns:
+*	TRUE if the resource is quick to send, FALSE otherwise
+************************************************************************/
+xboolean web_server_is_quick_request( IN http_message_t *req );
+
 /************************************************************************
 * Function: web_server_callback											*
 *																		*
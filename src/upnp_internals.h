@@ -37,6 +37,8 @@ struct dlnaVirtualDirCallbacks virtual_dir_callbacks;
 int upnp_init (dlna_t *dlna, dlna_device_type_t type);
 int upnp_uninit (dlna_t *dlna);
 
+void dlna_http_file_cache_flush (dlna_t *dlna);
+
 int upnp_add_response (upnp_action_event_t *ev, char *key, const char *value);
 char *upnp_get_string (struct dlna_Action_Request *ar, const char *key);
 int upnp_get_ui4 (struct dlna_Action_Request *ar, const char *key);
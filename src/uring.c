@@ -0,0 +1,416 @@
+/*
+ * libdlna: reference DLNA standards implementation.
+ * Copyright (C) 2007-2008 Benjamin Zores <ben@geexbox.org>
+ *
+ * This file is part of libdlna.
+ *
+ * libdlna is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libdlna is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libdlna; if not, write to the Free Software
+ * Foundation, Inc, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Asynchronous media reader on Linux io_uring.
+ *
+ * Each stream owns a small ring and URING_DEPTH blocks of URING_BLOCK
+ * bytes. The blocks following the read position are always queued to
+ * the kernel, so that the disk reads of a stream go on while the HTTP
+ * server writes the previous data to the socket. The ring is used
+ * through the raw system calls: no liburing is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "dlna_internals.h"
+#include "minmax.h"
+
+/* number of blocks read ahead of a stream */
+#define URING_DEPTH               4
+/* size of a block */
+#define URING_BLOCK               (128 * 1024)
+
+enum {
+  URING_SLOT_FREE,
+  URING_SLOT_PENDING,
+  URING_SLOT_READY
+};
+
+typedef struct uring_slot_s {
+  char *buf;
+  struct iovec iov;
+  off_t offset;                   /* file offset of the block */
+  ssize_t result;                 /* bytes read, -errno on error */
+  ssize_t pos;                    /* bytes already consumed */
+  int state;
+} uring_slot_t;
+
+struct dlna_uring_reader_s {
+  int ring;
+  int fd;
+
+  /* submission queue */
+  void *sq_ptr;
+  size_t sq_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  /* completion queue */
+  void *cq_ptr;
+  size_t cq_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  uring_slot_t slots[URING_DEPTH]; /* in stream order from head */
+  int head;
+  int pending;                    /* blocks queued to the kernel */
+  off_t next;                     /* offset of the next block to queue */
+  off_t expected;                 /* offset of the next byte to read */
+  off_t eof;                      /* end of the file once met, or -1 */
+};
+
+/* set once io_uring is found missing, not to try again on each stream */
+static int uring_unavailable = 0;
+
+static int
+uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter (int ring, unsigned to_submit, unsigned min_complete)
+{
+  return (int) syscall (__NR_io_uring_enter, ring, to_submit, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void
+uring_unmap (dlna_uring_reader_t *r)
+{
+  if (r->sqes && r->sqes != MAP_FAILED)
+    munmap (r->sqes, r->sqes_size);
+  if (r->cq_ptr && r->cq_ptr != MAP_FAILED)
+    munmap (r->cq_ptr, r->cq_size);
+  if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+    munmap (r->sq_ptr, r->sq_size);
+  if (r->ring >= 0)
+    close (r->ring);
+}
+
+static int
+uring_map (dlna_uring_reader_t *r)
+{
+  struct io_uring_params p;
+
+  memset (&p, 0, sizeof (p));
+  r->ring = uring_setup (URING_DEPTH, &p);
+  if (r->ring < 0)
+  {
+    if (errno == ENOSYS || errno == EPERM)
+      uring_unavailable = 1;
+    return -1;
+  }
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  r->sq_ptr = mmap (NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->ring, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED)
+    return -1;
+  r->sq_head  = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+  r->sq_tail  = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+  r->sq_mask  = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+
+  r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  r->sqes = mmap (NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->ring, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    return -1;
+
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  r->cq_ptr = mmap (NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->ring, IORING_OFF_CQ_RING);
+  if (r->cq_ptr == MAP_FAILED)
+    return -1;
+  r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+
+  return 0;
+}
+
+/* move the completed reads to their blocks */
+static void
+uring_reap (dlna_uring_reader_t *r)
+{
+  unsigned head, tail;
+
+  head = *r->cq_head;
+  tail = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail)
+  {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    uring_slot_t *slot = &r->slots[cqe->user_data];
+
+    slot->result = cqe->res;
+    slot->state = URING_SLOT_READY;
+    r->pending--;
+    head++;
+  }
+  __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int
+uring_wait (dlna_uring_reader_t *r)
+{
+  while (uring_enter (r->ring, 0, 1) < 0)
+    if (errno != EINTR)
+      return -1;
+  uring_reap (r);
+  return 0;
+}
+
+/*
+ * Queue the free blocks, ahead of the read position. The blocks the
+ * kernel did not take are freed again, to be queued on the next call.
+ */
+static int
+uring_fill (dlna_uring_reader_t *r)
+{
+  uring_slot_t *queued[URING_DEPTH];
+  unsigned tail;
+  int i, count = 0, submitted;
+
+  tail = *r->sq_tail;
+  for (i = 0; i < URING_DEPTH; i++)
+  {
+    int n = (r->head + i) % URING_DEPTH;
+    uring_slot_t *slot = &r->slots[n];
+    struct io_uring_sqe *sqe;
+
+    if (slot->state != URING_SLOT_FREE)
+      continue;
+    if (r->eof >= 0 && r->next >= r->eof)
+      break;
+
+    slot->offset = r->next;
+    slot->pos = 0;
+    slot->iov.iov_base = slot->buf;
+    slot->iov.iov_len = URING_BLOCK;
+    slot->state = URING_SLOT_PENDING;
+    r->next += URING_BLOCK;
+
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = r->fd;
+    sqe->off = slot->offset;
+    sqe->addr = (unsigned long) &slot->iov;
+    sqe->len = 1;
+    sqe->user_data = n;
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    tail++;
+    queued[count++] = slot;
+  }
+
+  if (!count)
+    return 0;
+
+  __atomic_store_n (r->sq_tail, tail, __ATOMIC_RELEASE);
+  while ((submitted = uring_enter (r->ring, count, 0)) < 0 && errno == EINTR)
+    ;
+  if (submitted > 0)
+    r->pending += submitted;
+  if (submitted >= count)
+    return 0;
+
+  /* the kernel takes the entries in order: rewind to the first left */
+  i = MAX (submitted, 0);
+  __atomic_store_n (r->sq_tail, tail - (count - i), __ATOMIC_RELEASE);
+  r->next = queued[i]->offset;
+  for (; i < count; i++)
+    queued[i]->state = URING_SLOT_FREE;
+
+  return submitted > 0 ? 0 : -1;
+}
+
+/* wait for the queued reads, and start again from a new offset */
+static int
+uring_reset (dlna_uring_reader_t *r, off_t offset)
+{
+  int i;
+
+  while (r->pending > 0)
+    if (uring_wait (r) < 0)
+      return -1;
+
+  for (i = 0; i < URING_DEPTH; i++)
+    r->slots[i].state = URING_SLOT_FREE;
+  r->head = 0;
+  r->next = offset;
+  r->expected = offset;
+  r->eof = -1;
+
+  return 0;
+}
+
+dlna_uring_reader_t *
+dlna_uring_reader_new (int fd)
+{
+  dlna_uring_reader_t *r;
+  int i;
+
+  if (fd < 0 || uring_unavailable)
+    return NULL;
+
+  r = calloc (1, sizeof (dlna_uring_reader_t));
+  if (!r)
+    return NULL;
+
+  r->ring = -1;
+  r->fd = fd;
+  if (uring_map (r) < 0)
+  {
+    uring_unmap (r);
+    free (r);
+    return NULL;
+  }
+
+  for (i = 0; i < URING_DEPTH; i++)
+  {
+    r->slots[i].buf = malloc (URING_BLOCK);
+    if (!r->slots[i].buf)
+    {
+      dlna_uring_reader_free (r);
+      return NULL;
+    }
+  }
+
+  /* nothing is read before the first request */
+  r->expected = -1;
+
+  return r;
+}
+
+ssize_t
+dlna_uring_reader_read (dlna_uring_reader_t *r,
+                        char *buf, size_t len, off_t offset)
+{
+  size_t copied = 0;
+
+  if (!r || !buf)
+    return -1;
+
+  if (offset != r->expected && uring_reset (r, offset) < 0)
+    return -1;
+
+  if (uring_fill (r) < 0)
+    return -1;
+
+  while (copied < len)
+  {
+    uring_slot_t *slot = &r->slots[r->head];
+    size_t n;
+
+    if (slot->state == URING_SLOT_FREE)
+      break; /* nothing queued: end of file */
+
+    while (slot->state == URING_SLOT_PENDING)
+      if (uring_wait (r) < 0)
+        return copied ? (ssize_t) copied : -1;
+
+    if (slot->result < 0)
+    {
+      /* read again from there on the next request */
+      errno = -slot->result;
+      slot->state = URING_SLOT_FREE;
+      uring_reset (r, r->expected);
+      return copied ? (ssize_t) copied : -1;
+    }
+
+    /* blocks queued after a short one do not follow the data read */
+    if (slot->offset + slot->pos != r->expected)
+    {
+      if (uring_reset (r, r->expected) < 0 || uring_fill (r) < 0)
+        return copied ? (ssize_t) copied : -1;
+      continue;
+    }
+
+    n = MIN ((size_t) (slot->result - slot->pos), len - copied);
+    memcpy (buf + copied, slot->buf + slot->pos, n);
+    slot->pos += n;
+    copied += n;
+    r->expected += n;
+
+    if (slot->pos < slot->result)
+      continue;
+
+    /* block consumed */
+    slot->state = URING_SLOT_FREE;
+    r->head = (r->head + 1) % URING_DEPTH;
+    if (slot->result < URING_BLOCK)
+    {
+      /* a short block ends the file only when the next one is empty */
+      uring_slot_t *next = &r->slots[r->head];
+
+      while (next->state == URING_SLOT_PENDING)
+        if (uring_wait (r) < 0)
+          return copied;
+      if (slot->result == 0
+          || (next->state == URING_SLOT_READY && next->result == 0))
+      {
+        r->eof = r->expected;
+        break;
+      }
+      if (uring_reset (r, r->expected) < 0)
+        break;
+    }
+    if (uring_fill (r) < 0)
+      break;
+  }
+
+  return copied;
+}
+
+void
+dlna_uring_reader_free (dlna_uring_reader_t *r)
+{
+  int i;
+
+  if (!r)
+    return;
+
+  if (r->ring >= 0 && r->cq_ptr)
+    uring_reset (r, 0);
+  uring_unmap (r);
+
+  for (i = 0; i < URING_DEPTH; i++)
+    free (r->slots[i].buf);
+  free (r);
+}
@@ -34,6 +34,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef UTHASH_H
 #define UTHASH_H 
 
+/* the switch cases of HASH_JEN fall through on purpose */
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 7)
+#define HASH_FALLTHROUGH __attribute__ ((fallthrough))
+#else
+#define HASH_FALLTHROUGH do {} while (0)
+#endif
+
 #define uthash_fatal(msg) exit(-1)        /* fatal error (out of memory,etc) */
 #define uthash_bkt_malloc(sz) malloc(sz)  /* malloc fcn for UT_hash_bucket's */
 #define uthash_bkt_free(ptr) free(ptr)    /* free fcn for UT_hash_bucket's   */
@@ -323,16 +330,16 @@ do {                                                                          \
   }                                                                           \
   hash += keylen;                                                             \
   switch ( k ) {                                                              \
-     case 11: hash += ( (unsigned)key[10] << 24 );                            \
-     case 10: hash += ( (unsigned)key[9] << 16 );                             \
-     case 9:  hash += ( (unsigned)key[8] << 8 );                              \
-     case 8:  j += ( (unsigned)key[7] << 24 );                                \
-     case 7:  j += ( (unsigned)key[6] << 16 );                                \
-     case 6:  j += ( (unsigned)key[5] << 8 );                                 \
-     case 5:  j += key[4];                                                    \
-     case 4:  i += ( (unsigned)key[3] << 24 );                                \
-     case 3:  i += ( (unsigned)key[2] << 16 );                                \
-     case 2:  i += ( (unsigned)key[1] << 8 );                                 \
+     case 11: hash += ( (unsigned)key[10] << 24 ); HASH_FALLTHROUGH;          \
+     case 10: hash += ( (unsigned)key[9] << 16 ); HASH_FALLTHROUGH;           \
+     case 9:  hash += ( (unsigned)key[8] << 8 ); HASH_FALLTHROUGH;            \
+     case 8:  j += ( (unsigned)key[7] << 24 ); HASH_FALLTHROUGH;              \
+     case 7:  j += ( (unsigned)key[6] << 16 ); HASH_FALLTHROUGH;              \
+     case 6:  j += ( (unsigned)key[5] << 8 ); HASH_FALLTHROUGH;               \
+     case 5:  j += key[4]; HASH_FALLTHROUGH;                                  \
+     case 4:  i += ( (unsigned)key[3] << 24 ); HASH_FALLTHROUGH;              \
+     case 3:  i += ( (unsigned)key[2] << 16 ); HASH_FALLTHROUGH;              \
+     case 2:  i += ( (unsigned)key[1] << 8 ); HASH_FALLTHROUGH;               \
      case 1:  i += key[0];                                                    \
   }                                                                           \
   HASH_JEN_MIX(i, j, hash);                                                   \